@@ -0,0 +1,503 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2019 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include <mango/mango.hpp>
+#include "statistics.hpp"
+
+// The shared parts of the image codec benchmarks. Every library is a plugin that decodes
+// from memory and encodes to memory; the timing, the statistics and the reports are the same
+// for all of them, so the numbers of different benchmarks can be compared directly.
+
+namespace benchmark
+{
+    using namespace mango;
+
+    // encoders take a library specific level (zlib level, JPEG quality) or this for their default
+    static const int DEFAULT_LEVEL = -1;
+
+    // ------------------------------------------------------------------
+    // plugins
+    // ------------------------------------------------------------------
+
+    // 8 bits per component, the components interleaved
+    struct Image
+    {
+        std::shared_ptr<u8> pixels; // freed the way the decoding library wants
+        int width = 0;
+        int height = 0;
+        int stride = 0; // in bytes
+        int components = 0;
+
+        u8* row(int y) const
+        {
+            return pixels.get() + size_t(y) * stride;
+        }
+
+        size_t bytes() const
+        {
+            return size_t(width) * height * components;
+        }
+
+        explicit operator bool () const
+        {
+            return pixels && width > 0 && height > 0;
+        }
+    };
+
+    // takes the ownership of pixels allocated by a library, released with deleter(pixels)
+    template <typename Deleter>
+    Image make_image(u8* pixels, int width, int height, int stride, int components, Deleter deleter)
+    {
+        Image image;
+        if (pixels)
+        {
+            image.pixels = std::shared_ptr<u8>(pixels, deleter);
+            image.width = width;
+            image.height = height;
+            image.stride = stride;
+            image.components = components;
+        }
+        return image;
+    }
+
+    // pixels in a buffer that the library reuses; valid until the next decode on the same thread
+    inline Image view_image(u8* pixels, int width, int height, int stride, int components)
+    {
+        return make_image(pixels, width, height, stride, components, [] (u8*) {});
+    }
+
+    struct Codec
+    {
+        const char* name;
+        const char* extension; // of the format that it reads and writes, ".png"
+
+        // either can be null, for the decoder and encoder variants of a library
+        Image (*decode)(ConstMemory memory); // an empty image on failure
+        bool (*encode)(std::vector<u8>& output, const Image& image, int level); // appends the file to output
+    };
+
+    // in the order of registration; in a single translation unit that's the order of definition
+    inline std::vector<Codec>& codecs()
+    {
+        static std::vector<Codec> registry;
+        return registry;
+    }
+
+    // a static Plugin adds the codec to the registry at start-up:
+    //     static benchmark::Plugin stb_plugin({ "stb", ".png", decode_stb, encode_stb });
+    struct Plugin
+    {
+        Plugin(const Codec& codec)
+        {
+            codecs().push_back(codec);
+        }
+    };
+
+    static const u64 CHECKSUM_BASIS = 0xcbf29ce484222325ull;
+
+    // FNV-1a, can be continued row by row
+    inline u64 update_checksum(u64 hash, const u8* data, size_t size)
+    {
+        for (size_t i = 0; i < size; ++i)
+        {
+            hash ^= data[i];
+            hash *= 0x100000001b3ull;
+        }
+        return hash;
+    }
+
+    // of the pixels without the row padding; 0 for an empty image
+    inline u64 checksum(const Image& image)
+    {
+        if (!image)
+            return 0;
+
+        u64 hash = CHECKSUM_BASIS;
+        for (int y = 0; y < image.height; ++y)
+        {
+            hash = update_checksum(hash, image.row(y), size_t(image.width) * image.components);
+        }
+        return hash;
+    }
+
+    // ------------------------------------------------------------------
+    // mango
+    // ------------------------------------------------------------------
+
+    inline Format get_format(int components)
+    {
+        return components == 4 ? Format(32, Format::UNORM, Format::RGBA, 8, 8, 8, 8)
+                               : Format(24, Format::UNORM, Format::RGB, 8, 8, 8);
+    }
+
+    // RGB or RGBA; the image keeps the bitmap alive
+    inline Image decode_bitmap(ConstMemory memory, const std::string& extension, int components)
+    {
+        auto bitmap = std::make_shared<Bitmap>(memory, extension, get_format(components));
+        if (bitmap->width <= 0 || bitmap->height <= 0)
+            return Image();
+
+        Image image;
+        image.pixels = std::shared_ptr<u8>(bitmap, bitmap->image);
+        image.width = bitmap->width;
+        image.height = bitmap->height;
+        image.stride = int(bitmap->stride);
+        image.components = components;
+        return image;
+    }
+
+    inline bool encode_bitmap(std::vector<u8>& output, const Image& image, const std::string& extension,
+                              const ImageEncodeOptions& options)
+    {
+        Surface surface(image.width, image.height, get_format(image.components), image.stride, image.pixels.get());
+
+        MemoryStream stream;
+        ImageEncoder encoder(extension);
+        encoder.encode(stream, surface, options);
+
+        ConstMemory memory = stream;
+        output.insert(output.end(), memory.address, memory.address + memory.size);
+        return memory.size > 0;
+    }
+
+    // the image the encoders compress, stored without padding
+    inline Image load_reference(ConstMemory memory, const std::string& extension, int components)
+    {
+        Image bitmap = decode_bitmap(memory, extension, components);
+        if (!bitmap)
+            return Image();
+
+        size_t stride = size_t(bitmap.width) * components;
+        u8* pixels = new u8[stride * bitmap.height];
+
+        for (int y = 0; y < bitmap.height; ++y)
+        {
+            std::memcpy(pixels + y * stride, bitmap.row(y), stride);
+        }
+
+        return make_image(pixels, bitmap.width, bitmap.height, int(stride), components, [] (u8* p) { delete[] p; });
+    }
+
+    inline bool write_file(const std::string& filename, const std::vector<u8>& data)
+    {
+        FILE* file = std::fopen(filename.c_str(), "wb");
+        if (!file)
+            return false;
+
+        size_t written = std::fwrite(data.data(), 1, data.size(), file);
+        std::fclose(file);
+        return written == data.size();
+    }
+
+    // ------------------------------------------------------------------
+    // timing
+    // ------------------------------------------------------------------
+
+    struct Options
+    {
+        int warmup = 2;
+        int runs = 10;
+        std::string csv; // report files, none if empty
+        std::string json;
+    };
+
+    // the options that all benchmarks have; returns false if argv[i] is not one of them
+    inline bool parse_option(Options& options, int argc, const char* argv[], int& i)
+    {
+        if (!std::strcmp(argv[i], "--warmup") && i + 1 < argc)
+        {
+            options.warmup = std::max(0, std::atoi(argv[++i]));
+        }
+        else if (!std::strcmp(argv[i], "--runs") && i + 1 < argc)
+        {
+            options.runs = std::max(1, std::atoi(argv[++i]));
+        }
+        else if (!std::strcmp(argv[i], "--csv") && i + 1 < argc)
+        {
+            options.csv = argv[++i];
+        }
+        else if (!std::strcmp(argv[i], "--json") && i + 1 < argc)
+        {
+            options.json = argv[++i];
+        }
+        else
+        {
+            return false;
+        }
+        return true;
+    }
+
+    static const char* const OPTIONS_USAGE = "[--warmup N] [--runs N] [--csv file] [--json file]";
+
+    template <typename Function>
+    Statistics measure(Function function, const Options& options)
+    {
+        for (int i = 0; i < options.warmup; ++i)
+        {
+            function();
+        }
+
+        std::vector<u64> times;
+
+        for (int i = 0; i < options.runs; ++i)
+        {
+            u64 time0 = Time::us();
+            function();
+            u64 time1 = Time::us();
+            times.push_back(time1 - time0);
+        }
+
+        return compute_statistics(times);
+    }
+
+    // ------------------------------------------------------------------
+    // results
+    // ------------------------------------------------------------------
+
+    struct Result
+    {
+        std::string image; // the input
+        std::string codec;
+        const char* operation = ""; // "decode" or "encode"
+        int level = DEFAULT_LEVEL;
+        int width = 0;
+        int height = 0;
+        int runs = 0;
+        Statistics time;
+        size_t size = 0; // compressed: the input of decode, the output of encode; 0 if it failed
+        size_t rawsize = 0; // decompressed
+        u64 checksum = 0; // of the decoded pixels
+    };
+
+    // MB of decompressed data per second, 10^6 bytes
+    inline double throughput(const Result& result)
+    {
+        return result.time.median > 0 ? result.rawsize / (result.time.median * 1000.0) : 0.0;
+    }
+
+    inline double ratio(const Result& result)
+    {
+        return result.size ? double(result.rawsize) / result.size : 0.0;
+    }
+
+    // Decodes the file and encodes the reference image with the codec, as far as the codec can.
+    // Codecs of another format than the file decode what they encoded, so that their results are
+    // comparable too. Returns the encoded file from the last run.
+    inline std::vector<u8> test(std::vector<Result>& results, const Codec& codec, const std::string& name,
+                                ConstMemory file, const std::string& extension, const Image& reference,
+                                int level, const Options& options)
+    {
+        std::vector<u8> output;
+
+        Result result;
+        result.image = name;
+        result.codec = codec.name;
+        result.level = level;
+        result.width = reference.width;
+        result.height = reference.height;
+        result.runs = options.runs;
+        result.rawsize = reference.bytes();
+
+        if (codec.encode)
+        {
+            bool success = false;
+            result.operation = "encode";
+            result.time = measure([&]
+            {
+                output.clear();
+                success = codec.encode(output, reference, level);
+            }, options);
+            result.size = success ? output.size() : 0;
+            if (!success)
+                output.clear();
+            results.push_back(result);
+        }
+
+        ConstMemory input = file;
+        if (extension != codec.extension)
+            input = ConstMemory(output.data(), output.size());
+
+        if (codec.decode && input.size)
+        {
+            Image image;
+            result.operation = "decode";
+            result.level = DEFAULT_LEVEL;
+            result.time = measure([&]
+            {
+                image = codec.decode(input);
+            }, options);
+            result.checksum = checksum(image);
+            result.size = image ? input.size : 0;
+            result.rawsize = image.bytes();
+            results.push_back(result);
+        }
+
+        return output;
+    }
+
+    inline const Result* find_result(const std::vector<Result>& results, const std::string& codec, const char* operation)
+    {
+        for (const auto& result : results)
+        {
+            if (result.codec == codec && !std::strcmp(result.operation, operation))
+                return &result;
+        }
+        return nullptr;
+    }
+
+    // ------------------------------------------------------------------
+    // reports
+    // ------------------------------------------------------------------
+
+    inline void print_header()
+    {
+        printf("-------------------------------------------------------------------------------\n");
+        printf("              load               save                    output              \n");
+        printf("            median      p95     median      p95        size   ratio      MB/s\n");
+        printf("-------------------------------------------------------------------------------\n");
+    }
+
+    // one line per codec, in the order of the results; the MB/s are of decoding
+    inline void print_results(const std::vector<Result>& results)
+    {
+        std::vector<std::string> printed;
+
+        for (const auto& result : results)
+        {
+            if (std::find(printed.begin(), printed.end(), result.codec) != printed.end())
+                continue;
+            printed.push_back(result.codec);
+
+            const Result* decode = find_result(results, result.codec, "decode");
+            const Result* encode = find_result(results, result.codec, "encode");
+
+            printf("%-10s", result.codec.c_str());
+
+            if (decode)
+                printf(" %8.2f %8.2f", decode->time.median, decode->time.p95);
+            else
+                printf(" %8s %8s", "-", "-");
+
+            if (encode)
+                printf("   %8.2f %8.2f %8d KB %7.2f", encode->time.median, encode->time.p95,
+                    int(encode->size / 1024), ratio(*encode));
+            else
+                printf("   %8s %8s %11s %7s", "-", "-", "-", "-");
+
+            if (decode && decode->size)
+                printf(" %9.1f", throughput(*decode));
+            else if (decode)
+                printf(" %9s", "failed");
+
+            printf("\n");
+        }
+    }
+
+    inline std::string escape_json(const std::string& text)
+    {
+        std::string s;
+        for (char c : text)
+        {
+            if (c == '"' || c == '\\')
+            {
+                s += '\\';
+                s += c;
+            }
+            else if (u8(c) < 0x20)
+            {
+                char temp[8];
+                std::snprintf(temp, sizeof(temp), "\\u%04x", c);
+                s += temp;
+            }
+            else
+            {
+                s += c;
+            }
+        }
+        return s;
+    }
+
+    inline std::string escape_csv(const std::string& text)
+    {
+        if (text.find_first_of(",\"\n") == std::string::npos)
+            return text;
+
+        std::string s = "\"";
+        for (char c : text)
+        {
+            if (c == '"')
+                s += '"';
+            s += c;
+        }
+        return s + "\"";
+    }
+
+    inline bool write_csv(const std::string& filename, const std::vector<Result>& results)
+    {
+        FILE* file = std::fopen(filename.c_str(), "w");
+        if (!file)
+            return false;
+
+        std::fprintf(file, "image,codec,operation,level,width,height,runs,median_ms,p95_ms,min_ms,mean_ms,"
+                           "size,rawsize,ratio,mb_per_s,checksum\n");
+
+        for (const auto& r : results)
+        {
+            std::fprintf(file, "%s,%s,%s,%d,%d,%d,%d,%.3f,%.3f,%.3f,%.3f,%zu,%zu,%.4f,%.2f,%016llx\n",
+                escape_csv(r.image).c_str(), escape_csv(r.codec).c_str(), r.operation, r.level,
+                r.width, r.height, r.runs, r.time.median, r.time.p95, r.time.min, r.time.mean,
+                r.size, r.rawsize, ratio(r), throughput(r), (unsigned long long) r.checksum);
+        }
+
+        std::fclose(file);
+        return true;
+    }
+
+    inline bool write_json(const std::string& filename, const std::vector<Result>& results)
+    {
+        FILE* file = std::fopen(filename.c_str(), "w");
+        if (!file)
+            return false;
+
+        std::fprintf(file, "[\n");
+
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            const Result& r = results[i];
+            std::fprintf(file, "  { \"image\": \"%s\", \"codec\": \"%s\", \"operation\": \"%s\", \"level\": %d, "
+                               "\"width\": %d, \"height\": %d, \"runs\": %d, "
+                               "\"median_ms\": %.3f, \"p95_ms\": %.3f, \"min_ms\": %.3f, \"mean_ms\": %.3f, "
+                               "\"size\": %zu, \"rawsize\": %zu, \"ratio\": %.4f, \"mb_per_s\": %.2f, "
+                               "\"checksum\": \"%016llx\" }%s\n",
+                escape_json(r.image).c_str(), escape_json(r.codec).c_str(), r.operation, r.level,
+                r.width, r.height, r.runs, r.time.median, r.time.p95, r.time.min, r.time.mean,
+                r.size, r.rawsize, ratio(r), throughput(r), (unsigned long long) r.checksum,
+                i + 1 < results.size() ? "," : "");
+        }
+
+        std::fprintf(file, "]\n");
+        std::fclose(file);
+        return true;
+    }
+
+    // writes the report files that the options ask for
+    inline void write_reports(const std::vector<Result>& results, const Options& options)
+    {
+        if (!options.csv.empty() && !write_csv(options.csv, results))
+            printf("Can't write %s\n", options.csv.c_str());
+
+        if (!options.json.empty() && !write_json(options.json, results))
+            printf("Can't write %s\n", options.json.c_str());
+    }
+
+} // namespace benchmark
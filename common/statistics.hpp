@@ -0,0 +1,54 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2019 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#pragma once
+
+#include <algorithm>
+#include <vector>
+#include <mango/mango.hpp>
+
+// The distribution of repeated timings, shared by the benchmarks that report more than a
+// single time.
+
+namespace benchmark
+{
+    using namespace mango;
+
+    struct Statistics
+    {
+        double median = 0; // milliseconds
+        double p95 = 0;
+        double min = 0;
+        double mean = 0;
+    };
+
+    // of times in microseconds
+    inline Statistics compute_statistics(std::vector<u64> times)
+    {
+        Statistics stats;
+        if (times.empty())
+            return stats;
+
+        std::sort(times.begin(), times.end());
+
+        size_t n = times.size();
+        u64 median = n & 1 ? times[n / 2] : (times[n / 2 - 1] + times[n / 2]) / 2;
+
+        // nearest rank: the smallest time that at least 95% of the runs are within
+        size_t rank = (n * 95 + 99) / 100;
+
+        u64 sum = 0;
+        for (u64 time : times)
+        {
+            sum += time;
+        }
+
+        stats.median = median / 1000.0;
+        stats.p95 = times[std::max(rank, size_t(1)) - 1] / 1000.0;
+        stats.min = times[0] / 1000.0;
+        stats.mean = double(sum) / n / 1000.0;
+        return stats;
+    }
+
+} // namespace benchmark
@@ -0,0 +1,467 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2019 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include <mango/mango.hpp>
+
+namespace stealing
+{
+    using namespace mango;
+
+    /*
+        ConcurrentQueue with a work stealing scheduler. Every worker has its own deque:
+        the tasks enqueued from a worker go to the bottom of its deque, where the worker
+        takes them back without contention, and idle workers steal from the top of the
+        others. Tasks from the other threads go to a shared deque which the workers steal
+        from. wait() runs tasks until there are none to take and then blocks until the
+        tasks of the queue are complete, like ConcurrentQueue::wait().
+
+        parallel_for() and enqueue_bulk() submit a whole range as one task. The thread
+        that runs it splits the upper half off to its deque only when the deque is empty,
+        so the range is split lazily as the other workers steal the halves, and a range
+        nobody steals runs without further submissions or wakeups.
+    */
+
+    class StealingQueue;
+
+    struct StealingTask
+    {
+        std::function<void()> function;
+        StealingQueue* queue;
+    };
+
+    // Chase-Lev deque with the memory orders from "Correct and Efficient Work-Stealing
+    // for Weak Memory Models" (Le et al. 2013). Only the owner pushes and pops.
+    class TaskDeque
+    {
+    protected:
+        struct Buffer
+        {
+            s64 mask;
+            std::unique_ptr<std::atomic<StealingTask*>[]> tasks;
+
+            explicit Buffer(s64 capacity)
+                : mask(capacity - 1)
+                , tasks(new std::atomic<StealingTask*>[capacity])
+            {
+            }
+
+            StealingTask* get(s64 index) const
+            {
+                return tasks[index & mask].load(std::memory_order_relaxed);
+            }
+
+            void put(s64 index, StealingTask* task)
+            {
+                tasks[index & mask].store(task, std::memory_order_relaxed);
+            }
+        };
+
+        // the stealers write top and the owner bottom, so they are on different cache lines
+        std::atomic<s64> top { 0 };
+        char padding[64 - sizeof(std::atomic<s64>)];
+        std::atomic<s64> bottom { 0 };
+        std::atomic<Buffer*> buffer;
+
+        // the stealers can still read the smaller buffers so they are kept until the end
+        std::vector<std::unique_ptr<Buffer>> buffers;
+
+        Buffer* grow(Buffer* current, s64 t, s64 b)
+        {
+            Buffer* next = new Buffer((current->mask + 1) * 2);
+            buffers.emplace_back(next);
+
+            for (s64 i = t; i < b; ++i)
+            {
+                next->put(i, current->get(i));
+            }
+
+            buffer.store(next, std::memory_order_release);
+            return next;
+        }
+
+    public:
+        TaskDeque()
+        {
+            buffers.emplace_back(new Buffer(1024));
+            buffer.store(buffers.back().get(), std::memory_order_relaxed);
+        }
+
+        bool empty() const
+        {
+            return top.load() >= bottom.load();
+        }
+
+        void push(StealingTask* task)
+        {
+            s64 b = bottom.load(std::memory_order_relaxed);
+            s64 t = top.load(std::memory_order_acquire);
+            Buffer* current = buffer.load(std::memory_order_relaxed);
+
+            if (b - t > current->mask)
+            {
+                current = grow(current, t, b);
+            }
+
+            current->put(b, task);
+            bottom.store(b + 1, std::memory_order_release);
+        }
+
+        StealingTask* pop()
+        {
+            s64 b = bottom.load(std::memory_order_relaxed) - 1;
+            Buffer* current = buffer.load(std::memory_order_relaxed);
+            bottom.store(b, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            s64 t = top.load(std::memory_order_relaxed);
+
+            StealingTask* task = nullptr;
+
+            if (t <= b)
+            {
+                task = current->get(b);
+                if (t == b)
+                {
+                    // the last task: the stealers race for it
+                    if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                        task = nullptr;
+                    bottom.store(b + 1, std::memory_order_relaxed);
+                }
+            }
+            else
+            {
+                bottom.store(b + 1, std::memory_order_relaxed);
+            }
+
+            return task;
+        }
+
+        // nullptr when empty or when another thread took the task first
+        StealingTask* steal()
+        {
+            s64 t = top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            s64 b = bottom.load(std::memory_order_acquire);
+
+            if (t < b)
+            {
+                StealingTask* task = buffer.load(std::memory_order_acquire)->get(t);
+                if (top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                    return task;
+            }
+
+            return nullptr;
+        }
+    };
+
+    class StealingPool
+    {
+    protected:
+        struct Worker
+        {
+            TaskDeque deque;
+            std::thread thread;
+        };
+
+        std::vector<std::unique_ptr<Worker>> workers;
+
+        // tasks from the threads outside of the pool
+        TaskDeque shared;
+        std::mutex shared_mutex;
+
+        std::mutex mutex;
+        std::condition_variable wakeup;
+        std::atomic<int> sleeping { 0 };
+        bool stop = false;
+
+        // the worker of the calling thread, nullptr outside of the pool
+        static Worker*& current()
+        {
+            static thread_local Worker* worker = nullptr;
+            return worker;
+        }
+
+        bool has_tasks() const
+        {
+            for (auto& worker : workers)
+            {
+                if (!worker->deque.empty())
+                    return true;
+            }
+            return !shared.empty();
+        }
+
+        void run(Worker* self)
+        {
+            current() = self;
+
+            for (;;)
+            {
+                if (StealingTask* task = find())
+                {
+                    execute(task);
+                    continue;
+                }
+
+                // the steals can fail while others take tasks, so look again before sleeping
+                bool found = false;
+                for (int i = 0; i < 64 && !found; ++i)
+                {
+                    std::this_thread::yield();
+                    found = has_tasks();
+                }
+
+                if (found)
+                    continue;
+
+                // the submit() after a task is pushed sees the sleeper or the sleeper sees the task
+                std::unique_lock<std::mutex> lock(mutex);
+                ++sleeping;
+                while (!stop && !has_tasks())
+                {
+                    wakeup.wait(lock);
+                }
+                --sleeping;
+
+                if (stop)
+                    return;
+            }
+        }
+
+        StealingPool()
+        {
+            const int count = std::max(1, int(std::thread::hardware_concurrency()));
+
+            for (int i = 0; i < count; ++i)
+            {
+                workers.emplace_back(new Worker());
+            }
+
+            for (auto& worker : workers)
+            {
+                Worker* self = worker.get();
+                worker->thread = std::thread([this, self]
+                {
+                    run(self);
+                });
+            }
+        }
+
+        ~StealingPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+            }
+            wakeup.notify_all();
+
+            for (auto& worker : workers)
+            {
+                worker->thread.join();
+            }
+        }
+
+    public:
+        static StealingPool& instance()
+        {
+            static StealingPool pool;
+            return pool;
+        }
+
+        void submit(StealingTask* task)
+        {
+            if (Worker* self = current())
+            {
+                self->deque.push(task);
+            }
+            else
+            {
+                std::lock_guard<std::mutex> lock(shared_mutex);
+                shared.push(task);
+            }
+
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (sleeping.load(std::memory_order_relaxed) > 0)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                wakeup.notify_one();
+            }
+        }
+
+        // nothing for the others to steal from the calling thread
+        bool local_empty() const
+        {
+            Worker* self = current();
+            return self ? self->deque.empty() : shared.empty();
+        }
+
+        // a task from the calling worker's own deque, or stolen from the others
+        StealingTask* find()
+        {
+            Worker* self = current();
+
+            if (self)
+            {
+                if (StealingTask* task = self->deque.pop())
+                    return task;
+            }
+
+            // every thread starts from a different victim
+            static thread_local size_t victim = std::hash<std::thread::id>()(std::this_thread::get_id());
+            const size_t count = workers.size();
+
+            for (size_t i = 0; i < count; ++i)
+            {
+                Worker* worker = workers[victim++ % count].get();
+                if (worker != self)
+                {
+                    if (StealingTask* task = worker->deque.steal())
+                        return task;
+                }
+            }
+
+            return shared.steal();
+        }
+
+        void execute(StealingTask* task);
+    };
+
+    class StealingQueue
+    {
+    protected:
+        friend class StealingPool;
+
+        std::atomic<u64> pending { 0 };
+        std::mutex mutex;
+        std::condition_variable done;
+
+        void complete()
+        {
+            u64 count = pending.load(std::memory_order_relaxed);
+            while (count > 1)
+            {
+                if (pending.compare_exchange_weak(count, count - 1, std::memory_order_acq_rel))
+                    return;
+            }
+
+            // the last task can be the one wait() returns after, so the queue is not
+            // touched once the mutex is released
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--pending == 0)
+            {
+                done.notify_all();
+            }
+        }
+
+        template <typename Function>
+        void run_range(const std::shared_ptr<Function>& function, u64 begin, u64 end, u64 grain)
+        {
+            StealingPool& pool = StealingPool::instance();
+
+            while (begin < end)
+            {
+                if (end - begin > grain && pool.local_empty())
+                {
+                    const u64 middle = begin + (end - begin) / 2;
+                    enqueue([this, function, middle, end, grain]
+                    {
+                        run_range(function, middle, end, grain);
+                    });
+                    end = middle;
+                }
+
+                const u64 next = std::min(begin + grain, end);
+                (*function)(begin, next);
+                begin = next;
+            }
+        }
+
+    public:
+        StealingQueue() = default;
+        StealingQueue(const StealingQueue&) = delete;
+        StealingQueue& operator = (const StealingQueue&) = delete;
+
+        ~StealingQueue()
+        {
+            wait();
+        }
+
+        template <typename Function>
+        void enqueue(Function&& function)
+        {
+            ++pending;
+            StealingPool::instance().submit(new StealingTask { std::forward<Function>(function), this });
+        }
+
+        // function(begin, end) for the ranges of [begin, end), grain elements or fewer each
+        template <typename Function>
+        void parallel_for(u64 begin, u64 end, u64 grain, Function&& function)
+        {
+            if (begin >= end)
+                return;
+
+            using Range = typename std::decay<Function>::type;
+            std::shared_ptr<Range> shared(new Range(std::forward<Function>(function)));
+            grain = std::max(grain, u64(1));
+
+            enqueue([this, shared, begin, end, grain]
+            {
+                run_range(shared, begin, end, grain);
+            });
+        }
+
+        // function(index) for the indices [0, count), submitted as one task; the ranges share
+        // the one function, which can be called from several threads at the same time
+        template <typename Function>
+        void enqueue_bulk(u64 count, Function&& function)
+        {
+            using Task = typename std::decay<Function>::type;
+            parallel_for(0, count, 1, [task = Task(std::forward<Function>(function))] (u64 begin, u64 end) mutable
+            {
+                for (u64 i = begin; i < end; ++i)
+                {
+                    task(i);
+                }
+            });
+        }
+
+        void wait()
+        {
+            StealingPool& pool = StealingPool::instance();
+
+            while (pending.load(std::memory_order_acquire) > 0)
+            {
+                StealingTask* task = pool.find();
+                if (!task)
+                    break;
+                pool.execute(task);
+            }
+
+            std::unique_lock<std::mutex> lock(mutex);
+            done.wait(lock, [this]
+            {
+                return pending.load() == 0;
+            });
+        }
+    };
+
+    inline void StealingPool::execute(StealingTask* task)
+    {
+        task->function();
+        StealingQueue* queue = task->queue;
+        delete task;
+        queue->complete();
+    }
+
+} // namespace stealing
@@ -1,30 +1,31 @@
 /*
     MANGO Multimedia Development Platform
-    Copyright (C) 2012-2020 Twilight Finland 3D Oy Ltd. All rights reserved.
+    Copyright (C) 2012-2019 Twilight Finland 3D Oy Ltd. All rights reserved.
 */
 #include <mango/mango.hpp>
+#include "../common/benchmark.hpp"
 
 using namespace mango;
 using namespace mango::filesystem;
 
+using benchmark::Image;
+
 #define TEST_STB
 //#define TEST_OCV
 #define TEST_JPEG_COMPRESSOR
 
-// ----------------------------------------------------------------------
-// warmup()
-// ----------------------------------------------------------------------
+// Every library decodes to RGB and encodes from the same RGB image, at the same quality.
 
-void warmup(const char* filename)
+static const int DEFAULT_QUALITY = 95;
+
+static int get_quality(int level)
 {
-    File file(filename);
-    ConstMemory memory = file;
-    std::vector<char> buffer(memory.size);
-    std::memcpy(buffer.data(), memory.address, memory.size);
+    return level == benchmark::DEFAULT_LEVEL ? DEFAULT_QUALITY : level;
+}
 
-    ImageDecoder decoder(memory, filename);
-    ImageHeader header = decoder.header();
-    printf("image: %d x %d (%d KB)\n", header.width, header.height, int(memory.size / 1024));
+static void delete_pixels(u8* pixels)
+{
+    delete[] pixels;
 }
 
 // ----------------------------------------------------------------------
@@ -34,119 +35,128 @@ void warmup(const char* filename)
 #include <jpeglib.h>
 #include <jerror.h>
 
-Surface load_jpeg(const char* filename)
+Image decode_libjpeg(ConstMemory memory)
 {
-    FILE *file = fopen(filename, "rb" );
-    if ( file == NULL )
-    {
-        return Surface(0, 0, FORMAT_NONE, 0, NULL);
-    }
-
     struct jpeg_decompress_struct info; //for our jpeg info
     struct jpeg_error_mgr err; //the error handler
 
     info.err = jpeg_std_error( &err );
     jpeg_create_decompress( &info ); //fills info structure
 
-    jpeg_stdio_src( &info, file );
+    jpeg_mem_src( &info, const_cast<u8*>(memory.address), (unsigned long) memory.size );
     jpeg_read_header( &info, TRUE );
 
+    // greyscale too, like the other decoders
+    info.out_color_space = JCS_RGB;
     jpeg_start_decompress( &info );
 
     int w = info.output_width;
     int h = info.output_height;
-    int numChannels = info.num_components; // 3 = RGB, 4 = RGBA
-    unsigned long dataSize = w * h * numChannels;
+    int stride = w * 3;
 
-    // read scanlines one at a time & put bytes in jdata[] array (assumes an RGB image)
-    unsigned char *data = new u8[dataSize];;
+    // read scanlines one at a time & put bytes in jdata[] array
+    u8* data = new u8[size_t(stride) * h];
     unsigned char *rowptr[ 1 ]; // array or pointers
     for ( ; info.output_scanline < info.output_height ; )
     {
-        rowptr[ 0 ] = data + info.output_scanline * w * numChannels;
+        rowptr[ 0 ] = data + size_t(info.output_scanline) * stride;
         jpeg_read_scanlines( &info, rowptr, 1 );
     }
 
     jpeg_finish_decompress( &info );
+    jpeg_destroy_decompress( &info );
 
-    fclose( file );
-
-    Format format = FORMAT_R8G8B8;
-    if (numChannels == 4)
-        format = FORMAT_R8G8B8A8;
-
-    // TODO: free data, format depends on numChannels
-    return Surface(w, h, format, w * numChannels, data);
+    return benchmark::make_image(data, w, h, stride, 3, delete_pixels);
 }
 
-void save_jpeg(const char* filename, const Surface& surface)
+bool encode_libjpeg(std::vector<u8>& output, const Image& image, int level)
 {
     struct jpeg_compress_struct cinfo;
-    jpeg_create_compress(&cinfo);
-
     struct jpeg_error_mgr jerr;
     cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
 
-    FILE * outfile;
-    if ((outfile = fopen(filename, "wb")) == NULL)
-    {
-        fprintf(stderr, "can't open %s\n", filename);
-        exit(1);
-    }
-    jpeg_stdio_dest(&cinfo, outfile);
+    // libjpeg allocates the output with malloc()
+    unsigned char* buffer = nullptr;
+    unsigned long size = 0;
+    jpeg_mem_dest(&cinfo, &buffer, &size);
 
-    cinfo.image_width = surface.width;
-    cinfo.image_height = surface.height;
-    cinfo.input_components = surface.format.bytes();
-    //cinfo.in_color_space = surface.format.bytes() == 3 ? JCS_RGB : JCS_EXT_RGBA;
+    cinfo.image_width = image.width;
+    cinfo.image_height = image.height;
+    cinfo.input_components = image.components;
     cinfo.in_color_space = JCS_RGB;
 
-    int quality = 95;
-
     jpeg_set_defaults(&cinfo);
-    jpeg_set_quality(&cinfo, quality, TRUE);
+    jpeg_set_quality(&cinfo, get_quality(level), TRUE);
     jpeg_start_compress(&cinfo, TRUE);
 
     JSAMPROW row_pointer[1];
 
     while (cinfo.next_scanline < cinfo.image_height)
     {
-        row_pointer[0] = surface.image + cinfo.next_scanline * surface.stride;
-        int x = jpeg_write_scanlines(&cinfo, row_pointer, 1);
-        (void) x;
+        row_pointer[0] = image.row(cinfo.next_scanline);
+        jpeg_write_scanlines(&cinfo, row_pointer, 1);
     }
 
     jpeg_finish_compress(&cinfo);
     jpeg_destroy_compress(&cinfo);
-    fclose(outfile);
 
-    delete[] surface.image;
+    output.insert(output.end(), buffer, buffer + size);
+    free(buffer);
+    return size > 0;
 }
 
+static benchmark::Plugin libjpeg_plugin({ "libjpeg", ".jpg", decode_libjpeg, encode_libjpeg });
+
 // ----------------------------------------------------------------------
 // stb
 // ----------------------------------------------------------------------
 
+#ifdef TEST_STB
+
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
-Surface stb_load_jpeg(const char* filename)
+static Image stb_decode_jpeg(ConstMemory memory, bool avx2)
 {
+    // the AVX2 kernels are used only when the CPU has them, see stbi_jpeg_avx2_enabled()
+    stbi_set_jpeg_avx2(avx2);
+
     int width, height, bpp;
-    u8* rgb = stbi_load(filename, &width, &height, &bpp, 3);
+    u8* rgb = stbi_load_from_memory(memory.address, int(memory.size), &width, &height, &bpp, 3);
 
-    return Surface(width, height, FORMAT_R8G8B8, width * 3, rgb);
+    return benchmark::make_image(rgb, width, height, width * 3, 3, stbi_image_free);
 }
 
-void stb_save_jpeg(const char* filename, const Surface& surface)
+Image decode_stb(ConstMemory memory)
 {
-    stbi_write_jpg(filename, surface.width, surface.height, 3, surface.image, surface.width*3);
-    stbi_image_free(surface.image);
+    return stb_decode_jpeg(memory, false);
 }
 
+Image decode_stb_avx2(ConstMemory memory)
+{
+    return stb_decode_jpeg(memory, true);
+}
+
+static void stb_write_callback(void* context, void* data, int size)
+{
+    std::vector<u8>* output = (std::vector<u8>*) context;
+    output->insert(output->end(), (u8*) data, (u8*) data + size);
+}
+
+bool encode_stb(std::vector<u8>& output, const Image& image, int level)
+{
+    return stbi_write_jpg_to_func_with_stride(stb_write_callback, &output, image.width, image.height,
+        image.components, image.pixels.get(), image.stride, get_quality(level)) != 0;
+}
+
+static benchmark::Plugin stb_plugin({ "stb", ".jpg", decode_stb, encode_stb });
+
+#endif
+
 // ----------------------------------------------------------------------
 // OpenCV
 // ----------------------------------------------------------------------
@@ -156,17 +166,26 @@ void stb_save_jpeg(const char* filename, const Surface& surface)
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
 
-using namespace cv;
-Surface ocv_load_jpeg(const char* filename)
+// the pixels are in BGR order, so the checksum is different from the others
+Image decode_ocv(ConstMemory memory)
 {
-    cv::Mat image;
-    image = cv::imread(filename, CV_LOAD_IMAGE_COLOR);
+    cv::Mat data(1, int(memory.size), CV_8UC1, const_cast<u8*>(memory.address));
+    cv::Mat* image = new cv::Mat(cv::imdecode(data, cv::IMREAD_COLOR));
 
-    int width = image.cols;
-    int height = image.rows;
-    return Surface(width, height, FORMAT_B8G8R8, width * 3, image.data);
+    return benchmark::make_image(image->data, image->cols, image->rows, int(image->step), 3,
+        [image] (u8*) { delete image; });
 }
 
+bool encode_ocv(std::vector<u8>& output, const Image& image, int level)
+{
+    // the channels are swapped, which does not change the amount of work
+    cv::Mat mat(image.height, image.width, CV_8UC3, image.pixels.get(), image.stride);
+    std::vector<int> params = { cv::IMWRITE_JPEG_QUALITY, get_quality(level) };
+    return cv::imencode(".jpg", mat, output, params);
+}
+
+static benchmark::Plugin ocv_plugin({ "opencv", ".jpg", decode_ocv, encode_ocv });
+
 #endif
 
 // ----------------------------------------------------------------------
@@ -178,34 +197,56 @@ Surface ocv_load_jpeg(const char* filename)
 #include "jpeg-compressor/jpgd.h"
 #include "jpeg-compressor/jpge.h"
 
-Surface jpgd_load(const char* filename)
+Image decode_jpgd(ConstMemory memory)
 {
     int width;
     int height;
     int comps;
-    u8* image = jpgd::decompress_jpeg_image_from_file(filename, &width, &height, &comps, 4);
-    return Surface(width, height, FORMAT_B8G8R8A8, width * 4, image);
+    u8* image = jpgd::decompress_jpeg_image_from_memory(memory.address, int(memory.size), &width, &height, &comps, 3);
+    return benchmark::make_image(image, width, height, width * 3, 3, free);
 }
 
-void jpge_save(const char* filename, const Surface& surface)
+bool encode_jpge(std::vector<u8>& output, const Image& image, int level)
 {
-    jpge::compress_image_to_jpeg_file(filename, surface.width, surface.height, 4, surface.image);
+    // jpge reads the rows without padding, and writes into a buffer that must be large enough
+    if (image.stride != image.width * image.components)
+        return false;
+
+    jpge::params params;
+    params.m_quality = get_quality(level);
+
+    int size = std::max(1024, int(image.bytes()));
+    size_t offset = output.size();
+    output.resize(offset + size);
+
+    bool success = jpge::compress_image_to_jpeg_file_in_memory(output.data() + offset, size,
+        image.width, image.height, image.components, image.pixels.get(), params);
+    output.resize(offset + (success ? size : 0));
+    return success;
 }
 
+static benchmark::Plugin jpgd_plugin({ "jpgd", ".jpg", decode_jpgd, encode_jpge });
+
 #endif
 
 // ----------------------------------------------------------------------
-// print
+// mango
 // ----------------------------------------------------------------------
 
-void print(const char* name, u64 time0, u64 time1, u64 time2)
+Image decode_mango(ConstMemory memory)
 {
-    printf("%s", name);
-    printf("%7d.%d ms ", int((time1 - time0) / 1000), int((time1 - time0) % 10));
-    printf("%7d.%d ms ", int((time2 - time1) / 1000), int((time2 - time1) % 10));
-    printf("\n");
+    return benchmark::decode_bitmap(memory, ".jpg", 3);
+}
+
+bool encode_mango(std::vector<u8>& output, const Image& image, int level)
+{
+    ImageEncodeOptions options;
+    options.quality = get_quality(level) / 100.0f;
+    return benchmark::encode_bitmap(output, image, ".jpg", options);
 }
 
+static benchmark::Plugin mango_plugin({ "mango", ".jpg", decode_mango, encode_mango });
+
 // ----------------------------------------------------------------------
 // main()
 // ----------------------------------------------------------------------
@@ -214,102 +255,62 @@ int main(int argc, const char* argv[])
 {
     if (argc < 2)
     {
-        printf("Too few arguments. usage: <filename.jpg>\n");
+        printf("Too few arguments. usage: <filename.jpg> %s\n", benchmark::OPTIONS_USAGE);
         exit(1);
     }
 
-    warmup(argv[1]);
-
-    printf("----------------------------------------------\n");
-    printf("                load         save             \n");
-    printf("----------------------------------------------\n");
-
-    u64 time0;
-    u64 time1;
-    u64 time2;
-
-    // ------------------------------------------------------------------
-
-    time0 = Time::us();
-
-    Surface s = load_jpeg(argv[1]);
-
-    time1 = Time::us();
-
-    save_jpeg("output-libjpeg.jpg", s);
-
-    time2 = Time::us();
-    print("libjpeg: ", time0, time1, time2);
-
-    // ------------------------------------------------------------------
-
-#ifdef TEST_OCV
+    const char* filename = argv[1];
 
-    // this is not timed; the ocv_image is for saving
-    cv::Mat ocv_image = cv::imread(argv[1], CV_LOAD_IMAGE_COLOR);
+    benchmark::Options options;
 
-    time0 = Time::us();
-
-    Surface s_ocv = ocv_load_jpeg(argv[1]);
-
-    time1 = Time::us();
-
-    cv::imwrite("output-ocv.jpg", ocv_image);
-
-    time2 = Time::us();
-    print("opencv:  ", time0, time1, time2);
-
-#endif
-
-    // ------------------------------------------------------------------
+    for (int i = 2; i < argc; ++i)
+    {
+        if (!benchmark::parse_option(options, argc, argv, i))
+        {
+            printf("Unknown argument: %s\n", argv[i]);
+            exit(1);
+        }
+    }
 
 #ifdef TEST_STB
-
-    time0 = Time::us();
-
-    Surface s_stb = stb_load_jpeg(argv[1]);
-
-    time1 = Time::us();
-
-    stb_save_jpeg("output-stb.jpg", s_stb);
-
-    time2 = Time::us();
-    print("stb:     ", time0, time1, time2);
-
-#endif
-
-    // ------------------------------------------------------------------
-
-#ifdef TEST_JPEG_COMPRESSOR
-
-    time0 = Time::us();
-
-    Surface s_jpgd = jpgd_load(argv[1]);
-
-    time1 = Time::us();
-
-    jpge_save("output-jpge.jpg", s_jpgd);
-
-    time2 = Time::us();
-    print("jpgd:    ", time0, time1, time2);
-
+    // the AVX2 variant is measured only on CPUs that have it
+    stbi_set_jpeg_avx2(true);
+    if (stbi_jpeg_avx2_enabled())
+    {
+        benchmark::codecs().push_back({ "stb-avx2", ".jpg", decode_stb_avx2, nullptr });
+    }
 #endif
 
-    // ------------------------------------------------------------------
+    File file(filename);
+    Buffer buffer(file);
 
-    time0 = Time::us();
+    Image reference = benchmark::load_reference(buffer, ".jpg", 3);
+    if (!reference)
+    {
+        printf("Can't decode %s\n", filename);
+        exit(1);
+    }
 
-    Bitmap bitmap(argv[1]);
+    printf("image: %d x %d (%d KB), quality: %d\n", reference.width, reference.height, int(file.size() / 1024), DEFAULT_QUALITY);
+    printf("runs: %d (+%d warmup), times in ms\n", options.runs, options.warmup);
+    benchmark::print_header();
 
-    time1 = Time::us();
+    std::vector<benchmark::Result> results;
 
-    ImageEncodeOptions options;
-    options.quality = 0.70f;
-    bitmap.save("output-mango.jpg", options);
+    for (const auto& codec : benchmark::codecs())
+    {
+        std::vector<benchmark::Result> codec_results;
+        std::vector<u8> output = benchmark::test(codec_results, codec, filename, buffer, ".jpg", reference,
+            benchmark::DEFAULT_LEVEL, options);
 
-    time2 = Time::us();
-    print("mango:   ", time0, time1, time2);
+        if (!output.empty())
+        {
+            benchmark::write_file(std::string("output-") + codec.name + ".jpg", output);
+        }
 
-    // ------------------------------------------------------------------
+        benchmark::print_results(codec_results);
+        results.insert(results.end(), codec_results.begin(), codec_results.end());
+    }
 
+    benchmark::write_reports(results, options);
 }
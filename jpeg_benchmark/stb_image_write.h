@@ -20,9 +20,10 @@ ABOUT:
    This header file is a library for writing images to C stdio. It could be
    adapted to write to memory or a general streaming interface; let me know.
 
-   The PNG output is not optimal; it is 20-50% larger than the file
-   written by a decent optimizing implementation; though providing a custom
-   zlib compress function (see STBIW_ZLIB_COMPRESS) can mitigate that.
+   The PNG output is not optimal; the builtin deflate (hash chains, lazy
+   matching, dynamic huffman blocks) is close to zlib at the same level,
+   and a custom zlib compress function (see STBIW_ZLIB_COMPRESS and
+   stbi_write_png_zlib_compress) can do better than that.
    This library is designed for source code compactness and simplicity,
    not optimal image file size or run-time performance.
 
@@ -48,6 +49,8 @@ USAGE:
      int stbi_write_jpg(char const *filename, int w, int h, int comp, const void *data, int quality);
      int stbi_write_hdr(char const *filename, int w, int h, int comp, const float *data);
 
+     int stbi_write_jpg_with_stride(char const *filename, int w, int h, int comp, const void *data, int stride_in_bytes, int quality);
+
      void stbi_flip_vertically_on_write(int flag); // flag is non-zero to flip data vertically
 
    There are also five equivalent functions that use an arbitrary write function. You are
@@ -58,14 +61,27 @@ USAGE:
      int stbi_write_tga_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void  *data);
      int stbi_write_hdr_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const float *data);
      int stbi_write_jpg_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void *data, int quality);
+     int stbi_write_jpg_to_func_with_stride(stbi_write_func *func, void *context, int x, int y, int comp, const void *data, int stride_in_bytes, int quality);
 
    where the callback is:
       void stbi_write_func(void *context, void *data, int size);
 
    You can configure it with these global variables:
       int stbi_write_tga_with_rle;             // defaults to true; set to 0 to disable RLE
-      int stbi_write_png_compression_level;    // defaults to 8; set to higher for more compression
+      int stbi_write_png_compression_level;    // defaults to 8; zlib style 0..9, 0 stores the data uncompressed
       int stbi_write_force_png_filter;         // defaults to -1; set to 0..5 to force a filter mode
+      stbi_write_zlib_compress_func *stbi_write_png_zlib_compress; // defaults to NULL; the PNG compressor, see below
+      stbi_write_parallel_func *stbi_write_png_parallel;            // defaults to NULL; runs PNG filtering in parallel, see below
+
+   stbi_write_png_zlib_compress replaces the builtin compressor at run time, with
+   the same contract as STBIW_ZLIB_COMPRESS:
+      unsigned char *stbi_write_zlib_compress_func(unsigned char *data, int data_len, int *out_len, int quality);
+
+   stbi_write_png_parallel must call task(data, index) once for each index in
+   0..count-1, in any order and on any threads, and return when all are done:
+      void stbi_write_parallel_func(void (*task)(void *data, int index), void *data, int count);
+   The filter for each row is then chosen in bands of rows at the same time.
+   The output is the same as without it.
 
 
    You can define STBI_WRITE_NO_STDIO to disable the file variant of these
@@ -80,17 +96,18 @@ USAGE:
    per channel, in the following order: 1=Y, 2=YA, 3=RGB, 4=RGBA. (Y is
    monochrome color.) The rectangle is 'w' pixels wide and 'h' pixels tall.
    The *data pointer points to the first byte of the top-left-most pixel.
-   For PNG, "stride_in_bytes" is the distance in bytes from the first byte of
-   a row of pixels to the first byte of the next row of pixels.
+   For PNG and JPEG, "stride_in_bytes" is the distance in bytes from the first
+   byte of a row of pixels to the first byte of the next row of pixels; 0 means
+   rows are packed (w*comp bytes).
 
    PNG creates output files with the same number of components as the input.
    The BMP format expands Y to RGB in the file format and does not
    output alpha.
 
-   PNG supports writing rectangles of data even when the bytes storing rows of
-   data are not consecutive in memory (e.g. sub-rectangles of a larger image),
-   by supplying the stride between the beginning of adjacent rows. The other
-   formats do not. (Thus you cannot write a native-format BMP through the BMP
+   PNG and JPEG support writing rectangles of data even when the bytes storing
+   rows of data are not consecutive in memory (e.g. sub-rectangles of a larger
+   image), by supplying the stride between the beginning of adjacent rows. The
+   other formats do not. (Thus you cannot write a native-format BMP through the BMP
    writer, both because it is in BGR order and because it may have padding
    at the end of the line.)
 
@@ -106,7 +123,10 @@ USAGE:
    
    JPEG does ignore alpha channels in input data; quality is between 1 and 100.
    Higher quality looks better but results in a bigger image.
-   JPEG baseline (no JPEG progressive).
+   JPEG baseline (no JPEG progressive). On x86 with SSE2 the color conversion
+   and DCT use SIMD; the output is the same as without. Define STBIW_NO_SIMD
+   to disable it. The entropy coded data is collected in blocks before it is
+   passed to the write function.
 
 CREDITS:
 
@@ -161,10 +181,15 @@ LICENSE
 #endif
 #endif
 
+typedef unsigned char *stbi_write_zlib_compress_func(unsigned char *data, int data_len, int *out_len, int quality);
+typedef void stbi_write_parallel_func(void (*task)(void *data, int index), void *data, int count);
+
 #ifndef STB_IMAGE_WRITE_STATIC  // C++ forbids static forward declarations
 extern int stbi_write_tga_with_rle;
 extern int stbi_write_png_compression_level;
 extern int stbi_write_force_png_filter;
+extern stbi_write_zlib_compress_func *stbi_write_png_zlib_compress;
+extern stbi_write_parallel_func *stbi_write_png_parallel;
 #endif
 
 #ifndef STBI_WRITE_NO_STDIO
@@ -173,6 +198,7 @@ STBIWDEF int stbi_write_bmp(char const *filename, int w, int h, int comp, const
 STBIWDEF int stbi_write_tga(char const *filename, int w, int h, int comp, const void  *data);
 STBIWDEF int stbi_write_hdr(char const *filename, int w, int h, int comp, const float *data);
 STBIWDEF int stbi_write_jpg(char const *filename, int x, int y, int comp, const void  *data, int quality);
+STBIWDEF int stbi_write_jpg_with_stride(char const *filename, int x, int y, int comp, const void  *data, int stride_in_bytes, int quality);
 #endif
 
 typedef void stbi_write_func(void *context, void *data, int size);
@@ -182,6 +208,7 @@ STBIWDEF int stbi_write_bmp_to_func(stbi_write_func *func, void *context, int w,
 STBIWDEF int stbi_write_tga_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void  *data);
 STBIWDEF int stbi_write_hdr_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const float *data);
 STBIWDEF int stbi_write_jpg_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void  *data, int quality);
+STBIWDEF int stbi_write_jpg_to_func_with_stride(stbi_write_func *func, void *context, int x, int y, int comp, const void  *data, int stride_in_bytes, int quality);
 
 STBIWDEF void stbi_flip_vertically_on_write(int flip_boolean);
 
@@ -238,16 +265,25 @@ STBIWDEF void stbi_flip_vertically_on_write(int flip_boolean);
 
 #define STBIW_UCHAR(x) (unsigned char) ((x) & 0xff)
 
+#if !defined(STBIW_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define STBIW_SSE2
+#include <emmintrin.h>
+#endif
+
 #ifdef STB_IMAGE_WRITE_STATIC
 static int stbi__flip_vertically_on_write=0;
 static int stbi_write_png_compression_level = 8;
 static int stbi_write_tga_with_rle = 1;
 static int stbi_write_force_png_filter = -1;
+static stbi_write_zlib_compress_func *stbi_write_png_zlib_compress = NULL;
+static stbi_write_parallel_func *stbi_write_png_parallel = NULL;
 #else
 int stbi_write_png_compression_level = 8;
 int stbi__flip_vertically_on_write=0;
 int stbi_write_tga_with_rle = 1;
 int stbi_write_force_png_filter = -1;
+stbi_write_zlib_compress_func *stbi_write_png_zlib_compress = NULL;
+stbi_write_parallel_func *stbi_write_png_parallel = NULL;
 #endif
 
 STBIWDEF void stbi_flip_vertically_on_write(int flag)
@@ -259,6 +295,8 @@ typedef struct
 {
    stbi_write_func *func;
    void *context;
+   unsigned char buffer[4096];
+   int buf_used;
 } stbi__write_context;
 
 // initialize a callback-based context
@@ -266,6 +304,7 @@ static void stbi__start_write_callbacks(stbi__write_context *s, stbi_write_func
 {
    s->func    = c;
    s->context = context;
+   s->buf_used = 0;
 }
 
 #ifndef STBI_WRITE_NO_STDIO
@@ -335,9 +374,34 @@ static void stbiw__writef(stbi__write_context *s, const char *fmt, ...)
    va_end(v);
 }
 
+// the JPEG writer goes through the buffer, so the write function gets a few
+// large blocks instead of one call per byte. it must flush before returning.
+static void stbiw__write_flush(stbi__write_context *s)
+{
+   if (s->buf_used) {
+      s->func(s->context, s->buffer, s->buf_used);
+      s->buf_used = 0;
+   }
+}
+
+static void stbiw__write_buffered(stbi__write_context *s, const void *data, int size)
+{
+   if (s->buf_used + size > (int) sizeof(s->buffer)) {
+      stbiw__write_flush(s);
+      if (size > (int) sizeof(s->buffer)) {
+         s->func(s->context, (void *) data, size);
+         return;
+      }
+   }
+   memcpy(s->buffer + s->buf_used, data, size);
+   s->buf_used += size;
+}
+
 static void stbiw__putc(stbi__write_context *s, unsigned char c)
 {
-   s->func(s->context, &c, 1);
+   if (s->buf_used == (int) sizeof(s->buffer))
+      stbiw__write_flush(s);
+   s->buffer[s->buf_used++] = c;
 }
 
 static void stbiw__write3(stbi__write_context *s, unsigned char a, unsigned char b, unsigned char c)
@@ -727,40 +791,45 @@ STBIWDEF int stbi_write_hdr(char const *filename, int x, int y, int comp, const
 //
 
 #ifndef STBIW_ZLIB_COMPRESS
-// stretchy buffer; stbiw__sbpush() == vector<>::push_back() -- stbiw__sbcount() == vector<>::size()
-#define stbiw__sbraw(a) ((int *) (a) - 2)
-#define stbiw__sbm(a)   stbiw__sbraw(a)[0]
-#define stbiw__sbn(a)   stbiw__sbraw(a)[1]
-
-#define stbiw__sbneedgrow(a,n)  ((a)==0 || stbiw__sbn(a)+n >= stbiw__sbm(a))
-#define stbiw__sbmaybegrow(a,n) (stbiw__sbneedgrow(a,(n)) ? stbiw__sbgrow(a,n) : 0)
-#define stbiw__sbgrow(a,n)  stbiw__sbgrowf((void **) &(a), (n), sizeof(*(a)))
-
-#define stbiw__sbpush(a, v)      (stbiw__sbmaybegrow(a,1), (a)[stbiw__sbn(a)++] = (v))
-#define stbiw__sbcount(a)        ((a) ? stbiw__sbn(a) : 0)
-#define stbiw__sbfree(a)         ((a) ? STBIW_FREE(stbiw__sbraw(a)),0 : 0)
+// output buffer with a bit writer; the space for a block is reserved before it is written
+typedef struct
+{
+   unsigned char *data;
+   int len, cap;
+   unsigned int bitbuf;
+   int bitcount;
+} stbiw__zbuf;
 
-static void *stbiw__sbgrowf(void **arr, int increment, int itemsize)
+static int stbiw__zbuf_reserve(stbiw__zbuf *z, int n)
 {
-   int m = *arr ? 2*stbiw__sbm(*arr)+increment : increment+1;
-   void *p = STBIW_REALLOC_SIZED(*arr ? stbiw__sbraw(*arr) : 0, *arr ? (stbiw__sbm(*arr)*itemsize + sizeof(int)*2) : 0, itemsize * m + sizeof(int)*2);
-   STBIW_ASSERT(p);
-   if (p) {
-      if (!*arr) ((int *) p)[1] = 0;
-      *arr = (void *) ((int *) p + 2);
-      stbiw__sbm(*arr) = m;
+   if (z->len + n > z->cap) {
+      int cap = z->cap ? z->cap : 1024;
+      unsigned char *p;
+      while (cap < z->len + n) cap *= 2;
+      p = (unsigned char *) STBIW_REALLOC_SIZED(z->data, z->cap, cap);
+      if (!p) return 0;
+      z->data = p;
+      z->cap = cap;
    }
-   return *arr;
+   return 1;
 }
 
-static unsigned char *stbiw__zlib_flushf(unsigned char *data, unsigned int *bitbuffer, int *bitcount)
+// at most 16 bits at a time, least significant bit first
+static void stbiw__zbuf_bits(stbiw__zbuf *z, unsigned int bits, int count)
 {
-   while (*bitcount >= 8) {
-      stbiw__sbpush(data, STBIW_UCHAR(*bitbuffer));
-      *bitbuffer >>= 8;
-      *bitcount -= 8;
+   z->bitbuf |= bits << z->bitcount;
+   z->bitcount += count;
+   while (z->bitcount >= 8) {
+      z->data[z->len++] = STBIW_UCHAR(z->bitbuf);
+      z->bitbuf >>= 8;
+      z->bitcount -= 8;
    }
-   return data;
+}
+
+static void stbiw__zbuf_align(stbiw__zbuf *z)
+{
+   if (z->bitcount)
+      stbiw__zbuf_bits(z, 0, 8 - z->bitcount);
 }
 
 static int stbiw__zlib_bitrev(int code, int codebits)
@@ -773,135 +842,472 @@ static int stbiw__zlib_bitrev(int code, int codebits)
    return res;
 }
 
-static unsigned int stbiw__zlib_countm(unsigned char *a, unsigned char *b, int limit)
+static const unsigned short stbiw__zlib_lengthc[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258, 259 };
+static const unsigned char  stbiw__zlib_lengtheb[]= { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0 };
+static const unsigned short stbiw__zlib_distc[]   = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577, 32768 };
+static const unsigned char  stbiw__zlib_disteb[]  = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+static const unsigned char  stbiw__zlib_clorder[] = { 16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15 };
+
+#define stbiw__ZWINDOW      32768
+#define stbiw__ZHASH_BITS   15
+#define stbiw__ZBLOCK       32768   // tokens per deflate block
+
+// matcher settings for levels 1..9, in the spirit of zlib's configuration table:
+// levels 1-3 take the first match and insert only short matches into the hash chains,
+// levels 4-9 look one byte ahead ("lazy" matching) before committing to a match
+static const struct { unsigned short good, lazy, nice, chain; } stbiw__zlib_config[10] =
 {
-   int i;
-   for (i=0; i < limit && i < 258; ++i)
-      if (a[i] != b[i]) break;
-   return i;
+   {  0,   0,   0,    0 }, // stored
+   {  4,   4,   8,    4 },
+   {  4,   5,  16,    8 },
+   {  4,   6,  32,   32 },
+   {  4,   4,  16,   16 },
+   {  8,  16,  32,   32 },
+   {  8,  16, 128,  128 },
+   {  8,  32, 128,  256 },
+   { 32, 128, 258, 1024 },
+   { 32, 258, 258, 4096 },
+};
+
+typedef struct
+{
+   unsigned char *data;
+   int data_len;
+   int *head;             // most recent position for each hash, -1 if none
+   int *prev;             // previous position with the same hash, indexed by position & (stbiw__ZWINDOW-1)
+   int good, nice, chain;
+   stbiw_uint32 *tokens;  // literal: byte, match: length << 16 | distance
+   int num_tokens;
+   int block_start;       // first input byte covered by the pending tokens
+   unsigned int litfreq[286];
+   unsigned int distfreq[30];
+} stbiw__zmatcher;
+
+static int stbiw__zhash(const unsigned char *data)
+{
+   stbiw_uint32 v = data[0] | (data[1] << 8) | ((stbiw_uint32) data[2] << 16);
+   return (int) ((v * 2654435761u) >> (32 - stbiw__ZHASH_BITS));
 }
 
-static unsigned int stbiw__zhash(unsigned char *data)
+// returns the first position in the chain for i, and links i into it
+static int stbiw__zinsert(stbiw__zmatcher *m, int i)
 {
-   stbiw_uint32 hash = data[0] + (data[1] << 8) + (data[2] << 16);
-   hash ^= hash << 3;
-   hash += hash >> 5;
-   hash ^= hash << 4;
-   hash += hash >> 17;
-   hash ^= hash << 25;
-   hash += hash >> 6;
-   return hash;
-}
-
-#define stbiw__zlib_flush() (out = stbiw__zlib_flushf(out, &bitbuf, &bitcount))
-#define stbiw__zlib_add(code,codebits) \
-      (bitbuf |= (code) << bitcount, bitcount += (codebits), stbiw__zlib_flush())
-#define stbiw__zlib_huffa(b,c)  stbiw__zlib_add(stbiw__zlib_bitrev(b,c),c)
-// default huffman tables
-#define stbiw__zlib_huff1(n)  stbiw__zlib_huffa(0x30 + (n), 8)
-#define stbiw__zlib_huff2(n)  stbiw__zlib_huffa(0x190 + (n)-144, 9)
-#define stbiw__zlib_huff3(n)  stbiw__zlib_huffa(0 + (n)-256,7)
-#define stbiw__zlib_huff4(n)  stbiw__zlib_huffa(0xc0 + (n)-280,8)
-#define stbiw__zlib_huff(n)  ((n) <= 143 ? stbiw__zlib_huff1(n) : (n) <= 255 ? stbiw__zlib_huff2(n) : (n) <= 279 ? stbiw__zlib_huff3(n) : stbiw__zlib_huff4(n))
-#define stbiw__zlib_huffb(n) ((n) <= 143 ? stbiw__zlib_huff1(n) : stbiw__zlib_huff2(n))
-
-#define stbiw__ZHASH   16384
+   int h = stbiw__zhash(m->data + i);
+   int candidate = m->head[h];
+   m->prev[i & (stbiw__ZWINDOW-1)] = candidate;
+   m->head[h] = i;
+   return candidate;
+}
 
-#endif // STBIW_ZLIB_COMPRESS
+// longest match for position i that is longer than best, or 0
+static int stbiw__zlongest(stbiw__zmatcher *m, int candidate, int i, int best, int *distance)
+{
+   unsigned char *data = m->data;
+   unsigned char *scan = data + i;
+   int limit = m->data_len - i;
+   int chain = m->chain;
+   int found = 0;
+   if (limit > 258) limit = 258;
+   if (best >= limit) return 0;
+   if (best >= m->good) chain >>= 2;
+   if (best < 2) best = 2;
+
+   while (candidate >= 0 && candidate > i - stbiw__ZWINDOW && chain--) {
+      unsigned char *match = data + candidate;
+      if (match[best] == scan[best] && match[0] == scan[0] && match[1] == scan[1]) {
+         int len = 2;
+         while (len < limit && match[len] == scan[len]) ++len;
+         if (len > best) {
+            best = len;
+            found = 1;
+            *distance = i - candidate;
+            if (len >= m->nice || len == limit) break;
+         }
+      }
+      candidate = m->prev[candidate & (stbiw__ZWINDOW-1)];
+   }
+   // a minimum length match that far back costs more than the literals
+   if (found && best == 3 && *distance > 4096)
+      found = 0;
+   return found ? best : 0;
+}
 
-unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
+// length-limited huffman code lengths for the symbols with non-zero frequency
+static void stbiw__zlib_lengths(const unsigned int *freq, int n, int maxbits, unsigned char *lengths)
 {
-#ifdef STBIW_ZLIB_COMPRESS
-   // user provided a zlib compress implementation, use that
-   return STBIW_ZLIB_COMPRESS(data, data_len, out_len, quality);
-#else // use builtin
-   static unsigned short lengthc[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258, 259 };
-   static unsigned char  lengtheb[]= { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0 };
-   static unsigned short distc[]   = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577, 32768 };
-   static unsigned char  disteb[]  = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
-   unsigned int bitbuf=0;
-   int i,j, bitcount=0;
-   unsigned char *out = NULL;
-   unsigned char ***hash_table = (unsigned char***) STBIW_MALLOC(stbiw__ZHASH * sizeof(char**));
-   if (hash_table == NULL)
-      return NULL;
-   if (quality < 5) quality = 5;
-
-   stbiw__sbpush(out, 0x78);   // DEFLATE 32K window
-   stbiw__sbpush(out, 0x5e);   // FLEVEL = 1
-   stbiw__zlib_add(1,1);  // BFINAL = 1
-   stbiw__zlib_add(1,2);  // BTYPE = 1 -- fixed huffman
-
-   for (i=0; i < stbiw__ZHASH; ++i)
-      hash_table[i] = NULL;
-
-   i=0;
-   while (i < data_len-3) {
-      // hash next 3 bytes of data to be compressed
-      int h = stbiw__zhash(data+i)&(stbiw__ZHASH-1), best=3;
-      unsigned char *bestloc = 0;
-      unsigned char **hlist = hash_table[h];
-      int n = stbiw__sbcount(hlist);
-      for (j=0; j < n; ++j) {
-         if (hlist[j]-data > i-32768) { // if entry lies within window
-            int d = stbiw__zlib_countm(hlist[j], data+i, data_len-i);
-            if (d >= best) best=d,bestloc=hlist[j];
+   int sym[288], parent[2*288], depth[2*288], count[16];
+   unsigned int weight[2*288];
+   int i, j, m = 0, leaf, inner, total;
+
+   memset(lengths, 0, n);
+   for (i=0; i < n; ++i) {
+      if (freq[i]) {
+         // insertion sort by frequency, the lists are short
+         for (j=m; j > 0 && freq[sym[j-1]] > freq[i]; --j)
+            sym[j] = sym[j-1];
+         sym[j] = i;
+         ++m;
+      }
+   }
+   if (m < 2) {
+      // a single code (or none, for the distances of a block without matches) still needs
+      // one bit; give it a partner so that decoders see a complete code
+      int s = m ? sym[0] : 0;
+      lengths[s] = 1;
+      lengths[s ? 0 : 1] = 1;
+      return;
+   }
+
+   // huffman tree with two queues: the sorted leaves, and the inner nodes in the order they are made
+   for (i=0; i < m; ++i)
+      weight[i] = freq[sym[i]];
+   leaf = 0;
+   inner = m;
+   for (i=m; i < 2*m-1; ++i) {
+      weight[i] = 0;
+      for (j=0; j < 2; ++j) {
+         int k = (leaf < m && (inner >= i || weight[leaf] <= weight[inner])) ? leaf++ : inner++;
+         parent[k] = i;
+         weight[i] += weight[k];
+      }
+   }
+   depth[2*m-2] = 0;
+   for (i=2*m-3; i >= 0; --i)
+      depth[i] = depth[parent[i]] + 1;
+
+   // clamp to maxbits and take codes from the shortest lengths until the code is complete again
+   memset(count, 0, sizeof(count));
+   for (i=0; i < m; ++i)
+      ++count[depth[i] > maxbits ? maxbits : depth[i]];
+   total = 0;
+   for (i=1; i <= maxbits; ++i)
+      total += count[i] << (maxbits - i);
+   while (total > (1 << maxbits)) {
+      --count[maxbits];
+      for (i=maxbits-1; i > 0; --i) {
+         if (count[i]) {
+            --count[i];
+            count[i+1] += 2;
+            break;
          }
       }
-      // when hash table entry is too long, delete half the entries
-      if (hash_table[h] && stbiw__sbn(hash_table[h]) == 2*quality) {
-         STBIW_MEMMOVE(hash_table[h], hash_table[h]+quality, sizeof(hash_table[h][0])*quality);
-         stbiw__sbn(hash_table[h]) = quality;
+      --total;
+   }
+
+   // the least frequent symbols get the longest codes
+   j = 0;
+   for (i=maxbits; i > 0; --i) {
+      int c;
+      for (c=count[i]; c > 0; --c)
+         lengths[sym[j++]] = (unsigned char) i;
+   }
+}
+
+// canonical codes, bit reversed for the least significant bit first output
+static void stbiw__zlib_codes(const unsigned char *lengths, int n, unsigned short *codes)
+{
+   int count[16], next[16], i, code = 0;
+   memset(count, 0, sizeof(count));
+   for (i=0; i < n; ++i)
+      ++count[lengths[i]];
+   count[0] = 0;
+   for (i=1; i < 16; ++i) {
+      code = (code + count[i-1]) << 1;
+      next[i] = code;
+   }
+   for (i=0; i < n; ++i)
+      if (lengths[i])
+         codes[i] = (unsigned short) stbiw__zlib_bitrev(next[lengths[i]]++, lengths[i]);
+}
+
+static int stbiw__zlib_lencode(int len)
+{
+   int j;
+   for (j=0; len > stbiw__zlib_lengthc[j+1]-1; ++j);
+   return j;
+}
+
+static int stbiw__zlib_distcode(int d)
+{
+   int j;
+   if (d <= 4) return d - 1;
+   // two codes for each power of two above 4
+   for (j=4; d > stbiw__zlib_distc[j+1]-1; ++j);
+   return j;
+}
+
+// run-length codes (16, 17, 18) for the concatenated code lengths; returns the number of entries
+static int stbiw__zlib_rle(const unsigned char *lengths, int n, unsigned short *rle, unsigned int *freq)
+{
+   int i = 0, count = 0;
+   while (i < n) {
+      int v = lengths[i], run = 1;
+      while (i + run < n && lengths[i+run] == v) ++run;
+      i += run;
+      if (v == 0) {
+         while (run >= 11) { int r = run > 138 ? 138 : run; rle[count++] = (unsigned short) (18 | (r - 11) << 8); ++freq[18]; run -= r; }
+         if (run >= 3) { rle[count++] = (unsigned short) (17 | (run - 3) << 8); ++freq[17]; run = 0; }
+      } else {
+         rle[count++] = (unsigned short) v; ++freq[v]; --run;
+         while (run >= 3) { int r = run > 6 ? 6 : run; rle[count++] = (unsigned short) (16 | (r - 3) << 8); ++freq[16]; run -= r; }
       }
-      stbiw__sbpush(hash_table[h],data+i);
-
-      if (bestloc) {
-         // "lazy matching" - check match at *next* byte, and if it's better, do cur byte as literal
-         h = stbiw__zhash(data+i+1)&(stbiw__ZHASH-1);
-         hlist = hash_table[h];
-         n = stbiw__sbcount(hlist);
-         for (j=0; j < n; ++j) {
-            if (hlist[j]-data > i-32767) {
-               int e = stbiw__zlib_countm(hlist[j], data+i+1, data_len-i-1);
-               if (e > best) { // if next match is better, bail on current match
-                  bestloc = NULL;
-                  break;
-               }
-            }
+      while (run--) { rle[count++] = (unsigned short) v; ++freq[v]; }
+   }
+   return count;
+}
+
+static int stbiw__zlib_stored(stbiw__zbuf *z, const unsigned char *data, int len, int final)
+{
+   if (!stbiw__zbuf_reserve(z, len + 5 * (len / 65535 + 1) + 8)) return 0;
+   do {
+      int part = len > 65535 ? 65535 : len;
+      len -= part;
+      stbiw__zbuf_bits(z, final && !len, 1);
+      stbiw__zbuf_bits(z, 0, 2); // BTYPE = 0 -- stored
+      stbiw__zbuf_align(z);
+      stbiw__zbuf_bits(z, part & 0xffff, 16);
+      stbiw__zbuf_bits(z, ~part & 0xffff, 16);
+      memcpy(z->data + z->len, data, part);
+      z->len += part;
+      data += part;
+   } while (len);
+   return 1;
+}
+
+// writes the pending tokens as a stored, fixed or dynamic block, whichever is smallest
+static int stbiw__zlib_block(stbiw__zbuf *z, stbiw__zmatcher *m, int block_end, int final)
+{
+   unsigned char lengths[286+30], cllengths[19];
+   unsigned short litcodes[288], distcodes[30], clcodes[19], rle[286+30];
+   unsigned int clfreq[19];
+   int hlit, hdist, hclen, nrle, i, btype;
+   int stored_len = block_end - m->block_start;
+   unsigned int extra = 0, fixed_bits = 3, dynamic_bits, stored_bits, bits;
+
+   m->litfreq[256] = 1;
+   for (i=0; i < 29; ++i)
+      extra += m->litfreq[257+i] * stbiw__zlib_lengtheb[i];
+   for (i=0; i < 30; ++i)
+      extra += m->distfreq[i] * stbiw__zlib_disteb[i];
+
+   // fixed huffman code lengths
+   for (i=0; i < 286; ++i)
+      fixed_bits += m->litfreq[i] * (i <= 143 ? 8 : i <= 255 ? 9 : i <= 279 ? 7 : 8);
+   for (i=0; i < 30; ++i)
+      fixed_bits += m->distfreq[i] * 5;
+   fixed_bits += extra;
+
+   stbiw__zlib_lengths(m->litfreq, 286, 15, lengths);
+   stbiw__zlib_lengths(m->distfreq, 30, 15, lengths + 286);
+   for (hlit=286; hlit > 257 && !lengths[hlit-1]; --hlit);
+   for (hdist=30; hdist > 1 && !lengths[286+hdist-1]; --hdist);
+   // the distance lengths follow the literal/length lengths directly, run lengths may cross over
+   if (hlit < 286)
+      memmove(lengths + hlit, lengths + 286, hdist);
+   memset(clfreq, 0, sizeof(clfreq));
+   nrle = stbiw__zlib_rle(lengths, hlit + hdist, rle, clfreq);
+   stbiw__zlib_lengths(clfreq, 19, 7, cllengths);
+   for (hclen=19; hclen > 4 && !cllengths[stbiw__zlib_clorder[hclen-1]]; --hclen);
+
+   dynamic_bits = 3 + 5 + 5 + 4 + hclen * 3 + extra;
+   for (i=0; i < 19; ++i)
+      dynamic_bits += clfreq[i] * cllengths[i];
+   dynamic_bits += clfreq[16] * 2 + clfreq[17] * 3 + clfreq[18] * 7;
+   for (i=0; i < hlit; ++i)
+      dynamic_bits += m->litfreq[i] * lengths[i];
+   for (i=0; i < hdist; ++i)
+      dynamic_bits += m->distfreq[i] * lengths[hlit+i];
+
+   stored_bits = (stored_len + 5 * (stored_len / 65535 + 1)) * 8 + 7;
+
+   btype = dynamic_bits < fixed_bits ? 2 : 1;
+   bits = btype == 2 ? dynamic_bits : fixed_bits;
+   if (stored_bits <= bits) {
+      if (!stbiw__zlib_stored(z, m->data + m->block_start, stored_len, final)) return 0;
+   } else {
+      if (!stbiw__zbuf_reserve(z, (int) (bits / 8) + 8)) return 0;
+      stbiw__zbuf_bits(z, final, 1);
+      stbiw__zbuf_bits(z, btype, 2);
+      if (btype == 1) {
+         // the fixed code has 288 literal/length symbols, the last two are never used
+         unsigned char fixed[288];
+         for (i=0; i < 288; ++i)
+            fixed[i] = (unsigned char) (i <= 143 ? 8 : i <= 255 ? 9 : i <= 279 ? 7 : 8);
+         stbiw__zlib_codes(fixed, 288, litcodes);
+         memcpy(lengths, fixed, 286);
+         memset(lengths + 286, 5, 30);
+         stbiw__zlib_codes(lengths + 286, 30, distcodes);
+      } else {
+         stbiw__zlib_codes(cllengths, 19, clcodes);
+         stbiw__zbuf_bits(z, hlit - 257, 5);
+         stbiw__zbuf_bits(z, hdist - 1, 5);
+         stbiw__zbuf_bits(z, hclen - 4, 4);
+         for (i=0; i < hclen; ++i)
+            stbiw__zbuf_bits(z, cllengths[stbiw__zlib_clorder[i]], 3);
+         for (i=0; i < nrle; ++i) {
+            int c = rle[i] & 0xff;
+            stbiw__zbuf_bits(z, clcodes[c], cllengths[c]);
+            if (c == 16) stbiw__zbuf_bits(z, rle[i] >> 8, 2);
+            if (c == 17) stbiw__zbuf_bits(z, rle[i] >> 8, 3);
+            if (c == 18) stbiw__zbuf_bits(z, rle[i] >> 8, 7);
          }
+         memmove(lengths + 286, lengths + hlit, hdist);
+         memset(lengths + hlit, 0, 286 - hlit);
+         memset(lengths + 286 + hdist, 0, 30 - hdist);
+         stbiw__zlib_codes(lengths, 286, litcodes);
+         stbiw__zlib_codes(lengths + 286, 30, distcodes);
       }
 
-      if (bestloc) {
-         int d = (int) (data+i - bestloc); // distance back
-         STBIW_ASSERT(d <= 32767 && best <= 258);
-         for (j=0; best > lengthc[j+1]-1; ++j);
-         stbiw__zlib_huff(j+257);
-         if (lengtheb[j]) stbiw__zlib_add(best - lengthc[j], lengtheb[j]);
-         for (j=0; d > distc[j+1]-1; ++j);
-         stbiw__zlib_add(stbiw__zlib_bitrev(j,5),5);
-         if (disteb[j]) stbiw__zlib_add(d - distc[j], disteb[j]);
-         i += best;
+      for (i=0; i < m->num_tokens; ++i) {
+         stbiw_uint32 t = m->tokens[i];
+         int d = t & 0xffff, v = t >> 16;
+         if (d == 0) {
+            stbiw__zbuf_bits(z, litcodes[v], lengths[v]);
+         } else {
+            int j = stbiw__zlib_lencode(v);
+            stbiw__zbuf_bits(z, litcodes[257+j], lengths[257+j]);
+            if (stbiw__zlib_lengtheb[j]) stbiw__zbuf_bits(z, v - stbiw__zlib_lengthc[j], stbiw__zlib_lengtheb[j]);
+            j = stbiw__zlib_distcode(d);
+            stbiw__zbuf_bits(z, distcodes[j], lengths[286+j]);
+            if (stbiw__zlib_disteb[j]) stbiw__zbuf_bits(z, d - stbiw__zlib_distc[j], stbiw__zlib_disteb[j]);
+         }
+      }
+      stbiw__zbuf_bits(z, litcodes[256], lengths[256]); // end of block
+   }
+
+   m->num_tokens = 0;
+   m->block_start = block_end;
+   memset(m->litfreq, 0, sizeof(m->litfreq));
+   memset(m->distfreq, 0, sizeof(m->distfreq));
+   return 1;
+}
+
+static void stbiw__zlib_literal(stbiw__zmatcher *m, int c)
+{
+   m->tokens[m->num_tokens++] = (stbiw_uint32) c << 16;
+   ++m->litfreq[c];
+}
+
+static void stbiw__zlib_match(stbiw__zmatcher *m, int len, int distance)
+{
+   m->tokens[m->num_tokens++] = (stbiw_uint32) len << 16 | distance;
+   ++m->litfreq[257 + stbiw__zlib_lencode(len)];
+   ++m->distfreq[stbiw__zlib_distcode(distance)];
+}
+
+static int stbiw__zlib_deflate(stbiw__zbuf *z, unsigned char *data, int data_len, int level)
+{
+   stbiw__zmatcher m;
+   int i = 0, ok = 1;
+   int lazy = stbiw__zlib_config[level].lazy;
+   int prev_len = 0, prev_dist = 0, have_prev = 0;
+
+   memset(&m, 0, sizeof(m));
+   m.data = data;
+   m.data_len = data_len;
+   m.good = stbiw__zlib_config[level].good;
+   m.nice = stbiw__zlib_config[level].nice;
+   m.chain = stbiw__zlib_config[level].chain;
+   m.head = (int *) STBIW_MALLOC(sizeof(int) << stbiw__ZHASH_BITS);
+   m.prev = (int *) STBIW_MALLOC(sizeof(int) * stbiw__ZWINDOW);
+   m.tokens = (stbiw_uint32 *) STBIW_MALLOC(sizeof(stbiw_uint32) * stbiw__ZBLOCK);
+   if (!m.head || !m.prev || !m.tokens) {
+      ok = 0;
+      goto done;
+   }
+   memset(m.head, 0xff, sizeof(int) << stbiw__ZHASH_BITS);
+
+   while (i < data_len && ok) {
+      int candidate, len = 0, dist = 0;
+      if (i + 3 <= data_len) {
+         candidate = stbiw__zinsert(&m, i);
+         if (level > 3) {
+            if (prev_len < lazy)
+               len = stbiw__zlongest(&m, candidate, i, prev_len, &dist);
+         } else {
+            len = stbiw__zlongest(&m, candidate, i, 0, &dist);
+         }
+      }
+
+      if (level <= 3) {
+         // greedy: take the match now
+         if (len) {
+            int end = i + len;
+            stbiw__zlib_match(&m, len, dist);
+            if (len <= lazy)
+               for (++i; i < end && i + 3 <= data_len; ++i)
+                  stbiw__zinsert(&m, i);
+            i = end;
+         } else {
+            stbiw__zlib_literal(&m, data[i++]);
+         }
+      } else if (have_prev && prev_len && len <= prev_len) {
+         // the match at the previous byte is at least as good as the one here
+         int end = i - 1 + prev_len;
+         stbiw__zlib_match(&m, prev_len, prev_dist);
+         for (++i; i < end && i + 3 <= data_len; ++i)
+            stbiw__zinsert(&m, i);
+         i = end;
+         have_prev = 0;
+         prev_len = 0;
       } else {
-         stbiw__zlib_huffb(data[i]);
+         if (have_prev)
+            stbiw__zlib_literal(&m, data[i-1]);
+         have_prev = 1;
+         prev_len = len;
+         prev_dist = dist;
          ++i;
       }
+
+      // a step adds one token at most, and the end of the data one more
+      if (m.num_tokens >= stbiw__ZBLOCK - 2)
+         ok = stbiw__zlib_block(z, &m, have_prev ? i - 1 : i, 0);
    }
-   // write out final bytes
-   for (;i < data_len; ++i)
-      stbiw__zlib_huffb(data[i]);
-   stbiw__zlib_huff(256); // end of block
-   // pad with 0 bits to byte boundary
-   while (bitcount)
-      stbiw__zlib_add(0,1);
-
-   for (i=0; i < stbiw__ZHASH; ++i)
-      (void) stbiw__sbfree(hash_table[i]);
-   STBIW_FREE(hash_table);
+   if (have_prev)
+      stbiw__zlib_literal(&m, data[data_len-1]);
+   if (ok)
+      ok = stbiw__zlib_block(z, &m, data_len, 1);
+
+done:
+   STBIW_FREE(m.head);
+   STBIW_FREE(m.prev);
+   STBIW_FREE(m.tokens);
+   return ok;
+}
+#endif // STBIW_ZLIB_COMPRESS
+
+// quality is a zlib style level: 0 stores the data, 1-3 are fast, 4-9 compress more
+unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
+{
+#ifdef STBIW_ZLIB_COMPRESS
+   // user provided a zlib compress implementation, use that
+   return STBIW_ZLIB_COMPRESS(data, data_len, out_len, quality);
+#else // use builtin
+   stbiw__zbuf z;
+   int ok;
+   if (quality < 0) quality = 0;
+   if (quality > 9) quality = 9;
+
+   memset(&z, 0, sizeof(z));
+   // the whole output is usually smaller than a quarter of the input
+   if (!stbiw__zbuf_reserve(&z, data_len / 4 + 64)) return NULL;
+   z.data[z.len++] = 0x78;   // DEFLATE 32K window
+   z.data[z.len++] = 0x5e;   // FLEVEL = 1
+
+   if (quality == 0)
+      ok = stbiw__zlib_stored(&z, data, data_len, 1);
+   else
+      ok = stbiw__zlib_deflate(&z, data, data_len, quality);
+   if (!ok || !stbiw__zbuf_reserve(&z, 5)) {
+      STBIW_FREE(z.data);
+      return NULL;
+   }
+   stbiw__zbuf_align(&z); // pad with 0 bits to byte boundary
 
    {
       // compute adler32 on input
       unsigned int s1=1, s2=0;
-      int blocklen = (int) (data_len % 5552);
+      int i, j, blocklen = (int) (data_len % 5552);
       j=0;
       while (j < data_len) {
          for (i=0; i < blocklen; ++i) s1 += data[j+i], s2 += s1;
@@ -909,15 +1315,13 @@ unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_l
          j += blocklen;
          blocklen = 5552;
       }
-      stbiw__sbpush(out, STBIW_UCHAR(s2 >> 8));
-      stbiw__sbpush(out, STBIW_UCHAR(s2));
-      stbiw__sbpush(out, STBIW_UCHAR(s1 >> 8));
-      stbiw__sbpush(out, STBIW_UCHAR(s1));
+      z.data[z.len++] = STBIW_UCHAR(s2 >> 8);
+      z.data[z.len++] = STBIW_UCHAR(s2);
+      z.data[z.len++] = STBIW_UCHAR(s1 >> 8);
+      z.data[z.len++] = STBIW_UCHAR(s1);
    }
-   *out_len = stbiw__sbn(out);
-   // make returned pointer freeable
-   STBIW_MEMMOVE(stbiw__sbraw(out), out, *out_len);
-   return (unsigned char *) stbiw__sbraw(out);
+   *out_len = z.len;
+   return z.data;
 #endif // STBIW_ZLIB_COMPRESS
 }
 
@@ -984,8 +1388,7 @@ static unsigned char stbiw__paeth(int a, int b, int c)
    return STBIW_UCHAR(c);
 }
 
-// @OPTIMIZE: provide an option that always forces left-predict or paeth predict
-static void stbiw__encode_png_line(unsigned char *pixels, int stride_bytes, int width, int height, int y, int n, int filter_type, signed char *line_buffer)
+static void stbiw__encode_png_line(unsigned char *pixels, int stride_bytes, int width, int height, int y, int n, int filter_type, unsigned char *line_buffer)
 {
    static int mapping[] = { 0,1,2,3,4 };
    static int firstmap[] = { 0,1,0,5,6 };
@@ -993,80 +1396,130 @@ static void stbiw__encode_png_line(unsigned char *pixels, int stride_bytes, int
    int i;
    int type = mymap[filter_type];
    unsigned char *z = pixels + stride_bytes * (stbi__flip_vertically_on_write ? height-1-y : y);
-   int signed_stride = stbi__flip_vertically_on_write ? -stride_bytes : stride_bytes;
-   for (i = 0; i < n; ++i) {
-      switch (type) {
-         case 0: line_buffer[i] = z[i]; break;
-         case 1: line_buffer[i] = z[i]; break;
-         case 2: line_buffer[i] = z[i] - z[i-signed_stride]; break;
-         case 3: line_buffer[i] = z[i] - (z[i-signed_stride]>>1); break;
-         case 4: line_buffer[i] = (signed char) (z[i] - stbiw__paeth(0,z[i-signed_stride],0)); break;
-         case 5: line_buffer[i] = z[i]; break;
-         case 6: line_buffer[i] = z[i]; break;
-      }
-   }
-   for (i=n; i < width*n; ++i) {
-      switch (type) {
-         case 0: line_buffer[i] = z[i]; break;
-         case 1: line_buffer[i] = z[i] - z[i-n]; break;
-         case 2: line_buffer[i] = z[i] - z[i-signed_stride]; break;
-         case 3: line_buffer[i] = z[i] - ((z[i-n] + z[i-signed_stride])>>1); break;
-         case 4: line_buffer[i] = z[i] - stbiw__paeth(z[i-n], z[i-signed_stride], z[i-signed_stride-n]); break;
-         case 5: line_buffer[i] = z[i] - (z[i-n]>>1); break;
-         case 6: line_buffer[i] = z[i] - stbiw__paeth(z[i-n], 0,0); break;
-      }
+   unsigned char *up = z - (stbi__flip_vertically_on_write ? -stride_bytes : stride_bytes);
+   // the first pixel has no left neighbour, so the filters fall back to their simpler forms there
+   switch (type) {
+      case 0:
+         memcpy(line_buffer, z, width*n);
+         break;
+      case 1: case 5: case 6:
+         memcpy(line_buffer, z, n);
+         if (type == 1) for (i=n; i < width*n; ++i) line_buffer[i] = STBIW_UCHAR(z[i] - z[i-n]);
+         if (type == 5) for (i=n; i < width*n; ++i) line_buffer[i] = STBIW_UCHAR(z[i] - (z[i-n]>>1));
+         if (type == 6) for (i=n; i < width*n; ++i) line_buffer[i] = STBIW_UCHAR(z[i] - z[i-n]);
+         break;
+      case 2:
+         for (i=0; i < width*n; ++i) line_buffer[i] = STBIW_UCHAR(z[i] - up[i]);
+         break;
+      case 3:
+         for (i=0; i < n; ++i) line_buffer[i] = STBIW_UCHAR(z[i] - (up[i]>>1));
+         for (i=n; i < width*n; ++i) line_buffer[i] = STBIW_UCHAR(z[i] - ((z[i-n] + up[i])>>1));
+         break;
+      case 4:
+         for (i=0; i < n; ++i) line_buffer[i] = STBIW_UCHAR(z[i] - up[i]);
+         for (i=n; i < width*n; ++i) line_buffer[i] = STBIW_UCHAR(z[i] - stbiw__paeth(z[i-n], up[i], up[i-n]));
+         break;
    }
 }
 
-unsigned char *stbi_write_png_to_mem(unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
+typedef struct
 {
-   int force_filter = stbi_write_force_png_filter;
-   int ctype[5] = { -1, 0, 4, 2, 6 };
-   unsigned char sig[8] = { 137,80,78,71,13,10,26,10 };
-   unsigned char *out,*o, *filt, *zlib;
-   signed char *line_buffer;
-   int j,zlen;
+   unsigned char *pixels, *filt, *scratch;
+   int stride_bytes, x, y, n, force_filter;
+   int rows_per_task;
+} stbiw__png_filter_job;
 
-   if (stride_bytes == 0)
-      stride_bytes = x * n;
+#define stbiw__PNG_FILTER_TASKS  64
 
-   if (force_filter >= 5) {
-      force_filter = -1;
-   }
-
-   filt = (unsigned char *) STBIW_MALLOC((x*n+1) * y); if (!filt) return 0;
-   line_buffer = (signed char *) STBIW_MALLOC(x * n); if (!line_buffer) { STBIW_FREE(filt); return 0; }
-   for (j=0; j < y; ++j) {
+// filters one band of rows; the bands only read the source pixels, so they can run in any order
+static void stbiw__png_filter_rows(void *data, int index)
+{
+   stbiw__png_filter_job *job = (stbiw__png_filter_job *) data;
+   int x = job->x, n = job->n, j;
+   int begin = index * job->rows_per_task;
+   int end = begin + job->rows_per_task > job->y ? job->y : begin + job->rows_per_task;
+   unsigned char *scratch = job->scratch + (size_t) index * x * n;
+
+   for (j=begin; j < end; ++j) {
+      unsigned char *row = job->filt + (size_t) j * (x*n+1);
       int filter_type;
-      if (force_filter > -1) {
-         filter_type = force_filter;
-         stbiw__encode_png_line(pixels, stride_bytes, x, y, j, n, force_filter, line_buffer);
+      if (job->force_filter > -1) {
+         filter_type = job->force_filter;
+         stbiw__encode_png_line(job->pixels, job->stride_bytes, x, job->y, j, n, filter_type, row+1);
       } else { // Estimate the best filter by running through all of them:
-         int best_filter = 0, best_filter_val = 0x7fffffff, est, i;
+         // the best line so far stays in one buffer while the next candidate goes to the other
+         unsigned char *buffer[2];
+         int best_filter = 0, best_buffer = 0, next = 0, best_filter_val = 0x7fffffff, est, i;
+         buffer[0] = row+1;
+         buffer[1] = scratch;
          for (filter_type = 0; filter_type < 5; filter_type++) {
-            stbiw__encode_png_line(pixels, stride_bytes, x, y, j, n, filter_type, line_buffer);
+            unsigned char *line = buffer[next];
+            stbiw__encode_png_line(job->pixels, job->stride_bytes, x, job->y, j, n, filter_type, line);
 
             // Estimate the entropy of the line using this filter; the less, the better.
             est = 0;
             for (i = 0; i < x*n; ++i) {
-               est += abs((signed char) line_buffer[i]);
+               est += abs((signed char) line[i]);
             }
             if (est < best_filter_val) {
                best_filter_val = est;
                best_filter = filter_type;
+               best_buffer = next;
+               next ^= 1;
+               if (est == 0) break;
             }
          }
-         if (filter_type != best_filter) {  // If the last iteration already got us the best filter, don't redo it
-            stbiw__encode_png_line(pixels, stride_bytes, x, y, j, n, best_filter, line_buffer);
-            filter_type = best_filter;
-         }
+         if (best_buffer)
+            memcpy(row+1, scratch, x*n);
+         filter_type = best_filter;
       }
-      // when we get here, filter_type contains the filter type, and line_buffer contains the data
-      filt[j*(x*n+1)] = (unsigned char) filter_type;
-      STBIW_MEMMOVE(filt+j*(x*n+1)+1, line_buffer, x*n);
+      // when we get here, filter_type contains the filter type, and the row contains the data
+      row[0] = (unsigned char) filter_type;
    }
-   STBIW_FREE(line_buffer);
-   zlib = stbi_zlib_compress(filt, y*( x*n+1), &zlen, stbi_write_png_compression_level);
+}
+
+unsigned char *stbi_write_png_to_mem(unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
+{
+   int force_filter = stbi_write_force_png_filter;
+   int ctype[5] = { -1, 0, 4, 2, 6 };
+   unsigned char sig[8] = { 137,80,78,71,13,10,26,10 };
+   unsigned char *out,*o, *filt, *zlib;
+   stbiw__png_filter_job job;
+   int j,zlen,tasks;
+
+   if (stride_bytes == 0)
+      stride_bytes = x * n;
+
+   if (force_filter >= 5) {
+      force_filter = -1;
+   }
+
+   // one band of rows per task, a serial encode is a single band
+   tasks = stbi_write_png_parallel ? stbiw__PNG_FILTER_TASKS : 1;
+   if (tasks > y) tasks = y > 0 ? y : 1;
+   job.pixels = pixels;
+   job.stride_bytes = stride_bytes;
+   job.x = x;
+   job.y = y;
+   job.n = n;
+   job.force_filter = force_filter;
+   job.rows_per_task = (y + tasks - 1) / tasks;
+   tasks = job.rows_per_task ? (y + job.rows_per_task - 1) / job.rows_per_task : 1;
+
+   filt = (unsigned char *) STBIW_MALLOC((x*n+1) * y); if (!filt) return 0;
+   job.filt = filt;
+   job.scratch = (unsigned char *) STBIW_MALLOC((size_t) x * n * tasks); if (!job.scratch) { STBIW_FREE(filt); return 0; }
+   if (tasks > 1) {
+      stbi_write_png_parallel(stbiw__png_filter_rows, &job, tasks);
+   } else {
+      for (j=0; j < tasks; ++j)
+         stbiw__png_filter_rows(&job, j);
+   }
+   STBIW_FREE(job.scratch);
+   if (stbi_write_png_zlib_compress)
+      zlib = stbi_write_png_zlib_compress(filt, y*( x*n+1), &zlen, stbi_write_png_compression_level);
+   else
+      zlib = stbi_zlib_compress(filt, y*( x*n+1), &zlen, stbi_write_png_compression_level);
    STBIW_FREE(filt);
    if (!zlib) return 0;
 
@@ -1164,6 +1617,7 @@ static void stbiw__jpg_writeBits(stbi__write_context *s, int *bitBufP, int *bitC
    *bitCntP = bitCnt;
 }
 
+#ifndef STBIW_SSE2
 static void stbiw__jpg_DCT(float *d0p, float *d1p, float *d2p, float *d3p, float *d4p, float *d5p, float *d6p, float *d7p) {
    float d0 = *d0p, d1 = *d1p, d2 = *d2p, d3 = *d3p, d4 = *d4p, d5 = *d5p, d6 = *d6p, d7 = *d7p;
    float z1, z2, z3, z4, z5, z11, z13;
@@ -1211,6 +1665,122 @@ static void stbiw__jpg_DCT(float *d0p, float *d1p, float *d2p, float *d3p, float
 
    *d0p = d0;  *d2p = d2;  *d4p = d4;  *d6p = d6;
 }
+#endif
+
+#ifdef STBIW_SSE2
+// the DCT of jo_jpeg on four rows (or columns) at once, with the same operations
+// in the same order, so the results are bit-identical.
+static void stbiw__jpg_DCT_sse2(__m128 *d) {
+   __m128 z1, z2, z3, z4, z5, z11, z13;
+
+   __m128 tmp0 = _mm_add_ps(d[0], d[7]);
+   __m128 tmp7 = _mm_sub_ps(d[0], d[7]);
+   __m128 tmp1 = _mm_add_ps(d[1], d[6]);
+   __m128 tmp6 = _mm_sub_ps(d[1], d[6]);
+   __m128 tmp2 = _mm_add_ps(d[2], d[5]);
+   __m128 tmp5 = _mm_sub_ps(d[2], d[5]);
+   __m128 tmp3 = _mm_add_ps(d[3], d[4]);
+   __m128 tmp4 = _mm_sub_ps(d[3], d[4]);
+
+   // Even part
+   __m128 tmp10 = _mm_add_ps(tmp0, tmp3);   // phase 2
+   __m128 tmp13 = _mm_sub_ps(tmp0, tmp3);
+   __m128 tmp11 = _mm_add_ps(tmp1, tmp2);
+   __m128 tmp12 = _mm_sub_ps(tmp1, tmp2);
+
+   d[0] = _mm_add_ps(tmp10, tmp11);       // phase 3
+   d[4] = _mm_sub_ps(tmp10, tmp11);
+
+   z1 = _mm_mul_ps(_mm_add_ps(tmp12, tmp13), _mm_set1_ps(0.707106781f)); // c4
+   d[2] = _mm_add_ps(tmp13, z1);       // phase 5
+   d[6] = _mm_sub_ps(tmp13, z1);
+
+   // Odd part
+   tmp10 = _mm_add_ps(tmp4, tmp5);       // phase 2
+   tmp11 = _mm_add_ps(tmp5, tmp6);
+   tmp12 = _mm_add_ps(tmp6, tmp7);
+
+   // The rotator is modified from fig 4-8 to avoid extra negations.
+   z5 = _mm_mul_ps(_mm_sub_ps(tmp10, tmp12), _mm_set1_ps(0.382683433f)); // c6
+   z2 = _mm_add_ps(_mm_mul_ps(tmp10, _mm_set1_ps(0.541196100f)), z5); // c2-c6
+   z4 = _mm_add_ps(_mm_mul_ps(tmp12, _mm_set1_ps(1.306562965f)), z5); // c2+c6
+   z3 = _mm_mul_ps(tmp11, _mm_set1_ps(0.707106781f)); // c4
+
+   z11 = _mm_add_ps(tmp7, z3);      // phase 5
+   z13 = _mm_sub_ps(tmp7, z3);
+
+   d[5] = _mm_add_ps(z13, z2);         // phase 6
+   d[3] = _mm_sub_ps(z13, z2);
+   d[1] = _mm_add_ps(z11, z4);
+   d[7] = _mm_sub_ps(z11, z4);
+}
+
+// transposes the 4x4 blocks of an 8x8 block held as two columns of 8 rows:
+// a[i] is row i, columns 0-3, b[i] is row i, columns 4-7
+static void stbiw__jpg_transpose_sse2(__m128 *a, __m128 *b) {
+   __m128 t;
+   _MM_TRANSPOSE4_PS(a[0], a[1], a[2], a[3]);
+   _MM_TRANSPOSE4_PS(b[4], b[5], b[6], b[7]);
+   _MM_TRANSPOSE4_PS(b[0], b[1], b[2], b[3]);
+   _MM_TRANSPOSE4_PS(a[4], a[5], a[6], a[7]);
+   t = b[0]; b[0] = a[4]; a[4] = t;
+   t = b[1]; b[1] = a[5]; a[5] = t;
+   t = b[2]; b[2] = a[6]; a[6] = t;
+   t = b[3]; b[3] = a[7]; a[7] = t;
+}
+
+// rows then columns like the scalar version, then quantize and round half
+// away from zero: (int) truncates, so add 0.5 with the sign of v.
+static void stbiw__jpg_DCT_quantize_sse2(int *DU, const float *CDU, const float *fdtbl) {
+   __m128 a[8], b[8];
+   __m128 sign = _mm_set1_ps(-0.0f), half = _mm_set1_ps(0.5f);
+   int i;
+
+   for(i=0; i<8; ++i) {
+      a[i] = _mm_loadu_ps(CDU + i*8);
+      b[i] = _mm_loadu_ps(CDU + i*8 + 4);
+   }
+   // DCT rows: a[j], b[j] now hold column j of rows 0-3 and 4-7
+   stbiw__jpg_transpose_sse2(a, b);
+   stbiw__jpg_DCT_sse2(a);
+   stbiw__jpg_DCT_sse2(b);
+   // DCT columns
+   stbiw__jpg_transpose_sse2(a, b);
+   stbiw__jpg_DCT_sse2(a);
+   stbiw__jpg_DCT_sse2(b);
+
+   for(i=0; i<8; ++i) {
+      __m128 va = _mm_mul_ps(a[i], _mm_loadu_ps(fdtbl + i*8));
+      __m128 vb = _mm_mul_ps(b[i], _mm_loadu_ps(fdtbl + i*8 + 4));
+      va = _mm_add_ps(va, _mm_or_ps(_mm_and_ps(va, sign), half));
+      vb = _mm_add_ps(vb, _mm_or_ps(_mm_and_ps(vb, sign), half));
+      _mm_storeu_si128((__m128i *) (DU + i*8), _mm_cvttps_epi32(va));
+      _mm_storeu_si128((__m128i *) (DU + i*8 + 4), _mm_cvttps_epi32(vb));
+   }
+}
+
+// color conversion of 8 pixels of RGB or RGBA data
+static void stbiw__jpg_RGB_to_YCbCr_sse2(float *Y, float *U, float *V, const unsigned char *d, int comp) {
+   __m128i mask = _mm_set1_epi32(255);
+   int i;
+   for(i=0; i<8; i+=4, d+=4*comp) {
+      __m128i px;
+      __m128 r, g, b;
+      if (comp == 4) {
+         px = _mm_loadu_si128((const __m128i *) d);
+      } else {
+         px = _mm_setr_epi32(d[0] | d[1] << 8 | d[2] << 16, d[3] | d[4] << 8 | d[5] << 16,
+                             d[6] | d[7] << 8 | d[8] << 16, d[9] | d[10] << 8 | d[11] << 16);
+      }
+      r = _mm_cvtepi32_ps(_mm_and_si128(px, mask));
+      g = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(px, 8), mask));
+      b = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(px, 16), mask));
+      _mm_storeu_ps(Y+i, _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(+0.29900f), r), _mm_mul_ps(_mm_set1_ps(0.58700f), g)), _mm_mul_ps(_mm_set1_ps(0.11400f), b)), _mm_set1_ps(128)));
+      _mm_storeu_ps(U+i, _mm_add_ps(_mm_sub_ps(_mm_mul_ps(_mm_set1_ps(-0.16874f), r), _mm_mul_ps(_mm_set1_ps(0.33126f), g)), _mm_mul_ps(_mm_set1_ps(0.50000f), b)));
+      _mm_storeu_ps(V+i, _mm_sub_ps(_mm_sub_ps(_mm_mul_ps(_mm_set1_ps(+0.50000f), r), _mm_mul_ps(_mm_set1_ps(0.41869f), g)), _mm_mul_ps(_mm_set1_ps(0.08131f), b)));
+   }
+}
+#endif
 
 static void stbiw__jpg_calcBits(int val, unsigned short bits[2]) {
    int tmp1 = val < 0 ? -val : val;
@@ -1225,9 +1795,19 @@ static void stbiw__jpg_calcBits(int val, unsigned short bits[2]) {
 static int stbiw__jpg_processDU(stbi__write_context *s, int *bitBuf, int *bitCnt, float *CDU, float *fdtbl, int DC, const unsigned short HTDC[256][2], const unsigned short HTAC[256][2]) {
    const unsigned short EOB[2] = { HTAC[0x00][0], HTAC[0x00][1] };
    const unsigned short M16zeroes[2] = { HTAC[0xF0][0], HTAC[0xF0][1] };
-   int dataOff, i, diff, end0pos;
+   int i, diff, end0pos;
    int DU[64];
 
+#ifdef STBIW_SSE2
+   int QU[64];
+   stbiw__jpg_DCT_quantize_sse2(QU, CDU, fdtbl);
+   // zigzag the coefficients
+   for(i=0; i<64; ++i) {
+      DU[stbiw__jpg_ZigZag[i]] = QU[i];
+   }
+#else
+   int dataOff;
+
    // DCT rows
    for(dataOff=0; dataOff<64; dataOff+=8) {
       stbiw__jpg_DCT(&CDU[dataOff], &CDU[dataOff+1], &CDU[dataOff+2], &CDU[dataOff+3], &CDU[dataOff+4], &CDU[dataOff+5], &CDU[dataOff+6], &CDU[dataOff+7]);
@@ -1243,6 +1823,7 @@ static int stbiw__jpg_processDU(stbi__write_context *s, int *bitBuf, int *bitCnt
       // ceilf() and floorf() are C99, not C89, but I /think/ they're not needed here anyway?
       DU[stbiw__jpg_ZigZag[i]] = (int)(v < 0 ? v - 0.5f : v + 0.5f);
    }
+#endif
 
    // Encode DC
    diff = DU[0] - DC;
@@ -1287,7 +1868,7 @@ static int stbiw__jpg_processDU(stbi__write_context *s, int *bitBuf, int *bitCnt
    return DU[0];
 }
 
-static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, int comp, const void* data, int quality) {
+static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, int comp, const void* data, int stride, int quality) {
    // Constants that don't pollute global namespace
    static const unsigned char std_dc_luminance_nrcodes[] = {0,0,1,5,1,1,1,1,1,1,0,0,0,0,0,0,0};
    static const unsigned char std_dc_luminance_values[] = {0,1,2,3,4,5,6,7,8,9,10,11};
@@ -1367,6 +1948,9 @@ static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, in
       return 0;
    }
 
+   if (stride == 0)
+      stride = width * comp;
+
    quality = quality ? quality : 90;
    quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
    quality = quality < 50 ? 5000 / quality : 200 - quality * 2;
@@ -1391,23 +1975,23 @@ static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, in
       static const unsigned char head2[] = { 0xFF,0xDA,0,0xC,3,1,0,2,0x11,3,0x11,0,0x3F,0 };
       const unsigned char head1[] = { 0xFF,0xC0,0,0x11,8,(unsigned char)(height>>8),STBIW_UCHAR(height),(unsigned char)(width>>8),STBIW_UCHAR(width),
                                       3,1,0x11,0,2,0x11,1,3,0x11,1,0xFF,0xC4,0x01,0xA2,0 };
-      s->func(s->context, (void*)head0, sizeof(head0));
-      s->func(s->context, (void*)YTable, sizeof(YTable));
+      stbiw__write_buffered(s, (void*)head0, sizeof(head0));
+      stbiw__write_buffered(s, (void*)YTable, sizeof(YTable));
       stbiw__putc(s, 1);
-      s->func(s->context, UVTable, sizeof(UVTable));
-      s->func(s->context, (void*)head1, sizeof(head1));
-      s->func(s->context, (void*)(std_dc_luminance_nrcodes+1), sizeof(std_dc_luminance_nrcodes)-1);
-      s->func(s->context, (void*)std_dc_luminance_values, sizeof(std_dc_luminance_values));
+      stbiw__write_buffered(s, UVTable, sizeof(UVTable));
+      stbiw__write_buffered(s, (void*)head1, sizeof(head1));
+      stbiw__write_buffered(s, (void*)(std_dc_luminance_nrcodes+1), sizeof(std_dc_luminance_nrcodes)-1);
+      stbiw__write_buffered(s, (void*)std_dc_luminance_values, sizeof(std_dc_luminance_values));
       stbiw__putc(s, 0x10); // HTYACinfo
-      s->func(s->context, (void*)(std_ac_luminance_nrcodes+1), sizeof(std_ac_luminance_nrcodes)-1);
-      s->func(s->context, (void*)std_ac_luminance_values, sizeof(std_ac_luminance_values));
+      stbiw__write_buffered(s, (void*)(std_ac_luminance_nrcodes+1), sizeof(std_ac_luminance_nrcodes)-1);
+      stbiw__write_buffered(s, (void*)std_ac_luminance_values, sizeof(std_ac_luminance_values));
       stbiw__putc(s, 1); // HTUDCinfo
-      s->func(s->context, (void*)(std_dc_chrominance_nrcodes+1), sizeof(std_dc_chrominance_nrcodes)-1);
-      s->func(s->context, (void*)std_dc_chrominance_values, sizeof(std_dc_chrominance_values));
+      stbiw__write_buffered(s, (void*)(std_dc_chrominance_nrcodes+1), sizeof(std_dc_chrominance_nrcodes)-1);
+      stbiw__write_buffered(s, (void*)std_dc_chrominance_values, sizeof(std_dc_chrominance_values));
       stbiw__putc(s, 0x11); // HTUACinfo
-      s->func(s->context, (void*)(std_ac_chrominance_nrcodes+1), sizeof(std_ac_chrominance_nrcodes)-1);
-      s->func(s->context, (void*)std_ac_chrominance_values, sizeof(std_ac_chrominance_values));
-      s->func(s->context, (void*)head2, sizeof(head2));
+      stbiw__write_buffered(s, (void*)(std_ac_chrominance_nrcodes+1), sizeof(std_ac_chrominance_nrcodes)-1);
+      stbiw__write_buffered(s, (void*)std_ac_chrominance_values, sizeof(std_ac_chrominance_values));
+      stbiw__write_buffered(s, (void*)head2, sizeof(head2));
    }
 
    // Encode 8x8 macroblocks
@@ -1423,19 +2007,23 @@ static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, in
          for(x = 0; x < width; x += 8) {
             float YDU[64], UDU[64], VDU[64];
             for(row = y, pos = 0; row < y+8; ++row) {
+               // blocks past the edge repeat the last row and column
+               int clampedRow = row < height ? row : height-1;
+               const unsigned char *line = imageData + (stbi__flip_vertically_on_write ? height-1-clampedRow : clampedRow)*stride;
+#ifdef STBIW_SSE2
+               if(comp >= 3 && x+8 <= width) {
+                  stbiw__jpg_RGB_to_YCbCr_sse2(&YDU[pos], &UDU[pos], &VDU[pos], line + x*comp, comp);
+                  pos += 8;
+                  continue;
+               }
+#endif
                for(col = x; col < x+8; ++col, ++pos) {
-                  int p = (stbi__flip_vertically_on_write ? height-1-row : row)*width*comp + col*comp;
+                  const unsigned char *p = line + (col < width ? col : width-1)*comp;
                   float r, g, b;
-                  if(row >= height) {
-                     p -= width*comp*(row+1 - height);
-                  }
-                  if(col >= width) {
-                     p -= comp*(col+1 - width);
-                  }
 
-                  r = imageData[p+0];
-                  g = imageData[p+ofsG];
-                  b = imageData[p+ofsB];
+                  r = p[0];
+                  g = p[ofsG];
+                  b = p[ofsB];
                   YDU[pos]=+0.29900f*r+0.58700f*g+0.11400f*b-128;
                   UDU[pos]=-0.16874f*r-0.33126f*g+0.50000f*b;
                   VDU[pos]=+0.50000f*r-0.41869f*g-0.08131f*b;
@@ -1455,24 +2043,35 @@ static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, in
    // EOI
    stbiw__putc(s, 0xFF);
    stbiw__putc(s, 0xD9);
+   stbiw__write_flush(s);
 
    return 1;
 }
 
 STBIWDEF int stbi_write_jpg_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void *data, int quality)
+{
+   return stbi_write_jpg_to_func_with_stride(func, context, x, y, comp, data, 0, quality);
+}
+
+STBIWDEF int stbi_write_jpg_to_func_with_stride(stbi_write_func *func, void *context, int x, int y, int comp, const void *data, int stride_in_bytes, int quality)
 {
    stbi__write_context s;
    stbi__start_write_callbacks(&s, func, context);
-   return stbi_write_jpg_core(&s, x, y, comp, (void *) data, quality);
+   return stbi_write_jpg_core(&s, x, y, comp, (void *) data, stride_in_bytes, quality);
 }
 
 
 #ifndef STBI_WRITE_NO_STDIO
 STBIWDEF int stbi_write_jpg(char const *filename, int x, int y, int comp, const void *data, int quality)
+{
+   return stbi_write_jpg_with_stride(filename, x, y, comp, data, 0, quality);
+}
+
+STBIWDEF int stbi_write_jpg_with_stride(char const *filename, int x, int y, int comp, const void *data, int stride_in_bytes, int quality)
 {
    stbi__write_context s;
    if (stbi__start_write_file(&s,filename)) {
-      int r = stbi_write_jpg_core(&s, x, y, comp, data, quality);
+      int r = stbi_write_jpg_core(&s, x, y, comp, data, stride_in_bytes, quality);
       stbi__end_write_file(&s);
       return r;
    } else
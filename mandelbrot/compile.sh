@@ -1,2 +1,2 @@
-c++ mandelbrot.cpp -o mandelbrot -std=c++14 -O3 -lmango -lmango-framebuffer
+c++ mandelbrot.cpp -o mandelbrot -std=c++14 -O3 -lmango -lmango-framebuffer -lpthread
 
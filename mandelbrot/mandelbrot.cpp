@@ -4,9 +4,11 @@
 */
 #include <mango/mango.hpp>
 #include <mango/framebuffer/framebuffer.hpp>
+#include "../common/stealing_queue.hpp"
 
 using namespace mango;
 using namespace mango::framebuffer;
+using stealing::StealingQueue;
 
 class DemoWindow : public Framebuffer
 {
@@ -101,11 +103,13 @@ public:
         double dydu = bx / height;
         double dydv = by / height;
 
-        ConcurrentQueue q;
+        // the rows are one task which is split only when there are idle threads to steal
+        // the halves, so the rows near the set, which take longer, are shared out as needed
+        StealingQueue q;
 
-        for (int y = 0; y < height; ++y)
+        q.parallel_for(0, height, 1, [this,&s,width,u0,v0,dxdu,dxdv,dydu,dydv] (u64 begin, u64 end)
         {
-            q.enqueue([this,&s,width,y,u0,v0,dxdu,dxdv,dydu,dydv]
+            for (int y = int(begin); y < int(end); ++y)
             {
                 u32* scan = s.address<u32>(0, y);
 
@@ -117,8 +121,8 @@ public:
                     n = 255 -n;
                     scan[x] = makeBGRA(n, n & 0xf0, n & 0x0f, 0xff);
                 }
-            });
-        }
+            }
+        });
 
         q.wait();
     }
@@ -4,274 +4,2833 @@
 */
 #include <mango/mango.hpp>
 #include <algorithm>
-#include <random>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <thread>
+#include "../common/statistics.hpp"
+
+#if defined(__SSE__)
+#include <immintrin.h>
+#endif
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 using namespace mango;
 
-template <typename T>
-using AlignedVector = std::vector<T, AlignedAllocator<T, 16>>;
+// the arrays start at a cache line so that the chunks of the parallel transform don't share lines
+constexpr size_t CACHE_LINE = 64;
+
+template <typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T, CACHE_LINE>>;
+
+// ----------------------------------------------------------------------
+// helpers
+// ----------------------------------------------------------------------
+
+namespace
+{
+
+    // A counter based generator: the number for a counter is a hash of the counter and
+    // the seed, like in SplitMix, so that every thread and SIMD lane can make the numbers
+    // it needs without a shared state. The arithmetic is 32 bit so that the loops that
+    // use it vectorize with SSE4.1.
+    struct Random
+    {
+        u32 key;
+
+        explicit Random(u64 seed)
+            : key(hash(hash(u32(seed >> 32) + 0x9e3779b9) ^ u32(seed)))
+        {
+        }
+
+        static u32 hash(u32 x)
+        {
+            x ^= x >> 16;
+            x *= 0x7feb352d;
+            x ^= x >> 15;
+            x *= 0x846ca68b;
+            x ^= x >> 16;
+            return x;
+        }
+
+        u32 bits(u32 counter) const
+        {
+            return hash(counter * 0x9e3779b9 + key);
+        }
+
+        // in [-1, 1)
+        float uniform(u32 counter) const
+        {
+            return float(bits(counter) >> 8) * (2.0f / 16777216.0f) - 1.0f;
+        }
+    };
+
+    // hint the cache lines of the range to be loaded
+    inline void prefetch(const void* address, size_t bytes)
+    {
+#if defined(__GNUC__)
+        const char* p = reinterpret_cast<const char*>(address);
+        for (size_t offset = 0; offset < bytes; offset += CACHE_LINE)
+        {
+            __builtin_prefetch(p + offset);
+        }
+#else
+        (void) address;
+        (void) bytes;
+#endif
+    }
+
+} // namespace
+
+// ----------------------------------------------------------------------
+// parallel for
+// ----------------------------------------------------------------------
+
+/*
+    The scene is split into chunks of elements which the threads take in order from
+    a shared counter. A chunk ends on a cache line in every array, so two threads
+    never write to the same line, and is small enough that every thread gets several
+    of them even with the smaller scenes.
+*/
+
+constexpr size_t CHUNK_BYTES = 32 * 1024; // per array
+
+// the smallest number of elements that is a whole number of cache lines
+size_t get_line_step(size_t element_size)
+{
+    size_t a = element_size;
+    size_t b = CACHE_LINE;
+    while (b)
+    {
+        size_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return CACHE_LINE / a;
+}
+
+// the number of elements closest to bytes that is a whole number of cache lines, at least one step
+size_t get_step_multiple(size_t element_size, size_t bytes)
+{
+    size_t step = get_line_step(element_size);
+    return std::max(bytes / element_size / step, size_t(1)) * step;
+}
+
+size_t get_chunk_size(size_t element_size)
+{
+    return get_step_multiple(element_size, CHUNK_BYTES);
+}
+
+// function(begin, end) for the chunks of [0, count)
+template <typename Function>
+void parallel_for(size_t count, size_t chunk, int threads, Function function)
+{
+    if (threads <= 1 || count <= chunk)
+    {
+        function(size_t(0), count);
+        return;
+    }
+
+    std::atomic<size_t> next { 0 };
+    ConcurrentQueue q("particles");
+
+    for (int i = 0; i < threads; ++i)
+    {
+        q.enqueue([&]
+        {
+            for (size_t begin = next.fetch_add(chunk); begin < count; begin = next.fetch_add(chunk))
+            {
+                function(begin, std::min(begin + chunk, count));
+            }
+        });
+    }
+
+    q.wait();
+}
+
+// ----------------------------------------------------------------------
+// physics
+// ----------------------------------------------------------------------
+
+/*
+    The step() of every scene integrates gravity and drag, keeps the particles inside
+    a sphere, removes the particles whose lifetime has run out and emits new ones at
+    the end of the arrays. Only the first count particles of a scene are alive.
+*/
+
+namespace
+{
+
+    // in units and seconds
+    struct Physics
+    {
+        float dt = 1.0f / 60.0f;
+        float gravity = -2.0f; // along y
+        float drag = 0.2f; // fraction of the velocity lost in a second
+        float bounds = 1.0f; // radius of the sphere at the origin that the particles stay in
+        float restitution = 0.5f; // of the speed towards the bounds in a collision
+        float lifetime = 2.0f; // of a new particle, at most
+        size_t emit = 0; // new particles per step, at most
+    };
+
+    /*
+        A particle has an index, and its random numbers are from the counters after
+        index * RANDOM_VALUES. The scenes are made of the particles [0, count) and the
+        particles that they emit continue from there, so the same seed gives the same
+        particles in every layout, made in any order by any number of threads.
+    */
+
+    enum RandomValue
+    {
+        RANDOM_POSITION = 0, // x, y, z
+        RANDOM_VELOCITY = 3,
+        RANDOM_COLOR = 6,
+        RANDOM_RADIUS,
+        RANDOM_ROTATION,
+        RANDOM_LIFETIME,
+        RANDOM_VALUES
+    };
+
+    // the initial particles are in a cube and the emitted ones in the middle of the bounds
+    constexpr float INITIAL_SPREAD = 1.0f;
+    constexpr float EMIT_SPREAD = 0.5f;
+
+    // particles per chunk when the scenes are made in parallel; a multiple of every
+    // packet and block width, and of a cache line in every array
+    constexpr size_t INIT_CHUNK = 16 * 1024;
+
+    inline float random_value(const Random& random, u32 index, int value)
+    {
+        return random.uniform(index * RANDOM_VALUES + value);
+    }
+
+    inline u32 random_color(const Random& random, u32 index)
+    {
+        return random.bits(index * RANDOM_VALUES + RANDOM_COLOR);
+    }
+
+    inline float random_radius(const Random& random, u32 index)
+    {
+        return 0.01f + random_value(random, index, RANDOM_RADIUS) * 0.005f;
+    }
+
+    inline float random_rotation(const Random& random, u32 index)
+    {
+        return random_value(random, index, RANDOM_ROTATION) * 3.14159265f;
+    }
+
+    inline float random_lifetime(const Random& random, u32 index, const Physics& physics)
+    {
+        return (random_value(random, index, RANDOM_LIFETIME) * 0.5f + 0.5f) * physics.lifetime;
+    }
+
+    // the attributes of count particles from first into arrays; the loop vectorizes
+    inline void random_attributes(const Random& random, const Physics& physics, u32 first, size_t count,
+                                  u32* colors, float* radiuses, float* rotations, float* lifetimes)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            const u32 index = first + u32(i);
+            colors[i] = random_color(random, index);
+            radiuses[i] = random_radius(random, index);
+            rotations[i] = random_rotation(random, index);
+            lifetimes[i] = random_lifetime(random, index, physics);
+        }
+    }
+
+    // the positions or velocities of count particles from first into arrays
+    inline void random_vectors(const Random& random, int value, float spread, u32 first, size_t count,
+                               float* x, float* y, float* z)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            const u32 index = first + u32(i);
+            x[i] = random_value(random, index, value + 0) * spread;
+            y[i] = random_value(random, index, value + 1) * spread;
+            z[i] = random_value(random, index, value + 2) * spread;
+        }
+    }
+
+    struct NewParticle
+    {
+        float position[3];
+        float velocity[3];
+        u32 color;
+        float radius;
+        float rotation;
+        float lifetime;
+    };
+
+    inline NewParticle new_particle(const Random& random, u32 index, float spread, const Physics& physics)
+    {
+        NewParticle p;
+        for (int i = 0; i < 3; ++i)
+        {
+            p.position[i] = random_value(random, index, RANDOM_POSITION + i) * spread;
+            p.velocity[i] = random_value(random, index, RANDOM_VELOCITY + i);
+        }
+        p.color = random_color(random, index);
+        p.radius = random_radius(random, index);
+        p.rotation = random_rotation(random, index);
+        p.lifetime = random_lifetime(random, index, physics);
+        return p;
+    }
+
+    // n particles with the attributes in separate arrays; without branches, so that the
+    // compiler can vectorize the loop
+    inline void integrate(const Physics& physics, float* px, float* py, float* pz,
+                          float* vx, float* vy, float* vz, const float* radius, float* lifetime, size_t n)
+    {
+        const float dt = physics.dt;
+        const float damping = 1.0f - physics.drag * dt;
+        const float bounce = 1.0f + physics.restitution;
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            float x = vx[i] * damping;
+            float y = (vy[i] + physics.gravity * dt) * damping;
+            float z = vz[i] * damping;
+
+            float a = px[i] + x * dt;
+            float b = py[i] + y * dt;
+            float c = pz[i] + z * dt;
+
+            // a particle that went through the bounds is moved back onto them, and the part
+            // of its velocity towards the bounds is reflected
+            float limit = physics.bounds - radius[i];
+            float d = std::sqrt(a * a + b * b + c * c);
+            float inv = 1.0f / std::max(d, 1e-6f);
+            float nx = a * inv;
+            float ny = b * inv;
+            float nz = c * inv;
+            float vn = x * nx + y * ny + z * nz;
+
+            bool hit = d > limit;
+            float scale = hit ? limit * inv : 1.0f;
+            float k = hit & (vn > 0.0f) ? bounce * vn : 0.0f;
+
+            px[i] = a * scale;
+            py[i] = b * scale;
+            pz[i] = c * scale;
+            vx[i] = x - k * nx;
+            vy[i] = y - k * ny;
+            vz[i] = z - k * nz;
+            lifetime[i] -= dt;
+        }
+    }
+
+#if defined(__SSSE3__)
+
+    // integrate() for groups of 4 particles; n is rounded up to a whole group, the lanes
+    // after the live particles are computed but not used
+    inline void integrate_groups(const Physics& physics, float* px, float* py, float* pz,
+                                 float* vx, float* vy, float* vz, const float* radius, float* lifetime, size_t n)
+    {
+        const __m128 dt = _mm_set1_ps(physics.dt);
+        const __m128 damping = _mm_set1_ps(1.0f - physics.drag * physics.dt);
+        const __m128 gravity = _mm_set1_ps(physics.gravity * physics.dt);
+        const __m128 bounce = _mm_set1_ps(1.0f + physics.restitution);
+        const __m128 bounds = _mm_set1_ps(physics.bounds);
+        const __m128 epsilon = _mm_set1_ps(1e-6f);
+        const __m128 one = _mm_set1_ps(1.0f);
+        const __m128 zero = _mm_setzero_ps();
+
+        for (size_t i = 0; i < n; i += 4)
+        {
+            __m128 x = _mm_mul_ps(_mm_loadu_ps(vx + i), damping);
+            __m128 y = _mm_mul_ps(_mm_add_ps(_mm_loadu_ps(vy + i), gravity), damping);
+            __m128 z = _mm_mul_ps(_mm_loadu_ps(vz + i), damping);
+
+            __m128 a = _mm_add_ps(_mm_loadu_ps(px + i), _mm_mul_ps(x, dt));
+            __m128 b = _mm_add_ps(_mm_loadu_ps(py + i), _mm_mul_ps(y, dt));
+            __m128 c = _mm_add_ps(_mm_loadu_ps(pz + i), _mm_mul_ps(z, dt));
+
+            __m128 limit = _mm_sub_ps(bounds, _mm_loadu_ps(radius + i));
+            __m128 d = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(a, a), _mm_mul_ps(b, b)), _mm_mul_ps(c, c)));
+            __m128 inv = _mm_div_ps(one, _mm_max_ps(d, epsilon));
+            __m128 nx = _mm_mul_ps(a, inv);
+            __m128 ny = _mm_mul_ps(b, inv);
+            __m128 nz = _mm_mul_ps(c, inv);
+            __m128 vn = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, nx), _mm_mul_ps(y, ny)), _mm_mul_ps(z, nz));
+
+            __m128 hit = _mm_cmpgt_ps(d, limit);
+            __m128 scale = _mm_or_ps(_mm_and_ps(hit, _mm_mul_ps(limit, inv)), _mm_andnot_ps(hit, one));
+            __m128 k = _mm_and_ps(_mm_and_ps(hit, _mm_cmpgt_ps(vn, zero)), _mm_mul_ps(bounce, vn));
+
+            _mm_storeu_ps(px + i, _mm_mul_ps(a, scale));
+            _mm_storeu_ps(py + i, _mm_mul_ps(b, scale));
+            _mm_storeu_ps(pz + i, _mm_mul_ps(c, scale));
+            _mm_storeu_ps(vx + i, _mm_sub_ps(x, _mm_mul_ps(k, nx)));
+            _mm_storeu_ps(vy + i, _mm_sub_ps(y, _mm_mul_ps(k, ny)));
+            _mm_storeu_ps(vz + i, _mm_sub_ps(z, _mm_mul_ps(k, nz)));
+            _mm_storeu_ps(lifetime + i, _mm_sub_ps(_mm_loadu_ps(lifetime + i), dt));
+        }
+    }
+
+#else
+
+    inline void integrate_groups(const Physics& physics, float* px, float* py, float* pz,
+                                 float* vx, float* vy, float* vz, const float* radius, float* lifetime, size_t n)
+    {
+        integrate(physics, px, py, pz, vx, vy, vz, radius, lifetime, (n + 3) & ~size_t(3));
+    }
+
+#endif
+
+    // The attributes of the SIMD layouts, one array of 32 bit lanes for each. The lanes are
+    // in packets, and a packet is in groups of 4 lanes that are next to each other.
+    enum Attribute
+    {
+        PX, PY, PZ, VX, VY, VZ, COLOR, RADIUS, ROTATION, LIFETIME, ATTRIBUTES
+    };
+
+    struct Lanes
+    {
+        u8* base;
+        int shift; // log2 of the groups in a packet
+        size_t mask;
+        size_t stride; // bytes from a packet to the next
+
+        // packet and stride are in lanes; the packet is a power of two, at least 4
+        Lanes(void* data, size_t packet, size_t stride)
+            : base(reinterpret_cast<u8*>(data))
+            , shift(0)
+            , stride(stride * 4)
+        {
+            while ((size_t(4) << shift) < packet)
+                ++shift;
+            mask = (size_t(1) << shift) - 1;
+        }
+
+        u8* group(size_t g) const
+        {
+            return base + (g >> shift) * stride + (g & mask) * 16;
+        }
+
+        u8* lane(size_t i) const
+        {
+            return group(i / 4) + (i % 4) * 4;
+        }
+
+        template <typename T>
+        T get(size_t i) const
+        {
+            T value;
+            std::memcpy(&value, lane(i), 4);
+            return value;
+        }
+
+        template <typename T>
+        void set(size_t i, T value) const
+        {
+            std::memcpy(lane(i), &value, 4);
+        }
+    };
+
+    using LaneArray = std::array<Lanes, ATTRIBUTES>;
+
+#if defined(__SSSE3__)
+
+    // For every 4 bit mask of live lanes and n lanes that are waiting to be written: a shuffle
+    // that packs the live lanes after the n waiting ones, one for the live lanes that don't fit
+    // in the group any more, and the number of live lanes. 0x80 clears a byte.
+    struct CompactTable
+    {
+        __m128i low[16][4];
+        __m128i high[16][4];
+        int count[16];
+
+        CompactTable()
+        {
+            for (int mask = 0; mask < 16; ++mask)
+            {
+                u8 pack[16];
+                std::memset(pack, 0x80, 16);
+
+                int k = 0;
+                for (int lane = 0; lane < 4; ++lane)
+                {
+                    if (mask & (1 << lane))
+                    {
+                        for (int i = 0; i < 4; ++i)
+                        {
+                            pack[k * 4 + i] = u8(lane * 4 + i);
+                        }
+                        ++k;
+                    }
+                }
+
+                count[mask] = k;
+
+                for (int n = 0; n < 4; ++n)
+                {
+                    alignas(16) u8 lo[16];
+                    alignas(16) u8 hi[16];
+
+                    for (int i = 0; i < 16; ++i)
+                    {
+                        lo[i] = i >= n * 4 ? pack[i - n * 4] : 0x80;
+                        hi[i] = i + (4 - n) * 4 < 16 ? pack[i + (4 - n) * 4] : 0x80;
+                    }
+
+                    low[mask][n] = _mm_load_si128(reinterpret_cast<const __m128i*>(lo));
+                    high[mask][n] = _mm_load_si128(reinterpret_cast<const __m128i*>(hi));
+                }
+            }
+        }
+    };
+
+    const CompactTable compact_table;
+
+    // Removes the particles whose lifetime has run out, keeping the order of the others, and
+    // returns the new count. The live lanes of a group are shuffled after the ones waiting in
+    // a register, and only whole groups are written, so the packets can be of any size.
+    size_t compact(const LaneArray& lanes, size_t count)
+    {
+        __m128i pending[ATTRIBUTES];
+        for (auto& p : pending)
+        {
+            p = _mm_setzero_si128();
+        }
+
+        int n = 0; // lanes in pending
+        size_t output = 0; // whole groups written
+
+        const size_t groups = (count + 3) / 4;
+        const __m128 zero = _mm_setzero_ps();
+
+        for (size_t g = 0; g < groups; ++g)
+        {
+            size_t left = count - g * 4;
+            int valid = left >= 4 ? 0xf : (1 << left) - 1;
+
+            __m128 lifetime = _mm_loadu_ps(reinterpret_cast<const float*>(lanes[LIFETIME].group(g)));
+            int mask = _mm_movemask_ps(_mm_cmpgt_ps(lifetime, zero)) & valid;
+
+            if (mask == 0xf && n == 0)
+            {
+                // nothing to pack; the group moves as it is, or stays where it is
+                if (output != g)
+                {
+                    for (const auto& a : lanes)
+                    {
+                        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a.group(g)));
+                        _mm_storeu_si128(reinterpret_cast<__m128i*>(a.group(output)), v);
+                    }
+                }
+                ++output;
+                continue;
+            }
+
+            const __m128i low = compact_table.low[mask][n];
+            const __m128i high = compact_table.high[mask][n];
+            const int k = compact_table.count[mask];
+
+            if (n + k >= 4)
+            {
+                for (int a = 0; a < ATTRIBUTES; ++a)
+                {
+                    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lanes[a].group(g)));
+                    __m128i full = _mm_or_si128(pending[a], _mm_shuffle_epi8(v, low));
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes[a].group(output)), full);
+                    pending[a] = _mm_shuffle_epi8(v, high);
+                }
+                ++output;
+                n += k - 4;
+            }
+            else
+            {
+                for (int a = 0; a < ATTRIBUTES; ++a)
+                {
+                    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lanes[a].group(g)));
+                    pending[a] = _mm_or_si128(pending[a], _mm_shuffle_epi8(v, low));
+                }
+                n += k;
+            }
+        }
+
+        if (n)
+        {
+            // the lanes after the new count are not used
+            for (int a = 0; a < ATTRIBUTES; ++a)
+            {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes[a].group(output)), pending[a]);
+            }
+        }
+
+        return output * 4 + n;
+    }
+
+#else
+
+    size_t compact(const LaneArray& lanes, size_t count)
+    {
+        size_t output = 0;
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            float lifetime;
+            std::memcpy(&lifetime, lanes[LIFETIME].lane(i), 4);
+
+            if (lifetime > 0.0f)
+            {
+                if (output != i)
+                {
+                    for (const auto& a : lanes)
+                    {
+                        std::memcpy(a.lane(output), a.lane(i), 4);
+                    }
+                }
+                ++output;
+            }
+        }
+
+        return output;
+    }
+
+#endif
+
+    // appends new particles after the count and returns the new count; next is the index
+    // of the next particle to emit
+    size_t emit(const LaneArray& lanes, size_t count, size_t capacity, const Physics& physics,
+                const Random& random, u32& next)
+    {
+        const size_t end = std::min(count + physics.emit, capacity);
+
+        for (size_t i = count; i < end; ++i)
+        {
+            NewParticle p = new_particle(random, next++, EMIT_SPREAD, physics);
+            lanes[PX].set(i, p.position[0]);
+            lanes[PY].set(i, p.position[1]);
+            lanes[PZ].set(i, p.position[2]);
+            lanes[VX].set(i, p.velocity[0]);
+            lanes[VY].set(i, p.velocity[1]);
+            lanes[VZ].set(i, p.velocity[2]);
+            lanes[COLOR].set(i, p.color);
+            lanes[RADIUS].set(i, p.radius);
+            lanes[ROTATION].set(i, p.rotation);
+            lanes[LIFETIME].set(i, p.lifetime);
+        }
+
+        return end;
+    }
+
+} // namespace
+
+// ----------------------------------------------------------------------
+// method1: AoS - Array of Structures
+// ----------------------------------------------------------------------
+
+/*
+    This method wastes memory bandwidth for reading data which is not needed
+    and writing data that doesn't change.
+*/
+
+namespace method1
+{
+
+    struct Particle
+    {
+        float4 position; // this is the only mutable data in the transform() method
+        float4 velocity;
+        u32 color;
+        float radius;
+        float rotation;
+        float lifetime;
+    };
+
+    struct Scene
+    {
+        AlignedVector<Particle> particles;
+        size_t count; // alive
+
+        // the parallel transform works on ranges of elements, here particles
+        static constexpr size_t element_size = sizeof(Particle);
+
+        // bytes read and written per element; every cache line has a position so all are written back
+        static constexpr size_t traffic = sizeof(Particle) * 2;
+
+        Random random;
+        u32 next; // index of the next particle to emit
+
+        Scene(int count, u64 seed, int threads)
+            : particles(count)
+            , count(count)
+            , random(seed)
+            , next(count)
+        {
+            parallel_for(count, INIT_CHUNK, threads, [&] (size_t begin, size_t end)
+            {
+                for (size_t i = begin; i < end; ++i)
+                {
+                    NewParticle n = new_particle(random, u32(i), INITIAL_SPREAD, Physics());
+                    Particle& p = particles[i];
+                    p.position = float4(n.position[0], n.position[1], n.position[2], 1.0f);
+                    p.velocity = float4(n.velocity[0], n.velocity[1], n.velocity[2], 0.0f);
+                    p.color = n.color;
+                    p.radius = n.radius;
+                    p.rotation = n.rotation;
+                    p.lifetime = n.lifetime;
+                }
+            });
+        }
+
+        size_t size() const
+        {
+            return particles.size();
+        }
+
+        size_t footprint() const
+        {
+            return particles.size() * sizeof(Particle);
+        }
+
+        void transform(size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; ++i)
+            {
+                particles[i].position += particles[i].velocity;
+            }
+        }
+
+        void transform()
+        {
+            transform(0, size());
+        }
+
+        // there is no streaming transform: the positions share their cache lines with
+        // the data that is only read, so non-temporal stores would write partial lines
+        void prefetch(size_t begin, size_t end) const
+        {
+            ::prefetch(&particles[begin], (end - begin) * sizeof(Particle));
+        }
+
+        void step(const Physics& physics)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                Particle& p = particles[i];
+                float px = p.position.x;
+                float py = p.position.y;
+                float pz = p.position.z;
+                float vx = p.velocity.x;
+                float vy = p.velocity.y;
+                float vz = p.velocity.z;
+                integrate(physics, &px, &py, &pz, &vx, &vy, &vz, &p.radius, &p.lifetime, 1);
+                p.position = float4(px, py, pz, p.position.w);
+                p.velocity = float4(vx, vy, vz, p.velocity.w);
+            }
+
+            size_t output = 0;
+            for (size_t i = 0; i < count; ++i)
+            {
+                if (particles[i].lifetime > 0.0f)
+                {
+                    if (output != i)
+                        particles[output] = particles[i];
+                    ++output;
+                }
+            }
+
+            const size_t end = std::min(output + physics.emit, particles.size());
+            for (count = output; count < end; ++count)
+            {
+                NewParticle n = new_particle(random, next++, EMIT_SPREAD, physics);
+                Particle& p = particles[count];
+                p.position = float4(n.position[0], n.position[1], n.position[2], 1.0f);
+                p.velocity = float4(n.velocity[0], n.velocity[1], n.velocity[2], 0.0f);
+                p.color = n.color;
+                p.radius = n.radius;
+                p.rotation = n.rotation;
+                p.lifetime = n.lifetime;
+            }
+        }
+    };
+
+} // namespace
+
+// ----------------------------------------------------------------------
+// method2: SoA - Structure of Arrays
+// ----------------------------------------------------------------------
+
+/*
+    This method is slightly better as it writes to continuous memory w/o any holes.
+*/
+
+namespace method2
+{
+
+    struct Scene
+    {
+        AlignedVector<float4> positions;
+        AlignedVector<float4> velocities;
+        std::vector<u32> colors;
+        std::vector<float> radiuses;
+        std::vector<float> rotations;
+        std::vector<float> lifetimes;
+        size_t count; // alive
+
+        static constexpr size_t element_size = sizeof(float4);
+        static constexpr size_t traffic = sizeof(float4) * 3;
+
+        Random random;
+        u32 next; // index of the next particle to emit
+
+        Scene(int count, u64 seed, int threads)
+            : positions(count)
+            , velocities(count)
+            , colors(count)
+            , radiuses(count)
+            , rotations(count)
+            , lifetimes(count)
+            , count(count)
+            , random(seed)
+            , next(count)
+        {
+            parallel_for(count, INIT_CHUNK, threads, [&] (size_t begin, size_t end)
+            {
+                // the vectors interleave x, y and z so the values go through a buffer
+                constexpr size_t BUFFER = 64;
+                float x[BUFFER], y[BUFFER], z[BUFFER];
+
+                for (size_t i = begin; i < end; i += BUFFER)
+                {
+                    const size_t n = std::min(BUFFER, end - i);
+
+                    random_vectors(random, RANDOM_POSITION, INITIAL_SPREAD, u32(i), n, x, y, z);
+                    for (size_t j = 0; j < n; ++j)
+                    {
+                        positions[i + j] = float4(x[j], y[j], z[j], 1.0f);
+                    }
+
+                    random_vectors(random, RANDOM_VELOCITY, 1.0f, u32(i), n, x, y, z);
+                    for (size_t j = 0; j < n; ++j)
+                    {
+                        velocities[i + j] = float4(x[j], y[j], z[j], 0.0f);
+                    }
+                }
+
+                random_attributes(random, Physics(), u32(begin), end - begin,
+                                  &colors[begin], &radiuses[begin], &rotations[begin], &lifetimes[begin]);
+            });
+        }
+
+        size_t size() const
+        {
+            return positions.size();
+        }
+
+        size_t footprint() const
+        {
+            return (positions.size() + velocities.size()) * sizeof(float4) + colors.size() * sizeof(u32) +
+                   (radiuses.size() + rotations.size() + lifetimes.size()) * sizeof(float);
+        }
+
+        void transform(size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; ++i)
+            {
+                positions[i] += velocities[i];
+            }
+        }
+
+        void transform()
+        {
+            transform(0, size());
+        }
+
+        void prefetch(size_t begin, size_t end) const
+        {
+            ::prefetch(&positions[begin], (end - begin) * sizeof(float4));
+            ::prefetch(&velocities[begin], (end - begin) * sizeof(float4));
+        }
+
+#if defined(__SSE__)
+        // the positions are written with non-temporal stores, which don't keep them in the caches
+        void transform_stream(size_t begin, size_t end)
+        {
+            float* p = reinterpret_cast<float*>(positions.data());
+            const float* v = reinterpret_cast<const float*>(velocities.data());
+            for (size_t i = begin * 4; i < end * 4; i += 4)
+            {
+                _mm_stream_ps(p + i, _mm_add_ps(_mm_load_ps(p + i), _mm_load_ps(v + i)));
+            }
+            _mm_sfence();
+        }
+#endif
+
+        void step(const Physics& physics)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                float px = positions[i].x;
+                float py = positions[i].y;
+                float pz = positions[i].z;
+                float vx = velocities[i].x;
+                float vy = velocities[i].y;
+                float vz = velocities[i].z;
+                integrate(physics, &px, &py, &pz, &vx, &vy, &vz, &radiuses[i], &lifetimes[i], 1);
+                positions[i] = float4(px, py, pz, positions[i].w);
+                velocities[i] = float4(vx, vy, vz, velocities[i].w);
+            }
+
+            size_t output = 0;
+            for (size_t i = 0; i < count; ++i)
+            {
+                if (lifetimes[i] > 0.0f)
+                {
+                    if (output != i)
+                    {
+                        positions[output] = positions[i];
+                        velocities[output] = velocities[i];
+                        colors[output] = colors[i];
+                        radiuses[output] = radiuses[i];
+                        rotations[output] = rotations[i];
+                        lifetimes[output] = lifetimes[i];
+                    }
+                    ++output;
+                }
+            }
+
+            const size_t end = std::min(output + physics.emit, positions.size());
+            for (count = output; count < end; ++count)
+            {
+                NewParticle n = new_particle(random, next++, EMIT_SPREAD, physics);
+                positions[count] = float4(n.position[0], n.position[1], n.position[2], 1.0f);
+                velocities[count] = float4(n.velocity[0], n.velocity[1], n.velocity[2], 0.0f);
+                colors[count] = n.color;
+                radiuses[count] = n.radius;
+                rotations[count] = n.rotation;
+                lifetimes[count] = n.lifetime;
+            }
+        }
+    };
+
+} // namespace
+
+// ----------------------------------------------------------------------
+// method3: SoA w/ 100% SIMD register utilization
+// ----------------------------------------------------------------------
+
+/*
+    This method does not waste 25% of ram for storing the w-coordinate which
+    is a constant value. It was stored in the earlier methods for alignment.
+*/
+
+namespace method3
+{
+
+    struct Scene
+    {
+        AlignedVector<float4> xpositions;
+        AlignedVector<float4> ypositions;
+        AlignedVector<float4> zpositions;
+        AlignedVector<float4> xvelocities;
+        AlignedVector<float4> yvelocities;
+        AlignedVector<float4> zvelocities;
+        std::vector<u32> colors;
+        std::vector<float> radiuses;
+        std::vector<float> rotations;
+        std::vector<float> lifetimes;
+        size_t count; // alive
+
+        // an element is four particles in each of the six arrays
+        static constexpr size_t element_size = sizeof(float4);
+        static constexpr size_t traffic = sizeof(float4) * 9;
+
+        Random random;
+        u32 next; // index of the next particle to emit
+
+        Scene(int count, u64 seed, int threads)
+            : xpositions(count / 4)
+            , ypositions(count / 4)
+            , zpositions(count / 4)
+            , xvelocities(count / 4)
+            , yvelocities(count / 4)
+            , zvelocities(count / 4)
+            , colors(count)
+            , radiuses(count)
+            , rotations(count)
+            , lifetimes(count)
+            , count(count / 4 * 4)
+            , random(seed)
+            , next(count)
+        {
+            parallel_for(this->count, INIT_CHUNK, threads, [&] (size_t begin, size_t end)
+            {
+                const size_t n = end - begin;
+                random_vectors(random, RANDOM_POSITION, INITIAL_SPREAD, u32(begin), n,
+                               &xpositions[begin / 4][0], &ypositions[begin / 4][0], &zpositions[begin / 4][0]);
+                random_vectors(random, RANDOM_VELOCITY, 1.0f, u32(begin), n,
+                               &xvelocities[begin / 4][0], &yvelocities[begin / 4][0], &zvelocities[begin / 4][0]);
+                random_attributes(random, Physics(), u32(begin), n,
+                                  &colors[begin], &radiuses[begin], &rotations[begin], &lifetimes[begin]);
+            });
+        }
+
+        size_t size() const
+        {
+            return xpositions.size();
+        }
+
+        size_t footprint() const
+        {
+            return xpositions.size() * sizeof(float4) * 6 + colors.size() * sizeof(u32) +
+                   (radiuses.size() + rotations.size() + lifetimes.size()) * sizeof(float);
+        }
+
+        void transform(size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; ++i)
+            {
+                xpositions[i] += xvelocities[i];
+                ypositions[i] += yvelocities[i];
+                zpositions[i] += zvelocities[i];
+            }
+        }
+
+        void transform()
+        {
+            transform(0, size());
+        }
+
+        void prefetch(size_t begin, size_t end) const
+        {
+            const size_t bytes = (end - begin) * sizeof(float4);
+            ::prefetch(&xpositions[begin], bytes);
+            ::prefetch(&ypositions[begin], bytes);
+            ::prefetch(&zpositions[begin], bytes);
+            ::prefetch(&xvelocities[begin], bytes);
+            ::prefetch(&yvelocities[begin], bytes);
+            ::prefetch(&zvelocities[begin], bytes);
+        }
+
+#if defined(__SSE__)
+        void transform_stream(size_t begin, size_t end)
+        {
+            float* px = reinterpret_cast<float*>(xpositions.data());
+            float* py = reinterpret_cast<float*>(ypositions.data());
+            float* pz = reinterpret_cast<float*>(zpositions.data());
+            const float* vx = reinterpret_cast<const float*>(xvelocities.data());
+            const float* vy = reinterpret_cast<const float*>(yvelocities.data());
+            const float* vz = reinterpret_cast<const float*>(zvelocities.data());
+            for (size_t i = begin * 4; i < end * 4; i += 4)
+            {
+                _mm_stream_ps(px + i, _mm_add_ps(_mm_load_ps(px + i), _mm_load_ps(vx + i)));
+                _mm_stream_ps(py + i, _mm_add_ps(_mm_load_ps(py + i), _mm_load_ps(vy + i)));
+                _mm_stream_ps(pz + i, _mm_add_ps(_mm_load_ps(pz + i), _mm_load_ps(vz + i)));
+            }
+            _mm_sfence();
+        }
+#endif
+
+        LaneArray lanes()
+        {
+            return {{
+                Lanes(xpositions.data(), 4, 4),
+                Lanes(ypositions.data(), 4, 4),
+                Lanes(zpositions.data(), 4, 4),
+                Lanes(xvelocities.data(), 4, 4),
+                Lanes(yvelocities.data(), 4, 4),
+                Lanes(zvelocities.data(), 4, 4),
+                Lanes(colors.data(), 4, 4),
+                Lanes(radiuses.data(), 4, 4),
+                Lanes(rotations.data(), 4, 4),
+                Lanes(lifetimes.data(), 4, 4)
+            }};
+        }
+
+        void step(const Physics& physics)
+        {
+            // the lanes of the packets are one contiguous array
+            integrate_groups(physics,
+                reinterpret_cast<float*>(xpositions.data()),
+                reinterpret_cast<float*>(ypositions.data()),
+                reinterpret_cast<float*>(zpositions.data()),
+                reinterpret_cast<float*>(xvelocities.data()),
+                reinterpret_cast<float*>(yvelocities.data()),
+                reinterpret_cast<float*>(zvelocities.data()),
+                radiuses.data(), lifetimes.data(), count);
+
+            LaneArray a = lanes();
+            count = compact(a, count);
+            count = emit(a, count, xpositions.size() * 4, physics, random, next);
+        }
+    };
+
+} // namespace
+
+// ----------------------------------------------------------------------
+// method4: SoA with vector types
+// ----------------------------------------------------------------------
+
+namespace method4
+{
+
+    // configure SIMD vector type
+    using VectorType = float32x4;
+
+    // 3-dimensional vector of VectorType
+    using PackedVector = Vector<VectorType, 3>;
+
+    constexpr int N = VectorType::VectorSize;
+
+    struct Scene
+    {
+        AlignedVector<PackedVector> positions;
+        AlignedVector<PackedVector> velocities;
+        std::vector<u32> colors;
+        std::vector<float> radiuses;
+        std::vector<float> rotations;
+        std::vector<float> lifetimes;
+        size_t count; // alive
+
+        static constexpr size_t element_size = sizeof(PackedVector);
+        static constexpr size_t traffic = sizeof(PackedVector) * 3;
+
+        Random random;
+        u32 next; // index of the next particle to emit
+
+        Scene(int count, u64 seed, int threads)
+            : positions(count / N)
+            , velocities(count / N)
+            , colors(count)
+            , radiuses(count)
+            , rotations(count)
+            , lifetimes(count)
+            , count(count / N * N)
+            , random(seed)
+            , next(count)
+        {
+            parallel_for(this->count, INIT_CHUNK, threads, [&] (size_t begin, size_t end)
+            {
+                // the packets interleave x, y and z so the values go through a buffer
+                float x[N], y[N], z[N];
+
+                for (size_t i = begin; i < end; i += N)
+                {
+                    PackedVector& position = positions[i / N];
+                    PackedVector& velocity = velocities[i / N];
+
+                    random_vectors(random, RANDOM_POSITION, INITIAL_SPREAD, u32(i), N, x, y, z);
+                    for (int j = 0; j < N; ++j)
+                    {
+                        position.x[j] = x[j];
+                        position.y[j] = y[j];
+                        position.z[j] = z[j];
+                    }
+
+                    random_vectors(random, RANDOM_VELOCITY, 1.0f, u32(i), N, x, y, z);
+                    for (int j = 0; j < N; ++j)
+                    {
+                        velocity.x[j] = x[j];
+                        velocity.y[j] = y[j];
+                        velocity.z[j] = z[j];
+                    }
+                }
+
+                random_attributes(random, Physics(), u32(begin), end - begin,
+                                  &colors[begin], &radiuses[begin], &rotations[begin], &lifetimes[begin]);
+            });
+        }
+
+        size_t size() const
+        {
+            return positions.size();
+        }
+
+        size_t footprint() const
+        {
+            return (positions.size() + velocities.size()) * sizeof(PackedVector) + colors.size() * sizeof(u32) +
+                   (radiuses.size() + rotations.size() + lifetimes.size()) * sizeof(float);
+        }
+
+        void transform(size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; ++i)
+            {
+                positions[i].x += velocities[i].x;
+                positions[i].y += velocities[i].y;
+                positions[i].z += velocities[i].z;
+            }
+
+            /* generated code with g++ 7.1
+
+            .L631:
+            movaps  (%rax), %xmm0
+            addq    $48, %rax
+            addq    $48, %rcx
+            addps   -48(%rcx), %xmm0
+            movaps  %xmm0, -48(%rax)
+            movaps  -32(%rax), %xmm0
+            addps   -32(%rcx), %xmm0
+            movaps  %xmm0, -32(%rax)
+            movaps  -16(%rax), %xmm0
+            addps   -16(%rcx), %xmm0
+            movaps  %xmm0, -16(%rax)
+            cmpq    %rax, %rsi
+            jne     .L631
+
+            */
+        }
+
+        void transform()
+        {
+            transform(0, size());
+        }
+
+        void prefetch(size_t begin, size_t end) const
+        {
+            ::prefetch(&positions[begin], (end - begin) * sizeof(PackedVector));
+            ::prefetch(&velocities[begin], (end - begin) * sizeof(PackedVector));
+        }
+
+#if defined(__SSE__)
+        // the x, y and z vectors of the range are one array of floats
+        void transform_stream(size_t begin, size_t end)
+        {
+            float* p = reinterpret_cast<float*>(positions.data());
+            const float* v = reinterpret_cast<const float*>(velocities.data());
+            for (size_t i = begin * N * 3; i < end * N * 3; i += 4)
+            {
+                _mm_stream_ps(p + i, _mm_add_ps(_mm_load_ps(p + i), _mm_load_ps(v + i)));
+            }
+            _mm_sfence();
+        }
+#endif
+
+        LaneArray lanes()
+        {
+            // a packet is the x, y and z vectors
+            float* p = reinterpret_cast<float*>(positions.data());
+            float* v = reinterpret_cast<float*>(velocities.data());
+            return {{
+                Lanes(p + 0 * N, N, 3 * N),
+                Lanes(p + 1 * N, N, 3 * N),
+                Lanes(p + 2 * N, N, 3 * N),
+                Lanes(v + 0 * N, N, 3 * N),
+                Lanes(v + 1 * N, N, 3 * N),
+                Lanes(v + 2 * N, N, 3 * N),
+                Lanes(colors.data(), 4, 4),
+                Lanes(radiuses.data(), 4, 4),
+                Lanes(rotations.data(), 4, 4),
+                Lanes(lifetimes.data(), 4, 4)
+            }};
+        }
+
+        void step(const Physics& physics)
+        {
+            for (size_t i = 0; i < count; i += N)
+            {
+                PackedVector& p = positions[i / N];
+                PackedVector& v = velocities[i / N];
+                integrate_groups(physics,
+                    reinterpret_cast<float*>(&p.x),
+                    reinterpret_cast<float*>(&p.y),
+                    reinterpret_cast<float*>(&p.z),
+                    reinterpret_cast<float*>(&v.x),
+                    reinterpret_cast<float*>(&v.y),
+                    reinterpret_cast<float*>(&v.z),
+                    &radiuses[i], &lifetimes[i], std::min(count - i, size_t(N)));
+            }
+
+            LaneArray a = lanes();
+            count = compact(a, count);
+            count = emit(a, count, positions.size() * N, physics, random, next);
+        }
+    };
+
+} // namespace
+
+// ----------------------------------------------------------------------
+// method5: AoSoA with runtime selected vector width
+// ----------------------------------------------------------------------
+
+/*
+    The particles are in blocks of W, with the x, y and z of a block in their own
+    arrays, so one block is one register of every ISA up to AVX-512. The transform
+    adds contiguous floats, which is done with the widest instructions the CPU has.
+
+    The mango vector types are fixed by the compiler flags of the build (-msse4), so
+    the wide kernels use intrinsics with a target attribute instead and the binary
+    still runs on any SSE4 CPU.
+*/
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PARTICLE_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+namespace method5
+{
+
+    // configure the packet width, in floats
+    constexpr int W = 16;
+
+    static_assert(W >= 4 && (W & (W - 1)) == 0, "the physics step needs packets of a power of two lanes");
+
+    struct Block
+    {
+        float x[W];
+        float y[W];
+        float z[W];
+    };
+
+    // dest[i] += src[i], both aligned to the block
+    using Kernel = void (*)(float* dest, const float* src, size_t count);
+
+    void add_scalar(float* dest, const float* src, size_t count)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            dest[i] += src[i];
+        }
+    }
+
+#if defined(PARTICLE_X86_DISPATCH)
+
+    void add_sse(float* dest, const float* src, size_t count)
+    {
+        size_t i = 0;
+        for ( ; i + 4 <= count; i += 4)
+        {
+            _mm_store_ps(dest + i, _mm_add_ps(_mm_load_ps(dest + i), _mm_load_ps(src + i)));
+        }
+        add_scalar(dest + i, src + i, count - i);
+    }
+
+    __attribute__((target("avx2")))
+    void add_avx2(float* dest, const float* src, size_t count)
+    {
+        size_t i = 0;
+        for ( ; i + 8 <= count; i += 8)
+        {
+            _mm256_store_ps(dest + i, _mm256_add_ps(_mm256_load_ps(dest + i), _mm256_load_ps(src + i)));
+        }
+        add_scalar(dest + i, src + i, count - i);
+    }
+
+    __attribute__((target("avx512f")))
+    void add_avx512(float* dest, const float* src, size_t count)
+    {
+        size_t i = 0;
+        for ( ; i + 16 <= count; i += 16)
+        {
+            _mm512_store_ps(dest + i, _mm512_add_ps(_mm512_load_ps(dest + i), _mm512_load_ps(src + i)));
+        }
+        add_scalar(dest + i, src + i, count - i);
+    }
+
+    // the same with non-temporal stores; the blocks are aligned to the widest register
+
+    void stream_sse(float* dest, const float* src, size_t count)
+    {
+        size_t i = 0;
+        for ( ; i + 4 <= count; i += 4)
+        {
+            _mm_stream_ps(dest + i, _mm_add_ps(_mm_load_ps(dest + i), _mm_load_ps(src + i)));
+        }
+        _mm_sfence();
+        add_scalar(dest + i, src + i, count - i);
+    }
+
+    __attribute__((target("avx2")))
+    void stream_avx2(float* dest, const float* src, size_t count)
+    {
+        size_t i = 0;
+        for ( ; i + 8 <= count; i += 8)
+        {
+            _mm256_stream_ps(dest + i, _mm256_add_ps(_mm256_load_ps(dest + i), _mm256_load_ps(src + i)));
+        }
+        _mm_sfence();
+        add_scalar(dest + i, src + i, count - i);
+    }
+
+    __attribute__((target("avx512f")))
+    void stream_avx512(float* dest, const float* src, size_t count)
+    {
+        size_t i = 0;
+        for ( ; i + 16 <= count; i += 16)
+        {
+            _mm512_stream_ps(dest + i, _mm512_add_ps(_mm512_load_ps(dest + i), _mm512_load_ps(src + i)));
+        }
+        _mm_sfence();
+        add_scalar(dest + i, src + i, count - i);
+    }
+
+#endif
+
+    struct Isa
+    {
+        const char* name;
+        Kernel kernel;
+        Kernel stream; // with non-temporal stores
+    };
+
+    // the kernels that this CPU can run, the widest last
+    std::vector<Isa> get_kernels()
+    {
+        std::vector<Isa> kernels;
+
+#if defined(PARTICLE_X86_DISPATCH)
+        __builtin_cpu_init();
+        kernels.push_back({ "sse", add_sse, stream_sse });
+        if (__builtin_cpu_supports("avx2"))
+            kernels.push_back({ "avx2", add_avx2, stream_avx2 });
+        if (__builtin_cpu_supports("avx512f"))
+            kernels.push_back({ "avx512", add_avx512, stream_avx512 });
+#else
+        kernels.push_back({ "scalar", add_scalar, add_scalar });
+#endif
+
+        return kernels;
+    }
+
+    struct Scene
+    {
+        AlignedVector<Block> positions;
+        AlignedVector<Block> velocities;
+        std::vector<u32> colors;
+        std::vector<float> radiuses;
+        std::vector<float> rotations;
+        std::vector<float> lifetimes;
+        size_t count; // alive
+
+        Isa isa;
+
+        static constexpr size_t element_size = sizeof(Block);
+        static constexpr size_t traffic = sizeof(Block) * 3;
+
+        Random random;
+        u32 next; // index of the next particle to emit
+
+        Scene(int count, u64 seed, int threads)
+            : positions(count / W)
+            , velocities(count / W)
+            , colors(count)
+            , radiuses(count)
+            , rotations(count)
+            , lifetimes(count)
+            , count(count / W * W)
+            , isa(get_kernels().back())
+            , random(seed)
+            , next(count)
+        {
+            parallel_for(this->count, INIT_CHUNK, threads, [&] (size_t begin, size_t end)
+            {
+                for (size_t i = begin; i < end; i += W)
+                {
+                    Block& position = positions[i / W];
+                    Block& velocity = velocities[i / W];
+                    random_vectors(random, RANDOM_POSITION, INITIAL_SPREAD, u32(i), W, position.x, position.y, position.z);
+                    random_vectors(random, RANDOM_VELOCITY, 1.0f, u32(i), W, velocity.x, velocity.y, velocity.z);
+                }
+
+                random_attributes(random, Physics(), u32(begin), end - begin,
+                                  &colors[begin], &radiuses[begin], &rotations[begin], &lifetimes[begin]);
+            });
+        }
+
+        size_t size() const
+        {
+            return positions.size();
+        }
+
+        size_t footprint() const
+        {
+            return (positions.size() + velocities.size()) * sizeof(Block) + colors.size() * sizeof(u32) +
+                   (radiuses.size() + rotations.size() + lifetimes.size()) * sizeof(float);
+        }
+
+        void transform(size_t begin, size_t end)
+        {
+            // the blocks are contiguous so the range is one array of floats
+            isa.kernel(positions[begin].x, velocities[begin].x, (end - begin) * W * 3);
+        }
+
+        void transform()
+        {
+            transform(0, size());
+        }
+
+        void prefetch(size_t begin, size_t end) const
+        {
+            ::prefetch(&positions[begin], (end - begin) * sizeof(Block));
+            ::prefetch(&velocities[begin], (end - begin) * sizeof(Block));
+        }
+
+        void transform_stream(size_t begin, size_t end)
+        {
+            isa.stream(positions[begin].x, velocities[begin].x, (end - begin) * W * 3);
+        }
+
+        LaneArray lanes()
+        {
+            Block& p = positions[0];
+            Block& v = velocities[0];
+            return {{
+                Lanes(p.x, W, 3 * W),
+                Lanes(p.y, W, 3 * W),
+                Lanes(p.z, W, 3 * W),
+                Lanes(v.x, W, 3 * W),
+                Lanes(v.y, W, 3 * W),
+                Lanes(v.z, W, 3 * W),
+                Lanes(colors.data(), 4, 4),
+                Lanes(radiuses.data(), 4, 4),
+                Lanes(rotations.data(), 4, 4),
+                Lanes(lifetimes.data(), 4, 4)
+            }};
+        }
+
+        void step(const Physics& physics)
+        {
+            for (size_t i = 0; i < count; i += W)
+            {
+                Block& p = positions[i / W];
+                Block& v = velocities[i / W];
+                integrate_groups(physics, p.x, p.y, p.z, v.x, v.y, v.z, &radiuses[i], &lifetimes[i],
+                    std::min(count - i, size_t(W)));
+            }
+
+            LaneArray a = lanes();
+            count = compact(a, count);
+            count = emit(a, count, positions.size() * W, physics, random, next);
+        }
+    };
+
+} // namespace
+
+// ----------------------------------------------------------------------
+// method6: AoSoA with quantized storage
+// ----------------------------------------------------------------------
+
+/*
+    Blocks of W particles like in method5, but the positions are 16 bit fixed point
+    from an origin and scale of their block, the velocities are half floats and the
+    other attributes are packed into 8 bytes. A particle takes 22 bytes instead of
+    the 40 of method3, for when the number of particles is limited by the memory
+    and not the speed.
+
+    The transform decodes a block to floats, adds the velocities and encodes the
+    positions back, which rounds them to the scale of the block every frame. A block
+    whose particles no longer fit around its origin gets a new origin at their center,
+    and a larger scale when they are spread too far apart; the scale is a power of two
+    so that the scalar and SIMD kernels give the same results.
+*/
+
+namespace method6
+{
+
+    constexpr int W = 8;
+
+    constexpr float INITIAL_SCALE = 1.0f / 16384.0f; // the initial positions are in [-1, 1]
+    constexpr float QUANTIZED_LIMIT = 32767.0f;
+    constexpr float MAX_RADIUS = 0.02f;
+
+    // The step decodes a chunk of the particles at a time to the float arrays of the other
+    // SIMD layouts. A buffer has room for the particles of the chunk before that don't fill
+    // a whole block, and for the lanes after the last group.
+    constexpr size_t STEP_CHUNK = 1024;
+    constexpr size_t STEP_BUFFER = STEP_CHUNK + W * 2;
+
+    // the arrays of a step buffer from the particle at offset
+    inline LaneArray step_lanes(u32* buffer, size_t offset)
+    {
+        u32* p = buffer + offset;
+        return {{
+            Lanes(p + PX * STEP_BUFFER, 4, 4),
+            Lanes(p + PY * STEP_BUFFER, 4, 4),
+            Lanes(p + PZ * STEP_BUFFER, 4, 4),
+            Lanes(p + VX * STEP_BUFFER, 4, 4),
+            Lanes(p + VY * STEP_BUFFER, 4, 4),
+            Lanes(p + VZ * STEP_BUFFER, 4, 4),
+            Lanes(p + COLOR * STEP_BUFFER, 4, 4),
+            Lanes(p + RADIUS * STEP_BUFFER, 4, 4),
+            Lanes(p + ROTATION * STEP_BUFFER, 4, 4),
+            Lanes(p + LIFETIME * STEP_BUFFER, 4, 4)
+        }};
+    }
+
+    inline float* step_array(const LaneArray& lanes, Attribute a)
+    {
+        return reinterpret_cast<float*>(lanes[a].lane(0));
+    }
+
+    // position = origin + scale * p, one cache line
+    struct PositionBlock
+    {
+        float origin[3];
+        float scale;
+        s16 x[W];
+        s16 y[W];
+        s16 z[W];
+    };
+
+    struct VelocityBlock
+    {
+        float16 x[W];
+        float16 y[W];
+        float16 z[W];
+    };
+
+    struct Attributes
+    {
+        u32 color;
+        u8 radius; // of MAX_RADIUS
+        u8 rotation; // of a full turn
+        float16 lifetime;
+    };
+
+    inline Attributes pack_attributes(u32 color, float radius, float rotation, float lifetime)
+    {
+        const float pi = 3.14159265f;
+
+        Attributes a;
+        a.color = color;
+        a.radius = u8(std::min(std::max(radius / MAX_RADIUS, 0.0f), 1.0f) * 255.0f + 0.5f);
+        a.rotation = u8(int(std::floor(rotation / (2.0f * pi) * 256.0f + 0.5f)) & 0xff);
+        a.lifetime = float16(lifetime);
+        return a;
+    }
+
+    // encode the positions of a block, with a new origin and scale when they don't fit
+    void encode(PositionBlock& block, const float* x, const float* y, const float* z)
+    {
+        const float* p[] = { x, y, z };
+        s16* q[] = { block.x, block.y, block.z };
+
+        float inv = 1.0f / block.scale;
+        bool fits = true;
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            for (int i = 0; i < W; ++i)
+            {
+                fits &= std::abs((p[axis][i] - block.origin[axis]) * inv) <= QUANTIZED_LIMIT;
+            }
+        }
+
+        if (!fits)
+        {
+            float extent = 0.0f;
+
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                float low = *std::min_element(p[axis], p[axis] + W);
+                float high = *std::max_element(p[axis], p[axis] + W);
+                block.origin[axis] = (low + high) * 0.5f;
+                extent = std::max(extent, (high - low) * 0.5f);
+            }
+
+            // the smallest power of two that fits the extent, with room for the rounding
+            int exponent;
+            std::frexp(extent / (QUANTIZED_LIMIT - 1.0f), &exponent);
+            block.scale = std::max(std::ldexp(1.0f, exponent), INITIAL_SCALE);
+            inv = 1.0f / block.scale;
+        }
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            for (int i = 0; i < W; ++i)
+            {
+                float v = (p[axis][i] - block.origin[axis]) * inv;
+                q[axis][i] = s16(std::nearbyint(std::min(std::max(v, -QUANTIZED_LIMIT), QUANTIZED_LIMIT)));
+            }
+        }
+    }
+
+    // blocks of positions += velocities
+    using Kernel = void (*)(PositionBlock* positions, const VelocityBlock* velocities, size_t count);
+
+    void transform_scalar(PositionBlock* positions, const VelocityBlock* velocities, size_t count)
+    {
+        for (size_t b = 0; b < count; ++b)
+        {
+            PositionBlock& p = positions[b];
+            const VelocityBlock& v = velocities[b];
+
+            float x[W];
+            float y[W];
+            float z[W];
+
+            for (int i = 0; i < W; ++i)
+            {
+                x[i] = p.origin[0] + p.x[i] * p.scale + float(v.x[i]);
+                y[i] = p.origin[1] + p.y[i] * p.scale + float(v.y[i]);
+                z[i] = p.origin[2] + p.z[i] * p.scale + float(v.z[i]);
+            }
+
+            encode(p, x, y, z);
+        }
+    }
+
+#if defined(PARTICLE_X86_DISPATCH)
+
+    // one axis of a block is one register
+    __attribute__((target("avx2,f16c")))
+    inline __m256 decode_avx2(const s16* q, const float16* v, float origin, __m256 scale)
+    {
+        __m256 p = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_load_si128(reinterpret_cast<const __m128i*>(q))));
+        p = _mm256_add_ps(_mm256_mul_ps(p, scale), _mm256_set1_ps(origin));
+        return _mm256_add_ps(p, _mm256_cvtph_ps(_mm_load_si128(reinterpret_cast<const __m128i*>(v))));
+    }
+
+    __attribute__((target("avx2,f16c")))
+    inline __m256 quantize_avx2(__m256 p, float origin, __m256 inv)
+    {
+        return _mm256_mul_ps(_mm256_sub_ps(p, _mm256_set1_ps(origin)), inv);
+    }
+
+    __attribute__((target("avx2,f16c")))
+    inline void store_avx2(s16* q, __m256 v)
+    {
+        __m256i i = _mm256_cvtps_epi32(v);
+        __m128i packed = _mm_packs_epi32(_mm256_castsi256_si128(i), _mm256_extracti128_si256(i, 1));
+        _mm_store_si128(reinterpret_cast<__m128i*>(q), packed);
+    }
+
+    __attribute__((target("avx2,f16c")))
+    void transform_avx2(PositionBlock* positions, const VelocityBlock* velocities, size_t count)
+    {
+        const __m256 sign = _mm256_set1_ps(-0.0f);
+        const __m256 limit = _mm256_set1_ps(QUANTIZED_LIMIT);
+
+        for (size_t b = 0; b < count; ++b)
+        {
+            PositionBlock& p = positions[b];
+            const VelocityBlock& v = velocities[b];
+
+            const __m256 scale = _mm256_set1_ps(p.scale);
+            const __m256 inv = _mm256_set1_ps(1.0f / p.scale);
+
+            __m256 x = decode_avx2(p.x, v.x, p.origin[0], scale);
+            __m256 y = decode_avx2(p.y, v.y, p.origin[1], scale);
+            __m256 z = decode_avx2(p.z, v.z, p.origin[2], scale);
+
+            __m256 qx = quantize_avx2(x, p.origin[0], inv);
+            __m256 qy = quantize_avx2(y, p.origin[1], inv);
+            __m256 qz = quantize_avx2(z, p.origin[2], inv);
+
+            __m256 outside = _mm256_cmp_ps(_mm256_andnot_ps(sign, qx), limit, _CMP_GT_OQ);
+            outside = _mm256_or_ps(outside, _mm256_cmp_ps(_mm256_andnot_ps(sign, qy), limit, _CMP_GT_OQ));
+            outside = _mm256_or_ps(outside, _mm256_cmp_ps(_mm256_andnot_ps(sign, qz), limit, _CMP_GT_OQ));
+
+            if (_mm256_movemask_ps(outside))
+            {
+                // the block needs a new origin
+                alignas(32) float fx[W];
+                alignas(32) float fy[W];
+                alignas(32) float fz[W];
+                _mm256_store_ps(fx, x);
+                _mm256_store_ps(fy, y);
+                _mm256_store_ps(fz, z);
+                encode(p, fx, fy, fz);
+            }
+            else
+            {
+                store_avx2(p.x, qx);
+                store_avx2(p.y, qy);
+                store_avx2(p.z, qz);
+            }
+        }
+    }
+
+#endif
+
+    struct Isa
+    {
+        const char* name;
+        Kernel kernel;
+    };
+
+    // the kernels that this CPU can run, the fastest last
+    std::vector<Isa> get_kernels()
+    {
+        std::vector<Isa> kernels;
+        kernels.push_back({ "scalar", transform_scalar });
+
+#if defined(PARTICLE_X86_DISPATCH)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c"))
+            kernels.push_back({ "avx2", transform_avx2 });
+#endif
+
+        return kernels;
+    }
+
+    struct Scene
+    {
+        AlignedVector<PositionBlock> positions;
+        AlignedVector<VelocityBlock> velocities;
+        std::vector<Attributes> attributes;
+        size_t count; // alive
+
+        Isa isa;
+
+        // the chunks are whole cache lines in both arrays as the position blocks are one line
+        static constexpr size_t element_size = sizeof(VelocityBlock);
+        static constexpr size_t traffic = sizeof(PositionBlock) * 2 + sizeof(VelocityBlock);
+
+        Random random;
+        u32 next; // index of the next particle to emit
+
+        // the same particles as in the other layouts before they are quantized
+        Scene(int count, u64 seed, int threads)
+            : positions(count / W)
+            , velocities(count / W)
+            , attributes(count)
+            , count(count / W * W)
+            , isa(get_kernels().back())
+            , random(seed)
+            , next(count)
+        {
+            parallel_for(positions.size() * W, INIT_CHUNK, threads, [&] (size_t begin, size_t end)
+            {
+                float x[W];
+                float y[W];
+                float z[W];
+                u32 colors[W];
+                float radiuses[W];
+                float rotations[W];
+                float lifetimes[W];
+
+                for (size_t i = begin; i < end; i += W)
+                {
+                    PositionBlock& position = positions[i / W];
+                    random_vectors(random, RANDOM_POSITION, INITIAL_SPREAD, u32(i), W, x, y, z);
+                    std::fill(position.origin, position.origin + 3, 0.0f);
+                    position.scale = INITIAL_SCALE;
+                    encode(position, x, y, z);
+
+                    VelocityBlock& velocity = velocities[i / W];
+                    random_vectors(random, RANDOM_VELOCITY, 1.0f, u32(i), W, x, y, z);
+                    for (int j = 0; j < W; ++j)
+                    {
+                        velocity.x[j] = float16(x[j]);
+                        velocity.y[j] = float16(y[j]);
+                        velocity.z[j] = float16(z[j]);
+                    }
+
+                    random_attributes(random, Physics(), u32(i), W, colors, radiuses, rotations, lifetimes);
+                    for (int j = 0; j < W; ++j)
+                    {
+                        attributes[i + j] = pack_attributes(colors[j], radiuses[j], rotations[j], lifetimes[j]);
+                    }
+                }
+            });
+        }
+
+        size_t size() const
+        {
+            return positions.size();
+        }
+
+        size_t footprint() const
+        {
+            return positions.size() * sizeof(PositionBlock) +
+                   velocities.size() * sizeof(VelocityBlock) +
+                   attributes.size() * sizeof(Attributes);
+        }
+
+        void transform(size_t begin, size_t end)
+        {
+            isa.kernel(&positions[begin], &velocities[begin], end - begin);
+        }
+
+        void transform()
+        {
+            transform(0, size());
+        }
+
+        void prefetch(size_t begin, size_t end) const
+        {
+            ::prefetch(&positions[begin], (end - begin) * sizeof(PositionBlock));
+            ::prefetch(&velocities[begin], (end - begin) * sizeof(VelocityBlock));
+        }
+
+        // decodes n particles from the particle i
+        void load(const LaneArray& lanes, size_t i, size_t n) const
+        {
+            const float pi = 3.14159265f;
+
+            for (size_t k = 0; k < n; ++k, ++i)
+            {
+                const PositionBlock& p = positions[i / W];
+                const VelocityBlock& v = velocities[i / W];
+                const Attributes& a = attributes[i];
+                const size_t lane = i % W;
+
+                lanes[PX].set(k, p.origin[0] + p.x[lane] * p.scale);
+                lanes[PY].set(k, p.origin[1] + p.y[lane] * p.scale);
+                lanes[PZ].set(k, p.origin[2] + p.z[lane] * p.scale);
+                lanes[VX].set(k, float(v.x[lane]));
+                lanes[VY].set(k, float(v.y[lane]));
+                lanes[VZ].set(k, float(v.z[lane]));
+                lanes[COLOR].set(k, a.color);
+                lanes[RADIUS].set(k, a.radius * (MAX_RADIUS / 255.0f));
+                lanes[ROTATION].set(k, a.rotation * (2.0f * pi / 256.0f));
+                lanes[LIFETIME].set(k, float(a.lifetime));
+            }
+        }
+
+        // encodes the particles to the blocks from the block b; n is whole blocks
+        void store(const LaneArray& lanes, size_t b, size_t n)
+        {
+            const float* x = step_array(lanes, PX);
+            const float* y = step_array(lanes, PY);
+            const float* z = step_array(lanes, PZ);
+
+            for (size_t k = 0; k < n; k += W, ++b)
+            {
+                encode(positions[b], x + k, y + k, z + k);
+
+                VelocityBlock& v = velocities[b];
+                for (int lane = 0; lane < W; ++lane)
+                {
+                    const size_t j = k + lane;
+                    v.x[lane] = float16(lanes[VX].get<float>(j));
+                    v.y[lane] = float16(lanes[VY].get<float>(j));
+                    v.z[lane] = float16(lanes[VZ].get<float>(j));
+                    attributes[b * W + lane] = pack_attributes(lanes[COLOR].get<u32>(j),
+                        lanes[RADIUS].get<float>(j), lanes[ROTATION].get<float>(j), lanes[LIFETIME].get<float>(j));
+                }
+            }
+        }
+
+        // stores the whole blocks of the n particles in the buffer after the output, and
+        // moves the rest to the front; returns the particles left in the buffer
+        size_t flush(u32* buffer, size_t n, size_t& output)
+        {
+            const size_t whole = n / W * W;
+            store(step_lanes(buffer, 0), output / W, whole);
+            output += whole;
+
+            for (int a = 0; a < ATTRIBUTES; ++a)
+            {
+                u32* array = buffer + a * STEP_BUFFER;
+                std::copy(array + whole, array + n, array);
+            }
+
+            return n - whole;
+        }
+
+        // the physics of method5 on a chunk of decoded particles at a time, which are stored
+        // back in order after the particles that are alive, so only a buffer is needed
+        void step(const Physics& physics)
+        {
+            std::vector<u32> buffer(ATTRIBUTES * STEP_BUFFER, 0);
+            const size_t capacity = positions.size() * W;
+
+            size_t output = 0; // particles encoded
+            size_t n = 0; // in the buffer
+
+            for (size_t i = 0; i < count; i += STEP_CHUNK)
+            {
+                const size_t chunk = std::min(count - i, STEP_CHUNK);
+
+                LaneArray a = step_lanes(buffer.data(), n);
+                load(a, i, chunk);
+                integrate_groups(physics, step_array(a, PX), step_array(a, PY), step_array(a, PZ),
+                    step_array(a, VX), step_array(a, VY), step_array(a, VZ),
+                    step_array(a, RADIUS), step_array(a, LIFETIME), chunk);
+
+                n += compact(a, chunk);
+                n = flush(buffer.data(), n, output);
+            }
+
+            const size_t end = std::min(output + n + physics.emit, capacity);
+
+            while (output + n < end)
+            {
+                const size_t room = std::min(end - output - n, STEP_CHUNK);
+                n = emit(step_lanes(buffer.data(), 0), n, n + room, physics, random, next);
+                n = flush(buffer.data(), n, output);
+            }
+
+            count = output + n;
+
+            if (n)
+            {
+                // the lanes after the last particle are copies of it, which keeps the scale
+                for (int a = 0; a < ATTRIBUTES; ++a)
+                {
+                    u32* array = buffer.data() + a * STEP_BUFFER;
+                    std::fill(array + n, array + W, array[n - 1]);
+                }
+
+                store(step_lanes(buffer.data(), 0), output / W, W);
+            }
+        }
+    };
+
+} // namespace
+
+// ----------------------------------------------------------------------
+// profiling
+// ----------------------------------------------------------------------
+
+/*
+    The transforms are timed one frame at a time, and the hardware counters of the
+    thread are read around all of the frames of a method when the kernel allows it
+    (perf_event_paranoid) and the CPU has them. The counters are the cycles, the
+    instructions and the last level cache misses; the memory bandwidth from them is
+    the misses times the cache line, which leaves out the prefetches and write-backs
+    that the cache does not count as misses.
+*/
+
+class PerfCounters
+{
+public:
+    struct Sample
+    {
+        bool valid = false;
+        u64 cycles = 0;
+        u64 instructions = 0;
+        u64 misses = 0;
+    };
+
+#if defined(__linux__)
+
+    PerfCounters()
+    {
+        // a group, so that the counters are scheduled together
+        fd[0] = open_counter(PERF_COUNT_HW_CPU_CYCLES, -1);
+        fd[1] = fd[0] < 0 ? -1 : open_counter(PERF_COUNT_HW_INSTRUCTIONS, fd[0]);
+        fd[2] = fd[1] < 0 ? -1 : open_counter(PERF_COUNT_HW_CACHE_MISSES, fd[0]);
+
+        if (fd[2] < 0)
+        {
+            close_counters();
+        }
+    }
+
+    ~PerfCounters()
+    {
+        close_counters();
+    }
+
+    bool available() const
+    {
+        return fd[0] >= 0;
+    }
+
+    void start()
+    {
+        if (available())
+        {
+            ioctl(fd[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+    }
+
+    Sample stop()
+    {
+        Sample sample;
+
+        if (available())
+        {
+            ioctl(fd[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+            // the number of counters and then their values in the order they were opened
+            u64 values[4];
+            if (read(fd[0], values, sizeof(values)) == ssize_t(sizeof(values)) && values[0] == 3 && values[1])
+            {
+                sample.valid = true;
+                sample.cycles = values[1];
+                sample.instructions = values[2];
+                sample.misses = values[3];
+            }
+        }
+
+        return sample;
+    }
+
+private:
+    int fd[3];
+
+    static int open_counter(u64 config, int group)
+    {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = config;
+        attr.disabled = group < 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+
+        // this thread on any CPU
+        return int(syscall(__NR_perf_event_open, &attr, 0, -1, group, 0));
+    }
+
+    void close_counters()
+    {
+        for (int& f : fd)
+        {
+            if (f >= 0)
+                close(f);
+            f = -1;
+        }
+    }
+
+#else
+
+    bool available() const
+    {
+        return false;
+    }
+
+    void start()
+    {
+    }
+
+    Sample stop()
+    {
+        return Sample();
+    }
+
+#endif
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator = (const PerfCounters&) = delete;
+};
+
+// the distribution of the frame times of the transform on this thread; GB/s is first of
+// the traffic of the layout at the median time, then of the cache misses over all frames
+template <typename Scene>
+void test_profile(const char* name, Scene& scene, PerfCounters& counters, int frames)
+{
+    std::vector<u64> times;
+    times.reserve(frames);
+
+    counters.start();
+
+    for (int i = 0; i < frames; ++i)
+    {
+        u64 time0 = Time::us();
+        scene.transform();
+        times.push_back(Time::us() - time0);
+    }
+
+    PerfCounters::Sample sample = counters.stop();
+
+    benchmark::Statistics stats = benchmark::compute_statistics(times);
+
+    double median = std::max(stats.median, 0.001);
+    double gbps = double(Scene::traffic) * scene.size() / median / 1000000.0;
+
+    printf("%-9s %8.3f %8.3f %8.3f %8.3f %8.1f %7.2f", name, stats.median, stats.p95, stats.min, stats.mean,
+        1000.0 / median, gbps);
+
+    if (sample.valid)
+    {
+        double total = std::max(stats.mean * frames, 0.001);
+        double ipc = double(sample.instructions) / sample.cycles;
+        double misses = double(sample.misses) / frames;
+        double measured = double(sample.misses) * CACHE_LINE / total / 1000000.0;
+        printf(" %6.2f %9.0f %6.2f\n", ipc, misses, measured);
+    }
+    else
+    {
+        printf("      -         -      -\n");
+    }
+}
+
+// ----------------------------------------------------------------------
+// parallel transform
+// ----------------------------------------------------------------------
+
+template <typename Scene>
+void parallel_transform(Scene& scene, int threads)
+{
+    parallel_for(scene.size(), get_chunk_size(Scene::element_size), threads, [&] (size_t begin, size_t end)
+    {
+        scene.transform(begin, end);
+    });
+}
+
+// fps against the number of threads; the memory bandwidth is saturated when more threads
+// don't make the transform faster
+template <typename Scene>
+void test_scaling(const char* name, Scene& scene, const std::vector<int>& thread_counts, int frames)
+{
+    double single = 0;
+    double previous = 0;
+
+    for (int threads : thread_counts)
+    {
+        u64 time0 = Time::us();
+
+        for (int i = 0; i < frames; ++i)
+        {
+            parallel_transform(scene, threads);
+        }
+
+        u64 time = std::max(Time::us() - time0, u64(1));
+
+        double fps = frames * 1000000.0 / time;
+        double gbps = double(Scene::traffic) * scene.size() * frames / time / 1000.0;
+        if (threads == 1)
+            single = fps;
+
+        // less than 10% faster than with the previous thread count
+        bool saturated = previous && fps < previous * 1.1;
+        previous = fps;
+
+        printf("%-9s %6d %9.1f %8.2f %8.2f  %s\n", name, threads, fps, gbps, fps / single,
+            saturated ? "saturated" : "");
+    }
+}
+
+// the memory of a scene, with the attributes that the transform doesn't touch, against its speed
+template <typename Scene>
+void test_footprint(const char* name, Scene& scene, int count, int threads, int frames)
+{
+    u64 time0 = Time::us();
+
+    for (int i = 0; i < frames; ++i)
+    {
+        parallel_transform(scene, threads);
+    }
+
+    u64 time = std::max(Time::us() - time0, u64(1));
+
+    double fps = frames * 1000000.0 / time;
+    double bytes = double(scene.footprint());
+
+    printf("%-9s %9.1f %8.1f %9.1f\n", name, bytes / (1024.0 * 1024.0), bytes / count, fps);
+}
+
+// ----------------------------------------------------------------------
+// memory bandwidth
+// ----------------------------------------------------------------------
+
+/*
+    The transform of a million particles streams through memory, so the limit for
+    the methods is the memory bandwidth. The roofline is measured with the kernels
+    of the STREAM benchmark on arrays much larger than the caches, and the bytes are
+    counted the same way as the traffic of the scenes: what is read plus what is
+    written, without the write-allocate reads. A scene that fits into a large last
+    level cache can be faster than the roofline.
+
+    The variants of the transform against it are:
+
+    prefetch: the cache lines a distance ahead in every array are prefetched
+    stream:   the positions are written with non-temporal stores
+    fused:    a tile that fits into L1 is transformed for K frames before moving on,
+              which reads and writes the memory once every K frames. The result is
+              the same as from K separate transforms.
+*/
+
+constexpr size_t STREAM_SIZE = 16 * 1024 * 1024; // floats per array
+constexpr size_t TILE_BYTES = 4 * 1024; // per array
+
+struct Roofline
+{
+    double copy = 0;  // a = b
+    double scale = 0; // a = s * b
+    double add = 0;   // a = b + c
+    double triad = 0; // a = b + s * c
+
+    // the kernels with the same two reads for a write as the transform
+    double limit() const
+    {
+        return std::max(add, triad);
+    }
+};
+
+// GB/s of the best run
+template <typename Function>
+double measure_bandwidth(size_t bytes, int threads, int runs, Function function)
+{
+    u64 best = ~u64(0);
+
+    for (int i = 0; i < runs; ++i)
+    {
+        u64 time0 = Time::us();
+        parallel_for(STREAM_SIZE, get_chunk_size(sizeof(float)), threads, function);
+        best = std::min(best, std::max(Time::us() - time0, u64(1)));
+    }
+
+    return double(bytes) / best / 1000.0;
+}
+
+Roofline measure_roofline(int threads, int runs)
+{
+    AlignedVector<float> a(STREAM_SIZE);
+    AlignedVector<float> b(STREAM_SIZE);
+    AlignedVector<float> c(STREAM_SIZE);
+    float* pa = a.data();
+    float* pb = b.data();
+    float* pc = c.data();
+    const float s = 3.0f;
+
+    // the pages are touched first by the threads that use them
+    parallel_for(STREAM_SIZE, get_chunk_size(sizeof(float)), threads, [=] (size_t begin, size_t end)
+    {
+        std::fill(pa + begin, pa + end, 1.0f);
+        std::fill(pb + begin, pb + end, 2.0f);
+        std::fill(pc + begin, pc + end, 0.0f);
+    });
+
+    const size_t bytes = STREAM_SIZE * sizeof(float);
+    Roofline roofline;
+
+    roofline.copy = measure_bandwidth(bytes * 2, threads, runs, [=] (size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+            pc[i] = pa[i];
+    });
+
+    roofline.scale = measure_bandwidth(bytes * 2, threads, runs, [=] (size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+            pb[i] = s * pc[i];
+    });
+
+    roofline.add = measure_bandwidth(bytes * 3, threads, runs, [=] (size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+            pc[i] = pa[i] + pb[i];
+    });
+
+    roofline.triad = measure_bandwidth(bytes * 3, threads, runs, [=] (size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+            pa[i] = pb[i] + s * pc[i];
+    });
+
+    return roofline;
+}
+
+// distance is in elements and a multiple of the line step
+template <typename Scene>
+void transform_prefetch(Scene& scene, size_t begin, size_t end, size_t distance)
+{
+    const size_t step = get_line_step(Scene::element_size);
+    const size_t size = scene.size();
+
+    for (size_t i = begin; i < end; i += step)
+    {
+        size_t ahead = i + distance;
+        if (ahead < size)
+        {
+            scene.prefetch(ahead, std::min(ahead + step, size));
+        }
+        scene.transform(i, std::min(i + step, end));
+    }
+}
+
+template <typename Scene>
+void transform_fused(Scene& scene, size_t begin, size_t end, int frames)
+{
+    const size_t tile = get_step_multiple(Scene::element_size, TILE_BYTES);
+
+    for (size_t i = begin; i < end; i += tile)
+    {
+        size_t last = std::min(i + tile, end);
+        for (int frame = 0; frame < frames; ++frame)
+        {
+            scene.transform(i, last);
+        }
+    }
+}
+
+// the GB/s is of the traffic of every frame, so the fused variants can be above the roofline
+template <typename Scene, typename Function>
+void test_variant(const char* name, const std::string& variant, Scene& scene, const Roofline& roofline,
+                  int threads, int passes, int frames_per_pass, Function function)
+{
+    u64 time0 = Time::us();
+
+    for (int i = 0; i < passes; ++i)
+    {
+        parallel_for(scene.size(), get_chunk_size(Scene::element_size), threads, function);
+    }
+
+    u64 time = std::max(Time::us() - time0, u64(1));
+
+    int frames = passes * frames_per_pass;
+    double fps = frames * 1000000.0 / time;
+    double gbps = double(Scene::traffic) * scene.size() * frames / time / 1000.0;
+
+    printf("%-9s %-14s %9.1f %8.2f %8.1f%%\n", name, variant.c_str(), fps, gbps, gbps * 100.0 / roofline.limit());
+}
+
+template <typename Scene>
+void test_variants(const char* name, Scene& scene, const Roofline& roofline, int threads, int frames,
+                   const std::vector<int>& distances, const std::vector<int>& fused)
+{
+    test_variant(name, "plain", scene, roofline, threads, frames, 1, [&] (size_t begin, size_t end)
+    {
+        scene.transform(begin, end);
+    });
+
+    for (int bytes : distances)
+    {
+        size_t distance = get_step_multiple(Scene::element_size, bytes);
+        std::string variant = "prefetch-" + std::to_string(distance * Scene::element_size);
+        test_variant(name, variant, scene, roofline, threads, frames, 1, [&] (size_t begin, size_t end)
+        {
+            transform_prefetch(scene, begin, end, distance);
+        });
+    }
+
+    for (int k : fused)
+    {
+        std::string variant = "fused-" + std::to_string(k);
+        test_variant(name, variant, scene, roofline, threads, std::max(frames / k, 1), k, [&] (size_t begin, size_t end)
+        {
+            transform_fused(scene, begin, end, k);
+        });
+    }
+}
+
+template <typename Scene>
+void test_stream(const char* name, Scene& scene, const Roofline& roofline, int threads, int frames)
+{
+    test_variant(name, "stream", scene, roofline, threads, frames, 1, [&] (size_t begin, size_t end)
+    {
+        scene.transform_stream(begin, end);
+    });
+}
 
 // ----------------------------------------------------------------------
-// helpers
+// physics step
 // ----------------------------------------------------------------------
 
-namespace
+template <typename Scene>
+void test_step(const char* name, Scene& scene, const Physics& physics, int frames)
 {
+    u64 time0 = Time::us();
 
-    std::random_device rd;
-    std::mt19937 mt(rd());
-    std::uniform_real_distribution<float> dist(-1.0, 1.0);
-
-    inline float4 random_float4(float w)
+    for (int i = 0; i < frames; ++i)
     {
-        float x = dist(mt);
-        float y = dist(mt);
-        float z = dist(mt);
-        return float4(x, y, z, w);
+        scene.step(physics);
     }
 
-} // namespace
+    u64 time = std::max(Time::us() - time0, u64(1));
+    printf("%s: %d ms (%d fps), %d alive\n", name, int(time / 1000), int(frames * 1000000 / time), int(scene.count));
+}
 
 // ----------------------------------------------------------------------
-// method1: AoS - Array of Structures
+// spatial grid
 // ----------------------------------------------------------------------
 
 /*
-    This method wastes memory bandwidth for reading data which is not needed
-    and writing data that doesn't change.
+    A uniform grid over the bounds of the physics, rebuilt every frame for neighbor
+    queries. The cells are numbered in Morton order and the particles are sorted by
+    their cell, so the particles of a cell are next to each other and the cells that
+    are near in space are mostly near in memory too. The arrays of the scene are
+    reordered where they are, and the queries read the positions from the scene, so the
+    grid needs 8 bytes for every particle and the cells on top of the scene.
+
+    The counting sort is in two passes, so that no thread needs a histogram of all the
+    cells. The high bits of a key are its bucket, a block of at most 4096 cells which
+    are near each other in the Morton order:
+
+    1. every thread counts the buckets of a block of the particles
+    2. the counts are turned into the offsets of the blocks in every bucket, in the
+       order of the buckets and then the blocks, which keeps the sort stable
+    3. every block puts its particles in the order of the buckets
+    4. every bucket is sorted by the low bits of the keys, in a task for a range of the
+       buckets; this gives the start of every cell and the grid order
+    5. every attribute array is gathered in the grid order into the keys, which are
+       not needed any more, and copied back, in ranges of the particles
 */
 
-namespace method1
+constexpr int GRID_MAX_BITS = 10; // per axis, for 30 bit keys
+constexpr int GRID_BUCKET_BITS = 12; // of the keys, for the first pass of the sort
+
+// the low 10 bits of v to every third bit
+inline u32 part_1by2(u32 v)
 {
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
 
-    struct Particle
-    {
-        float4 position; // this is the only mutable data in the transform() method
-        float4 velocity;
-        u32 color;
-        float radius;
-        float rotation;
-    };
+inline u32 morton(u32 x, u32 y, u32 z)
+{
+    return part_1by2(x) | (part_1by2(y) << 1) | (part_1by2(z) << 2);
+}
 
-    struct Scene
+// function(block) for every block, each in a task of its own
+template <typename Function>
+void parallel_blocks(int blocks, Function function)
+{
+    if (blocks <= 1)
     {
-        AlignedVector<Particle> particles;
+        function(0);
+        return;
+    }
 
-        Scene(int count)
-            : particles(count)
-        {
-            for (auto &particle : particles)
-            {
-                particle.position = random_float4(1.0f);
-                particle.velocity = random_float4(0.0f);
-            }
-        }
+    ConcurrentQueue q("grid");
 
-        void transform()
+    for (int i = 0; i < blocks; ++i)
+    {
+        q.enqueue([&function, i]
         {
-            for (auto &particle : particles)
-            {
-                particle.position += particle.velocity;
-            }
-        }
-    };
+            function(i);
+        });
+    }
 
-} // namespace
+    q.wait();
+}
 
-// ----------------------------------------------------------------------
-// method2: SoA - Structure of Arrays
-// ----------------------------------------------------------------------
+struct Grid
+{
+    float origin;
+    float cell_size;
+    float inv_cell_size;
+    float radius; // of the neighbor query
+    u32 resolution;
 
-/*
-    This method is slightly better as it writes to continuous memory w/o any holes.
-*/
+    std::vector<u32> keys; // of the particles, and then a buffer for the reorder
+    std::vector<u32> order; // of the particles, in the buckets and then in the grid
+    std::vector<u32> histograms; // of every block, over the buckets
+    std::vector<u32> bucket_starts; // of every bucket, and the end of the last
+    std::vector<u32> starts; // of every cell, and the end of the last
+    int bits; // of the keys under the buckets
+    size_t count = 0; // of the particles in the last build
 
-namespace method2
-{
+    // the positions of the scene, in the grid order after a build
+    const float* xpositions = nullptr;
+    const float* ypositions = nullptr;
+    const float* zpositions = nullptr;
+    size_t positions = 0; // in the arrays, alive or not
 
-    struct Scene
+    // The cells are at least the radius wide, so that the neighbors of a particle are in
+    // the cells next to its own, and the grid is the largest power of two of them that
+    // fits in the bounds. A radius too small for the largest grid makes the cells wider.
+    Grid(float bounds, float radius)
     {
-        AlignedVector<float4> positions;
-        AlignedVector<float4> velocities;
-        std::vector<u32> colors;
-        std::vector<float> radiuses;
-        std::vector<float> rotations;
+        int axis = 0;
+        while (axis < GRID_MAX_BITS && 2.0f * bounds / float(2 << axis) >= radius)
+            ++axis;
 
-        Scene(int count)
-            : positions(count)
-            , velocities(count)
-            , colors(count)
-            , radiuses(count)
-            , rotations(count)
+        resolution = 1u << axis;
+        cell_size = 2.0f * bounds / resolution;
+        inv_cell_size = 1.0f / cell_size;
+        origin = -bounds;
+        this->radius = radius;
+        bits = std::max(3 * axis - GRID_BUCKET_BITS, 0);
+        starts.resize((size_t(1) << (3 * axis)) + 1);
+        bucket_starts.resize((cells() >> bits) + 1);
+    }
+
+    size_t cells() const
+    {
+        return starts.size() - 1;
+    }
+
+    // the particles outside of the bounds are in the cells at the border
+    u32 cell(float v) const
+    {
+        float c = (v - origin) * inv_cell_size;
+        return u32(std::min(std::max(c, 0.0f), float(resolution - 1)));
+    }
+
+    // sorts the alive particles of the scene, whose positions are contiguous arrays
+    // like those of method3
+    template <typename Scene>
+    void build(Scene& scene, int threads)
+    {
+        const size_t count = scene.count;
+        const size_t cells = this->cells();
+        const size_t buckets = bucket_starts.size() - 1;
+        const u32 mask = (1u << bits) - 1;
+        const int blocks = std::max(threads, 1);
+        const size_t block_size = (count + blocks - 1) / blocks;
+
+        keys.resize(count);
+        order.resize(count);
+        histograms.resize(buckets * blocks);
+        this->count = count;
+
+        const LaneArray source = scene.lanes();
+
+        parallel_blocks(blocks, [&] (int block)
         {
-            for (auto &position : positions)
+            u32* histogram = &histograms[buckets * block];
+            std::fill(histogram, histogram + buckets, 0);
+
+            const size_t end = std::min(count, (block + 1) * block_size);
+            for (size_t i = block * block_size; i < end; ++i)
             {
-                position = random_float4(1.0f);
+                u32 x = cell(source[PX].get<float>(i));
+                u32 y = cell(source[PY].get<float>(i));
+                u32 z = cell(source[PZ].get<float>(i));
+                u32 key = morton(x, y, z);
+                keys[i] = key;
+                ++histogram[key >> bits];
             }
+        });
+
+        u32 offset = 0;
 
-            for (auto &velocity : velocities)
+        for (size_t b = 0; b < buckets; ++b)
+        {
+            bucket_starts[b] = offset;
+            for (int block = 0; block < blocks; ++block)
             {
-                velocity = random_float4(1.0f);
+                u32& n = histograms[buckets * block + b];
+                u32 next = offset + n;
+                n = offset;
+                offset = next;
             }
         }
 
-        void transform()
+        bucket_starts[buckets] = u32(count);
+
+        parallel_blocks(blocks, [&] (int block)
         {
-            const size_t count = positions.size();
-            for (size_t i = 0; i < count; ++i)
+            u32* offsets = &histograms[buckets * block];
+
+            const size_t end = std::min(count, (block + 1) * block_size);
+            for (size_t i = block * block_size; i < end; ++i)
             {
-                positions[i] += velocities[i];
+                order[offsets[keys[i] >> bits]++] = u32(i);
             }
-        }
-    };
+        });
 
-} // namespace
+        parallel_for(buckets, std::max(buckets / (blocks * 4), size_t(1)), threads, [&] (size_t begin, size_t end)
+        {
+            std::vector<u32> offsets(size_t(1) << bits);
+            std::vector<u32> bucket;
 
-// ----------------------------------------------------------------------
-// method3: SoA w/ 100% SIMD register utilization
-// ----------------------------------------------------------------------
+            for (size_t b = begin; b < end; ++b)
+            {
+                const u32 first = bucket_starts[b];
+                const u32 last = bucket_starts[b + 1];
 
-/*
-    This method does not waste 25% of ram for storing the w-coordinate which
-    is a constant value. It was stored in the earlier methods for alignment.
-*/
+                std::fill(offsets.begin(), offsets.end(), 0);
+                for (u32 k = first; k < last; ++k)
+                {
+                    ++offsets[keys[order[k]] & mask];
+                }
 
-namespace method3
-{
+                u32 offset = first;
+                for (size_t c = 0; c < offsets.size(); ++c)
+                {
+                    starts[(b << bits) + c] = offset;
+                    u32 next = offset + offsets[c];
+                    offsets[c] = offset;
+                    offset = next;
+                }
 
-    struct Scene
-    {
-        AlignedVector<float4> xpositions;
-        AlignedVector<float4> ypositions;
-        AlignedVector<float4> zpositions;
-        AlignedVector<float4> xvelocities;
-        AlignedVector<float4> yvelocities;
-        AlignedVector<float4> zvelocities;
-        std::vector<u32> colors;
-        std::vector<float> radiuses;
-        std::vector<float> rotations;
+                bucket.assign(order.begin() + first, order.begin() + last);
+                for (u32 i : bucket)
+                {
+                    order[offsets[keys[i] & mask]++] = i;
+                }
+            }
+        });
 
-        Scene(int count)
-            : xpositions(count / 4)
-            , ypositions(count / 4)
-            , zpositions(count / 4)
-            , xvelocities(count / 4)
-            , yvelocities(count / 4)
-            , zvelocities(count / 4)
-            , colors(count)
-            , radiuses(count)
-            , rotations(count)
+        starts[cells] = u32(count);
+
+        for (int a = 0; a < ATTRIBUTES; ++a)
         {
-            count /= 4;
-            for (int i = 0; i < count; ++i)
+            const Lanes lanes = source[a];
+
+            parallel_for(count, get_chunk_size(sizeof(float)), threads, [&] (size_t begin, size_t end)
             {
-                xpositions[i] = random_float4(1.0f);
-                ypositions[i] = random_float4(1.0f);
-                zpositions[i] = random_float4(2.0f);
-                xvelocities[i] = random_float4(1.0f);
-                yvelocities[i] = random_float4(2.0f);
-                zvelocities[i] = random_float4(5.0f);
-            }
+                for (size_t i = begin; i < end; ++i)
+                {
+                    keys[i] = lanes.get<u32>(order[i]);
+                }
+            });
+
+            parallel_for(count, get_chunk_size(sizeof(float)), threads, [&] (size_t begin, size_t end)
+            {
+                for (size_t i = begin; i < end; ++i)
+                {
+                    lanes.set(i, keys[i]);
+                }
+            });
         }
 
-        void transform()
+        xpositions = reinterpret_cast<const float*>(source[PX].lane(0));
+        ypositions = reinterpret_cast<const float*>(source[PY].lane(0));
+        zpositions = reinterpret_cast<const float*>(source[PZ].lane(0));
+        positions = scene.size() * Scene::element_size / sizeof(float);
+    }
+
+    // a density for the particles in the range from their neighbors within the radius,
+    // themselves included; returns the number of neighbors
+    size_t query(float* densities, size_t begin, size_t end) const
+    {
+        const float r2 = radius * radius;
+        size_t neighbors = 0;
+
+        for (size_t i = begin; i < end; ++i)
         {
-            const int count = xpositions.size();
-            for (int i = 0; i < count; ++i)
+            const float px = xpositions[i];
+            const float py = ypositions[i];
+            const float pz = zpositions[i];
+
+            // the cells that the ball of the radius overlaps, at most two on every axis
+            const u32 x0 = cell(px - radius);
+            const u32 y0 = cell(py - radius);
+            const u32 z0 = cell(pz - radius);
+            const u32 x1 = cell(px + radius);
+            const u32 y1 = cell(py + radius);
+            const u32 z1 = cell(pz + radius);
+
+            float density = 0.0f;
+
+#if defined(__SSE2__)
+            const __m128 x = _mm_set1_ps(px);
+            const __m128 y = _mm_set1_ps(py);
+            const __m128 z = _mm_set1_ps(pz);
+            const __m128 r = _mm_set1_ps(r2);
+            const __m128i lanes = _mm_setr_epi32(0, 1, 2, 3);
+            __m128 densities4 = _mm_setzero_ps();
+            __m128i found = _mm_setzero_si128();
+#endif
+
+            for (u32 nz = z0; nz <= z1; ++nz)
             {
-                xpositions[i] += xvelocities[i];
-                ypositions[i] += yvelocities[i];
-                zpositions[i] += zvelocities[i];
+                for (u32 ny = y0; ny <= y1; ++ny)
+                {
+                    for (u32 nx = x0; nx <= x1; ++nx)
+                    {
+                        const u32 c = morton(nx, ny, nz);
+                        const u32 e = starts[c + 1];
+                        u32 j = starts[c];
+
+#if defined(__SSE2__)
+                        // four particles at a time; the lanes after the cell are masked out,
+                        // and the last particles of the arrays are left to the scalar loop
+                        const __m128i count = _mm_set1_epi32(int(e));
+                        for ( ; j < e && j + 4 <= positions; j += 4)
+                        {
+                            __m128 dx = _mm_sub_ps(_mm_loadu_ps(&xpositions[j]), x);
+                            __m128 dy = _mm_sub_ps(_mm_loadu_ps(&ypositions[j]), y);
+                            __m128 dz = _mm_sub_ps(_mm_loadu_ps(&zpositions[j]), z);
+                            __m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+                            __m128 w = _mm_max_ps(_mm_sub_ps(r, d2), _mm_setzero_ps());
+                            __m128i inside = _mm_cmplt_epi32(_mm_add_epi32(_mm_set1_epi32(int(j)), lanes), count);
+                            w = _mm_and_ps(w, _mm_castsi128_ps(inside));
+                            densities4 = _mm_add_ps(densities4, _mm_mul_ps(_mm_mul_ps(w, w), w));
+                            found = _mm_sub_epi32(found, _mm_castps_si128(_mm_cmpgt_ps(w, _mm_setzero_ps())));
+                        }
+#endif
+
+                        for ( ; j < e; ++j)
+                        {
+                            float dx = xpositions[j] - px;
+                            float dy = ypositions[j] - py;
+                            float dz = zpositions[j] - pz;
+                            float w = std::max(r2 - (dx * dx + dy * dy + dz * dz), 0.0f);
+                            density += w * w * w;
+                            neighbors += w > 0.0f;
+                        }
+                    }
+                }
             }
+
+#if defined(__SSE2__)
+            alignas(16) float d[4];
+            alignas(16) u32 n[4];
+            _mm_store_ps(d, densities4);
+            _mm_store_si128(reinterpret_cast<__m128i*>(n), found);
+            density += (d[0] + d[1]) + (d[2] + d[3]);
+            neighbors += n[0] + n[1] + n[2] + n[3];
+#endif
+
+            densities[i] = density;
         }
-    };
 
-} // namespace
+        return neighbors;
+    }
 
-// ----------------------------------------------------------------------
-// method4: SoA with vector types
-// ----------------------------------------------------------------------
+    size_t query(float* densities, int threads) const
+    {
+        std::atomic<size_t> neighbors { 0 };
 
-namespace method4
-{
+        parallel_for(count, get_chunk_size(sizeof(float)), threads, [&] (size_t begin, size_t end)
+        {
+            neighbors += query(densities, begin, end);
+        });
 
-    // configure SIMD vector type
-    using VectorType = float32x4;
+        return neighbors;
+    }
+};
 
-    // 3-dimensional vector of VectorType
-    using PackedVector = Vector<VectorType, 3>;
+// the build and query of the grid after every physics step, for the SoA layout; the
+// radius is for about 32 neighbors for the particles spread evenly in the bounds
+void test_grid(int count, u64 seed, const std::vector<int>& thread_counts, int frames)
+{
+    const int threads = *std::max_element(thread_counts.begin(), thread_counts.end());
+    method3::Scene scene(count, seed, threads);
 
-    constexpr int N = VectorType::VectorSize;
+    Physics physics;
+    physics.emit = size_t(count * physics.dt / (physics.lifetime * 0.5f));
 
-    VectorType vrandom()
+    // the initial positions of the transform are in a cube, so every particle's own
+    // uniform values are mapped into the ball of the bounds: a radius with a uniform
+    // volume and a uniform direction on the sphere
+    LaneArray lanes = scene.lanes();
+    parallel_for(scene.count, INIT_CHUNK, threads, [&] (size_t begin, size_t end)
     {
-        VectorType v;
-        for (int i = 0; i < N; ++i)
+        for (size_t i = begin; i < end; ++i)
         {
-            v[i] = dist(mt);
+            const float r = std::cbrt(lanes[PX].get<float>(i) * 0.5f + 0.5f) * physics.bounds;
+            const float z = lanes[PY].get<float>(i);
+            const float phi = lanes[PZ].get<float>(i) * 3.14159265f;
+            const float s = std::sqrt(std::max(1.0f - z * z, 0.0f));
+
+            lanes[PX].set(i, r * s * std::cos(phi));
+            lanes[PY].set(i, r * s * std::sin(phi));
+            lanes[PZ].set(i, r * z);
         }
-        return v;
-    }
+    });
 
-    struct Scene
-    {
-        AlignedVector<PackedVector> positions;
-        AlignedVector<PackedVector> velocities;
-        std::vector<u32> colors;
-        std::vector<float> radiuses;
-        std::vector<float> rotations;
+    Grid grid(physics.bounds, physics.bounds * std::cbrt(32.0f / count));
+    AlignedVector<float> densities(count);
 
-        Scene(int count)
-            : positions(count / N)
-            , velocities(count / N)
-            , colors(count)
-            , radiuses(count)
-            , rotations(count)
-        {
-            count /= N;
-            for (int i = 0; i < count; ++i)
-            {
-                positions[i].x = vrandom();
-                positions[i].y = vrandom();
-                positions[i].z = vrandom();
-                velocities[i].x = vrandom();
-                velocities[i].y = vrandom();
-                velocities[i].z = vrandom();
-            }
-        }
+    printf("%d particles, radius %.4f, %u^3 cells\n", count, grid.radius, grid.resolution);
 
-        void transform()
-        {
-            const int count = positions.size();
-            for (int i = 0; i < count; ++i)
-            {
-                positions[i].x += velocities[i].x;
-                positions[i].y += velocities[i].y;
-                positions[i].z += velocities[i].z;
-            }
+    for (int threads : thread_counts)
+    {
+        u64 build = 0;
+        u64 query = 0;
+        size_t neighbors = 0;
+        size_t queries = 0;
 
-            /* generated code with g++ 7.1
+        for (int i = 0; i < frames; ++i)
+        {
+            scene.step(physics);
 
-            .L631:
-            movaps  (%rax), %xmm0
-            addq    $48, %rax
-            addq    $48, %rcx
-            addps   -48(%rcx), %xmm0
-            movaps  %xmm0, -48(%rax)
-            movaps  -32(%rax), %xmm0
-            addps   -32(%rcx), %xmm0
-            movaps  %xmm0, -32(%rax)
-            movaps  -16(%rax), %xmm0
-            addps   -16(%rcx), %xmm0
-            movaps  %xmm0, -16(%rax)
-            cmpq    %rax, %rsi
-            jne     .L631
+            u64 time0 = Time::us();
+            grid.build(scene, threads);
+            u64 time1 = Time::us();
+            neighbors += grid.query(densities.data(), threads);
+            u64 time2 = Time::us();
 
-            */
+            build += time1 - time0;
+            query += time2 - time1;
+            queries += scene.count;
         }
-    };
 
-} // namespace
+        build = std::max(build, u64(1));
+        query = std::max(query, u64(1));
+
+        printf("%-9s %6d %9.2f %9.2f %9.2f %9.1f\n", "", threads, build / 1000.0 / frames,
+            query / 1000.0 / frames, double(queries) / query, double(neighbors) / std::max(queries, size_t(1)));
+    }
+}
 
 // ----------------------------------------------------------------------
 // main()
@@ -290,46 +2849,197 @@ namespace method4
 
 int main(int argc, const char* argv[])
 {
-    const int count = 1000 * 1000;
+    int count = 1000 * 1000;
+
+    int max_threads = std::max(1, int(std::thread::hardware_concurrency()));
+
+    // the same seed gives the same particles in every run and layout
+    u64 seed = 1;
+
+    // bytes ahead in every array, and frames per pass over the memory
+    std::vector<int> distances;
+    std::vector<int> fused;
+
+    // particles for the grid
+    std::vector<int> grid_counts;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+        {
+            max_threads = std::max(1, std::atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+        {
+            seed = std::strtoull(argv[++i], nullptr, 0);
+        }
+        else if (!strcmp(argv[i], "--count") && i + 1 < argc)
+        {
+            // a multiple of the largest block
+            count = std::max(64, std::atoi(argv[++i]) / 64 * 64);
+        }
+        else if (!strcmp(argv[i], "--grid") && i + 1 < argc)
+        {
+            grid_counts.push_back(std::max(64, std::atoi(argv[++i]) / 64 * 64));
+        }
+        else if (!strcmp(argv[i], "--prefetch") && i + 1 < argc)
+        {
+            distances.push_back(std::max(1, std::atoi(argv[++i])));
+        }
+        else if (!strcmp(argv[i], "--fuse") && i + 1 < argc)
+        {
+            fused.push_back(std::max(1, std::atoi(argv[++i])));
+        }
+        else
+        {
+            printf("Unknown argument: %s (usage: [--threads N] [--seed N] [--count PARTICLES] [--grid PARTICLES]... [--prefetch BYTES]... [--fuse FRAMES]...)\n", argv[i]);
+            exit(1);
+        }
+    }
 
-    method1::Scene scene1(count);
-    method2::Scene scene2(count);
-    method3::Scene scene3(count);
-    method4::Scene scene4(count);
+    if (distances.empty())
+        distances = { 256, 1024, 4096 };
 
-    u64 time1 = 0;
-    u64 time2 = 0;
-    u64 time3 = 0;
-    u64 time4 = 0;
+    if (fused.empty())
+        fused = { 2, 4, 8 };
 
-    Timer timer;
+    if (grid_counts.empty())
+        grid_counts = { count };
+
+    u64 time0 = Time::us();
+
+    method1::Scene scene1(count, seed, max_threads);
+    method2::Scene scene2(count, seed, max_threads);
+    method3::Scene scene3(count, seed, max_threads);
+    method4::Scene scene4(count, seed, max_threads);
+    method5::Scene scene5(count, seed, max_threads);
+    method6::Scene scene6(count, seed, max_threads);
+
+    u64 time1 = Time::us();
+    printf("Scenes of %d particles from seed %llu in %.1f ms with %d threads\n", count,
+        (unsigned long long) seed, (time1 - time0) / 1000.0, max_threads);
 
     const int frames = 60;
-    for (int i = 0; i < frames; ++i)
+
+    PerfCounters counters;
+
+    printf("Rendered %d frames of %d particles on one thread, times per frame in ms\n", frames, count);
+    if (!counters.available())
+        printf("The hardware performance counters are not available\n");
+    printf("--------------------------------------------------------------------------------------\n");
+    printf("            median      p95      min     mean      fps    GB/s    IPC  LLC miss   GB/s\n");
+    printf("--------------------------------------------------------------------------------------\n");
+
+    test_profile("method1", scene1, counters, frames);
+    test_profile("method2", scene2, counters, frames);
+    test_profile("method3", scene3, counters, frames);
+    test_profile("method4", scene4, counters, frames);
+
+    // method5 once with every ISA that the CPU has
+    std::vector<method5::Isa> kernels = method5::get_kernels();
+
+    for (const auto& isa : kernels)
+    {
+        std::string name = std::string("m5-") + isa.name;
+        scene5.isa = isa;
+        test_profile(name.c_str(), scene5, counters, frames);
+    }
+
+    // method6 with the scalar and SIMD decoding
+    std::vector<method6::Isa> quantized_kernels = method6::get_kernels();
+
+    for (const auto& isa : quantized_kernels)
     {
-        u64 s0 = timer.ms();
-        scene1.transform();
+        std::string name = std::string("m6-") + isa.name;
+        scene6.isa = isa;
+        test_profile(name.c_str(), scene6, counters, frames);
+    }
+
+    printf("\nMemory footprint of the scenes against the transform with %d threads\n", max_threads);
+    printf("----------------------------------------------------\n");
+    printf("                 MB  bytes/p       fps              \n");
+    printf("----------------------------------------------------\n");
+
+    test_footprint("method1", scene1, count, max_threads, frames);
+    test_footprint("method2", scene2, count, max_threads, frames);
+    test_footprint("method3", scene3, count, max_threads, frames);
+    test_footprint("method4", scene4, count, max_threads, frames);
+    test_footprint("method5", scene5, count, max_threads, frames);
+    test_footprint("method6", scene6, count, max_threads, frames);
 
-        u64 s1 = timer.ms();
-        scene2.transform();
+    // the emission replaces about as many particles as expire
+    Physics physics;
+    physics.emit = size_t(count * physics.dt / (physics.lifetime * 0.5f));
 
-        u64 s2 = timer.ms();
-        scene3.transform();
+    printf("\nStepped %d frames with gravity, drag, collisions, expiry and emission in...\n", frames);
+    test_step("method1", scene1, physics, frames);
+    test_step("method2", scene2, physics, frames);
+    test_step("method3", scene3, physics, frames);
+    test_step("method4", scene4, physics, frames);
+    test_step("method5", scene5, physics, frames);
+    test_step("method6", scene6, physics, frames);
 
-        u64 s3 = timer.ms();
-        scene4.transform();
+    std::vector<int> thread_counts;
+    for (int threads = 1; threads < max_threads; threads *= 2)
+    {
+        thread_counts.push_back(threads);
+    }
+    thread_counts.push_back(max_threads);
 
-        u64 s4 = timer.ms();
+    printf("\nGB/s are of the memory the transform reads and writes, scaling is against 1 thread\n");
+    printf("----------------------------------------------------\n");
+    printf("         threads       fps     GB/s  scaling        \n");
+    printf("----------------------------------------------------\n");
 
-        time1 += (s1 - s0);
-        time2 += (s2 - s1);
-        time3 += (s3 - s2);
-        time4 += (s4 - s3);
+    test_scaling("method1", scene1, thread_counts, frames);
+    test_scaling("method2", scene2, thread_counts, frames);
+    test_scaling("method3", scene3, thread_counts, frames);
+    test_scaling("method4", scene4, thread_counts, frames);
+
+    for (const auto& isa : kernels)
+    {
+        std::string name = std::string("m5-") + isa.name;
+        scene5.isa = isa;
+        test_scaling(name.c_str(), scene5, thread_counts, frames);
     }
 
-    printf("Rendered %d frames in...\n", frames);
-    printf("time: %d ms (%d fps)\n", int(time1), int(frames * 1000 / time1));
-    printf("time: %d ms (%d fps)\n", int(time2), int(frames * 1000 / time2));
-    printf("time: %d ms (%d fps)\n", int(time3), int(frames * 1000 / time3));
-    printf("time: %d ms (%d fps)\n", int(time4), int(frames * 1000 / time4));
+    test_scaling("method6", scene6, thread_counts, frames);
+
+    Roofline roofline = measure_roofline(max_threads, 10);
+
+    printf("\nSTREAM with %d threads, best of 10 runs: copy %.2f GB/s, scale %.2f GB/s, add %.2f GB/s, triad %.2f GB/s\n",
+        max_threads, roofline.copy, roofline.scale, roofline.add, roofline.triad);
+    printf("The roofline is %.2f GB/s; the prefetch distance is in bytes per array\n", roofline.limit());
+    printf("----------------------------------------------------\n");
+    printf("          variant              fps     GB/s  roofline\n");
+    printf("----------------------------------------------------\n");
+
+    scene5.isa = kernels.back();
+
+    test_variants("method1", scene1, roofline, max_threads, frames, distances, fused);
+    test_variants("method2", scene2, roofline, max_threads, frames, distances, fused);
+#if defined(__SSE__)
+    test_stream("method2", scene2, roofline, max_threads, frames);
+#endif
+    test_variants("method3", scene3, roofline, max_threads, frames, distances, fused);
+#if defined(__SSE__)
+    test_stream("method3", scene3, roofline, max_threads, frames);
+#endif
+    test_variants("method4", scene4, roofline, max_threads, frames, distances, fused);
+#if defined(__SSE__)
+    test_stream("method4", scene4, roofline, max_threads, frames);
+#endif
+    test_variants("method5", scene5, roofline, max_threads, frames, distances, fused);
+    test_stream("method5", scene5, roofline, max_threads, frames);
+    test_variants("method6", scene6, roofline, max_threads, frames, distances, fused);
+
+    printf("\nUniform grid in Morton order, built and queried after every physics step; times in ms\n");
+    printf("----------------------------------------------------\n");
+    printf("         threads     build     query  Mquery/s neighbors\n");
+    printf("----------------------------------------------------\n");
+
+    for (int grid_count : grid_counts)
+    {
+        test_grid(grid_count, seed, thread_counts, 10);
+    }
 }
@@ -27,6 +27,17 @@ void print(const Path& path)
     printf("\n");
 }
 
+// sum of every byte in the memory to validate the memory mapping
+u32 checksum(ConstMemory memory)
+{
+    u64 sum = 0;
+    for (u64 i = 0; i < memory.size; ++i)
+    {
+        sum += memory.address[i];
+    }
+    return u32(sum);
+}
+
 void print(const File& file)
 {
     printf("[file] %s + %s, size: %" PRIu64 " bytes \n", 
@@ -34,14 +45,7 @@ void print(const File& file)
         file.filename().c_str(), 
         u64(file.size()));
 
-    // sum of every byte in the file to validate the memory mapping
-    u64 sum = 0;
-    ConstMemory memory = file;
-    for (u64 i = 0; i < memory.size; ++i)
-    {
-        sum += memory.address[i];
-    }
-    printf("    checksum: %d\n", u32(sum));
+    printf("    checksum: %d\n", checksum(file));
 
     printf("\n");
 }
@@ -326,6 +330,75 @@ void test28()
 #endif
 }
 
+// parallel decompression
+
+void collect(std::vector<std::string>& filenames, const Path& path, const std::string& prefix)
+{
+    for (auto node : path)
+    {
+        // directory names end with '/' so they can be appended as such; this also
+        // walks into containers nested in the zip
+        if (node.isDirectory())
+            collect(filenames, Path(path, node.name), prefix + node.name);
+        else
+            filenames.push_back(prefix + node.name);
+    }
+}
+
+// the members of a zip are compressed independently of each other, so they are
+// decompressed at the same time with one task per member
+void testParallel(const Path& path)
+{
+    std::vector<std::string> filenames;
+    collect(filenames, path, "");
+    printf("[path] %s, %d members\n", path.pathname().c_str(), int(filenames.size()));
+
+    std::vector<u32> serial(filenames.size());
+    std::vector<u32> parallel(filenames.size());
+
+    u64 time0 = Time::us();
+
+    for (size_t i = 0; i < filenames.size(); ++i)
+    {
+        File file(path, filenames[i]);
+        serial[i] = checksum(file);
+    }
+
+    u64 time1 = Time::us();
+
+    ConcurrentQueue q("pathtest");
+
+    for (size_t i = 0; i < filenames.size(); ++i)
+    {
+        q.enqueue([&, i]
+        {
+            File file(path, filenames[i]);
+            parallel[i] = checksum(file);
+        });
+    }
+
+    q.wait();
+
+    u64 time2 = Time::us();
+
+    printf("    serial:   %d us\n", int(time1 - time0));
+    printf("    parallel: %d us\n", int(time2 - time1));
+    printf("    checksums %s\n", serial == parallel ? "match" : "DO NOT MATCH");
+    printf("\n");
+}
+
+void test29()
+{
+    Path path("data/kokopaska.zip/");
+    testParallel(path);
+}
+
+void test30()
+{
+    Path path("data/outer.zip/data/inner.zip/");
+    testParallel(path);
+}
+
 // -----------------------------------------------------------------------------------
 // main()
 // -----------------------------------------------------------------------------------
@@ -365,6 +438,8 @@ int main(int argc, char *argv[])
     MAKE_TEST(26);
     MAKE_TEST(27);
     MAKE_TEST(28);
+    MAKE_TEST(29);
+    MAKE_TEST(30);
 
     printf("---------------------------------- done\n\n");
 }
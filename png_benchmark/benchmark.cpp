@@ -2,17 +2,27 @@
     MANGO Multimedia Development Platform
     Copyright (C) 2012-2019 Twilight Finland 3D Oy Ltd. All rights reserved.
 */
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
 #include <mango/mango.hpp>
+#include "../common/benchmark.hpp"
 
 using namespace mango;
 using namespace mango::filesystem;
 
+using benchmark::Image;
+
 #define ENABLE_LIBPNG
 #define ENABLE_LODEPNG
 //#define ENABLE_SPNG
 #define ENABLE_STB
 #define ENABLE_MANGO
 
+// Every library decodes to 8 bit RGBA and encodes from the same RGBA image in memory.
+// Encoders take a zlib style compression level, or benchmark::DEFAULT_LEVEL for the library's default.
+
 // ----------------------------------------------------------------------
 // libpng
 // ----------------------------------------------------------------------
@@ -23,27 +33,65 @@ using namespace mango::filesystem;
 
 struct png_source
 {
-    u8* data;
-    int size;
-    int offset;
+    const u8* data;
+    size_t size;
+    size_t offset;
 };
 
 static void png_read_callback(png_structp png_ptr, png_bytep data, png_size_t length)
 {
     png_source* source = (png_source*) png_get_io_ptr(png_ptr);
+    if (length > source->size - source->offset)
+    {
+        // truncated file; png_error() does not return
+        png_error(png_ptr, "read past the end of the data");
+    }
     std::memcpy(data, source->data + source->offset, length);
     source->offset += length;
 }
 
-void load_libpng(Memory memory)
+// decode to 8 bit RGBA like the other decoders in this benchmark
+static void png_set_rgba_transforms(png_structp png_ptr, png_infop info_ptr)
+{
+    png_byte color_type = png_get_color_type(png_ptr, info_ptr);
+    png_byte bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+
+    png_set_expand(png_ptr);
+    if (bit_depth == 16)
+        png_set_strip_16(png_ptr);
+    if (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+        png_set_gray_to_rgb(png_ptr);
+    png_set_add_alpha(png_ptr, 0xff, PNG_FILLER_AFTER);
+}
+
+Image decode_libpng(ConstMemory memory)
 {
     png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png_ptr)
+        return Image();
 
     png_infop info_ptr = png_create_info_struct(png_ptr);
+    if (!info_ptr)
+    {
+        png_destroy_read_struct(&png_ptr, NULL, NULL);
+        return Image();
+    }
+
+    // modified after setjmp() so these must be volatile
+    u8* volatile image = nullptr;
+    png_bytep* volatile row_pointers = nullptr;
+
+    if (setjmp(png_jmpbuf(png_ptr)))
+    {
+        free(row_pointers);
+        free(image);
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        return Image();
+    }
 
     png_source source;
     source.data = memory.address + 8;
-    source.size = memory.size;
+    source.size = memory.size > 8 ? memory.size - 8 : 0;
     source.offset = 0;
     png_set_read_fn(png_ptr, &source, png_read_callback);
 
@@ -52,85 +100,194 @@ void load_libpng(Memory memory)
 
     int width = png_get_image_width(png_ptr, info_ptr);
     int height = png_get_image_height(png_ptr, info_ptr);
-    png_byte color_type = png_get_color_type(png_ptr, info_ptr);
-    png_byte bit_depth = png_get_bit_depth(png_ptr, info_ptr);
 
-    int number_of_passes = png_set_interlace_handling(png_ptr);
+    png_set_rgba_transforms(png_ptr, info_ptr);
+    png_set_interlace_handling(png_ptr);
     png_read_update_info(png_ptr, info_ptr);
 
-    int stride = png_get_rowbytes(png_ptr, info_ptr);
-    u8* image = (u8*)malloc(stride * height);
-    png_bytep *row_pointers = (png_bytep*) malloc(sizeof(png_bytep) * height);
-
+    size_t stride = png_get_rowbytes(png_ptr, info_ptr);
+    image = (u8*)malloc(stride * height);
+    row_pointers = (png_bytep*) malloc(sizeof(png_bytep) * height);
 
-    for (int y=0; y<height; y++)
+    for (int y = 0; y < height; y++)
     {
         row_pointers[y] = image + stride * y;
     }
 
     png_read_image(png_ptr, row_pointers);
+    png_read_end(png_ptr, NULL);
 
     free(row_pointers);
-    free(image);
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+
+    return benchmark::make_image(image, width, height, int(stride), 4, free);
 }
 
-void save_libpng(const Bitmap& bitmap)
+// The decoded image goes into this buffer, which is only reallocated when an image is
+// larger than any before it, so repeated decoding doesn't measure the allocator.
+// Every thread has its own for the corpus mode.
+static thread_local std::vector<u8> g_libpng_image;
+
+// simplified API, reads straight from the memory
+Image decode_libpng_simplified(ConstMemory memory)
 {
+    png_image image;
+    std::memset(&image, 0, sizeof(image));
+    image.version = PNG_IMAGE_VERSION;
+
+    if (!png_image_begin_read_from_memory(&image, memory.address, memory.size))
+        return Image();
 
-    const char* filename = "output-libpng.png";
+    image.format = PNG_FORMAT_RGBA;
+    size_t size = PNG_IMAGE_SIZE(image);
+    if (g_libpng_image.size() < size)
+        g_libpng_image.resize(size);
 
-    int width = bitmap.width;
-    int height = bitmap.height;
+    // finish_read frees the image also on failure
+    if (!png_image_finish_read(&image, NULL, g_libpng_image.data(), 0, NULL))
+        return Image();
 
-    std::vector<u8*> row_pointer_array(height);
-    for (int y = 0; y < height; ++y)
+    return benchmark::view_image(g_libpng_image.data(), image.width, image.height, PNG_IMAGE_ROW_STRIDE(image), 4);
+}
+
+// progressive reader: the whole buffer is given to libpng at once, so the compressed data
+// is not copied out of the mapped file first
+struct png_progressive
+{
+    u8* image;
+    int width;
+    int height;
+    size_t stride;
+    bool complete; // the end callback was called, so no rows are missing
+};
+
+static void png_progressive_info(png_structp png_ptr, png_infop info_ptr)
+{
+    png_progressive* state = (png_progressive*) png_get_progressive_ptr(png_ptr);
+
+    png_set_rgba_transforms(png_ptr, info_ptr);
+    png_set_interlace_handling(png_ptr);
+    png_read_update_info(png_ptr, info_ptr);
+
+    state->width = png_get_image_width(png_ptr, info_ptr);
+    state->height = png_get_image_height(png_ptr, info_ptr);
+    state->stride = png_get_rowbytes(png_ptr, info_ptr);
+
+    size_t size = state->stride * state->height;
+    if (g_libpng_image.size() < size)
+        g_libpng_image.resize(size);
+    state->image = g_libpng_image.data();
+}
+
+static void png_progressive_row(png_structp png_ptr, png_bytep row, png_uint_32 y, int /*pass*/)
+{
+    png_progressive* state = (png_progressive*) png_get_progressive_ptr(png_ptr);
+
+    // interlaced passes give null for rows that don't change
+    if (row)
+    {
+        png_progressive_combine_row(png_ptr, state->image + state->stride * y, row);
+    }
+}
+
+// libpng calls this at the IEND chunk after all of the image data, which a truncated file never reaches
+static void png_progressive_end(png_structp png_ptr, png_infop /*info_ptr*/)
+{
+    png_progressive* state = (png_progressive*) png_get_progressive_ptr(png_ptr);
+    state->complete = true;
+}
+
+// the image is decoded into g_libpng_image
+Image decode_libpng_progressive(ConstMemory memory)
+{
+    png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png_ptr)
+        return Image();
+
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+    if (!info_ptr)
+    {
+        png_destroy_read_struct(&png_ptr, NULL, NULL);
+        return Image();
+    }
+
+    if (setjmp(png_jmpbuf(png_ptr)))
     {
-        row_pointer_array[y] = bitmap.address(0, y);
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        return Image();
     }
 
-    u8** row_pointers = row_pointer_array.data();
+    png_progressive state;
+    state.image = nullptr;
+    state.width = 0;
+    state.height = 0;
+    state.stride = 0;
+    state.complete = false;
 
-    FILE *fp = fopen(filename, "wb");
-    if(!fp)
-        abort();
+    png_set_progressive_read_fn(png_ptr, &state, png_progressive_info, png_progressive_row, png_progressive_end);
+    png_process_data(png_ptr, info_ptr, const_cast<u8*>(memory.address), memory.size);
 
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+
+    if (!state.complete)
+        return Image();
+
+    return benchmark::view_image(state.image, state.width, state.height, int(state.stride), 4);
+}
+
+static void png_write_callback(png_structp png_ptr, png_bytep data, png_size_t length)
+{
+    std::vector<u8>* output = (std::vector<u8>*) png_get_io_ptr(png_ptr);
+    output->insert(output->end(), data, data + length);
+}
+
+static void png_flush_callback(png_structp /*png_ptr*/)
+{
+}
+
+bool encode_libpng(std::vector<u8>& output, const Image& image, int level)
+{
     png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
     if (!png)
-        abort();
+        return false;
 
     png_infop info = png_create_info_struct(png);
-    if (!info) abort();
+    if (!info)
+    {
+        png_destroy_write_struct(&png, NULL);
+        return false;
+    }
 
     if (setjmp(png_jmpbuf(png)))
-        abort();
-
-    png_init_io(png, fp);
-
-    // Output is 8bit depth, RGBA format.
-    png_set_IHDR(
-        png,
-        info,
-        width, height,
-        8,
-        PNG_COLOR_TYPE_RGBA,
-        PNG_INTERLACE_NONE,
-        PNG_COMPRESSION_TYPE_DEFAULT,
-        PNG_FILTER_TYPE_DEFAULT
-    );
-    png_write_info(png, info);
+    {
+        png_destroy_write_struct(&png, &info);
+        return false;
+    }
 
-    // To remove the alpha channel for PNG_COLOR_TYPE_RGB format,
-    // Use png_set_filler().
-    //png_set_filler(png, 0, PNG_FILLER_AFTER);
+    png_set_write_fn(png, &output, png_write_callback, png_flush_callback);
 
-    png_write_image(png, row_pointers);
-    png_write_end(png, NULL);
+    if (level != benchmark::DEFAULT_LEVEL)
+        png_set_compression_level(png, level);
+
+    int color_type = image.components == 4 ? PNG_COLOR_TYPE_RGBA : PNG_COLOR_TYPE_RGB;
+    png_set_IHDR(png, info, image.width, image.height, 8, color_type, PNG_INTERLACE_NONE,
+        PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
 
-    fclose(fp);
+    for (int y = 0; y < image.height; ++y)
+    {
+        png_write_row(png, image.row(y));
+    }
 
+    png_write_end(png, NULL);
     png_destroy_write_struct(&png, &info);
+    return true;
 }
 
+static benchmark::Plugin libpng_plugin({ "libpng", ".png", decode_libpng, encode_libpng });
+static benchmark::Plugin libpng_simplified_plugin({ "libpng-s", ".png", decode_libpng_simplified, nullptr });
+static benchmark::Plugin libpng_progressive_plugin({ "libpng-p", ".png", decode_libpng_progressive, nullptr });
+
 #endif
 
 // ----------------------------------------------------------------------
@@ -141,19 +298,167 @@ void save_libpng(const Bitmap& bitmap)
 
 #include "lodepng/lodepng.h"
 
-void load_lodepng(Memory memory)
+Image decode_lodepng(ConstMemory memory)
 {
     u32 width, height;
-    u8* image;
-    int error = lodepng_decode32(&image, &width, &height, memory.address, memory.size);
-    free(image);
+    u8* image = nullptr;
+    unsigned error = lodepng_decode32(&image, &width, &height, memory.address, memory.size);
+    if (error)
+    {
+        free(image);
+        return Image();
+    }
+
+    return benchmark::make_image(image, width, height, width * 4, 4, free);
+}
+
+// lodepng hands out the independent parts of decoding, like the Adam7 passes, through this
+static void lodepng_parallel(void (*task)(void* data, unsigned index), void* data, unsigned count,
+                             const void* /*context*/)
+{
+    ConcurrentQueue q("lodepng");
+
+    for (unsigned i = 0; i < count; ++i)
+    {
+        q.enqueue([=]
+        {
+            task(data, i);
+        });
+    }
+
+    q.wait();
+}
+
+Image decode_lodepng_parallel(ConstMemory memory)
+{
+    LodePNGState state;
+    lodepng_state_init(&state);
+    state.decoder.custom_parallel = lodepng_parallel;
+
+    u32 width, height;
+    u8* image = nullptr;
+    unsigned error = lodepng_decode(&image, &width, &height, &state, memory.address, memory.size);
+
+    lodepng_state_cleanup(&state);
+
+    if (error)
+    {
+        free(image);
+        return Image();
+    }
+
+    return benchmark::make_image(image, width, height, width * 4, 4, free);
+}
+
+// the streaming decoder, into a surface of our own; it needs a few rows of memory on top of it
+Image decode_lodepng_stream(ConstMemory memory)
+{
+    LodePNGState state;
+    lodepng_state_init(&state);
+
+    u32 width, height;
+    u8* image = nullptr;
+    unsigned error = lodepng_inspect(&width, &height, &state, memory.address, memory.size);
+    if (!error)
+    {
+        image = reinterpret_cast<u8*>(malloc(size_t(width) * height * 4));
+        error = image ? lodepng_decode_into(image, width * 4, width, height, &state, memory.address, memory.size) : 83;
+    }
+
+    lodepng_state_cleanup(&state);
+
+    if (error)
+    {
+        free(image);
+        return Image();
+    }
+
+    return benchmark::make_image(image, width, height, width * 4, 4, free);
 }
 
-void save_lodepng(const Bitmap& bitmap)
+// The streaming decoder must not accept image data that ends before the zlib stream does, or
+// zlib data that goes on after it. The file is decoded with its last IDAT chunk cut in half and
+// with zeros added to it; returns the damage that decoded anyway, or nullptr.
+const char* check_lodepng_stream(ConstMemory memory)
 {
-    lodepng_encode32_file("output-lodepng.png", bitmap.image, bitmap.width, bitmap.height);
+    size_t last = 0;
+    for (size_t offset = 8; offset + 12 <= memory.size; offset += 12 + size_t(lodepng_chunk_length(memory.address + offset)))
+    {
+        if (lodepng_chunk_type_equals(memory.address + offset, "IDAT"))
+            last = offset;
+    }
+
+    if (!last)
+        return nullptr;
+
+    const u8* chunk = memory.address + last;
+    const size_t length = lodepng_chunk_length(chunk);
+    const u8* after = chunk + 12 + length;
+
+    struct Damage
+    {
+        const char* name;
+        size_t length;
+    };
+
+    const Damage damages[] =
+    {
+        { "a truncated IDAT chunk", length / 2 },
+        { "zeros after the zlib stream", length + 16 },
+    };
+
+    for (const Damage& damage : damages)
+    {
+        std::vector<u8> file(memory.address, chunk + 8 + std::min(length, damage.length));
+        file.resize(last + 8 + damage.length + 4, 0);
+        file.insert(file.end(), after, memory.address + memory.size);
+
+        u8* p = &file[last];
+        p[0] = u8(damage.length >> 24);
+        p[1] = u8(damage.length >> 16);
+        p[2] = u8(damage.length >> 8);
+        p[3] = u8(damage.length);
+        lodepng_chunk_generate_crc(p);
+
+        if (decode_lodepng_stream(ConstMemory(file.data(), file.size())))
+            return damage.name;
+    }
+
+    return nullptr;
+}
+
+bool encode_lodepng(std::vector<u8>& output, const Image& image, int level)
+{
+    // lodepng reads the rows without padding
+    if (image.stride != image.width * image.components)
+        return false;
+
+    LodePNGState state;
+    lodepng_state_init(&state);
+    state.info_raw.colortype = image.components == 4 ? LCT_RGBA : LCT_RGB;
+
+    // same default level as encode_mango() so that the speed/size trade-off is comparable
+    if (level == benchmark::DEFAULT_LEVEL)
+        level = 4;
+    lodepng_compress_settings_set_level(&state.encoder.zlibsettings, level);
+
+    u8* buffer = nullptr;
+    size_t size = 0;
+    unsigned error = lodepng_encode(&buffer, &size, image.pixels.get(), image.width, image.height, &state);
+    if (!error)
+    {
+        output.insert(output.end(), buffer, buffer + size);
+    }
+
+    free(buffer);
+    lodepng_state_cleanup(&state);
+    return !error;
 }
 
+static benchmark::Plugin lodepng_plugin({ "lodepng", ".png", decode_lodepng, encode_lodepng });
+static benchmark::Plugin lodepng_parallel_plugin({ "lodepng-t", ".png", decode_lodepng_parallel, nullptr });
+static benchmark::Plugin lodepng_stream_plugin({ "lodepng-s", ".png", decode_lodepng_stream, nullptr });
+
 #endif
 
 // ----------------------------------------------------------------------
@@ -268,19 +573,17 @@ skip_err:
     return out;
 }
 
-void load_spng(Memory memory)
+Image decode_spng(ConstMemory memory)
 {
     struct spng_ihdr ihdr;
     size_t img_spng_size;
 
-    u8* image = getimage_libspng(memory.address, memory.size, &img_spng_size, SPNG_FMT_RGBA8, 0, &ihdr);
-    free(image);
+    u8* image = getimage_libspng(const_cast<u8*>(memory.address), memory.size, &img_spng_size, SPNG_FMT_RGBA8, 0, &ihdr);
+    return benchmark::make_image(image, ihdr.width, ihdr.height, ihdr.width * 4, 4, free);
 }
 
-void save_spng(const Bitmap& bitmap)
-{
-    // TODO: not supported yet in libspng v0.5.0
-}
+// TODO: encoding is not supported yet in libspng v0.5.0
+static benchmark::Plugin spng_plugin({ "spng", ".png", decode_spng, nullptr });
 
 #endif
 
@@ -296,18 +599,62 @@ void save_spng(const Bitmap& bitmap)
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "../jpeg_benchmark/stb_image_write.h"
 
-void load_stb(Memory memory)
+Image decode_stb(ConstMemory memory)
 {
     int width, height, bpp;
-    u8* image = stbi_load_from_memory(memory.address, memory.size, &width, &height, &bpp, 4);
-    free(image);
+    u8* image = stbi_load_from_memory(memory.address, int(memory.size), &width, &height, &bpp, 4);
+    return benchmark::make_image(image, width, height, width * 4, 4, stbi_image_free);
+}
+
+static void stb_write_callback(void* context, void* data, int size)
+{
+    std::vector<u8>* output = (std::vector<u8>*) context;
+    output->insert(output->end(), (u8*) data, (u8*) data + size);
+}
+
+bool encode_stb(std::vector<u8>& output, const Image& image, int level)
+{
+    // the level is a global in stb; it is only changed, and restored, when a level is asked for
+    // so that the encoders of the corpus threads don't write it
+    int default_level = stbi_write_png_compression_level;
+    if (level != benchmark::DEFAULT_LEVEL)
+        stbi_write_png_compression_level = level;
+
+    int success = stbi_write_png_to_func(stb_write_callback, &output, image.width, image.height,
+        image.components, image.pixels.get(), image.stride);
+
+    if (level != benchmark::DEFAULT_LEVEL)
+        stbi_write_png_compression_level = default_level;
+    return success != 0;
 }
 
-void save_stb(const Bitmap& bitmap)
+// stb hands out bands of rows for choosing the PNG filters through this
+static void stb_parallel(void (*task)(void* data, int index), void* data, int count)
 {
-    stbi_write_png("output-stb.png", bitmap.width, bitmap.height, 4, bitmap.image, bitmap.width * 4);
+    ConcurrentQueue q("stb");
+
+    for (int i = 0; i < count; ++i)
+    {
+        q.enqueue([=]
+        {
+            task(data, i);
+        });
+    }
+
+    q.wait();
 }
 
+bool encode_stb_parallel(std::vector<u8>& output, const Image& image, int level)
+{
+    stbi_write_png_parallel = stb_parallel;
+    bool success = encode_stb(output, image, level);
+    stbi_write_png_parallel = nullptr;
+    return success;
+}
+
+static benchmark::Plugin stb_plugin({ "stb", ".png", decode_stb, encode_stb });
+static benchmark::Plugin stb_parallel_plugin({ "stb-t", ".png", nullptr, encode_stb_parallel });
+
 #endif
 
 // ----------------------------------------------------------------------
@@ -316,92 +663,539 @@ void save_stb(const Bitmap& bitmap)
 
 #if defined(ENABLE_MANGO)
 
-void load_mango(Memory memory)
+Image decode_mango(ConstMemory memory)
 {
-    // low-level decoding from memory
-    /*
-    ImageDecoder decoder(memory, ".png");
-
-    ImageHeader header = decoder.header();
-    Bitmap bitmap(header.width, header.height, header.format);
-
-    ImageDecodeOptions options;
-    decoder.decode(bitmap, options);
-    */
-
-    // higher-level "easy way"
-    Bitmap bitmap(memory, ".png");
+    // the bitmap stride may have padding
+    return benchmark::decode_bitmap(memory, ".png", 4);
 }
 
-void save_mango(const Bitmap& bitmap)
+bool encode_mango(std::vector<u8>& output, const Image& image, int level)
 {
     ImageEncodeOptions options;
-    options.compression = 4;
-    bitmap.save("output-mango.png", options);
+    options.compression = level == benchmark::DEFAULT_LEVEL ? 4 : level;
+    return benchmark::encode_bitmap(output, image, ".png", options);
 }
 
+static benchmark::Plugin mango_plugin({ "mango", ".png", decode_mango, encode_mango });
+
 #endif
 
 // ----------------------------------------------------------------------
-// main()
+// corpus
 // ----------------------------------------------------------------------
 
-template <typename Load, typename Save>
-void test(const char* name, Load load, Save save, Memory memory, const Bitmap& bitmap)
+// The corpus and the level sweep compare one decoder and one encoder of every library.
+// The variants that run in parallel themselves would compete with the corpus threads.
+static const std::vector<std::string> LIBRARY_DECODERS = { "libpng-p", "lodepng", "spng", "stb", "mango" };
+static const std::vector<std::string> LIBRARY_ENCODERS = { "libpng", "lodepng", "stb", "mango" };
+
+// the registered codecs of the names, in the same order; the disabled libraries are skipped
+static std::vector<const benchmark::Codec*> find_codecs(const std::vector<std::string>& names, bool encoder)
+{
+    std::vector<const benchmark::Codec*> result;
+
+    for (const auto& name : names)
+    {
+        for (const auto& codec : benchmark::codecs())
+        {
+            if (name == codec.name && (encoder ? codec.encode != nullptr : codec.decode != nullptr))
+                result.push_back(&codec);
+        }
+    }
+
+    return result;
+}
+
+struct CorpusImage
 {
-    printf("%s", name);
+    std::string name;
+    std::string format; // color type, bit depth and interlacing from the IHDR chunk
+    std::vector<u8> data; // the PNG file
+    Image image; // RGBA reference, the input for the encoders
+};
+
+static std::string get_png_format(const std::vector<u8>& data)
+{
+    if (data.size() < 29)
+        return "invalid";
+
+    const char* type = "unknown";
+    switch (data[25])
+    {
+        case 0: type = "grey"; break;
+        case 2: type = "rgb"; break;
+        case 3: type = "palette"; break;
+        case 4: type = "grey-alpha"; break;
+        case 6: type = "rgba"; break;
+    }
+
+    std::string format = std::string(type) + "/" + std::to_string(data[24]);
+    if (data[28])
+        format += " adam7";
+    return format;
+}
+
+// every image is kept in memory, compressed and decoded, so that only the codecs are measured
+void load_corpus(std::vector<CorpusImage>& corpus, const Path& path)
+{
+    for (auto node : path)
+    {
+        if (node.isDirectory())
+        {
+            std::string name = node.name;
+            if (name.empty() || name.back() != '/')
+                name += '/';
+
+            Path child(path, name);
+            load_corpus(corpus, child);
+            continue;
+        }
+
+        std::string extension = filesystem::getExtension(node.name);
+        std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+        if (extension != ".png")
+            continue;
+
+        File file(path, node.name);
+        ConstMemory memory = file;
+
+        CorpusImage image;
+        image.name = path.pathname() + node.name;
+        image.data.assign(memory.address, memory.address + memory.size);
+        image.format = get_png_format(image.data);
+
+        image.image = benchmark::load_reference(ConstMemory(image.data.data(), image.data.size()), ".png", 4);
+        if (!image.image)
+        {
+            printf("skipped: %s (can't decode)\n", image.name.c_str());
+            continue;
+        }
+
+        corpus.push_back(std::move(image));
+    }
+}
+
+// runs function(index) for every image, on the given number of tasks in a ConcurrentQueue,
+// and returns the wall clock time in microseconds
+template <typename Function>
+u64 run_corpus(size_t count, int threads, Function function)
+{
+    ConcurrentQueue q("png corpus");
+    std::atomic<size_t> next { 0 };
+
     u64 time0 = Time::us();
 
-    load(memory);
+    for (int i = 0; i < threads; ++i)
+    {
+        q.enqueue([&]
+        {
+            for (size_t index = next++; index < count; index = next++)
+            {
+                function(index);
+            }
+        });
+    }
 
-    u64 time1 = Time::us();
+    q.wait();
 
-    save(bitmap);
+    return std::max(Time::us() - time0, u64(1));
+}
 
-    u64 time2 = Time::us();
-    printf("%7d.%d ms ", int((time1 - time0) / 1000), int((time1 - time0) % 10));
-    printf("%7d.%d ms ", int((time2 - time1) / 1000), int((time2 - time1) % 10));
+// time and bytes per image format, for one codec
+struct FormatTotals
+{
+    int images = 0;
+    u64 time = 0;
+    size_t bytes = 0;
+};
+
+void print_formats(const char* title, const std::vector<const benchmark::Codec*>& codecs,
+                   const std::vector<CorpusImage>& corpus, const std::vector<std::vector<u64>>& times)
+{
+    std::vector<std::string> formats;
+    for (const auto& image : corpus)
+    {
+        if (std::find(formats.begin(), formats.end(), image.format) == formats.end())
+            formats.push_back(image.format);
+    }
+    std::sort(formats.begin(), formats.end());
+
+    printf("\n%s MB/s per format (1 thread)\n", title);
+    printf("%-18s %6s", "format", "images");
+    for (const auto* codec : codecs)
+    {
+        printf(" %9s", codec->name);
+    }
     printf("\n");
+
+    for (const auto& format : formats)
+    {
+        printf("%-18s", format.c_str());
+
+        for (size_t c = 0; c < codecs.size(); ++c)
+        {
+            FormatTotals totals;
+            for (size_t i = 0; i < corpus.size(); ++i)
+            {
+                if (corpus[i].format == format)
+                {
+                    ++totals.images;
+                    totals.time += times[c][i];
+                    totals.bytes += corpus[i].image.bytes();
+                }
+            }
+
+            if (c == 0)
+                printf(" %6d", totals.images);
+
+            printf(" %9.1f", double(totals.bytes) / std::max(totals.time, u64(1)));
+        }
+        printf("\n");
+    }
 }
 
+// Only the library call is timed, the checksum of the pixels is computed after it.
+// The single threaded time of every image goes into the results for the reports.
+void test_corpus(std::vector<benchmark::Result>& results, const char* pathname, int max_threads)
+{
+    std::vector<const benchmark::Codec*> decoders = find_codecs(LIBRARY_DECODERS, false);
+    std::vector<const benchmark::Codec*> encoders = find_codecs(LIBRARY_ENCODERS, true);
+
+    std::vector<CorpusImage> corpus;
+
+    std::string name = pathname;
+    if (name.empty() || name.back() != '/')
+        name += '/';
+
+    Path path(name);
+    load_corpus(corpus, path);
+
+    if (corpus.empty() || decoders.empty())
+    {
+        printf("No PNG images in %s\n", name.c_str());
+        return;
+    }
+
+    size_t compressed = 0;
+    size_t decompressed = 0;
+    for (const auto& image : corpus)
+    {
+        compressed += image.data.size();
+        decompressed += image.image.bytes();
+    }
+
+    printf("corpus: %d images, %d MB compressed, %d MB as RGBA\n", int(corpus.size()),
+        int(compressed >> 20), int(decompressed >> 20));
+
+    std::vector<int> thread_counts;
+    for (int threads = 1; threads < max_threads; threads *= 2)
+    {
+        thread_counts.push_back(threads);
+    }
+    thread_counts.push_back(max_threads);
+
+    const size_t count = corpus.size();
+
+    // per codec and image, from the single threaded runs
+    std::vector<std::vector<u64>> decode_times(decoders.size(), std::vector<u64>(count));
+    std::vector<std::vector<u64>> encode_times(encoders.size(), std::vector<u64>(count));
+    std::vector<std::vector<u64>> checksums(decoders.size(), std::vector<u64>(count));
+    std::vector<std::vector<size_t>> sizes(encoders.size(), std::vector<size_t>(count));
+
+    printf("\nMB/s are of RGBA pixels (10^6 bytes), scaling is against 1 thread\n");
+    printf("-----------------------------------------------------------------------\n");
+    printf("                  threads   images/s       MB/s   scaling      ratio  \n");
+    printf("-----------------------------------------------------------------------\n");
+
+    for (int encode = 0; encode < 2; ++encode)
+    {
+        const std::vector<const benchmark::Codec*>& codecs = encode ? encoders : decoders;
+
+        for (size_t c = 0; c < codecs.size(); ++c)
+        {
+            const benchmark::Codec& codec = *codecs[c];
+            double single = 0;
+
+            for (int threads : thread_counts)
+            {
+                std::atomic<size_t> encoded { 0 };
+
+                u64 time = run_corpus(count, threads, [&] (size_t index)
+                {
+                    const CorpusImage& image = corpus[index];
+                    ConstMemory memory(image.data.data(), image.data.size());
+
+                    if (encode)
+                    {
+                        // reused, so that the encoders don't grow a new buffer for every image
+                        static thread_local std::vector<u8> output;
+                        output.clear();
+
+                        u64 time0 = Time::us();
+                        bool success = codec.encode(output, image.image, benchmark::DEFAULT_LEVEL);
+                        u64 time1 = Time::us();
+
+                        size_t size = success ? output.size() : 0;
+                        encoded += size;
+                        if (threads == 1)
+                        {
+                            encode_times[c][index] = time1 - time0;
+                            sizes[c][index] = size;
+                        }
+                    }
+                    else
+                    {
+                        u64 time0 = Time::us();
+                        Image decoded = codec.decode(memory);
+                        u64 time1 = Time::us();
+
+                        if (threads == 1)
+                        {
+                            decode_times[c][index] = time1 - time0;
+                            checksums[c][index] = benchmark::checksum(decoded);
+                        }
+                    }
+                });
+
+                double seconds = time / 1000000.0;
+                double images = count / seconds;
+                if (threads == 1)
+                    single = images;
+
+                printf("%-7s %-9s %7d %10.1f %10.1f %9.2f", encode ? "encode" : "decode", codec.name,
+                    threads, images, decompressed / seconds / 1000000.0, images / single);
+                if (encode && encoded)
+                    printf(" %10.2f", double(decompressed) / encoded);
+                printf("\n");
+            }
+
+            for (size_t i = 0; i < count; ++i)
+            {
+                benchmark::Result result;
+                result.image = corpus[i].name;
+                result.codec = codec.name;
+                result.operation = encode ? "encode" : "decode";
+                result.width = corpus[i].image.width;
+                result.height = corpus[i].image.height;
+                result.runs = 1;
+
+                double ms = (encode ? encode_times[c][i] : decode_times[c][i]) / 1000.0;
+                result.time.median = ms;
+                result.time.p95 = ms;
+                result.time.min = ms;
+                result.time.mean = ms;
+
+                result.size = encode ? sizes[c][i] : checksums[c][i] ? corpus[i].data.size() : 0;
+                result.rawsize = corpus[i].image.bytes();
+                result.checksum = encode ? 0 : checksums[c][i];
+                results.push_back(result);
+            }
+        }
+    }
+
+    print_formats("decode", decoders, corpus, decode_times);
+    print_formats("encode", encoders, corpus, encode_times);
+
+    // the first decoder is the reference; the others must decode to the same pixels
+    int mismatches = 0;
+    printf("\n");
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        std::string report;
+
+        for (size_t c = 0; c < decoders.size(); ++c)
+        {
+            if (!checksums[c][i])
+                report += std::string(" ") + decoders[c]->name + " failed";
+            else if (c > 0 && checksums[0][i] && checksums[c][i] != checksums[0][i])
+                report += std::string(" ") + decoders[c]->name + " differs";
+        }
+
+        if (!report.empty())
+        {
+            printf("mismatch: %s (%s):%s\n", corpus[i].name.c_str(), corpus[i].format.c_str(), report.c_str());
+            ++mismatches;
+        }
+    }
+
+    printf("%d images decode differently from %s\n", mismatches, decoders[0]->name);
+}
+
+// ----------------------------------------------------------------------
+// compression level sweep
+// ----------------------------------------------------------------------
+
+void sweep(std::vector<benchmark::Result>& results, const std::string& filename, const Image& reference,
+           const benchmark::Options& options)
+{
+    for (const benchmark::Codec* codec : find_codecs(LIBRARY_ENCODERS, true))
+    {
+        for (int level = 0; level <= 9; ++level)
+        {
+            std::vector<u8> output;
+            bool success = false;
+
+            benchmark::Result result;
+            result.image = filename;
+            result.codec = codec->name;
+            result.operation = "encode";
+            result.level = level;
+            result.width = reference.width;
+            result.height = reference.height;
+            result.runs = options.runs;
+            result.time = benchmark::measure([&]
+            {
+                output.clear();
+                success = codec->encode(output, reference, level);
+            }, options);
+            result.size = success ? output.size() : 0;
+            result.rawsize = reference.bytes();
+            results.push_back(result);
+        }
+    }
+}
+
+// prints every (library, level) from smallest to largest output; the pareto optimal ones,
+// that no other result beats in both median time and size, are marked with a '*'
+void print_pareto(std::vector<benchmark::Result> results)
+{
+    std::sort(results.begin(), results.end(), [] (const benchmark::Result& a, const benchmark::Result& b)
+    {
+        return a.size < b.size || (a.size == b.size && a.time.median < b.time.median);
+    });
+
+    printf("\n");
+    printf("----------------------------------------------------------------\n");
+    printf("           level   median      p95        size   ratio        \n");
+    printf("----------------------------------------------------------------\n");
+
+    for (const auto& a : results)
+    {
+        // failed encodes have no size and don't take part
+        bool pareto = a.size > 0;
+        for (const auto& b : results)
+        {
+            bool as_good = b.time.median <= a.time.median && b.size <= a.size;
+            bool better = b.time.median < a.time.median || b.size < a.size;
+            if (b.size && as_good && better)
+            {
+                pareto = false;
+                break;
+            }
+        }
+
+        printf("%-9s %4d %8.2f %8.2f %8d KB %6.2f %s\n", a.codec.c_str(), a.level,
+            a.time.median, a.time.p95, int(a.size / 1024), benchmark::ratio(a), pareto ? "*" : "");
+    }
+}
+
+// ----------------------------------------------------------------------
+// main()
+// ----------------------------------------------------------------------
+
 int main(int argc, const char* argv[])
 {
     if (argc < 2)
     {
-        printf("Too few arguments. usage: <filename.png>\n");
+        printf("Too few arguments. usage: <filename.png> [--pareto] %s\n", benchmark::OPTIONS_USAGE);
+        printf("                          --corpus <folder|file.zip> [--threads N] [--csv file] [--json file]\n");
         exit(1);
     }
 
-    const char* filename = argv[1];
+    const char* filename = nullptr;
+    const char* corpus = nullptr;
+    int threads = std::max(1, int(std::thread::hardware_concurrency()));
+    bool pareto = false;
 
-    Bitmap bitmap(filename, Format(32, Format::UNORM, Format::RGBA, 8, 8, 8, 8));
+    benchmark::Options options;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "--corpus") && i + 1 < argc)
+        {
+            corpus = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+        {
+            threads = std::max(1, std::atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--pareto"))
+        {
+            pareto = true;
+        }
+        else if (benchmark::parse_option(options, argc, argv, i))
+        {
+        }
+        else if (!filename && argv[i][0] != '-')
+        {
+            filename = argv[i];
+        }
+        else
+        {
+            printf("Unknown argument: %s\n", argv[i]);
+            exit(1);
+        }
+    }
+
+    std::vector<benchmark::Result> results;
+
+    if (corpus)
+    {
+        test_corpus(results, corpus, threads);
+        benchmark::write_reports(results, options);
+        return 0;
+    }
+
+    if (!filename)
+    {
+        printf("No input file.\n");
+        exit(1);
+    }
 
     File file(filename);
     Buffer buffer(file);
 
-    printf("image: %d x %d (%d KB)\n", bitmap.width, bitmap.height, int(file.size() / 1024));
-    printf("----------------------------------------------\n");
-    printf("                load         save             \n");
-    printf("----------------------------------------------\n");
+    Image reference = benchmark::load_reference(buffer, ".png", 4);
+    if (!reference)
+    {
+        printf("Can't decode %s\n", filename);
+        exit(1);
+    }
 
-#if defined ENABLE_LIBPNG
-    test("libpng:  ", load_libpng, save_libpng, buffer, bitmap);
-#endif
+    printf("image: %d x %d (%d KB)\n", reference.width, reference.height, int(file.size() / 1024));
+    printf("runs: %d (+%d warmup), times in ms\n", options.runs, options.warmup);
+    benchmark::print_header();
 
-#if defined ENABLE_LODEPNG
-    test("lodepng: ", load_lodepng, save_lodepng, buffer, bitmap);
-#endif
+    for (const auto& codec : benchmark::codecs())
+    {
+        std::vector<benchmark::Result> codec_results;
+        std::vector<u8> output = benchmark::test(codec_results, codec, filename, buffer, ".png", reference,
+            benchmark::DEFAULT_LEVEL, options);
 
-#if defined(ENABLE_SPNG)
-    test("spng:    ", load_spng, save_spng, buffer, bitmap);
-#endif
+        if (!output.empty())
+        {
+            benchmark::write_file(std::string("output-") + codec.name + ".png", output);
+        }
 
-#if defined(ENABLE_STB)
-    test("stb:     ", load_stb, save_stb, buffer, bitmap);
-#endif
+        benchmark::print_results(codec_results);
+        results.insert(results.end(), codec_results.begin(), codec_results.end());
+    }
 
-#if defined(ENABLE_MANGO)
-    test("mango:   ", load_mango, save_mango, buffer, bitmap);
+#if defined ENABLE_LODEPNG
+    if (const char* damage = check_lodepng_stream(buffer))
+    {
+        printf("lodepng-s decoded the file with %s\n", damage);
+    }
 #endif
 
+    if (pareto)
+    {
+        std::vector<benchmark::Result> levels;
+        sweep(levels, filename, reference, options);
+        print_pareto(levels);
+        results.insert(results.end(), levels.begin(), levels.end());
+    }
+
+    benchmark::write_reports(results, options);
 }
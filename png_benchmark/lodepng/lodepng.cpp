@@ -33,12 +33,27 @@ Rename this file to lodepng.cpp to use it for C++, or to lodepng.c to use it for
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #if defined(_MSC_VER) && (_MSC_VER >= 1310) /*Visual Studio: A few warning types are not desired here.*/
 #pragma warning( disable : 4244 ) /*implicit conversions: not warned by gcc -Wall -Wextra and requires too much casts*/
 #pragma warning( disable : 4996 ) /*VS does not like fopen, but fopen_s is not standard C so unusable here*/
 #endif /*_MSC_VER */
 
+/*SSE2 is used in a few hot loops when the compiler targets it, which is always the case on x86-64*/
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LODEPNG_SIMD_SSE2
+#include <emmintrin.h>
+/*SSSE3 only when the compiler targets it, for the pshufb palette lookup*/
+#if defined(__SSSE3__) || defined(__AVX__)
+#define LODEPNG_SIMD_SSSE3
+#include <tmmintrin.h>
+#endif /*SSSE3*/
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif /*SSE2*/
+
 const char* LODEPNG_VERSION_STRING = "20180910";
 
 /*
@@ -95,6 +110,24 @@ void lodepng_free(void* ptr);
 #define LODEPNG_MAX(a, b) (((a) > (b)) ? (a) : (b))
 #define LODEPNG_MIN(a, b) (((a) < (b)) ? (a) : (b))
 
+#ifdef LODEPNG_SIMD_SSE2
+/*index of the lowest set bit, value must not be 0*/
+static unsigned lodepng_ctz(unsigned value)
+{
+#if defined(__GNUC__) || defined(__clang__)
+  return (unsigned)__builtin_ctz(value);
+#elif defined(_MSC_VER)
+  unsigned long index;
+  _BitScanForward(&index, value);
+  return (unsigned)index;
+#else
+  unsigned index = 0;
+  while(!(value & 1)) { value >>= 1; ++index; }
+  return index;
+#endif
+}
+#endif /*LODEPNG_SIMD_SSE2*/
+
 /*
 Often in case of an error a value is assigned to a variable and then it breaks
 out of a loop (to go to the cleanup phase of a function). This macro does that.
@@ -1228,7 +1261,7 @@ static unsigned inflateNoCompression(ucvector* out, const unsigned char* in, siz
   p = (*bp) / 8; /*byte position*/
 
   /*read LEN (2 bytes) and NLEN (2 bytes)*/
-  if(p + 4 >= inlength) return 52; /*error, bit pointer will jump past memory*/
+  if(p + 4 > inlength) return 52; /*error, bit pointer will jump past memory*/
   LEN = in[p] + 256u * in[p + 1]; p += 2;
   NLEN = in[p] + 256u * in[p + 1]; p += 2;
 
@@ -1246,36 +1279,158 @@ static unsigned inflateNoCompression(ucvector* out, const unsigned char* in, siz
   return error;
 }
 
-static unsigned lodepng_inflatev(ucvector* out,
-                                 const unsigned char* in, size_t insize,
-                                 const LodePNGDecompressSettings* settings)
+/*Inflates the blocks of in to out from *pos on; the output before *pos is the history that matches can
+refer to. With stop_at_end it also stops without error when in ends exactly between two blocks. *final
+tells whether the last block of the stream was read.*/
+static unsigned inflateBlocks(ucvector* out, const unsigned char* in, size_t insize, size_t* pos,
+                              unsigned stop_at_end, unsigned* final)
 {
   /*bit pointer in the "in" data, current byte is bp >> 3, current bit is bp & 0x7 (from lsb to msb of the byte)*/
   size_t bp = 0;
   unsigned BFINAL = 0;
-  size_t pos = 0; /*byte position in the out buffer*/
   unsigned error = 0;
 
-  (void)settings;
-
   while(!BFINAL)
   {
     unsigned BTYPE;
+    if(stop_at_end && bp == insize * 8) break;
     if(bp + 2 >= insize * 8) return 52; /*error, bit pointer will jump past memory*/
     BFINAL = readBitFromStream(&bp, in);
     BTYPE = 1u * readBitFromStream(&bp, in);
     BTYPE += 2u * readBitFromStream(&bp, in);
 
     if(BTYPE == 3) return 20; /*error: invalid BTYPE*/
-    else if(BTYPE == 0) error = inflateNoCompression(out, in, &bp, &pos, insize); /*no compression*/
-    else error = inflateHuffmanBlock(out, in, &bp, &pos, insize, BTYPE); /*compression, BTYPE 01 or 10*/
+    else if(BTYPE == 0) error = inflateNoCompression(out, in, &bp, pos, insize); /*no compression*/
+    else error = inflateHuffmanBlock(out, in, &bp, pos, insize, BTYPE); /*compression, BTYPE 01 or 10*/
 
     if(error) return error;
   }
 
+  *final = BFINAL;
+  return error;
+}
+
+/*
+Parallel inflate for streams written with full flushes (Z_FULL_FLUSH in zlib). A full flush ends the
+output so far with an empty stored block, whose LEN and NLEN are the bytes 00 00 ff ff at a byte
+boundary, and no match after it refers to data before it. The stream is split after such markers and
+the parts are inflated at the same time, each without history.
+
+A marker can also appear by chance in compressed data, or come from a sync flush that keeps the
+history. A part is only used as is if the part before it ended exactly between two blocks, and a match
+into the missing history fails with error 52. Any part that fails is inflated again in order after the
+output so far, so the result, errors included, is always that of the serial inflate.
+*/
+
+#define INFLATE_MIN_PART 65536 /*the least compressed bytes handed to one task*/
+
+typedef struct InflatePart
+{
+  const unsigned char* in;
+  size_t insize;
+  ucvector out;
+  unsigned error;
+  unsigned final;
+} InflatePart;
+
+static void inflatePartTask(void* data, unsigned index)
+{
+  InflatePart* part = &((InflatePart*)data)[index];
+  size_t pos = 0;
+  part->final = 0;
+  part->error = inflateBlocks(&part->out, part->in, part->insize, &pos, 1, &part->final);
+}
+
+/*returns the start of the part after the one at start, or insize if it is the last one*/
+static size_t findInflatePart(const unsigned char* in, size_t insize, size_t start)
+{
+  size_t p;
+  for(p = start + INFLATE_MIN_PART - 4; p + 4 < insize; ++p)
+  {
+    if(in[p] == 0 && in[p + 1] == 0 && in[p + 2] == 255 && in[p + 3] == 255) return p + 4;
+  }
+  return insize;
+}
+
+static unsigned inflateParallel(ucvector* out, const unsigned char* in, size_t insize,
+                                const LodePNGDecompressSettings* settings)
+{
+  InflatePart* parts;
+  unsigned numparts = 0, i;
+  size_t start, pos = 0; /*byte position in the out buffer*/
+  unsigned final = 0, error = 0;
+
+  for(start = 0; start < insize; start = findInflatePart(in, insize, start)) ++numparts;
+  if(numparts < 2) return inflateBlocks(out, in, insize, &pos, 0, &final);
+
+  parts = (InflatePart*)lodepng_malloc(numparts * sizeof(InflatePart));
+  if(!parts) return 83; /*alloc fail*/
+
+  for(i = 0, start = 0; i != numparts; ++i)
+  {
+    size_t end = findInflatePart(in, insize, start);
+    parts[i].in = &in[start];
+    parts[i].insize = end - start;
+    ucvector_init_buffer(&parts[i].out, 0, 0);
+    start = end;
+  }
+
+  settings->custom_parallel(inflatePartTask, parts, numparts, settings->custom_parallel_context);
+
+  for(i = 0; i != numparts; ++i)
+  {
+    InflatePart* part = &parts[i];
+    /*the last part must hold the final block, else the stream is truncated*/
+    unsigned valid = !part->error && (part->final || i + 1 != numparts);
+
+    if(valid)
+    {
+      if(!ucvector_resize(out, pos + part->out.size))
+      {
+        error = 83; /*alloc fail*/
+        break;
+      }
+      if(part->out.size) memcpy(&out->data[pos], part->out.data, part->out.size);
+      pos += part->out.size;
+      final = part->final;
+    }
+    else
+    {
+      /*it needs the history before it, or the stream is broken in it: inflate it after the output so far*/
+      size_t partstart = pos;
+      error = inflateBlocks(out, part->in, part->insize, &pos, 1, &final);
+      if(error || (!final && i + 1 == numparts))
+      {
+        /*it did not end between two blocks, so the next parts can't be used: inflate the rest in order*/
+        pos = partstart;
+        if(!ucvector_resize(out, pos))
+        {
+          error = 83; /*alloc fail*/
+          break;
+        }
+        error = inflateBlocks(out, part->in, insize - (size_t)(part->in - in), &pos, 0, &final);
+        break;
+      }
+    }
+    if(final) break;
+  }
+
+  for(i = 0; i != numparts; ++i) lodepng_free(parts[i].out.data);
+  lodepng_free(parts);
   return error;
 }
 
+static unsigned lodepng_inflatev(ucvector* out,
+                                 const unsigned char* in, size_t insize,
+                                 const LodePNGDecompressSettings* settings)
+{
+  size_t pos = 0; /*byte position in the out buffer*/
+  unsigned final;
+
+  if(settings->custom_parallel) return inflateParallel(out, in, insize, settings);
+  return inflateBlocks(out, in, insize, &pos, 0, &final);
+}
+
 unsigned lodepng_inflate(unsigned char** out, size_t* outsize,
                          const unsigned char* in, size_t insize,
                          const LodePNGDecompressSettings* settings)
@@ -1374,10 +1529,25 @@ typedef struct Hash
   unsigned short* zeros; /*length of zeros streak, used as a second hash chain*/
 } Hash;
 
-static unsigned hash_init(Hash* hash, unsigned windowsize)
+/*the greedy matcher only uses head, and the RLE matcher no hash at all, so only allocate what the strategy needs*/
+static unsigned hash_init(Hash* hash, unsigned windowsize, LodePNGMatchStrategy strategy)
 {
   unsigned i;
+  hash->head = 0;
+  hash->val = 0;
+  hash->chain = 0;
+  hash->zeros = 0;
+  hash->headz = 0;
+  hash->chainz = 0;
+
+  if(strategy == LMS_RLE) return 0;
+
   hash->head = (int*)lodepng_malloc(sizeof(int) * HASH_NUM_VALUES);
+  if(!hash->head) return 83; /*alloc fail*/
+  for(i = 0; i != HASH_NUM_VALUES; ++i) hash->head[i] = -1;
+
+  if(strategy == LMS_GREEDY) return 0;
+
   hash->val = (int*)lodepng_malloc(sizeof(int) * windowsize);
   hash->chain = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * windowsize);
 
@@ -1385,13 +1555,12 @@ static unsigned hash_init(Hash* hash, unsigned windowsize)
   hash->headz = (int*)lodepng_malloc(sizeof(int) * (MAX_SUPPORTED_DEFLATE_LENGTH + 1));
   hash->chainz = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * windowsize);
 
-  if(!hash->head || !hash->chain || !hash->val  || !hash->headz|| !hash->chainz || !hash->zeros)
+  if(!hash->chain || !hash->val  || !hash->headz|| !hash->chainz || !hash->zeros)
   {
     return 83; /*alloc fail*/
   }
 
   /*initialize hash table*/
-  for(i = 0; i != HASH_NUM_VALUES; ++i) hash->head[i] = -1;
   for(i = 0; i != windowsize; ++i) hash->val[i] = -1;
   for(i = 0; i != windowsize; ++i) hash->chain[i] = i; /*same value as index indicates uninitialized*/
 
@@ -1435,12 +1604,51 @@ static unsigned getHash(const unsigned char* data, size_t size, size_t pos)
   return result & HASH_BIT_MASK;
 }
 
+/*hash of 4 bytes for the greedy matcher, which only probes one slot and needs fewer collisions than getHash*/
+static unsigned getHashFast(const unsigned char* data)
+{
+  unsigned value = (unsigned)data[0] | ((unsigned)data[1] << 8u) | ((unsigned)data[2] << 16u) | ((unsigned)data[3] << 24u);
+  return ((value * 2654435761u) >> 16u) & HASH_BIT_MASK;
+}
+
+/*returns the first position in [fore, end) where fore and back differ, or end. back is
+before fore and may overlap it: all bytes are already final input, so comparing wide chunks is fine.*/
+static const unsigned char* matchForward(const unsigned char* fore, const unsigned char* back, const unsigned char* end)
+{
+#ifdef LODEPNG_SIMD_SSE2
+  while(end - fore >= 16)
+  {
+    __m128i a = _mm_loadu_si128((const __m128i*)fore);
+    __m128i b = _mm_loadu_si128((const __m128i*)back);
+    unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) ^ 0xffffu;
+    if(mask) return fore + lodepng_ctz(mask);
+    fore += 16;
+    back += 16;
+  }
+#endif /*LODEPNG_SIMD_SSE2*/
+  while(fore != end && *back == *fore)
+  {
+    ++back;
+    ++fore;
+  }
+  return fore;
+}
+
 static unsigned countZeros(const unsigned char* data, size_t size, size_t pos)
 {
   const unsigned char* start = data + pos;
   const unsigned char* end = start + MAX_SUPPORTED_DEFLATE_LENGTH;
   if(end > data + size) end = data + size;
   data = start;
+#ifdef LODEPNG_SIMD_SSE2
+  while(end - data >= 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i*)data);
+    unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) ^ 0xffffu;
+    if(mask) return (unsigned)(data - start) + lodepng_ctz(mask);
+    data += 16;
+  }
+#endif /*LODEPNG_SIMD_SSE2*/
   while(data != end && *data == 0) ++data;
   /*subtracting two addresses returned as 32-bit number (max value is MAX_SUPPORTED_DEFLATE_LENGTH)*/
   return (unsigned)(data - start);
@@ -1467,14 +1675,12 @@ sliding window (of windowsize) is used, and all past bytes in that window can be
 the "dictionary". A brute force search through all possible distances would be slow, and
 this hash technique is one out of several ways to speed this up.
 */
-static unsigned encodeLZ77(uivector* out, Hash* hash,
-                           const unsigned char* in, size_t inpos, size_t insize, unsigned windowsize,
-                           unsigned minmatch, unsigned nicematch, unsigned lazymatching)
+static unsigned encodeLZ77Chain(uivector* out, Hash* hash,
+                                const unsigned char* in, size_t inpos, size_t insize, unsigned windowsize,
+                                unsigned minmatch, unsigned nicematch, unsigned lazymatching, unsigned maxchainlength)
 {
   size_t pos;
   unsigned i, error = 0;
-  /*for large window lengths, assume the user wants no compression loss. Otherwise, max hash chain length speedup.*/
-  unsigned maxchainlength = windowsize >= 8192 ? windowsize : windowsize / 8;
   unsigned maxlazymatch = windowsize >= 8192 ? MAX_SUPPORTED_DEFLATE_LENGTH : 64;
 
   unsigned usezeros = 1; /*not sure if setting it to false for windowsize < 8192 is better or worse*/
@@ -1494,6 +1700,8 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
   if((windowsize & (windowsize - 1)) != 0) return 90; /*error: must be power of two*/
 
   if(nicematch > MAX_SUPPORTED_DEFLATE_LENGTH) nicematch = MAX_SUPPORTED_DEFLATE_LENGTH;
+  /*for large window lengths, assume the user wants no compression loss. Otherwise, max hash chain length speedup.*/
+  if(maxchainlength == 0) maxchainlength = windowsize >= 8192 ? windowsize : windowsize / 8;
 
   for(pos = inpos; pos < insize; ++pos)
   {
@@ -1546,11 +1754,8 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
           foreptr += skip;
         }
 
-        while(foreptr != lastptr && *backptr == *foreptr) /*maximum supported length by deflate is max length*/
-        {
-          ++backptr;
-          ++foreptr;
-        }
+        /*maximum supported length by deflate is max length*/
+        if(foreptr < lastptr) foreptr = matchForward(foreptr, backptr, lastptr);
         current_length = (unsigned)(foreptr - &in[pos]);
 
         if(current_length > length)
@@ -1644,6 +1849,134 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
   return error;
 }
 
+/*matches inside a longer match are not added to the greedy hash table, this bounds the work per input byte*/
+static const unsigned GREEDY_MAX_INSERT = 16;
+
+/*
+Single-probe greedy LZ77: each position looks at the last position with the same hash and
+takes whatever match it finds there, without chains or lazy evaluation. The hash table only
+stores window positions, so a candidate may be stale; this is harmless since every candidate
+is verified by comparing bytes, and any distance within the window is a valid reference.
+*/
+static unsigned encodeLZ77Greedy(uivector* out, Hash* hash,
+                                 const unsigned char* in, size_t inpos, size_t insize, unsigned windowsize,
+                                 unsigned minmatch)
+{
+  size_t pos = inpos;
+  unsigned i, error = 0;
+
+  if(windowsize == 0 || windowsize > 32768) return 60; /*error: windowsize smaller/larger than allowed*/
+  if((windowsize & (windowsize - 1)) != 0) return 90; /*error: must be power of two*/
+
+  while(pos < insize)
+  {
+    unsigned length = 0;
+    unsigned offset = 0;
+
+    if(pos + 4 <= insize)
+    {
+      size_t wpos = pos & (windowsize - 1);
+      unsigned hashval = getHashFast(&in[pos]);
+      int head = hash->head[hashval];
+      hash->head[hashval] = (int)wpos;
+
+      if(head != -1)
+      {
+        offset = (unsigned)((size_t)head <= wpos ? wpos - (size_t)head : wpos - (size_t)head + windowsize);
+        if(offset > 0 && offset <= pos)
+        {
+          const unsigned char* lastptr = &in[insize < pos + MAX_SUPPORTED_DEFLATE_LENGTH ? insize : pos + MAX_SUPPORTED_DEFLATE_LENGTH];
+          length = (unsigned)(matchForward(&in[pos], &in[pos - offset], lastptr) - &in[pos]);
+        }
+      }
+    }
+
+    if(length < 3 || length < minmatch || (length == 3 && offset > 4096))
+    {
+      if(!uivector_push_back(out, in[pos])) ERROR_BREAK(83 /*alloc fail*/);
+      ++pos;
+      continue;
+    }
+
+    addLengthDistance(out, length, offset);
+    if(length <= GREEDY_MAX_INSERT)
+    {
+      for(i = 1; i < length && pos + i + 4 <= insize; ++i)
+      {
+        hash->head[getHashFast(&in[pos + i])] = (int)((pos + i) & (windowsize - 1));
+      }
+    }
+    pos += length;
+  }
+
+  return error;
+}
+
+/*
+Run-length LZ77 tuned for filtered PNG data: only distances 1 to 4 are tried, which covers
+runs of equal bytes and of equal 2, 3 or 4 byte pixels. After filtering, flat areas and
+repeated rows both turn into such runs, so this gets most of the gain for almost no work.
+*/
+static unsigned encodeLZ77RLE(uivector* out, const unsigned char* in, size_t inpos, size_t insize,
+                              unsigned minmatch)
+{
+  size_t pos = inpos;
+  unsigned error = 0;
+
+  while(pos < insize)
+  {
+    unsigned length = 0;
+    unsigned offset = 0;
+    unsigned distance;
+    const unsigned char* lastptr = &in[insize < pos + MAX_SUPPORTED_DEFLATE_LENGTH ? insize : pos + MAX_SUPPORTED_DEFLATE_LENGTH];
+
+    for(distance = 1; distance <= 4 && distance <= pos; ++distance)
+    {
+      unsigned current_length = (unsigned)(matchForward(&in[pos], &in[pos - distance], lastptr) - &in[pos]);
+      if(current_length > length)
+      {
+        length = current_length;
+        offset = distance;
+        if(pos + length == insize || length == MAX_SUPPORTED_DEFLATE_LENGTH) break;
+      }
+    }
+
+    if(length < 3 || length < minmatch)
+    {
+      if(!uivector_push_back(out, in[pos])) ERROR_BREAK(83 /*alloc fail*/);
+      ++pos;
+    }
+    else
+    {
+      addLengthDistance(out, length, offset);
+      pos += length;
+    }
+  }
+
+  return error;
+}
+
+/*
+LZ77-encode with the match finder selected in the settings. The hash must have been
+initialized for the same strategy.
+*/
+static unsigned encodeLZ77(uivector* out, Hash* hash,
+                           const unsigned char* in, size_t inpos, size_t insize,
+                           const LodePNGCompressSettings* settings)
+{
+  switch(settings->match_strategy)
+  {
+    case LMS_GREEDY:
+      return encodeLZ77Greedy(out, hash, in, inpos, insize, settings->windowsize, settings->minmatch);
+    case LMS_RLE:
+      return encodeLZ77RLE(out, in, inpos, insize, settings->minmatch);
+    default:
+      return encodeLZ77Chain(out, hash, in, inpos, insize, settings->windowsize,
+                             settings->minmatch, settings->nicematch, settings->lazymatching,
+                             settings->maxchainlength);
+  }
+}
+
 /* /////////////////////////////////////////////////////////////////////////// */
 
 static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize)
@@ -1778,8 +2111,7 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
   {
     if(settings->use_lz77)
     {
-      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                         settings->minmatch, settings->nicematch, settings->lazymatching);
+      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings);
       if(error) break;
     }
     else
@@ -1988,8 +2320,7 @@ static unsigned deflateFixed(ucvector* out, size_t* bp, Hash* hash,
   {
     uivector lz77_encoded;
     uivector_init(&lz77_encoded);
-    error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                       settings->minmatch, settings->nicematch, settings->lazymatching);
+    error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings);
     if(!error) writeLZ77data(bp, out, &lz77_encoded, &tree_ll, &tree_d);
     uivector_cleanup(&lz77_encoded);
   }
@@ -2032,8 +2363,12 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
   numdeflateblocks = (insize + blocksize - 1) / blocksize;
   if(numdeflateblocks == 0) numdeflateblocks = 1;
 
-  error = hash_init(&hash, settings->windowsize);
-  if(error) return error;
+  error = hash_init(&hash, settings->windowsize, settings->use_lz77 ? settings->match_strategy : LMS_RLE);
+  if(error)
+  {
+    hash_cleanup(&hash);
+    return error;
+  }
 
   for(i = 0; i != numdeflateblocks && !error; ++i)
   {
@@ -2275,13 +2610,45 @@ void lodepng_compress_settings_init(LodePNGCompressSettings* settings)
   settings->minmatch = 3;
   settings->nicematch = 128;
   settings->lazymatching = 1;
+  settings->maxchainlength = 0;
+  settings->match_strategy = LMS_CHAIN;
 
   settings->custom_zlib = 0;
   settings->custom_deflate = 0;
   settings->custom_context = 0;
 }
 
-const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0};
+const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, LMS_CHAIN, 0, 0, 0};
+
+void lodepng_compress_settings_set_level(LodePNGCompressSettings* settings, unsigned level)
+{
+  /*nicematch, lazymatching and maxchainlength per level, loosely following zlib's configuration table.
+  Level 1 uses the greedy matcher, which ignores these.*/
+  static const unsigned LEVELS[10][3] =
+  {
+    {  0, 0,    0},
+    { 32, 0,    1},
+    { 16, 0,    4},
+    { 32, 0,    8},
+    { 32, 1,   16},
+    { 64, 1,   32},
+    {128, 1,  128},
+    {128, 1,  256},
+    {258, 1, 1024},
+    {258, 1, 4096}
+  };
+
+  if(level > 9) level = 9;
+
+  settings->btype = level == 0 ? 0 : 2;
+  settings->use_lz77 = 1;
+  settings->windowsize = 32768;
+  settings->minmatch = 3;
+  settings->nicematch = LEVELS[level][0];
+  settings->lazymatching = LEVELS[level][1];
+  settings->maxchainlength = LEVELS[level][2];
+  settings->match_strategy = level == 1 ? LMS_GREEDY : LMS_CHAIN;
+}
 
 
 #endif /*LODEPNG_COMPILE_ENCODER*/
@@ -2295,9 +2662,11 @@ void lodepng_decompress_settings_init(LodePNGDecompressSettings* settings)
   settings->custom_zlib = 0;
   settings->custom_inflate = 0;
   settings->custom_context = 0;
+  settings->custom_parallel = 0;
+  settings->custom_parallel_context = 0;
 }
 
-const LodePNGDecompressSettings lodepng_default_decompress_settings = {0, 0, 0, 0};
+const LodePNGDecompressSettings lodepng_default_decompress_settings = {0, 0, 0, 0, 0, 0};
 
 #endif /*LODEPNG_COMPILE_DECODER*/
 
@@ -3136,13 +3505,6 @@ static int color_tree_get(ColorTree* tree, unsigned char r, unsigned char g, uns
   return tree ? tree->index : -1;
 }
 
-#ifdef LODEPNG_COMPILE_ENCODER
-static int color_tree_has(ColorTree* tree, unsigned char r, unsigned char g, unsigned char b, unsigned char a)
-{
-  return color_tree_get(tree, r, g, b, a) >= 0;
-}
-#endif /*LODEPNG_COMPILE_ENCODER*/
-
 /*color is not allowed to already exist.
 Index should be >= 0 (it's signed to be compatible with using -1 for "doesn't exist")*/
 static void color_tree_add(ColorTree* tree,
@@ -3383,138 +3745,384 @@ static void getPixelColorRGBA8(unsigned char* r, unsigned char* g,
   }
 }
 
-/*Similar to getPixelColorRGBA8, but with all the for loops inside of the color
-mode test cases, optimized to convert the colors much faster, when converting
-to RGBA or RGB with 8 bit per cannel. buffer must be RGBA or RGB output with
-enough memory, if has_alpha is true the output is RGBA. mode has the color mode
-of the input buffer.*/
-static void getPixelColorsRGBA8(unsigned char* buffer, size_t numpixels,
-                                unsigned has_alpha, const unsigned char* in,
-                                const LodePNGColorMode* mode)
+/*The fast paths of getPixelColorsRGBA8. Palette and grey images with less than 8 bits, and
+8-bit palette images, are converted through a table with the RGBA color of every possible value,
+so the color type, bit depth and color key are not tested again for every pixel.*/
+
+/*fills table with the RGBA color of every possible value of the palette or grey input, 4 bytes each*/
+static void getColorTable(unsigned char table[256 * 4], const LodePNGColorMode* mode)
 {
-  unsigned num_channels = has_alpha ? 4 : 3;
   size_t i;
-  if(mode->colortype == LCT_GREY)
+  size_t numvalues = (size_t)1u << mode->bitdepth;
+  for(i = 0; i != numvalues; ++i)
   {
-    if(mode->bitdepth == 8)
+    unsigned char* color = &table[i * 4];
+    if(mode->colortype == LCT_PALETTE)
     {
-      for(i = 0; i != numpixels; ++i, buffer += num_channels)
+      if(i >= mode->palettesize)
       {
-        buffer[0] = buffer[1] = buffer[2] = in[i];
-        if(has_alpha) buffer[3] = mode->key_defined && in[i] == mode->key_r ? 0 : 255;
+        /*out of range indices become opaque black, see getPixelColorsRGBA8*/
+        color[0] = color[1] = color[2] = 0;
+        color[3] = 255;
       }
-    }
-    else if(mode->bitdepth == 16)
-    {
-      for(i = 0; i != numpixels; ++i, buffer += num_channels)
+      else
       {
-        buffer[0] = buffer[1] = buffer[2] = in[i * 2];
-        if(has_alpha) buffer[3] = mode->key_defined && 256U * in[i * 2 + 0] + in[i * 2 + 1] == mode->key_r ? 0 : 255;
+        color[0] = mode->palette[i * 4 + 0];
+        color[1] = mode->palette[i * 4 + 1];
+        color[2] = mode->palette[i * 4 + 2];
+        color[3] = mode->palette[i * 4 + 3];
       }
     }
     else
     {
-      unsigned highest = ((1U << mode->bitdepth) - 1U); /*highest possible value for this bit depth*/
-      size_t j = 0;
-      for(i = 0; i != numpixels; ++i, buffer += num_channels)
-      {
-        unsigned value = readBitsFromReversedStream(&j, in, mode->bitdepth);
-        buffer[0] = buffer[1] = buffer[2] = (value * 255) / highest;
-        if(has_alpha) buffer[3] = mode->key_defined && value == mode->key_r ? 0 : 255;
-      }
+      color[0] = color[1] = color[2] = (unsigned char)((i * 255) / (numvalues - 1));
+      color[3] = mode->key_defined && i == mode->key_r ? 0 : 255;
     }
   }
-  else if(mode->colortype == LCT_RGB)
+}
+
+/*unpacks numpixels values of bitdepth 1, 2 or 4 to one byte each, the first pixel is in the
+most significant bits of the first byte like in readBitsFromReversedStream*/
+static void unpackBits(unsigned char* out, const unsigned char* in, size_t numpixels, unsigned bitdepth)
+{
+  unsigned mask = (1u << bitdepth) - 1u;
+  size_t i = 0;
+#ifdef LODEPNG_SIMD_SSE2
+  if(bitdepth == 4)
   {
-    if(mode->bitdepth == 8)
+    const __m128i low = _mm_set1_epi8(15);
+    for(; i + 32 <= numpixels; i += 32, in += 16)
     {
-      for(i = 0; i != numpixels; ++i, buffer += num_channels)
-      {
-        buffer[0] = in[i * 3 + 0];
-        buffer[1] = in[i * 3 + 1];
-        buffer[2] = in[i * 3 + 2];
-        if(has_alpha) buffer[3] = mode->key_defined && buffer[0] == mode->key_r
-           && buffer[1]== mode->key_g && buffer[2] == mode->key_b ? 0 : 255;
-      }
+      __m128i v = _mm_loadu_si128((const __m128i*)in);
+      __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), low);
+      __m128i lo = _mm_and_si128(v, low);
+      _mm_storeu_si128((__m128i*)&out[i + 0], _mm_unpacklo_epi8(hi, lo));
+      _mm_storeu_si128((__m128i*)&out[i + 16], _mm_unpackhi_epi8(hi, lo));
     }
-    else
+  }
+#endif /*LODEPNG_SIMD_SSE2*/
+  if(bitdepth == 1)
+  {
+    for(; i + 8 <= numpixels; i += 8, ++in)
     {
-      for(i = 0; i != numpixels; ++i, buffer += num_channels)
-      {
-        buffer[0] = in[i * 6 + 0];
-        buffer[1] = in[i * 6 + 2];
-        buffer[2] = in[i * 6 + 4];
-        if(has_alpha) buffer[3] = mode->key_defined
-           && 256U * in[i * 6 + 0] + in[i * 6 + 1] == mode->key_r
-           && 256U * in[i * 6 + 2] + in[i * 6 + 3] == mode->key_g
-           && 256U * in[i * 6 + 4] + in[i * 6 + 5] == mode->key_b ? 0 : 255;
-      }
+      unsigned value = *in;
+      out[i + 0] = (value >> 7) & 1; out[i + 1] = (value >> 6) & 1;
+      out[i + 2] = (value >> 5) & 1; out[i + 3] = (value >> 4) & 1;
+      out[i + 4] = (value >> 3) & 1; out[i + 5] = (value >> 2) & 1;
+      out[i + 6] = (value >> 1) & 1; out[i + 7] = (value >> 0) & 1;
     }
   }
-  else if(mode->colortype == LCT_PALETTE)
+  else if(bitdepth == 2)
   {
-    unsigned index;
-    size_t j = 0;
-    for(i = 0; i != numpixels; ++i, buffer += num_channels)
+    for(; i + 4 <= numpixels; i += 4, ++in)
     {
-      if(mode->bitdepth == 8) index = in[i];
-      else index = readBitsFromReversedStream(&j, in, mode->bitdepth);
-
-      if(index >= mode->palettesize)
-      {
-        /*This is an error according to the PNG spec, but most PNG decoders make it black instead.
-        Done here too, slightly faster due to no error handling needed.*/
-        buffer[0] = buffer[1] = buffer[2] = 0;
-        if(has_alpha) buffer[3] = 255;
-      }
-      else
-      {
-        buffer[0] = mode->palette[index * 4 + 0];
-        buffer[1] = mode->palette[index * 4 + 1];
-        buffer[2] = mode->palette[index * 4 + 2];
-        if(has_alpha) buffer[3] = mode->palette[index * 4 + 3];
-      }
+      unsigned value = *in;
+      out[i + 0] = (value >> 6) & 3; out[i + 1] = (value >> 4) & 3;
+      out[i + 2] = (value >> 2) & 3; out[i + 3] = (value >> 0) & 3;
     }
   }
-  else if(mode->colortype == LCT_GREY_ALPHA)
+  else
   {
-    if(mode->bitdepth == 8)
+    for(; i + 2 <= numpixels; i += 2, ++in)
     {
-      for(i = 0; i != numpixels; ++i, buffer += num_channels)
-      {
-        buffer[0] = buffer[1] = buffer[2] = in[i * 2 + 0];
-        if(has_alpha) buffer[3] = in[i * 2 + 1];
-      }
+      out[i + 0] = *in >> 4;
+      out[i + 1] = *in & 15;
     }
-    else
+  }
+  /*the last byte may be partially used*/
+  if(i != numpixels)
+  {
+    unsigned value = *in;
+    unsigned shift = 8;
+    while(i != numpixels)
     {
-      for(i = 0; i != numpixels; ++i, buffer += num_channels)
-      {
-        buffer[0] = buffer[1] = buffer[2] = in[i * 4 + 0];
-        if(has_alpha) buffer[3] = in[i * 4 + 2];
-      }
+      shift -= bitdepth;
+      out[i++] = (unsigned char)((value >> shift) & mask);
     }
   }
-  else if(mode->colortype == LCT_RGBA)
+}
+
+/*looks up the color of every value in table from getColorTable*/
+static void lookupColors(unsigned char* buffer, size_t numpixels, unsigned has_alpha,
+                         const unsigned char* values, const unsigned char* table, unsigned numvalues)
+{
+  size_t i = 0;
+  if(has_alpha)
   {
-    if(mode->bitdepth == 8)
+#ifdef LODEPNG_SIMD_SSSE3
+    if(numvalues <= 16)
     {
-      for(i = 0; i != numpixels; ++i, buffer += num_channels)
+      /*the table fits a register per channel, so pshufb looks up 16 pixels at a time*/
+      unsigned char planes[4][16];
+      unsigned j, c;
+      __m128i r, g, b, a;
+      for(j = 0; j != 16; ++j)
       {
-        buffer[0] = in[i * 4 + 0];
-        buffer[1] = in[i * 4 + 1];
-        buffer[2] = in[i * 4 + 2];
-        if(has_alpha) buffer[3] = in[i * 4 + 3];
+        for(c = 0; c != 4; ++c) planes[c][j] = j < numvalues ? table[j * 4 + c] : 0;
+      }
+      r = _mm_loadu_si128((const __m128i*)planes[0]);
+      g = _mm_loadu_si128((const __m128i*)planes[1]);
+      b = _mm_loadu_si128((const __m128i*)planes[2]);
+      a = _mm_loadu_si128((const __m128i*)planes[3]);
+      for(; i + 16 <= numpixels; i += 16, buffer += 64)
+      {
+        __m128i v = _mm_loadu_si128((const __m128i*)&values[i]);
+        __m128i vr = _mm_shuffle_epi8(r, v);
+        __m128i vg = _mm_shuffle_epi8(g, v);
+        __m128i vb = _mm_shuffle_epi8(b, v);
+        __m128i va = _mm_shuffle_epi8(a, v);
+        __m128i rg0 = _mm_unpacklo_epi8(vr, vg);
+        __m128i rg1 = _mm_unpackhi_epi8(vr, vg);
+        __m128i ba0 = _mm_unpacklo_epi8(vb, va);
+        __m128i ba1 = _mm_unpackhi_epi8(vb, va);
+        _mm_storeu_si128((__m128i*)(buffer + 0), _mm_unpacklo_epi16(rg0, ba0));
+        _mm_storeu_si128((__m128i*)(buffer + 16), _mm_unpackhi_epi16(rg0, ba0));
+        _mm_storeu_si128((__m128i*)(buffer + 32), _mm_unpacklo_epi16(rg1, ba1));
+        _mm_storeu_si128((__m128i*)(buffer + 48), _mm_unpackhi_epi16(rg1, ba1));
       }
     }
-    else
+#else /*LODEPNG_SIMD_SSSE3*/
+    (void)numvalues;
+#endif /*LODEPNG_SIMD_SSSE3*/
+    for(; i != numpixels; ++i, buffer += 4) memcpy(buffer, &table[values[i] * 4], 4);
+  }
+  else
+  {
+    (void)numvalues;
+    for(; i != numpixels; ++i, buffer += 3)
+    {
+      const unsigned char* color = &table[values[i] * 4];
+      buffer[0] = color[0];
+      buffer[1] = color[1];
+      buffer[2] = color[2];
+    }
+  }
+}
+
+/*palette, or grey with less than 8 bits, to RGBA or RGB 8-bit through the table of getColorTable*/
+static void getTableColorsRGBA8(unsigned char* buffer, size_t numpixels,
+                                unsigned has_alpha, const unsigned char* in,
+                                const LodePNGColorMode* mode)
+{
+  unsigned char table[256 * 4];
+  unsigned numvalues = 1u << mode->bitdepth;
+  getColorTable(table, mode);
+  if(mode->bitdepth == 8)
+  {
+    lookupColors(buffer, numpixels, has_alpha, in, table, numvalues);
+  }
+  else
+  {
+    /*unpacked in blocks that start at a byte boundary for every bit depth*/
+    unsigned char values[256];
+    size_t i;
+    for(i = 0; i < numpixels; i += 256)
+    {
+      size_t count = LODEPNG_MIN(numpixels - i, (size_t)256);
+      unpackBits(values, &in[i * mode->bitdepth / 8], count, mode->bitdepth);
+      lookupColors(&buffer[i * (has_alpha ? 4 : 3)], count, has_alpha, values, table, numvalues);
+    }
+  }
+}
+
+/*grey 8-bit to RGBA 8-bit, alpha is 0 for the color key if there is one*/
+static void getGreyColorsRGBA8(unsigned char* buffer, size_t numpixels, const unsigned char* in,
+                               const LodePNGColorMode* mode)
+{
+  size_t i = 0;
+#ifdef LODEPNG_SIMD_SSE2
+  const __m128i opaque = _mm_set1_epi8((char)255);
+  const __m128i key = _mm_set1_epi8((char)mode->key_r);
+  for(; i + 16 <= numpixels; i += 16, buffer += 64)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i*)&in[i]);
+    __m128i alpha = opaque;
+    __m128i gg0, gg1, ga0, ga1;
+    if(mode->key_defined && mode->key_r < 256) alpha = _mm_andnot_si128(_mm_cmpeq_epi8(v, key), opaque);
+    gg0 = _mm_unpacklo_epi8(v, v);
+    gg1 = _mm_unpackhi_epi8(v, v);
+    ga0 = _mm_unpacklo_epi8(v, alpha);
+    ga1 = _mm_unpackhi_epi8(v, alpha);
+    _mm_storeu_si128((__m128i*)(buffer + 0), _mm_unpacklo_epi16(gg0, ga0));
+    _mm_storeu_si128((__m128i*)(buffer + 16), _mm_unpackhi_epi16(gg0, ga0));
+    _mm_storeu_si128((__m128i*)(buffer + 32), _mm_unpacklo_epi16(gg1, ga1));
+    _mm_storeu_si128((__m128i*)(buffer + 48), _mm_unpackhi_epi16(gg1, ga1));
+  }
+#endif /*LODEPNG_SIMD_SSE2*/
+  for(; i != numpixels; ++i, buffer += 4)
+  {
+    buffer[0] = buffer[1] = buffer[2] = in[i];
+    buffer[3] = mode->key_defined && in[i] == mode->key_r ? 0 : 255;
+  }
+}
+
+/*grey 16-bit to RGBA 8-bit, the color key is compared with the full 16-bit value*/
+static void getGrey16ColorsRGBA8(unsigned char* buffer, size_t numpixels, const unsigned char* in,
+                                 const LodePNGColorMode* mode)
+{
+  size_t i = 0;
+#ifdef LODEPNG_SIMD_SSE2
+  const __m128i mask = _mm_set1_epi16(255);
+  const __m128i key = _mm_set1_epi16((short)mode->key_r);
+  const __m128i zero = _mm_setzero_si128();
+  for(; i + 8 <= numpixels; i += 8, buffer += 32)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i*)&in[i * 2]);
+    __m128i grey = _mm_and_si128(v, mask);
+    __m128i alpha = mask;
+    __m128i gg, ga;
+    if(mode->key_defined)
+    {
+      /*byte swap to compare the big endian values*/
+      __m128i value = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+      alpha = _mm_andnot_si128(_mm_cmpeq_epi16(value, key), mask);
+    }
+    grey = _mm_packus_epi16(grey, zero);
+    alpha = _mm_packus_epi16(alpha, zero);
+    gg = _mm_unpacklo_epi8(grey, grey);
+    ga = _mm_unpacklo_epi8(grey, alpha);
+    _mm_storeu_si128((__m128i*)(buffer + 0), _mm_unpacklo_epi16(gg, ga));
+    _mm_storeu_si128((__m128i*)(buffer + 16), _mm_unpackhi_epi16(gg, ga));
+  }
+#endif /*LODEPNG_SIMD_SSE2*/
+  for(; i != numpixels; ++i, buffer += 4)
+  {
+    buffer[0] = buffer[1] = buffer[2] = in[i * 2];
+    buffer[3] = mode->key_defined && 256U * in[i * 2 + 0] + in[i * 2 + 1] == mode->key_r ? 0 : 255;
+  }
+}
+
+/*keeps the most significant byte of every 16-bit big endian value*/
+static void downConvert16(unsigned char* out, const unsigned char* in, size_t numvalues)
+{
+  size_t i = 0;
+#ifdef LODEPNG_SIMD_SSE2
+  const __m128i mask = _mm_set1_epi16(255);
+  for(; i + 16 <= numvalues; i += 16)
+  {
+    __m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i*)&in[i * 2 + 0]), mask);
+    __m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i*)&in[i * 2 + 16]), mask);
+    _mm_storeu_si128((__m128i*)&out[i], _mm_packus_epi16(a, b));
+  }
+#endif /*LODEPNG_SIMD_SSE2*/
+  for(; i != numvalues; ++i) out[i] = in[i * 2];
+}
+
+/*Similar to getPixelColorRGBA8, but with all the for loops inside of the color
+mode test cases, optimized to convert the colors much faster, when converting
+to RGBA or RGB with 8 bit per cannel. buffer must be RGBA or RGB output with
+enough memory, if has_alpha is true the output is RGBA. mode has the color mode
+of the input buffer.*/
+static void getPixelColorsRGBA8(unsigned char* buffer, size_t numpixels,
+                                unsigned has_alpha, const unsigned char* in,
+                                const LodePNGColorMode* mode)
+{
+  unsigned num_channels = has_alpha ? 4 : 3;
+  size_t i;
+  if(mode->colortype == LCT_PALETTE || (mode->colortype == LCT_GREY && mode->bitdepth < 8))
+  {
+    getTableColorsRGBA8(buffer, numpixels, has_alpha, in, mode);
+  }
+  else if(mode->colortype == LCT_GREY)
+  {
+    if(mode->bitdepth == 8)
+    {
+      if(has_alpha)
+      {
+        getGreyColorsRGBA8(buffer, numpixels, in, mode);
+      }
+      else
+      {
+        for(i = 0; i != numpixels; ++i, buffer += 3) buffer[0] = buffer[1] = buffer[2] = in[i];
+      }
+    }
+    else if(has_alpha)
+    {
+      getGrey16ColorsRGBA8(buffer, numpixels, in, mode);
+    }
+    else
+    {
+      for(i = 0; i != numpixels; ++i, buffer += 3) buffer[0] = buffer[1] = buffer[2] = in[i * 2];
+    }
+  }
+  else if(mode->colortype == LCT_RGB)
+  {
+    if(mode->bitdepth == 8 && has_alpha)
+    {
+      for(i = 0; i != numpixels; ++i, buffer += 4)
+      {
+        buffer[0] = in[i * 3 + 0];
+        buffer[1] = in[i * 3 + 1];
+        buffer[2] = in[i * 3 + 2];
+        buffer[3] = mode->key_defined && buffer[0] == mode->key_r
+           && buffer[1]== mode->key_g && buffer[2] == mode->key_b ? 0 : 255;
+      }
+    }
+    else if(mode->bitdepth == 8)
+    {
+      for(i = 0; i != numpixels; ++i, buffer += 3)
+      {
+        buffer[0] = in[i * 3 + 0];
+        buffer[1] = in[i * 3 + 1];
+        buffer[2] = in[i * 3 + 2];
+      }
+    }
+    else
+    {
+      for(i = 0; i != numpixels; ++i, buffer += num_channels)
+      {
+        buffer[0] = in[i * 6 + 0];
+        buffer[1] = in[i * 6 + 2];
+        buffer[2] = in[i * 6 + 4];
+        if(has_alpha) buffer[3] = mode->key_defined
+           && 256U * in[i * 6 + 0] + in[i * 6 + 1] == mode->key_r
+           && 256U * in[i * 6 + 2] + in[i * 6 + 3] == mode->key_g
+           && 256U * in[i * 6 + 4] + in[i * 6 + 5] == mode->key_b ? 0 : 255;
+      }
+    }
+  }
+  else if(mode->colortype == LCT_GREY_ALPHA)
+  {
+    if(mode->bitdepth == 8)
+    {
+      for(i = 0; i != numpixels; ++i, buffer += num_channels)
+      {
+        buffer[0] = buffer[1] = buffer[2] = in[i * 2 + 0];
+        if(has_alpha) buffer[3] = in[i * 2 + 1];
+      }
+    }
+    else
+    {
+      for(i = 0; i != numpixels; ++i, buffer += num_channels)
+      {
+        buffer[0] = buffer[1] = buffer[2] = in[i * 4 + 0];
+        if(has_alpha) buffer[3] = in[i * 4 + 2];
+      }
+    }
+  }
+  else if(mode->colortype == LCT_RGBA)
+  {
+    if(mode->bitdepth == 8)
+    {
+      for(i = 0; i != numpixels; ++i, buffer += num_channels)
+      {
+        buffer[0] = in[i * 4 + 0];
+        buffer[1] = in[i * 4 + 1];
+        buffer[2] = in[i * 4 + 2];
+        if(has_alpha) buffer[3] = in[i * 4 + 3];
+      }
+    }
+    else if(has_alpha)
+    {
+      downConvert16(buffer, in, numpixels * 4);
+    }
+    else
     {
       for(i = 0; i != numpixels; ++i, buffer += num_channels)
       {
         buffer[0] = in[i * 8 + 0];
         buffer[1] = in[i * 8 + 2];
         buffer[2] = in[i * 8 + 4];
-        if(has_alpha) buffer[3] = in[i * 8 + 6];
       }
     }
   }
@@ -3620,6 +4228,11 @@ unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
   {
     getPixelColorsRGBA8(out, numpixels, 0, in, mode_in);
   }
+  else if(mode_in->bitdepth == 16 && mode_out->bitdepth == 8 && mode_in->colortype == mode_out->colortype)
+  {
+    /*same channels, only the most significant bytes are kept*/
+    downConvert16(out, in, numpixels * lodepng_get_channels(mode_in));
+  }
   else
   {
     unsigned char r = 0, g = 0, b = 0, a = 0;
@@ -3747,6 +4360,98 @@ static unsigned getValueRequiredBits(unsigned char value)
   return 8;
 }
 
+/*Open addressing hash set of RGBA colors, used by lodepng_get_color_profile to count up to 257 distinct
+colors. Unlike the ColorTree it does no allocations and finds a color with one or two probes.*/
+#define COLOR_SET_SIZE 1024 /*power of two, at most 25% full*/
+
+typedef struct ColorSet
+{
+  unsigned colors[COLOR_SET_SIZE]; /*r, g, b, a packed from the lowest byte up*/
+  unsigned char used[COLOR_SET_SIZE];
+} ColorSet;
+
+static void color_set_init(ColorSet* set)
+{
+  memset(set->used, 0, sizeof(set->used));
+}
+
+/*returns 1 if the color was added, 0 if it was already in the set*/
+static unsigned color_set_add(ColorSet* set, unsigned color)
+{
+  unsigned i = (color * 2654435761u) >> (32 - 10);
+  while(set->used[i])
+  {
+    if(set->colors[i] == color) return 0;
+    i = (i + 1) & (COLOR_SET_SIZE - 1);
+  }
+  set->used[i] = 1;
+  set->colors[i] = color;
+  return 1;
+}
+
+/*Checks 8-bit RGBA pixels for the color profile: grey is set to 0 if any pixel has r, g and b not all
+equal, opaque is set to 0 if any pixel has alpha below 255. Stops when both are known to be 0.*/
+static void getRGBA8Properties(unsigned* grey, unsigned* opaque, const unsigned char* in, size_t numpixels)
+{
+  size_t i = 0;
+  *grey = 1;
+  *opaque = 1;
+#ifdef LODEPNG_SIMD_SSE2
+  {
+    const __m128i ones = _mm_set1_epi8((char)255);
+    while(numpixels - i >= 4 && (*grey || *opaque))
+    {
+      /*in blocks of 64 pixels between the tests for an early exit*/
+      size_t end = LODEPNG_MIN(numpixels & ~(size_t)3, i + 64);
+      __m128i same = ones; /*byte 0 of every pixel: r == g, byte 1: g == b*/
+      __m128i alpha = ones;
+      for(; i != end; i += 4)
+      {
+        __m128i v = _mm_loadu_si128((const __m128i*)&in[i * 4]);
+        same = _mm_and_si128(same, _mm_cmpeq_epi8(v, _mm_srli_epi32(v, 8)));
+        alpha = _mm_and_si128(alpha, v);
+      }
+      if((_mm_movemask_epi8(same) & 0x3333) != 0x3333) *grey = 0;
+      if((_mm_movemask_epi8(_mm_cmpeq_epi8(alpha, ones)) & 0x8888) != 0x8888) *opaque = 0;
+    }
+  }
+#endif /*LODEPNG_SIMD_SSE2*/
+  for(; i != numpixels && (*grey || *opaque); ++i)
+  {
+    const unsigned char* pixel = &in[i * 4];
+    if(pixel[0] != pixel[1] || pixel[0] != pixel[2]) *grey = 0;
+    if(pixel[3] != 255) *opaque = 0;
+  }
+}
+
+/*returns 1 if both bytes of every 16-bit value are equal, so the image loses nothing in 8 bits*/
+static unsigned is8BitRepresentable(const unsigned char* in, size_t numbytes)
+{
+  size_t i = 0;
+#ifdef LODEPNG_SIMD_SSE2
+  {
+    const __m128i ones = _mm_set1_epi8((char)255);
+    while(numbytes - i >= 16)
+    {
+      size_t end = LODEPNG_MIN(numbytes & ~(size_t)15, i + 256);
+      __m128i equal = ones;
+      for(; i != end; i += 16)
+      {
+        __m128i v = _mm_loadu_si128((const __m128i*)&in[i]);
+        __m128i swapped = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        equal = _mm_and_si128(equal, _mm_cmpeq_epi8(v, swapped));
+      }
+      if(_mm_movemask_epi8(equal) != 0xffff) return 0;
+    }
+  }
+#endif /*LODEPNG_SIMD_SSE2*/
+  for(; i + 2 <= numbytes; i += 2)
+  {
+    if(in[i] != in[i + 1]) return 0;
+  }
+  return 1;
+}
+
 /*profile must already have been inited.
 It's ok to set some parameters of profile to done already.*/
 unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
@@ -3755,14 +4460,17 @@ unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
 {
   unsigned error = 0;
   size_t i;
-  ColorTree tree;
+  ColorSet set;
   size_t numpixels = (size_t)w * (size_t)h;
+  unsigned rgba8 = mode_in->colortype == LCT_RGBA && mode_in->bitdepth == 8;
 
   /* mark things as done already if it would be impossible to have a more expensive case */
   unsigned colored_done = lodepng_is_greyscale_type(mode_in) ? 1 : 0;
   unsigned alpha_done = lodepng_can_have_alpha(mode_in) ? 0 : 1;
   unsigned numcolors_done = 0;
   unsigned bpp = lodepng_get_bpp(mode_in);
+  /*below 16 bits per channel, no more than 8 bits can be found, whatever the number of channels*/
+  unsigned maxbits = LODEPNG_MIN(bpp, 8);
   unsigned bits_done = (profile->bits == 1 && bpp == 1) ? 1 : 0;
   unsigned sixteen = 0; /* whether the input image is 16 bit */
   unsigned maxnumcolors = 257;
@@ -3770,14 +4478,14 @@ unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
 
   profile->numpixels += numpixels;
 
-  color_tree_init(&tree);
+  color_set_init(&set);
 
   /*If the profile was already filled in from previous data, fill its palette in tree
   and mark things as done already if we know they are the most expensive case already*/
   if(profile->alpha) alpha_done = 1;
   if(profile->colored) colored_done = 1;
   if(profile->bits == 16) numcolors_done = 1;
-  if(profile->bits >= bpp) bits_done = 1;
+  if(profile->bits >= maxbits) bits_done = 1;
   if(profile->numcolors >= maxnumcolors) numcolors_done = 1;
 
   if(!numcolors_done)
@@ -3785,26 +4493,20 @@ unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
     for(i = 0; i < profile->numcolors; i++)
     {
       const unsigned char* color = &profile->palette[i * 4];
-      color_tree_add(&tree, color[0], color[1], color[2], color[3], i);
+      color_set_add(&set, color[0] | (color[1] << 8u) | (color[2] << 16u) | ((unsigned)color[3] << 24u));
     }
   }
 
   /*Check if the 16-bit input is truly 16-bit*/
   if(mode_in->bitdepth == 16 && !sixteen)
   {
-    unsigned short r, g, b, a;
-    for(i = 0; i != numpixels; ++i)
+    /*the color key and the alpha made up for it are 8-bit representable, so only the values in the image matter*/
+    if(!is8BitRepresentable(in, lodepng_get_raw_size(w, h, mode_in)))
     {
-      getPixelColorRGBA16(&r, &g, &b, &a, in, i, mode_in);
-      if((r & 255) != ((r >> 8) & 255) || (g & 255) != ((g >> 8) & 255) ||
-         (b & 255) != ((b >> 8) & 255) || (a & 255) != ((a >> 8) & 255)) /*first and second byte differ*/
-      {
-        profile->bits = 16;
-        sixteen = 1;
-        bits_done = 1;
-        numcolors_done = 1; /*counting colors no longer useful, palette doesn't support 16-bit*/
-        break;
-      }
+      profile->bits = 16;
+      sixteen = 1;
+      bits_done = 1;
+      numcolors_done = 1; /*counting colors no longer useful, palette doesn't support 16-bit*/
     }
   }
 
@@ -3867,9 +4569,36 @@ unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
   else /* < 16-bit */
   {
     unsigned char r = 0, g = 0, b = 0, a = 0;
+
+    if(rgba8 && (!colored_done || !alpha_done))
+    {
+      /*Most images given to the encoder are RGBA, these two are decided for the whole image at once.
+      Finding a colored pixel up front gives the same profile as finding it during the loop below. An
+      opaque image changes nothing in the alpha test below, unless there is a color key already.*/
+      unsigned grey, opaque;
+      getRGBA8Properties(&grey, &opaque, in, numpixels);
+      if(!colored_done)
+      {
+        if(!grey)
+        {
+          profile->colored = 1;
+          if(profile->bits < 8) profile->bits = 8; /*PNG has no colored modes with less than 8-bit per channel*/
+        }
+        colored_done = 1;
+      }
+      if(opaque && !profile->key) alpha_done = 1;
+    }
+
     for(i = 0; i != numpixels; ++i)
     {
-      getPixelColorRGBA8(&r, &g, &b, &a, in, i, mode_in);
+      if(rgba8)
+      {
+        r = in[i * 4 + 0];
+        g = in[i * 4 + 1];
+        b = in[i * 4 + 2];
+        a = in[i * 4 + 3];
+      }
+      else getPixelColorRGBA8(&r, &g, &b, &a, in, i, mode_in);
 
       if(!bits_done && profile->bits < 8)
       {
@@ -3877,7 +4606,7 @@ unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
         unsigned bits = getValueRequiredBits(r);
         if(bits > profile->bits) profile->bits = bits;
       }
-      bits_done = (profile->bits >= bpp);
+      bits_done = (profile->bits >= maxbits);
 
       if(!colored_done && (r != g || r != b))
       {
@@ -3915,9 +4644,8 @@ unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
 
       if(!numcolors_done)
       {
-        if(!color_tree_has(&tree, r, g, b, a))
+        if(color_set_add(&set, r | (g << 8u) | (b << 16u) | ((unsigned)a << 24u)))
         {
-          color_tree_add(&tree, r, g, b, a, profile->numcolors);
           if(profile->numcolors < 256)
           {
             unsigned char* p = profile->palette;
@@ -3957,7 +4685,6 @@ unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
     profile->key_b += (profile->key_b << 8);
   }
 
-  color_tree_cleanup(&tree);
   return error;
 }
 
@@ -4319,106 +5046,193 @@ static unsigned unfilter(unsigned char* out, const unsigned char* in, unsigned w
   return 0;
 }
 
-/*
-in: Adam7 interlaced image, with no padding bits between scanlines, but between
- reduced images so that each reduced image starts at a byte.
-out: the same pixels, but re-ordered so that they're now a non-interlaced image with size w*h
-bpp: bits per pixel
-out has the following size in bits: w * h * bpp.
-in is possibly bigger due to padding bits between reduced images.
-out must be big enough AND must be 0 everywhere if bpp < 8 in the current implementation
-(because that's likely a little bit faster)
-NOTE: comments about padding bits are only relevant if bpp < 8
-*/
-static void Adam7_deinterlace(unsigned char* out, const unsigned char* in, unsigned w, unsigned h, unsigned bpp)
+/*writes one unfiltered scanline of an Adam7 pass with bpp >= 8 to its pixels in the full image. out
+points at the first pixel of the row in the full image, step is the distance in bytes between its pixels.
+The constant sizes let the compiler turn every pixel into a single load and store.*/
+static void Adam7_scatterBytes(unsigned char* out, const unsigned char* line, unsigned passw,
+                               size_t step, size_t bytewidth)
 {
-  unsigned passw[7], passh[7];
-  size_t filter_passstart[8], padded_passstart[8], passstart[8];
-  unsigned i;
-
-  Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart, w, h, bpp);
-
-  if(bpp >= 8)
+  unsigned x;
+  if(step == bytewidth)
   {
-    for(i = 0; i != 7; ++i)
-    {
-      unsigned x, y, b;
-      size_t bytewidth = bpp / 8;
-      for(y = 0; y < passh[i]; ++y)
-      for(x = 0; x < passw[i]; ++x)
-      {
-        size_t pixelinstart = passstart[i] + (y * passw[i] + x) * bytewidth;
-        size_t pixeloutstart = ((ADAM7_IY[i] + y * ADAM7_DY[i]) * w + ADAM7_IX[i] + x * ADAM7_DX[i]) * bytewidth;
-        for(b = 0; b < bytewidth; ++b)
-        {
-          out[pixeloutstart + b] = in[pixelinstart + b];
-        }
-      }
-    }
+    memcpy(out, line, passw * bytewidth); /*the last pass has all pixels of its rows*/
+    return;
   }
-  else /*bpp < 8: Adam7 with pixels < 8 bit is a bit trickier: with bit pointers*/
+  switch(bytewidth)
   {
-    for(i = 0; i != 7; ++i)
-    {
-      unsigned x, y, b;
-      unsigned ilinebits = bpp * passw[i];
-      unsigned olinebits = bpp * w;
-      size_t obp, ibp; /*bit pointers (for out and in buffer)*/
-      for(y = 0; y < passh[i]; ++y)
-      for(x = 0; x < passw[i]; ++x)
-      {
-        ibp = (8 * passstart[i]) + (y * ilinebits + x * bpp);
-        obp = (ADAM7_IY[i] + y * ADAM7_DY[i]) * olinebits + (ADAM7_IX[i] + x * ADAM7_DX[i]) * bpp;
-        for(b = 0; b < bpp; ++b)
-        {
-          unsigned char bit = readBitFromReversedStream(&ibp, in);
-          /*note that this function assumes the out buffer is completely 0, use setBitOfReversedStream otherwise*/
-          setBitOfReversedStream0(&obp, out, bit);
-        }
-      }
-    }
+    case 1: for(x = 0; x != passw; ++x) out[x * step] = line[x]; break;
+    case 2: for(x = 0; x != passw; ++x) memcpy(&out[x * step], &line[x * 2], 2); break;
+    case 3: for(x = 0; x != passw; ++x) memcpy(&out[x * step], &line[x * 3], 3); break;
+    case 4: for(x = 0; x != passw; ++x) memcpy(&out[x * step], &line[x * 4], 4); break;
+    case 6: for(x = 0; x != passw; ++x) memcpy(&out[x * step], &line[x * 6], 6); break;
+    case 8: for(x = 0; x != passw; ++x) memcpy(&out[x * step], &line[x * 8], 8); break;
+    default: for(x = 0; x != passw; ++x) memcpy(&out[x * step], &line[x * bytewidth], bytewidth); break;
   }
 }
 
-static void removePaddingBits(unsigned char* out, const unsigned char* in,
-                              size_t olinebits, size_t ilinebits, unsigned h)
+/*the same as Adam7_scatterBytes for bpp < 8, obp is the bit position of the first pixel of the row.
+Note that this function assumes the out buffer is completely 0.*/
+static void Adam7_scatterBits(unsigned char* out, const unsigned char* line, unsigned passw,
+                              size_t obp, size_t step, unsigned bpp)
 {
-  /*
-  After filtering there are still padding bits if scanlines have non multiple of 8 bit amounts. They need
-  to be removed (except at last scanline of (Adam7-reduced) image) before working with pure image buffers
-  for the Adam7 code, the color convert code and the output to the user.
-  in and out are allowed to be the same buffer, in may also be higher but still overlapping; in must
-  have >= ilinebits*h bits, out must have >= olinebits*h bits, olinebits must be <= ilinebits
-  also used to move bits after earlier such operations happened, e.g. in a sequence of reduced images from Adam7
-  only useful if (ilinebits - olinebits) is a value in the range 1..7
-  */
-  unsigned y;
-  size_t diff = ilinebits - olinebits;
-  size_t ibp = 0, obp = 0; /*input and output bit pointers*/
-  for(y = 0; y < h; ++y)
+  unsigned x, b;
+  size_t ibp = 0;
+  for(x = 0; x != passw; ++x, obp += step - bpp)
   {
-    size_t x;
-    for(x = 0; x < olinebits; ++x)
+    for(b = 0; b < bpp; ++b)
     {
-      unsigned char bit = readBitFromReversedStream(&ibp, in);
-      setBitOfReversedStream(&obp, out, bit);
+      unsigned char bit = readBitFromReversedStream(&ibp, line);
+      setBitOfReversedStream0(&obp, out, bit);
     }
-    ibp += diff;
   }
 }
 
-/*out must be buffer big enough to contain full image, and in must contain the full decompressed data from
-the IDAT chunks (with filter index bytes and possible padding bits)
-return value is error*/
-static unsigned postProcessScanlines(unsigned char* out, unsigned char* in,
-                                     unsigned w, unsigned h, const LodePNGInfo* info_png)
+typedef struct Adam7Passes
 {
-  /*
+  unsigned char* out; /*the full image, 0 everywhere*/
+  const unsigned char* in; /*the decompressed scanlines of all passes*/
+  unsigned w, bpp;
+  unsigned passw[7], passh[7];
+  size_t filter_passstart[8], padded_passstart[8], passstart[8];
+  unsigned error[7];
+} Adam7Passes;
+
+/*unfilters one pass of an Adam7 image, keeping only two scanlines, and puts every scanline in its
+place in the full image right away. The passes only read their own part of the input and, with bpp >= 8,
+write different bytes of the output, so they can run at the same time.*/
+static unsigned Adam7_decodePass(Adam7Passes* passes, unsigned i)
+{
+  unsigned y;
+  unsigned w = passes->w, bpp = passes->bpp;
+  unsigned passw = passes->passw[i], passh = passes->passh[i];
+  size_t bytewidth = (bpp + 7) / 8;
+  size_t linebytes = (passw * bpp + 7) / 8;
+  const unsigned char* in = &passes->in[passes->filter_passstart[i]];
+  unsigned char* rows;
+  unsigned char* line;
+  unsigned char* prevline = 0;
+
+  if(passw == 0 || passh == 0) return 0;
+
+  rows = (unsigned char*)lodepng_malloc(linebytes * 2);
+  if(!rows) return 83; /*alloc fail*/
+  line = rows;
+
+  for(y = 0; y != passh; ++y)
+  {
+    size_t outy = ADAM7_IY[i] + (size_t)y * ADAM7_DY[i];
+    const unsigned char* scanline = &in[(1 + linebytes) * y]; /*the filter type byte and the filtered bytes*/
+    unsigned error = unfilterScanline(line, scanline + 1, prevline, bytewidth, scanline[0], linebytes);
+    if(error)
+    {
+      lodepng_free(rows);
+      return error;
+    }
+
+    if(bpp >= 8)
+    {
+      Adam7_scatterBytes(&passes->out[(outy * w + ADAM7_IX[i]) * bytewidth], line, passw,
+                         ADAM7_DX[i] * bytewidth, bytewidth);
+    }
+    else
+    {
+      Adam7_scatterBits(passes->out, line, passw, outy * w * bpp + ADAM7_IX[i] * bpp, ADAM7_DX[i] * bpp, bpp);
+    }
+
+    prevline = line;
+    line = line == rows ? rows + linebytes : rows;
+  }
+
+  lodepng_free(rows);
+  return 0;
+}
+
+/*task for custom_parallel: the largest passes are handed out first*/
+static void Adam7_decodePassTask(void* data, unsigned index)
+{
+  Adam7Passes* passes = (Adam7Passes*)data;
+  passes->error[6 - index] = Adam7_decodePass(passes, 6 - index);
+}
+
+/*
+in: the decompressed Adam7 interlaced image, the seven filtered reduced images
+out: the same pixels, unfiltered and re-ordered so that they're now a non-interlaced image with size w*h
+bpp: bits per pixel
+out must be big enough AND must be 0 everywhere if bpp < 8 in the current implementation.
+Unlike the non-interlaced case in is not modified. With bpp >= 8 the passes are decoded with
+settings->custom_parallel if it is set.
+*/
+static unsigned Adam7_decode(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
+                             unsigned bpp, const LodePNGDecoderSettings* settings)
+{
+  Adam7Passes passes;
+  unsigned i;
+
+  passes.out = out;
+  passes.in = in;
+  passes.w = w;
+  passes.bpp = bpp;
+  Adam7_getpassvalues(passes.passw, passes.passh, passes.filter_passstart, passes.padded_passstart,
+                      passes.passstart, w, h, bpp);
+  for(i = 0; i != 7; ++i) passes.error[i] = 0;
+
+  /*with less than 8 bits per pixel, pixels of different passes share bytes of out*/
+  if(bpp >= 8 && settings->custom_parallel)
+  {
+    settings->custom_parallel(Adam7_decodePassTask, &passes, 7, settings->custom_parallel_context);
+  }
+  else
+  {
+    for(i = 0; i != 7; ++i) Adam7_decodePassTask(&passes, i);
+  }
+
+  for(i = 0; i != 7; ++i)
+  {
+    if(passes.error[i]) return passes.error[i];
+  }
+  return 0;
+}
+
+static void removePaddingBits(unsigned char* out, const unsigned char* in,
+                              size_t olinebits, size_t ilinebits, unsigned h)
+{
+  /*
+  After filtering there are still padding bits if scanlines have non multiple of 8 bit amounts. They need
+  to be removed (except at last scanline of (Adam7-reduced) image) before working with pure image buffers
+  for the Adam7 code, the color convert code and the output to the user.
+  in and out are allowed to be the same buffer, in may also be higher but still overlapping; in must
+  have >= ilinebits*h bits, out must have >= olinebits*h bits, olinebits must be <= ilinebits
+  also used to move bits after earlier such operations happened, e.g. in a sequence of reduced images from Adam7
+  only useful if (ilinebits - olinebits) is a value in the range 1..7
+  */
+  unsigned y;
+  size_t diff = ilinebits - olinebits;
+  size_t ibp = 0, obp = 0; /*input and output bit pointers*/
+  for(y = 0; y < h; ++y)
+  {
+    size_t x;
+    for(x = 0; x < olinebits; ++x)
+    {
+      unsigned char bit = readBitFromReversedStream(&ibp, in);
+      setBitOfReversedStream(&obp, out, bit);
+    }
+    ibp += diff;
+  }
+}
+
+/*out must be buffer big enough to contain full image, and in must contain the full decompressed data from
+the IDAT chunks (with filter index bytes and possible padding bits)
+return value is error*/
+static unsigned postProcessScanlines(unsigned char* out, unsigned char* in,
+                                     unsigned w, unsigned h, const LodePNGInfo* info_png,
+                                     const LodePNGDecoderSettings* settings)
+{
+  /*
   This function converts the filtered-padded-interlaced data into pure 2D image buffer with the PNG's colortype.
   Steps:
   *) if no Adam7: 1) unfilter 2) remove padding bits (= posible extra bits per scanline if bpp < 8)
-  *) if adam7: 1) 7x unfilter 2) 7x remove padding bits 3) Adam7_deinterlace
-  NOTE: the in buffer will be overwritten with intermediate data!
+  *) if adam7: per pass, unfilter a scanline and put its pixels in place, see Adam7_decode
+  NOTE: without Adam7 the in buffer will be overwritten with intermediate data!
   */
   unsigned bpp = lodepng_get_bpp(&info_png->color);
   if(bpp == 0) return 31; /*error: invalid colortype*/
@@ -4435,26 +5249,7 @@ static unsigned postProcessScanlines(unsigned char* out, unsigned char* in,
   }
   else /*interlace_method is 1 (Adam7)*/
   {
-    unsigned passw[7], passh[7]; size_t filter_passstart[8], padded_passstart[8], passstart[8];
-    unsigned i;
-
-    Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart, w, h, bpp);
-
-    for(i = 0; i != 7; ++i)
-    {
-      CERROR_TRY_RETURN(unfilter(&in[padded_passstart[i]], &in[filter_passstart[i]], passw[i], passh[i], bpp));
-      /*TODO: possible efficiency improvement: if in this reduced image the bits fit nicely in 1 scanline,
-      move bytes instead of bits or move not at all*/
-      if(bpp < 8)
-      {
-        /*remove padding bits in scanlines; after this there still may be padding
-        bits between the different reduced images: each reduced image still starts nicely at a byte*/
-        removePaddingBits(&in[passstart[i]], &in[padded_passstart[i]], passw[i] * bpp,
-                          ((passw[i] * bpp + 7) / 8) * 8, passh[i]);
-      }
-    }
-
-    Adam7_deinterlace(out, in, w, h, bpp);
+    CERROR_TRY_RETURN(Adam7_decode(out, in, w, h, bpp, settings));
   }
 
   return 0;
@@ -5161,7 +5956,7 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
   if(!state->error)
   {
     for(i = 0; i < outsize; i++) (*out)[i] = 0;
-    state->error = postProcessScanlines(*out, scanlines.data, *w, *h, &state->info_png);
+    state->error = postProcessScanlines(*out, scanlines.data, *w, *h, &state->info_png, &state->decoder);
   }
   ucvector_cleanup(&scanlines);
 }
@@ -5258,175 +6053,701 @@ unsigned lodepng_decode24_file(unsigned char** out, unsigned* w, unsigned* h, co
 }
 #endif /*LODEPNG_COMPILE_DISK*/
 
-void lodepng_decoder_settings_init(LodePNGDecoderSettings* settings)
-{
-  settings->color_convert = 1;
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-  settings->read_text_chunks = 1;
-  settings->remember_unknown_chunks = 0;
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-  settings->ignore_crc = 0;
-  settings->ignore_critical = 0;
-  settings->ignore_end = 0;
-  lodepng_decompress_settings_init(&settings->zlibsettings);
-}
-
-#endif /*LODEPNG_COMPILE_DECODER*/
+/* ////////////////////////////////////////////////////////////////////////// */
+/* / Streaming Decoder                                                      / */
+/* ////////////////////////////////////////////////////////////////////////// */
 
-#if defined(LODEPNG_COMPILE_DECODER) || defined(LODEPNG_COMPILE_ENCODER)
+/*compressed bytes staged from the IDAT chunks at a time*/
+#define STREAM_INPUT_SIZE 65536
+/*deflate back references reach at most this far into the decompressed data*/
+#define STREAM_WINDOW_SIZE 32768
+/*decompressed data is produced into a buffer of this size (plus two rows), and moved back to
+keep the window when full. Larger than the window so that the move happens only every ~100 KB*/
+#define STREAM_OUTPUT_SIZE 131072
 
-void lodepng_state_init(LodePNGState* state)
+/*
+Inflates the zlib stream spread over consecutive IDAT chunks, stopping whenever enough output
+is available. Compressed bytes are staged in a small buffer and decompressed bytes kept in a
+sliding window, so memory does not grow with the image.
+*/
+typedef struct StreamInflator
+{
+  const unsigned char* chunk; /*IDAT chunk currently read from, 0 once all IDAT chunks are staged*/
+  const unsigned char* next; /*first chunk after the IDAT chunks, valid once chunk is 0*/
+  const unsigned char* end; /*end of the PNG file*/
+  size_t chunkpos; /*bytes of the data of chunk already staged*/
+  unsigned ignore_crc;
+
+  unsigned char* in; /*staged compressed data*/
+  size_t insize;
+  size_t bp; /*bit pointer in the staged data*/
+
+  unsigned blocktype; /*0: at a block header, 1: in a huffman block, 2: in a stored block, 3: after the final block*/
+  unsigned final; /*the current block is the final one*/
+  size_t storedsize; /*bytes left in the stored block*/
+  HuffmanTree tree_ll;
+  HuffmanTree tree_d;
+
+  unsigned char* out; /*decompressed data: the window followed by bytes not yet taken*/
+  size_t outsize;
+  size_t outcapacity;
+  size_t outpos; /*first byte not yet taken*/
+  unsigned adler; /*adler32 of all bytes taken so far*/
+} StreamInflator;
+
+/*checks the chunk at the given position, which must be an IDAT chunk that fits in the file*/
+static unsigned streamInflator_enterChunk(StreamInflator* s, const unsigned char* chunk)
 {
-#ifdef LODEPNG_COMPILE_DECODER
-  lodepng_decoder_settings_init(&state->decoder);
-#endif /*LODEPNG_COMPILE_DECODER*/
-#ifdef LODEPNG_COMPILE_ENCODER
-  lodepng_encoder_settings_init(&state->encoder);
-#endif /*LODEPNG_COMPILE_ENCODER*/
-  lodepng_color_mode_init(&state->info_raw);
-  lodepng_info_init(&state->info_png);
-  state->error = 1;
+  unsigned chunkLength;
+  if(chunk < s->chunk || (size_t)(s->end - chunk) < 12) return 30; /*error: chunk doesn't fit in the file*/
+  chunkLength = lodepng_chunk_length(chunk);
+  if(chunkLength > 2147483647) return 63;
+  if((size_t)(s->end - chunk) - 12 < chunkLength) return 64;
+  if(!s->ignore_crc && lodepng_chunk_check_crc(chunk)) return 57; /*invalid CRC*/
+  s->chunk = chunk;
+  s->chunkpos = 0;
+  return 0;
 }
 
-void lodepng_state_cleanup(LodePNGState* state)
+/*moves the unread staged bytes to the front and stages as much new IDAT data as fits*/
+static unsigned streamInflator_refill(StreamInflator* s)
 {
-  lodepng_color_mode_cleanup(&state->info_raw);
-  lodepng_info_cleanup(&state->info_png);
+  size_t used = s->bp >> 3;
+  memmove(s->in, s->in + used, s->insize - used);
+  s->insize -= used;
+  s->bp &= 7;
+
+  while(s->chunk && s->insize < STREAM_INPUT_SIZE)
+  {
+    unsigned chunkLength = lodepng_chunk_length(s->chunk);
+    if(s->chunkpos == chunkLength)
+    {
+      const unsigned char* next = lodepng_chunk_next_const(s->chunk);
+      if(next < s->chunk || (size_t)(s->end - next) < 12 || !lodepng_chunk_type_equals(next, "IDAT"))
+      {
+        s->next = next;
+        s->chunk = 0;
+      }
+      else
+      {
+        unsigned error = streamInflator_enterChunk(s, next);
+        if(error) return error;
+      }
+    }
+    else
+    {
+      size_t amount = chunkLength - s->chunkpos;
+      if(amount > STREAM_INPUT_SIZE - s->insize) amount = STREAM_INPUT_SIZE - s->insize;
+      memcpy(s->in + s->insize, lodepng_chunk_data_const(s->chunk) + s->chunkpos, amount);
+      s->insize += amount;
+      s->chunkpos += amount;
+    }
+  }
+  return 0;
 }
 
-void lodepng_state_copy(LodePNGState* dest, const LodePNGState* source)
+/*makes sure at least the given amount of bytes is staged, unless the IDAT data ends earlier*/
+static unsigned streamInflator_ensure(StreamInflator* s, size_t bytes)
 {
-  lodepng_state_cleanup(dest);
-  *dest = *source;
-  lodepng_color_mode_init(&dest->info_raw);
-  lodepng_info_init(&dest->info_png);
-  dest->error = lodepng_color_mode_copy(&dest->info_raw, &source->info_raw); if(dest->error) return;
-  dest->error = lodepng_info_copy(&dest->info_png, &source->info_png); if(dest->error) return;
+  if(s->chunk && s->insize * 8 - s->bp < bytes * 8) return streamInflator_refill(s);
+  return 0;
 }
 
-#endif /* defined(LODEPNG_COMPILE_DECODER) || defined(LODEPNG_COMPILE_ENCODER) */
-
-#ifdef LODEPNG_COMPILE_ENCODER
+/*first must be an IDAT chunk. rowsize is the largest amount of bytes that will be asked for at once*/
+static unsigned streamInflator_init(StreamInflator* s, const unsigned char* first, const unsigned char* end,
+                                    size_t rowsize, const LodePNGDecoderSettings* settings)
+{
+  unsigned error;
+  unsigned CM, CINFO, FDICT;
 
-/* ////////////////////////////////////////////////////////////////////////// */
-/* / PNG Encoder                                                            / */
-/* ////////////////////////////////////////////////////////////////////////// */
+  s->chunk = first;
+  s->next = 0;
+  s->end = end;
+  s->ignore_crc = settings->ignore_crc;
+  s->insize = 0;
+  s->bp = 0;
+  s->blocktype = 0;
+  s->final = 0;
+  s->storedsize = 0;
+  HuffmanTree_init(&s->tree_ll);
+  HuffmanTree_init(&s->tree_d);
+  s->outsize = 0;
+  s->outpos = 0;
+  s->outcapacity = STREAM_OUTPUT_SIZE + 2 * rowsize;
+  s->adler = 1u;
+  s->in = (unsigned char*)lodepng_malloc(STREAM_INPUT_SIZE);
+  s->out = (unsigned char*)lodepng_malloc(s->outcapacity);
+  if(!s->in || !s->out) return 83; /*alloc fail*/
+
+  error = streamInflator_enterChunk(s, first);
+  if(!error) error = streamInflator_refill(s);
+  if(error) return error;
 
-/*chunkName must be string of 4 characters*/
-static unsigned addChunk(ucvector* out, const char* chunkName, const unsigned char* data, size_t length)
-{
-  CERROR_TRY_RETURN(lodepng_chunk_create(&out->data, &out->size, (unsigned)length, chunkName, data));
-  out->allocsize = out->size; /*fix the allocsize again*/
+  /*the zlib header, see lodepng_zlib_decompress*/
+  if(s->insize < 2) return 53; /*error, size of zlib data too small*/
+  if((s->in[0] * 256 + s->in[1]) % 31 != 0) return 24;
+  CM = s->in[0] & 15;
+  CINFO = (s->in[0] >> 4) & 15;
+  FDICT = (s->in[1] >> 5) & 1;
+  if(CM != 8 || CINFO > 7) return 25;
+  if(FDICT != 0) return 26;
+  s->bp = 16;
   return 0;
 }
 
-static void writeSignature(ucvector* out)
+static void streamInflator_cleanup(StreamInflator* s)
 {
-  /*8 bytes PNG signature, aka the magic bytes*/
-  ucvector_push_back(out, 137);
-  ucvector_push_back(out, 80);
-  ucvector_push_back(out, 78);
-  ucvector_push_back(out, 71);
-  ucvector_push_back(out, 13);
-  ucvector_push_back(out, 10);
-  ucvector_push_back(out, 26);
-  ucvector_push_back(out, 10);
+  HuffmanTree_cleanup(&s->tree_ll);
+  HuffmanTree_cleanup(&s->tree_d);
+  lodepng_free(s->in);
+  lodepng_free(s->out);
 }
 
-static unsigned addChunk_IHDR(ucvector* out, unsigned w, unsigned h,
-                              LodePNGColorType colortype, unsigned bitdepth, unsigned interlace_method)
+static unsigned streamInflator_blockHeader(StreamInflator* s)
 {
   unsigned error = 0;
-  ucvector header;
-  ucvector_init(&header);
-
-  lodepng_add32bitInt(&header, w); /*width*/
-  lodepng_add32bitInt(&header, h); /*height*/
-  ucvector_push_back(&header, (unsigned char)bitdepth); /*bit depth*/
-  ucvector_push_back(&header, (unsigned char)colortype); /*color type*/
-  ucvector_push_back(&header, 0); /*compression method*/
-  ucvector_push_back(&header, 0); /*filter method*/
-  ucvector_push_back(&header, interlace_method); /*interlace method*/
+  unsigned BTYPE;
+  size_t inbitlength;
 
-  error = addChunk(out, "IHDR", header.data, header.size);
-  ucvector_cleanup(&header);
+  /*a dynamic block header takes at most a few hundred bytes*/
+  error = streamInflator_ensure(s, 1024);
+  if(error) return error;
+  inbitlength = s->insize * 8;
 
-  return error;
-}
+  if(s->bp + 3 > inbitlength) return 52; /*error, bit pointer will jump past memory*/
+  s->final = readBitFromStream(&s->bp, s->in);
+  BTYPE = 1u * readBitFromStream(&s->bp, s->in);
+  BTYPE += 2u * readBitFromStream(&s->bp, s->in);
 
-static unsigned addChunk_PLTE(ucvector* out, const LodePNGColorMode* info)
-{
-  unsigned error = 0;
-  size_t i;
-  ucvector PLTE;
-  ucvector_init(&PLTE);
-  for(i = 0; i != info->palettesize * 4; ++i)
+  if(BTYPE == 3) return 20; /*error: invalid BTYPE*/
+  if(BTYPE == 0)
   {
-    /*add all channels except alpha channel*/
-    if(i % 4 != 3) ucvector_push_back(&PLTE, info->palette[i]);
+    size_t p;
+    unsigned LEN, NLEN;
+    s->bp = (s->bp + 7) & ~(size_t)7; /*go to first boundary of byte*/
+    p = s->bp >> 3;
+    if(p + 4 > s->insize) return 52; /*error, bit pointer will jump past memory*/
+    LEN = s->in[p] + 256u * s->in[p + 1];
+    NLEN = s->in[p + 2] + 256u * s->in[p + 3];
+    if(LEN + NLEN != 65535) return 21; /*error: NLEN is not one's complement of LEN*/
+    s->bp += 32;
+    s->storedsize = LEN;
+    s->blocktype = 2;
+    return 0;
   }
-  error = addChunk(out, "PLTE", PLTE.data, PLTE.size);
-  ucvector_cleanup(&PLTE);
 
+  HuffmanTree_cleanup(&s->tree_ll);
+  HuffmanTree_cleanup(&s->tree_d);
+  HuffmanTree_init(&s->tree_ll);
+  HuffmanTree_init(&s->tree_d);
+  if(BTYPE == 1) getTreeInflateFixed(&s->tree_ll, &s->tree_d);
+  else error = getTreeInflateDynamic(&s->tree_ll, &s->tree_d, s->in, &s->bp, s->insize);
+  s->blocktype = 1;
   return error;
 }
 
-static unsigned addChunk_tRNS(ucvector* out, const LodePNGColorMode* info)
+/*inflates until at least "need" bytes are available after outpos, or the deflate stream ends*/
+static unsigned streamInflator_fill(StreamInflator* s, size_t need)
 {
   unsigned error = 0;
-  size_t i;
-  ucvector tRNS;
-  ucvector_init(&tRNS);
-  if(info->colortype == LCT_PALETTE)
+
+  while(!error && s->outsize - s->outpos < need && s->blocktype != 3)
   {
-    size_t amount = info->palettesize;
-    /*the tail of palette values that all have 255 as alpha, does not have to be encoded*/
-    for(i = info->palettesize; i != 0; --i)
+    /*make room for at least one more symbol, keeping the window and the bytes not taken yet*/
+    if(s->outcapacity - s->outsize < MAX_SUPPORTED_DEFLATE_LENGTH)
     {
-      if(info->palette[4 * (i - 1) + 3] == 255) --amount;
-      else break;
+      size_t keep = s->outsize > STREAM_WINDOW_SIZE ? s->outsize - STREAM_WINDOW_SIZE : 0;
+      if(keep > s->outpos) keep = s->outpos;
+      memmove(s->out, s->out + keep, s->outsize - keep);
+      s->outsize -= keep;
+      s->outpos -= keep;
     }
-    /*add only alpha channel*/
-    for(i = 0; i != amount; ++i) ucvector_push_back(&tRNS, info->palette[4 * i + 3]);
-  }
-  else if(info->colortype == LCT_GREY)
-  {
-    if(info->key_defined)
+
+    if(s->blocktype == 0)
     {
-      ucvector_push_back(&tRNS, (unsigned char)(info->key_r >> 8));
-      ucvector_push_back(&tRNS, (unsigned char)(info->key_r & 255));
+      error = streamInflator_blockHeader(s);
     }
-  }
-  else if(info->colortype == LCT_RGB)
-  {
-    if(info->key_defined)
+    else if(s->blocktype == 2)
     {
-      ucvector_push_back(&tRNS, (unsigned char)(info->key_r >> 8));
-      ucvector_push_back(&tRNS, (unsigned char)(info->key_r & 255));
-      ucvector_push_back(&tRNS, (unsigned char)(info->key_g >> 8));
-      ucvector_push_back(&tRNS, (unsigned char)(info->key_g & 255));
-      ucvector_push_back(&tRNS, (unsigned char)(info->key_b >> 8));
-      ucvector_push_back(&tRNS, (unsigned char)(info->key_b & 255));
+      size_t amount = s->storedsize;
+      error = streamInflator_ensure(s, amount < STREAM_INPUT_SIZE ? amount : STREAM_INPUT_SIZE);
+      if(error) break;
+      if(amount > s->insize - (s->bp >> 3)) amount = s->insize - (s->bp >> 3);
+      if(amount > s->outcapacity - s->outsize) amount = s->outcapacity - s->outsize;
+      if(amount == 0 && s->storedsize != 0) ERROR_BREAK(23); /*error: reading outside of in buffer*/
+      memcpy(s->out + s->outsize, s->in + (s->bp >> 3), amount);
+      s->outsize += amount;
+      s->bp += amount * 8;
+      s->storedsize -= amount;
+      if(s->storedsize == 0) s->blocktype = s->final ? 3 : 0;
     }
-  }
+    else
+    {
+      /*decode symbols while there is room for a maximum length match*/
+      while(s->outsize - s->outpos < need && s->outcapacity - s->outsize >= MAX_SUPPORTED_DEFLATE_LENGTH)
+      {
+        size_t inbitlength;
+        unsigned code_ll;
 
-  error = addChunk(out, "tRNS", tRNS.data, tRNS.size);
-  ucvector_cleanup(&tRNS);
+        /*a symbol with its extra bits is at most 48 bits*/
+        error = streamInflator_ensure(s, 8);
+        if(error) break;
+        inbitlength = s->insize * 8;
 
-  return error;
-}
+        code_ll = huffmanDecodeSymbol(s->in, &s->bp, &s->tree_ll, inbitlength);
+        if(code_ll <= 255) /*literal symbol*/
+        {
+          s->out[s->outsize++] = (unsigned char)code_ll;
+        }
+        else if(code_ll >= FIRST_LENGTH_CODE_INDEX && code_ll <= LAST_LENGTH_CODE_INDEX) /*length code*/
+        {
+          unsigned code_d, distance, numextrabits_l, numextrabits_d;
+          size_t length, backward, forward;
 
-static unsigned addChunk_IDAT(ucvector* out, const unsigned char* data, size_t datasize,
-                              LodePNGCompressSettings* zlibsettings)
-{
-  ucvector zlibdata;
-  unsigned error = 0;
+          length = LENGTHBASE[code_ll - FIRST_LENGTH_CODE_INDEX];
+          numextrabits_l = LENGTHEXTRA[code_ll - FIRST_LENGTH_CODE_INDEX];
+          if((s->bp + numextrabits_l) > inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
+          length += readBitsFromStream(&s->bp, s->in, numextrabits_l);
 
-  /*compress with the Zlib compressor*/
-  ucvector_init(&zlibdata);
-  error = zlib_compress(&zlibdata.data, &zlibdata.size, data, datasize, zlibsettings);
-  if(!error) error = addChunk(out, "IDAT", zlibdata.data, zlibdata.size);
-  ucvector_cleanup(&zlibdata);
+          code_d = huffmanDecodeSymbol(s->in, &s->bp, &s->tree_d, inbitlength);
+          if(code_d > 29)
+          {
+            if(code_d == (unsigned)(-1)) error = s->bp > inbitlength ? 10 : 11;
+            else error = 18; /*error: invalid distance code (30-31 are never used)*/
+            break;
+          }
+          distance = DISTANCEBASE[code_d];
+          numextrabits_d = DISTANCEEXTRA[code_d];
+          if((s->bp + numextrabits_d) > inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
+          distance += readBitsFromStream(&s->bp, s->in, numextrabits_d);
+
+          if(distance > s->outsize) ERROR_BREAK(52); /*too long backward distance*/
+          backward = s->outsize - distance;
+          if(distance < length)
+          {
+            for(forward = 0; forward < length; ++forward) s->out[s->outsize++] = s->out[backward++];
+          }
+          else
+          {
+            memcpy(s->out + s->outsize, s->out + backward, length);
+            s->outsize += length;
+          }
+        }
+        else if(code_ll == 256)
+        {
+          s->blocktype = s->final ? 3 : 0;
+          break;
+        }
+        else
+        {
+          error = s->bp > inbitlength ? 10 : 11;
+          break;
+        }
+      }
+    }
+  }
+
+  return error;
+}
+
+/*returns the next "size" bytes of decompressed data, which must have been made available with fill*/
+static const unsigned char* streamInflator_take(StreamInflator* s, size_t size)
+{
+  const unsigned char* result = s->out + s->outpos;
+  s->adler = update_adler32(s->adler, result, (unsigned)size);
+  s->outpos += size;
+  return result;
+}
+
+/*checks that the final block ends after everything was taken, verifies the adler32 checksum, and
+checks that no IDAT data follows it*/
+static unsigned streamInflator_finish(StreamInflator* s, const LodePNGDecompressSettings* settings)
+{
+  size_t p;
+  unsigned error = streamInflator_fill(s, 1);
+  if(error) return error;
+  if(s->outsize != s->outpos) return 91; /*decompressed size doesn't match prediction*/
+  if(s->blocktype != 3) return 52; /*the IDAT data ends before the final block*/
+
+  s->bp = (s->bp + 7) & ~(size_t)7;
+  /*one byte more than the checksum, so that all IDAT chunks are staged unless data follows it*/
+  error = streamInflator_ensure(s, 5);
+  if(error) return error;
+  p = s->bp >> 3;
+  if(!settings->ignore_adler32)
+  {
+    if(p + 4 > s->insize) return 52; /*error, bit pointer will jump past memory*/
+    if(lodepng_read32bitInt(&s->in[p]) != s->adler) return 58; /*error, adler checksum not correct*/
+  }
+  if(s->chunk || s->insize > p + 4) return 109; /*error: IDAT data after the end of the zlib stream*/
+  return 0;
+}
+
+/*
+Processes the chunks from *chunk on like decodeGeneric does, until the first IDAT chunk when
+before_idat is set, or else until IEND. *chunk is left at the IDAT or IEND chunk.
+*/
+static unsigned streamReadChunks(LodePNGState* state, const unsigned char** chunk,
+                                 const unsigned char* in, size_t insize, unsigned before_idat)
+{
+  while(*chunk)
+  {
+    const unsigned char* current = *chunk;
+    unsigned chunkLength;
+    unsigned error;
+
+    if((size_t)(current - in) + 12 > insize || current < in)
+    {
+      if(state->decoder.ignore_end && !before_idat) return 0;
+      return 30; /*error: size of the in buffer too small to contain next chunk*/
+    }
+    chunkLength = lodepng_chunk_length(current);
+    if(chunkLength > 2147483647) return 63;
+    if((size_t)(current - in) + chunkLength + 12 > insize) return 64;
+
+    if(lodepng_chunk_type_equals(current, "IDAT"))
+    {
+      if(before_idat) return 0;
+      /*IDAT chunks after the image data are not allowed, but are harmless here*/
+    }
+    else if(lodepng_chunk_type_equals(current, "IEND"))
+    {
+      if(before_idat) return 48; /*error: no image data*/
+      return 0;
+    }
+    else if(lodepng_chunk_type_equals(current, "IHDR") || (!state->decoder.ignore_critical && !lodepng_chunk_ancillary(current)
+            && !lodepng_chunk_type_equals(current, "PLTE")))
+    {
+      return 69; /*error: unknown critical chunk*/
+    }
+    else
+    {
+      /*handles PLTE, tRNS and the known ancillary chunks, checking their CRC; others are ignored*/
+      error = lodepng_inspect_chunk(state, (size_t)(current - in), in, insize);
+      if(error) return error;
+    }
+    *chunk = lodepng_chunk_next_const(current);
+  }
+  return 0;
+}
+
+static unsigned decodeStream(unsigned* w, unsigned* h, LodePNGState* state,
+                             const unsigned char* in, size_t insize,
+                             LodePNGRowCallback callback, void* user,
+                             unsigned char* surface, size_t stride)
+{
+  const unsigned char* chunk;
+  unsigned error;
+  unsigned convert;
+  size_t rowsize; /*size of an output row*/
+
+  error = lodepng_inspect(w, h, state, in, insize);
+  if(error) return error;
+  if(lodepng_pixel_overflow(*w, *h, &state->info_png.color, &state->info_raw)) return 92;
+
+  chunk = &in[33]; /*first byte of the first chunk after the header*/
+  error = streamReadChunks(state, &chunk, in, insize, 1);
+  if(error) return error;
+
+  if(!state->decoder.color_convert)
+  {
+    error = lodepng_color_mode_copy(&state->info_raw, &state->info_png.color);
+    if(error) return error;
+  }
+  convert = !lodepng_color_mode_equal(&state->info_raw, &state->info_png.color);
+  if(convert && !(state->info_raw.colortype == LCT_RGB || state->info_raw.colortype == LCT_RGBA)
+     && !(state->info_raw.bitdepth == 8))
+  {
+    return 56; /*unsupported color mode conversion*/
+  }
+
+  rowsize = lodepng_get_raw_size(*w, 1, &state->info_raw);
+  if(surface && stride < rowsize) return 106;
+
+  if(state->info_png.interlace_method != 0)
+  {
+    /*Adam7 passes cover the whole image, so rows only become final at the end*/
+    unsigned char* image = 0;
+    unsigned y;
+    size_t linebits = (size_t)*w * lodepng_get_bpp(&state->info_raw);
+    unsigned char* row = (unsigned char*)lodepng_malloc(rowsize);
+
+    error = row ? lodepng_decode(&image, w, h, state, in, insize) : 83;
+    for(y = 0; y < *h && !error; ++y)
+    {
+      /*the raw image has no padding bits between rows, rows handed out start at a byte*/
+      unsigned char* dest = surface ? surface + (size_t)y * stride : row;
+      if(linebits % 8 == 0)
+      {
+        memcpy(dest, image + y * (linebits / 8), rowsize);
+      }
+      else
+      {
+        size_t ibp = y * linebits, obp = 0, x;
+        for(x = 0; x < rowsize; ++x) dest[x] = 0;
+        for(x = 0; x < linebits; ++x) setBitOfReversedStream(&obp, dest, readBitFromReversedStream(&ibp, image));
+      }
+      if(callback) error = callback(user, y, dest, rowsize);
+    }
+    lodepng_free(image);
+    lodepng_free(row);
+    return error;
+  }
+  else
+  {
+    StreamInflator inflator;
+    unsigned bpp = lodepng_get_bpp(&state->info_png.color);
+    size_t linebytes = ((size_t)*w * bpp + 7) / 8; /*size of an unfiltered PNG row*/
+    size_t bytewidth = (bpp + 7) / 8;
+    unsigned char* prevline = (unsigned char*)lodepng_malloc(linebytes);
+    unsigned char* line = (unsigned char*)lodepng_malloc(linebytes);
+    unsigned char* converted = convert && !surface ? (unsigned char*)lodepng_malloc(rowsize) : 0;
+    unsigned y;
+
+    error = streamInflator_init(&inflator, chunk, in + insize, linebytes + 1, &state->decoder);
+    if(!prevline || !line || (convert && !surface && !converted)) error = 83; /*alloc fail*/
+
+    for(y = 0; y < *h && !error; ++y)
+    {
+      const unsigned char* scanline;
+      unsigned char* dest;
+
+      error = streamInflator_fill(&inflator, linebytes + 1);
+      if(error) break;
+      if(inflator.outsize - inflator.outpos < linebytes + 1) ERROR_BREAK(91); /*too little image data*/
+      scanline = streamInflator_take(&inflator, linebytes + 1);
+
+      /*the first byte of a scanline is the filter type*/
+      error = unfilterScanline(line, scanline + 1, y ? prevline : 0, bytewidth, scanline[0], linebytes);
+      if(error) break;
+
+      if(convert)
+      {
+        dest = surface ? surface + (size_t)y * stride : converted;
+        error = lodepng_convert(dest, line, &state->info_raw, &state->info_png.color, *w, 1);
+        if(error) break;
+      }
+      else if(surface)
+      {
+        dest = surface + (size_t)y * stride;
+        memcpy(dest, line, rowsize);
+      }
+      else dest = line;
+
+      if(callback) error = callback(user, y, dest, rowsize);
+
+      /*swap, the current row is the previous one for the next*/
+      scanline = prevline;
+      prevline = line;
+      line = (unsigned char*)scanline;
+    }
+
+    if(!error) error = streamInflator_finish(&inflator, &state->decoder.zlibsettings);
+    if(!error)
+    {
+      chunk = inflator.next; /*all IDAT chunks were read to their end*/
+      error = streamReadChunks(state, &chunk, in, insize, 0);
+    }
+
+    streamInflator_cleanup(&inflator);
+    lodepng_free(prevline);
+    lodepng_free(line);
+    lodepng_free(converted);
+    return error;
+  }
+}
+
+unsigned lodepng_decode_rows(unsigned* w, unsigned* h,
+                             LodePNGState* state,
+                             const unsigned char* in, size_t insize,
+                             LodePNGRowCallback callback, void* user)
+{
+  state->error = decodeStream(w, h, state, in, insize, callback, user, 0, 0);
+  return state->error;
+}
+
+unsigned lodepng_decode_into(unsigned char* out, size_t stride, unsigned w, unsigned h,
+                             LodePNGState* state,
+                             const unsigned char* in, size_t insize)
+{
+  unsigned width, height;
+  state->error = lodepng_inspect(&width, &height, state, in, insize);
+  if(!state->error && (width != w || height != h)) state->error = 105;
+  if(!state->error) state->error = decodeStream(&width, &height, state, in, insize, 0, 0, out, stride);
+  return state->error;
+}
+
+void lodepng_decoder_settings_init(LodePNGDecoderSettings* settings)
+{
+  settings->color_convert = 1;
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+  settings->read_text_chunks = 1;
+  settings->remember_unknown_chunks = 0;
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  settings->ignore_crc = 0;
+  settings->ignore_critical = 0;
+  settings->ignore_end = 0;
+  settings->custom_parallel = 0;
+  settings->custom_parallel_context = 0;
+  lodepng_decompress_settings_init(&settings->zlibsettings);
+}
+
+#endif /*LODEPNG_COMPILE_DECODER*/
+
+#if defined(LODEPNG_COMPILE_DECODER) || defined(LODEPNG_COMPILE_ENCODER)
+
+void lodepng_state_init(LodePNGState* state)
+{
+#ifdef LODEPNG_COMPILE_DECODER
+  lodepng_decoder_settings_init(&state->decoder);
+#endif /*LODEPNG_COMPILE_DECODER*/
+#ifdef LODEPNG_COMPILE_ENCODER
+  lodepng_encoder_settings_init(&state->encoder);
+#endif /*LODEPNG_COMPILE_ENCODER*/
+  lodepng_color_mode_init(&state->info_raw);
+  lodepng_info_init(&state->info_png);
+  state->error = 1;
+}
+
+void lodepng_state_cleanup(LodePNGState* state)
+{
+  lodepng_color_mode_cleanup(&state->info_raw);
+  lodepng_info_cleanup(&state->info_png);
+}
+
+void lodepng_state_copy(LodePNGState* dest, const LodePNGState* source)
+{
+  lodepng_state_cleanup(dest);
+  *dest = *source;
+  lodepng_color_mode_init(&dest->info_raw);
+  lodepng_info_init(&dest->info_png);
+  dest->error = lodepng_color_mode_copy(&dest->info_raw, &source->info_raw); if(dest->error) return;
+  dest->error = lodepng_info_copy(&dest->info_png, &source->info_png); if(dest->error) return;
+}
+
+#endif /* defined(LODEPNG_COMPILE_DECODER) || defined(LODEPNG_COMPILE_ENCODER) */
+
+#ifdef LODEPNG_COMPILE_ENCODER
+
+/* ////////////////////////////////////////////////////////////////////////// */
+/* / PNG Encoder                                                            / */
+/* ////////////////////////////////////////////////////////////////////////// */
+
+/*chunkName must be string of 4 characters*/
+static unsigned addChunk(ucvector* out, const char* chunkName, const unsigned char* data, size_t length)
+{
+  CERROR_TRY_RETURN(lodepng_chunk_create(&out->data, &out->size, (unsigned)length, chunkName, data));
+  out->allocsize = out->size; /*fix the allocsize again*/
+  return 0;
+}
+
+static void writeSignature(ucvector* out)
+{
+  /*8 bytes PNG signature, aka the magic bytes*/
+  ucvector_push_back(out, 137);
+  ucvector_push_back(out, 80);
+  ucvector_push_back(out, 78);
+  ucvector_push_back(out, 71);
+  ucvector_push_back(out, 13);
+  ucvector_push_back(out, 10);
+  ucvector_push_back(out, 26);
+  ucvector_push_back(out, 10);
+}
+
+static unsigned addChunk_IHDR(ucvector* out, unsigned w, unsigned h,
+                              LodePNGColorType colortype, unsigned bitdepth, unsigned interlace_method)
+{
+  unsigned error = 0;
+  ucvector header;
+  ucvector_init(&header);
+
+  lodepng_add32bitInt(&header, w); /*width*/
+  lodepng_add32bitInt(&header, h); /*height*/
+  ucvector_push_back(&header, (unsigned char)bitdepth); /*bit depth*/
+  ucvector_push_back(&header, (unsigned char)colortype); /*color type*/
+  ucvector_push_back(&header, 0); /*compression method*/
+  ucvector_push_back(&header, 0); /*filter method*/
+  ucvector_push_back(&header, interlace_method); /*interlace method*/
+
+  error = addChunk(out, "IHDR", header.data, header.size);
+  ucvector_cleanup(&header);
+
+  return error;
+}
+
+static unsigned addChunk_PLTE(ucvector* out, const LodePNGColorMode* info)
+{
+  unsigned error = 0;
+  size_t i;
+  ucvector PLTE;
+  ucvector_init(&PLTE);
+  for(i = 0; i != info->palettesize * 4; ++i)
+  {
+    /*add all channels except alpha channel*/
+    if(i % 4 != 3) ucvector_push_back(&PLTE, info->palette[i]);
+  }
+  error = addChunk(out, "PLTE", PLTE.data, PLTE.size);
+  ucvector_cleanup(&PLTE);
+
+  return error;
+}
+
+static unsigned addChunk_tRNS(ucvector* out, const LodePNGColorMode* info)
+{
+  unsigned error = 0;
+  size_t i;
+  ucvector tRNS;
+  ucvector_init(&tRNS);
+  if(info->colortype == LCT_PALETTE)
+  {
+    size_t amount = info->palettesize;
+    /*the tail of palette values that all have 255 as alpha, does not have to be encoded*/
+    for(i = info->palettesize; i != 0; --i)
+    {
+      if(info->palette[4 * (i - 1) + 3] == 255) --amount;
+      else break;
+    }
+    /*add only alpha channel*/
+    for(i = 0; i != amount; ++i) ucvector_push_back(&tRNS, info->palette[4 * i + 3]);
+  }
+  else if(info->colortype == LCT_GREY)
+  {
+    if(info->key_defined)
+    {
+      ucvector_push_back(&tRNS, (unsigned char)(info->key_r >> 8));
+      ucvector_push_back(&tRNS, (unsigned char)(info->key_r & 255));
+    }
+  }
+  else if(info->colortype == LCT_RGB)
+  {
+    if(info->key_defined)
+    {
+      ucvector_push_back(&tRNS, (unsigned char)(info->key_r >> 8));
+      ucvector_push_back(&tRNS, (unsigned char)(info->key_r & 255));
+      ucvector_push_back(&tRNS, (unsigned char)(info->key_g >> 8));
+      ucvector_push_back(&tRNS, (unsigned char)(info->key_g & 255));
+      ucvector_push_back(&tRNS, (unsigned char)(info->key_b >> 8));
+      ucvector_push_back(&tRNS, (unsigned char)(info->key_b & 255));
+    }
+  }
+
+  error = addChunk(out, "tRNS", tRNS.data, tRNS.size);
+  ucvector_cleanup(&tRNS);
+
+  return error;
+}
+
+static unsigned addChunk_IDAT(ucvector* out, const unsigned char* data, size_t datasize,
+                              LodePNGCompressSettings* zlibsettings)
+{
+  ucvector zlibdata;
+  unsigned error = 0;
+
+  /*compress with the Zlib compressor*/
+  ucvector_init(&zlibdata);
+  error = zlib_compress(&zlibdata.data, &zlibdata.size, data, datasize, zlibsettings);
+  if(!error) error = addChunk(out, "IDAT", zlibdata.data, zlibdata.size);
+  ucvector_cleanup(&zlibdata);
 
   return error;
 }
@@ -5721,13 +7042,141 @@ static float flog2(float f)
   return result + 1.442695f * (f * f * f / 3 - 3 * f * f / 2 + 3 * f - 1.83333f);
 }
 
-static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
-                       const LodePNGColorMode* info, const LodePNGEncoderSettings* settings)
+/*minsum cost of a filtered byte: its absolute value when interpreted as signed char*/
+static unsigned filterCost(unsigned char s)
+{
+  return s < 128 ? s : 256u - s;
+}
+
+#ifdef LODEPNG_SIMD_SSE2
+static __m128i filterCostSSE2(__m128i s)
+{
+  /*min(s, 256 - s) per byte, summed horizontally into two 64-bit lanes*/
+  __m128i zero = _mm_setzero_si128();
+  return _mm_sad_epu8(_mm_min_epu8(s, _mm_sub_epi8(zero, s)), zero);
+}
+
+static __m128i paethPredictorSSE2(__m128i a, __m128i b, __m128i c)
+{
+  /*same decisions as paethPredictor, on 8 bytes widened to 16 bits*/
+  __m128i zero = _mm_setzero_si128();
+  __m128i a16 = _mm_unpacklo_epi8(a, zero);
+  __m128i b16 = _mm_unpacklo_epi8(b, zero);
+  __m128i c16 = _mm_unpacklo_epi8(c, zero);
+  __m128i pa = _mm_sub_epi16(b16, c16);
+  __m128i pb = _mm_sub_epi16(a16, c16);
+  __m128i pc = _mm_add_epi16(pa, pb);
+  __m128i not_a, c_over_b, bc;
+  pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+  pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+  pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+  c_over_b = _mm_cmpgt_epi16(pb, pc);
+  bc = _mm_or_si128(_mm_and_si128(c_over_b, c16), _mm_andnot_si128(c_over_b, b16));
+  not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+  return _mm_or_si128(_mm_and_si128(not_a, bc), _mm_andnot_si128(not_a, a16));
+}
+#endif /*LODEPNG_SIMD_SSE2*/
+
+/*
+Computes the minsum cost of all five filter types for one scanline in a single pass, without
+storing the filtered bytes. prevline must not be null: pass a row of zeros for the first scanline.
+Left and upper-left neighbours are read with a bytewidth offset, so 3 and 4 byte pixels (and
+every other bytewidth) use the same vectorized loop.
+*/
+static void filterCosts(size_t cost[5], const unsigned char* scanline, const unsigned char* prevline,
+                        size_t length, size_t bytewidth)
+{
+  size_t i;
+  for(i = 0; i != 5; ++i) cost[i] = 0;
+
+  /*the first pixel has no left neighbour*/
+  for(i = 0; i != bytewidth; ++i)
+  {
+    unsigned char x = scanline[i];
+    cost[0] += x;
+    cost[1] += filterCost(x);
+    cost[2] += filterCost((unsigned char)(x - prevline[i]));
+    cost[3] += filterCost((unsigned char)(x - (prevline[i] >> 1)));
+    cost[4] += filterCost((unsigned char)(x - prevline[i]));
+  }
+
+#ifdef LODEPNG_SIMD_SSE2
+  {
+    __m128i zero = _mm_setzero_si128();
+    __m128i one = _mm_set1_epi8(1);
+    __m128i sum0 = zero, sum1 = zero, sum2 = zero, sum3 = zero, sum4 = zero;
+    unsigned long long lanes[2];
+
+    for(; i + 16 <= length; i += 16)
+    {
+      __m128i x = _mm_loadu_si128((const __m128i*)&scanline[i]);
+      __m128i a = _mm_loadu_si128((const __m128i*)&scanline[i - bytewidth]);
+      __m128i b = _mm_loadu_si128((const __m128i*)&prevline[i]);
+      __m128i c = _mm_loadu_si128((const __m128i*)&prevline[i - bytewidth]);
+      /*floor((a + b) / 2): _mm_avg_epu8 rounds up, so subtract the lost low bit*/
+      __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+      __m128i paeth = _mm_packus_epi16(paethPredictorSSE2(a, b, c),
+                                       paethPredictorSSE2(_mm_srli_si128(a, 8), _mm_srli_si128(b, 8), _mm_srli_si128(c, 8)));
+      sum0 = _mm_add_epi64(sum0, _mm_sad_epu8(x, zero));
+      sum1 = _mm_add_epi64(sum1, filterCostSSE2(_mm_sub_epi8(x, a)));
+      sum2 = _mm_add_epi64(sum2, filterCostSSE2(_mm_sub_epi8(x, b)));
+      sum3 = _mm_add_epi64(sum3, filterCostSSE2(_mm_sub_epi8(x, avg)));
+      sum4 = _mm_add_epi64(sum4, filterCostSSE2(_mm_sub_epi8(x, paeth)));
+    }
+
+    _mm_storeu_si128((__m128i*)lanes, sum0); cost[0] += (size_t)(lanes[0] + lanes[1]);
+    _mm_storeu_si128((__m128i*)lanes, sum1); cost[1] += (size_t)(lanes[0] + lanes[1]);
+    _mm_storeu_si128((__m128i*)lanes, sum2); cost[2] += (size_t)(lanes[0] + lanes[1]);
+    _mm_storeu_si128((__m128i*)lanes, sum3); cost[3] += (size_t)(lanes[0] + lanes[1]);
+    _mm_storeu_si128((__m128i*)lanes, sum4); cost[4] += (size_t)(lanes[0] + lanes[1]);
+  }
+#endif /*LODEPNG_SIMD_SSE2*/
+
+  for(; i < length; ++i)
+  {
+    unsigned char x = scanline[i];
+    unsigned char a = scanline[i - bytewidth];
+    unsigned char b = prevline[i];
+    unsigned char c = prevline[i - bytewidth];
+    cost[0] += x;
+    cost[1] += filterCost((unsigned char)(x - a));
+    cost[2] += filterCost((unsigned char)(x - b));
+    cost[3] += filterCost((unsigned char)(x - ((a + b) >> 1)));
+    cost[4] += filterCost((unsigned char)(x - paethPredictor(a, b, c)));
+  }
+}
+
+/*rows longer than this are entropy-estimated on a subsample of their bytes*/
+static const size_t ADAPTIVE_ENTROPY_SAMPLES = 1024;
+
+/*Shannon entropy in bits per byte of every step-th byte of data*/
+static float sampledEntropy(const unsigned char* data, size_t length, size_t step)
+{
+  unsigned count[256];
+  size_t i, n = 0;
+  float result = 0;
+  for(i = 0; i != 256; ++i) count[i] = 0;
+  for(i = 0; i < length; i += step, ++n) ++count[data[i]];
+  for(i = 0; i != 256; ++i)
+  {
+    if(count[i])
+    {
+      float p = count[i] / (float)n;
+      result += flog2(1 / p) * p;
+    }
+  }
+  return result;
+}
+
+static unsigned filter(unsigned char* out, const unsigned char* in, const unsigned char* prevline, unsigned firstrow,
+                       unsigned w, unsigned h, const LodePNGColorMode* info, const LodePNGEncoderSettings* settings)
 {
   /*
   For PNG filter method 0
   out must be a buffer with as size: h + (w * h * bpp + 7) / 8, because there are
   the scanlines with 1 extra byte per scanline
+  prevline is the scanline above the first one, or NULL at the top of the image. firstrow is the
+  index of the first scanline in the image, for the predefined filters
   */
 
   unsigned bpp = lodepng_get_bpp(info);
@@ -5735,7 +7184,6 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
   size_t linebytes = (w * bpp + 7) / 8;
   /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
   size_t bytewidth = (bpp + 7) / 8;
-  const unsigned char* prevline = 0;
   unsigned x, y;
   unsigned error = 0;
   LodePNGFilterStrategy strategy = settings->filter_strategy;
@@ -5880,7 +7328,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     {
       size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
       size_t inindex = linebytes * y;
-      unsigned char type = settings->predefined_filters[y];
+      unsigned char type = settings->predefined_filters[firstrow + y];
       out[outindex] = type; /*filter type byte*/
       filterScanline(&out[outindex + 1], &in[inindex], prevline, linebytes, bytewidth, type);
       prevline = &in[inindex];
@@ -5936,6 +7384,57 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     }
     for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
   }
+  else if(strategy == LFS_ADAPTIVE)
+  {
+    size_t cost[5];
+    unsigned char* zeroline = (unsigned char*)lodepng_malloc(linebytes);
+    unsigned char* attempt = (unsigned char*)lodepng_malloc(linebytes);
+    /*subsample long rows; the step must not be a multiple of bytewidth or it would only sample one channel*/
+    size_t step = linebytes > ADAPTIVE_ENTROPY_SAMPLES ? (linebytes / ADAPTIVE_ENTROPY_SAMPLES) | 1 : 1;
+    if(bytewidth > 1 && step % bytewidth == 0) ++step;
+
+    if(!zeroline || !attempt) error = 83; /*alloc fail*/
+    else
+    {
+      for(x = 0; x != linebytes; ++x) zeroline[x] = 0;
+      if(!prevline) prevline = zeroline;
+    }
+
+    for(y = 0; y != h && !error; ++y)
+    {
+      unsigned char* outline = &out[y * (linebytes + 1) + 1];
+      const unsigned char* scanline = &in[y * linebytes];
+      unsigned char type, bestType = 0, secondType = 1;
+
+      filterCosts(cost, scanline, prevline, linebytes, bytewidth);
+      if(cost[1] < cost[0]) { bestType = 1; secondType = 0; }
+      for(type = 2; type != 5; ++type)
+      {
+        if(cost[type] < cost[bestType]) { secondType = bestType; bestType = type; }
+        else if(cost[type] < cost[secondType]) secondType = type;
+      }
+
+      /*the first scanline is filtered against the zero row, which filterScanline expects as null*/
+      filterScanline(outline, scanline, prevline == zeroline ? 0 : prevline, linebytes, bytewidth, bestType);
+
+      /*minsum is a poor predictor when two filters are within 1/8 of each other; let the entropy decide*/
+      if(cost[secondType] - cost[bestType] <= cost[bestType] / 8)
+      {
+        filterScanline(attempt, scanline, prevline == zeroline ? 0 : prevline, linebytes, bytewidth, secondType);
+        if(sampledEntropy(attempt, linebytes, step) < sampledEntropy(outline, linebytes, step))
+        {
+          bestType = secondType;
+          for(x = 0; x != linebytes; ++x) outline[x] = attempt[x];
+        }
+      }
+
+      out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
+      prevline = scanline;
+    }
+
+    lodepng_free(zeroline);
+    lodepng_free(attempt);
+  }
   else return 88; /* unknown filter strategy */
 
   return error;
@@ -6053,14 +7552,14 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
         if(!error)
         {
           addPaddingBits(padded, in, ((w * bpp + 7) / 8) * 8, w * bpp, h);
-          error = filter(*out, padded, w, h, &info_png->color, settings);
+          error = filter(*out, padded, 0, 0, w, h, &info_png->color, settings);
         }
         lodepng_free(padded);
       }
       else
       {
         /*we can immediately filter into the out buffer, no other steps needed*/
-        error = filter(*out, in, w, h, &info_png->color, settings);
+        error = filter(*out, in, 0, 0, w, h, &info_png->color, settings);
       }
     }
   }
@@ -6092,13 +7591,13 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
           if(!padded) ERROR_BREAK(83); /*alloc fail*/
           addPaddingBits(padded, &adam7[passstart[i]],
                          ((passw[i] * bpp + 7) / 8) * 8, passw[i] * bpp, passh[i]);
-          error = filter(&(*out)[filter_passstart[i]], padded,
+          error = filter(&(*out)[filter_passstart[i]], padded, 0, 0,
                          passw[i], passh[i], &info_png->color, settings);
           lodepng_free(padded);
         }
         else
         {
-          error = filter(&(*out)[filter_passstart[i]], &adam7[padded_passstart[i]],
+          error = filter(&(*out)[filter_passstart[i]], &adam7[padded_passstart[i]], 0, 0,
                          passw[i], passh[i], &info_png->color, settings);
         }
 
@@ -6174,6 +7673,135 @@ static unsigned isRGBICCProfile(const unsigned char* profile, unsigned size)
 }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
+/*checks the parts of the state that lodepng_encode and the streaming encoder both depend on*/
+static unsigned checkEncodeState(const LodePNGState* state)
+{
+  if((state->info_png.color.colortype == LCT_PALETTE || state->encoder.force_palette)
+      && (state->info_png.color.palettesize == 0 || state->info_png.color.palettesize > 256))
+  {
+    return 68; /*invalid palette size, it is only allowed to be 1-256*/
+  }
+  if(state->encoder.zlibsettings.btype > 2) return 61; /*error: unexisting btype*/
+  if(state->info_png.interlace_method > 1) return 71; /*error: unexisting interlace mode*/
+  /*error: unexisting color type given*/
+  CERROR_TRY_RETURN(checkColorValidity(state->info_png.color.colortype, state->info_png.color.bitdepth));
+  CERROR_TRY_RETURN(checkColorValidity(state->info_raw.colortype, state->info_raw.bitdepth));
+  return 0;
+}
+
+/*writes the signature, IHDR and all chunks that must come before the IDAT chunks*/
+static unsigned addChunksBeforeIDAT(ucvector* out, unsigned w, unsigned h,
+                                    const LodePNGInfo* info, LodePNGEncoderSettings* settings)
+{
+  /*write signature and chunks*/
+  writeSignature(out);
+  /*IHDR*/
+  addChunk_IHDR(out, w, h, info->color.colortype, info->color.bitdepth, info->interlace_method);
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+  /*unknown chunks between IHDR and PLTE*/
+  if(info->unknown_chunks_data[0])
+  {
+    CERROR_TRY_RETURN(addUnknownChunks(out, info->unknown_chunks_data[0], info->unknown_chunks_size[0]));
+  }
+  /*color profile chunks must come before PLTE */
+  if(info->iccp_defined) addChunk_iCCP(out, info, &settings->zlibsettings);
+  if(info->srgb_defined) addChunk_sRGB(out, info);
+  if(info->gama_defined) addChunk_gAMA(out, info);
+  if(info->chrm_defined) addChunk_cHRM(out, info);
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  /*PLTE*/
+  if(info->color.colortype == LCT_PALETTE)
+  {
+    addChunk_PLTE(out, &info->color);
+  }
+  if(settings->force_palette && (info->color.colortype == LCT_RGB || info->color.colortype == LCT_RGBA))
+  {
+    addChunk_PLTE(out, &info->color);
+  }
+  /*tRNS*/
+  if(info->color.colortype == LCT_PALETTE && getPaletteTranslucency(info->color.palette, info->color.palettesize) != 0)
+  {
+    addChunk_tRNS(out, &info->color);
+  }
+  if((info->color.colortype == LCT_GREY || info->color.colortype == LCT_RGB) && info->color.key_defined)
+  {
+    addChunk_tRNS(out, &info->color);
+  }
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+  /*bKGD (must come between PLTE and the IDAt chunks*/
+  if(info->background_defined) CERROR_TRY_RETURN(addChunk_bKGD(out, info));
+  /*pHYs (must come before the IDAT chunks)*/
+  if(info->phys_defined) addChunk_pHYs(out, info);
+
+  /*unknown chunks between PLTE and IDAT*/
+  if(info->unknown_chunks_data[1])
+  {
+    CERROR_TRY_RETURN(addUnknownChunks(out, info->unknown_chunks_data[1], info->unknown_chunks_size[1]));
+  }
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  return 0;
+}
+
+/*writes all chunks that come after the IDAT chunks, ending with IEND*/
+static unsigned addChunksAfterIDAT(ucvector* out, const LodePNGInfo* info, LodePNGEncoderSettings* settings)
+{
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+  size_t i;
+  /*tIME*/
+  if(info->time_defined) addChunk_tIME(out, &info->time);
+  /*tEXt and/or zTXt*/
+  for(i = 0; i != info->text_num; ++i)
+  {
+    if(strlen(info->text_keys[i]) > 79) return 66; /*text chunk too large*/
+    if(strlen(info->text_keys[i]) < 1) return 67; /*text chunk too small*/
+    if(settings->text_compression)
+    {
+      addChunk_zTXt(out, info->text_keys[i], info->text_strings[i], &settings->zlibsettings);
+    }
+    else
+    {
+      addChunk_tEXt(out, info->text_keys[i], info->text_strings[i]);
+    }
+  }
+  /*LodePNG version id in text chunk*/
+  if(settings->add_id)
+  {
+    unsigned already_added_id_text = 0;
+    for(i = 0; i != info->text_num; ++i)
+    {
+      if(!strcmp(info->text_keys[i], "LodePNG"))
+      {
+        already_added_id_text = 1;
+        break;
+      }
+    }
+    if(already_added_id_text == 0)
+    {
+      addChunk_tEXt(out, "LodePNG", LODEPNG_VERSION_STRING); /*it's shorter as tEXt than as zTXt chunk*/
+    }
+  }
+  /*iTXt*/
+  for(i = 0; i != info->itext_num; ++i)
+  {
+    if(strlen(info->itext_keys[i]) > 79) return 66; /*text chunk too large*/
+    if(strlen(info->itext_keys[i]) < 1) return 67; /*text chunk too small*/
+    addChunk_iTXt(out, settings->text_compression,
+                  info->itext_keys[i], info->itext_langtags[i], info->itext_transkeys[i], info->itext_strings[i],
+                  &settings->zlibsettings);
+  }
+
+  /*unknown chunks between IDAT and IEND*/
+  if(info->unknown_chunks_data[2])
+  {
+    CERROR_TRY_RETURN(addUnknownChunks(out, info->unknown_chunks_data[2], info->unknown_chunks_size[2]));
+  }
+#else /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  (void)info;
+  (void)settings;
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  return addChunk_IEND(out);
+}
+
 unsigned lodepng_encode(unsigned char** out, size_t* outsize,
                         const unsigned char* image, unsigned w, unsigned h,
                         LodePNGState* state)
@@ -6192,26 +7820,8 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
   state->error = 0;
 
   /*check input values validity*/
-  if((state->info_png.color.colortype == LCT_PALETTE || state->encoder.force_palette)
-      && (state->info_png.color.palettesize == 0 || state->info_png.color.palettesize > 256))
-  {
-    state->error = 68; /*invalid palette size, it is only allowed to be 1-256*/
-    goto cleanup;
-  }
-  if(state->encoder.zlibsettings.btype > 2)
-  {
-    state->error = 61; /*error: unexisting btype*/
-    goto cleanup;
-  }
-  if(state->info_png.interlace_method > 1)
-  {
-    state->error = 71; /*error: unexisting interlace mode*/
-    goto cleanup;
-  }
-  state->error = checkColorValidity(state->info_png.color.colortype, state->info_png.color.bitdepth);
-  if(state->error) goto cleanup; /*error: unexisting color type given*/
-  state->error = checkColorValidity(state->info_raw.colortype, state->info_raw.bitdepth);
-  if(state->error) goto cleanup; /*error: unexisting color type given*/
+  state->error = checkEncodeState(state);
+  if(state->error) goto cleanup;
 
   /* color convert and compute scanline filter types */
   lodepng_info_copy(&info, &state->info_png);
@@ -6303,134 +7913,12 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
   else preProcessScanlines(&data, &datasize, image, w, h, &info, &state->encoder);
 
   /* output all PNG chunks */
-  {
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    size_t i;
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    /*write signature and chunks*/
-    writeSignature(&outv);
-    /*IHDR*/
-    addChunk_IHDR(&outv, w, h, info.color.colortype, info.color.bitdepth, info.interlace_method);
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    /*unknown chunks between IHDR and PLTE*/
-    if(info.unknown_chunks_data[0])
-    {
-      state->error = addUnknownChunks(&outv, info.unknown_chunks_data[0], info.unknown_chunks_size[0]);
-      if(state->error) goto cleanup;
-    }
-    /*color profile chunks must come before PLTE */
-    if(info.iccp_defined) addChunk_iCCP(&outv, &info, &state->encoder.zlibsettings);
-    if(info.srgb_defined) addChunk_sRGB(&outv, &info);
-    if(info.gama_defined) addChunk_gAMA(&outv, &info);
-    if(info.chrm_defined) addChunk_cHRM(&outv, &info);
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    /*PLTE*/
-    if(info.color.colortype == LCT_PALETTE)
-    {
-      addChunk_PLTE(&outv, &info.color);
-    }
-    if(state->encoder.force_palette && (info.color.colortype == LCT_RGB || info.color.colortype == LCT_RGBA))
-    {
-      addChunk_PLTE(&outv, &info.color);
-    }
-    /*tRNS*/
-    if(info.color.colortype == LCT_PALETTE && getPaletteTranslucency(info.color.palette, info.color.palettesize) != 0)
-    {
-      addChunk_tRNS(&outv, &info.color);
-    }
-    if((info.color.colortype == LCT_GREY || info.color.colortype == LCT_RGB) && info.color.key_defined)
-    {
-      addChunk_tRNS(&outv, &info.color);
-    }
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    /*bKGD (must come between PLTE and the IDAt chunks*/
-    if(info.background_defined)
-    {
-      state->error = addChunk_bKGD(&outv, &info);
-      if(state->error) goto cleanup;
-    }
-    /*pHYs (must come before the IDAT chunks)*/
-    if(info.phys_defined) addChunk_pHYs(&outv, &info);
-
-    /*unknown chunks between PLTE and IDAT*/
-    if(info.unknown_chunks_data[1])
-    {
-      state->error = addUnknownChunks(&outv, info.unknown_chunks_data[1], info.unknown_chunks_size[1]);
-      if(state->error) goto cleanup;
-    }
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    /*IDAT (multiple IDAT chunks must be consecutive)*/
-    state->error = addChunk_IDAT(&outv, data, datasize, &state->encoder.zlibsettings);
-    if(state->error) goto cleanup;
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    /*tIME*/
-    if(info.time_defined) addChunk_tIME(&outv, &info.time);
-    /*tEXt and/or zTXt*/
-    for(i = 0; i != info.text_num; ++i)
-    {
-      if(strlen(info.text_keys[i]) > 79)
-      {
-        state->error = 66; /*text chunk too large*/
-        goto cleanup;
-      }
-      if(strlen(info.text_keys[i]) < 1)
-      {
-        state->error = 67; /*text chunk too small*/
-        goto cleanup;
-      }
-      if(state->encoder.text_compression)
-      {
-        addChunk_zTXt(&outv, info.text_keys[i], info.text_strings[i], &state->encoder.zlibsettings);
-      }
-      else
-      {
-        addChunk_tEXt(&outv, info.text_keys[i], info.text_strings[i]);
-      }
-    }
-    /*LodePNG version id in text chunk*/
-    if(state->encoder.add_id)
-    {
-      unsigned already_added_id_text = 0;
-      for(i = 0; i != info.text_num; ++i)
-      {
-        if(!strcmp(info.text_keys[i], "LodePNG"))
-        {
-          already_added_id_text = 1;
-          break;
-        }
-      }
-      if(already_added_id_text == 0)
-      {
-        addChunk_tEXt(&outv, "LodePNG", LODEPNG_VERSION_STRING); /*it's shorter as tEXt than as zTXt chunk*/
-      }
-    }
-    /*iTXt*/
-    for(i = 0; i != info.itext_num; ++i)
-    {
-      if(strlen(info.itext_keys[i]) > 79)
-      {
-        state->error = 66; /*text chunk too large*/
-        goto cleanup;
-      }
-      if(strlen(info.itext_keys[i]) < 1)
-      {
-        state->error = 67; /*text chunk too small*/
-        goto cleanup;
-      }
-      addChunk_iTXt(&outv, state->encoder.text_compression,
-                    info.itext_keys[i], info.itext_langtags[i], info.itext_transkeys[i], info.itext_strings[i],
-                    &state->encoder.zlibsettings);
-    }
-
-    /*unknown chunks between IDAT and IEND*/
-    if(info.unknown_chunks_data[2])
-    {
-      state->error = addUnknownChunks(&outv, info.unknown_chunks_data[2], info.unknown_chunks_size[2]);
-      if(state->error) goto cleanup;
-    }
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    addChunk_IEND(&outv);
-  }
+  state->error = addChunksBeforeIDAT(&outv, w, h, &info, &state->encoder);
+  if(state->error) goto cleanup;
+  /*IDAT (multiple IDAT chunks must be consecutive)*/
+  state->error = addChunk_IDAT(&outv, data, datasize, &state->encoder.zlibsettings);
+  if(state->error) goto cleanup;
+  state->error = addChunksAfterIDAT(&outv, &info, &state->encoder);
 
 cleanup:
   lodepng_info_cleanup(&info);
@@ -6469,6 +7957,310 @@ unsigned lodepng_encode24(unsigned char** out, size_t* outsize, const unsigned c
   return lodepng_encode_memory(out, outsize, image, w, h, LCT_RGB, 8);
 }
 
+/* ////////////////////////////////////////////////////////////////////////// */
+/* / Streaming Encoder                                                      / */
+/* ////////////////////////////////////////////////////////////////////////// */
+
+/*size of the IDAT chunks if lodepng_encode_begin is given 0*/
+#define STREAM_IDAT_SIZE 65536
+
+struct LodePNGStreamEncoder
+{
+  LodePNGState* state;
+  LodePNGChunkSink sink;
+  void* user;
+  unsigned w, h;
+  unsigned y; /*amount of rows given so far*/
+  unsigned error;
+  size_t linebytes; /*size of a row in the PNG color type, without the filter type byte*/
+  size_t chunksize; /*amount of zlib data per IDAT chunk*/
+  size_t blocksize; /*amount of filtered data per deflate block*/
+  size_t windowsize; /*history the matcher refers back to, 0 if it doesn't*/
+  unsigned char* prevline; /*the last row given to the filter*/
+  unsigned char* converted; /*rows converted to the PNG color type*/
+  size_t convertedrows; /*amount of rows that fit in converted*/
+  /*filtered data: the window before datapos was deflated already, datapos to datasize is the next
+  block. The data is moved back in multiples of the window size, so the circular positions in the
+  hash stay valid*/
+  unsigned char* data;
+  size_t datapos, datasize, dataalloc;
+  Hash hash;
+  ucvector zlib; /*zlib stream not yet written in IDAT chunks*/
+  size_t bp; /*bit pointer in zlib*/
+  unsigned adler; /*adler32 of the filtered data so far*/
+};
+
+static void streamEncoderCleanup(LodePNGStreamEncoder* s)
+{
+  lodepng_free(s->prevline);
+  lodepng_free(s->converted);
+  lodepng_free(s->data);
+  hash_cleanup(&s->hash);
+  ucvector_cleanup(&s->zlib);
+  lodepng_free(s);
+}
+
+/*a stored block that, unlike deflateNoCompression, can be followed by more blocks*/
+static void deflateStored(ucvector* out, size_t* bp, const unsigned char* data,
+                          size_t datapos, size_t dataend, unsigned final)
+{
+  unsigned LEN = (unsigned)(dataend - datapos);
+  unsigned NLEN = 65535 - LEN;
+
+  addBitToStream(bp, out, final);
+  addBitToStream(bp, out, 0); /*BTYPE 00*/
+  addBitToStream(bp, out, 0);
+  *bp = (*bp + 7u) & ~(size_t)7u; /*LEN starts at the next byte*/
+
+  ucvector_push_back(out, (unsigned char)(LEN & 255));
+  ucvector_push_back(out, (unsigned char)(LEN >> 8));
+  ucvector_push_back(out, (unsigned char)(NLEN & 255));
+  ucvector_push_back(out, (unsigned char)(NLEN >> 8));
+  for(; datapos != dataend; ++datapos) ucvector_push_back(out, data[datapos]);
+  *bp += 8u * (4u + LEN);
+}
+
+/*deflates the filtered data from datapos to dataend as one block*/
+static unsigned streamDeflateBlock(LodePNGStreamEncoder* s, size_t dataend, unsigned final)
+{
+  const LodePNGCompressSettings* settings = &s->state->encoder.zlibsettings;
+  unsigned error = 0;
+  if(settings->btype == 0) deflateStored(&s->zlib, &s->bp, s->data, s->datapos, dataend, final);
+  else if(settings->btype == 1) error = deflateFixed(&s->zlib, &s->bp, &s->hash, s->data, s->datapos, dataend, settings, final);
+  else error = deflateDynamic(&s->zlib, &s->bp, &s->hash, s->data, s->datapos, dataend, settings, final);
+  s->datapos = dataend;
+  return error;
+}
+
+/*hands full IDAT chunks to the sink, or, if final, everything that is left*/
+static unsigned streamWriteIDAT(LodePNGStreamEncoder* s, unsigned final)
+{
+  unsigned error = 0;
+  size_t pos = 0;
+  /*the last byte isn't complete yet while the bit pointer is inside it*/
+  size_t complete = (!final && (s->bp & 7u)) ? s->zlib.size - 1 : s->zlib.size;
+  while(!error && complete - pos >= (final ? 1 : s->chunksize))
+  {
+    size_t size = complete - pos < s->chunksize ? complete - pos : s->chunksize;
+    ucvector chunk;
+    ucvector_init(&chunk);
+    error = addChunk(&chunk, "IDAT", &s->zlib.data[pos], size);
+    if(!error) error = s->sink(s->user, chunk.data, chunk.size);
+    ucvector_cleanup(&chunk);
+    pos += size;
+  }
+  if(pos)
+  {
+    memmove(s->zlib.data, &s->zlib.data[pos], s->zlib.size - pos);
+    s->zlib.size -= pos;
+  }
+  return error;
+}
+
+/*drops deflated data that is further back than the window*/
+static void streamDiscardHistory(LodePNGStreamEncoder* s)
+{
+  size_t shift = s->datapos;
+  if(s->windowsize) shift = s->datapos > s->windowsize ? (s->datapos - s->windowsize) / s->windowsize * s->windowsize : 0;
+  if(shift == 0) return;
+  memmove(s->data, &s->data[shift], s->datasize - shift);
+  s->datapos -= shift;
+  s->datasize -= shift;
+}
+
+unsigned lodepng_encode_begin(LodePNGStreamEncoder** encoder, unsigned w, unsigned h,
+                              LodePNGState* state, size_t chunksize,
+                              LodePNGChunkSink sink, void* user)
+{
+  const LodePNGCompressSettings* zlibsettings = &state->encoder.zlibsettings;
+  LodePNGStreamEncoder* s;
+  unsigned error;
+  size_t filteredsize;
+  ucvector header;
+
+  *encoder = 0;
+  error = checkEncodeState(state);
+  /*Adam7 reorders the pixels over the whole image*/
+  if(!error && state->info_png.interlace_method != 0) error = 108;
+  if(!error && zlibsettings->btype != 0 && zlibsettings->use_lz77)
+  {
+    unsigned windowsize = zlibsettings->windowsize;
+    if(windowsize == 0 || windowsize > 32768) error = 60; /*error: windowsize smaller/larger than allowed*/
+    else if((windowsize & (windowsize - 1)) != 0) error = 90; /*error: must be power of two*/
+  }
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+  /*the color type is not chosen automatically, so it must already agree with the ICC profile*/
+  if(!error && state->info_png.iccp_defined)
+  {
+    LodePNGColorType colortype = state->info_png.color.colortype;
+    unsigned grey_icc = isGreyICCProfile(state->info_png.iccp_profile, state->info_png.iccp_profile_size);
+    unsigned grey_png = colortype == LCT_GREY || colortype == LCT_GREY_ALPHA;
+    if(!grey_icc && !isRGBICCProfile(state->info_png.iccp_profile, state->info_png.iccp_profile_size)) error = 100;
+    else if(grey_icc != grey_png) error = 101;
+  }
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  state->error = error;
+  if(error) return error;
+
+  s = (LodePNGStreamEncoder*)lodepng_malloc(sizeof(LodePNGStreamEncoder));
+  if(!s) return state->error = 83; /*alloc fail*/
+  s->state = state;
+  s->sink = sink;
+  s->user = user;
+  s->w = w;
+  s->h = h;
+  s->y = 0;
+  s->error = 0;
+  s->linebytes = lodepng_get_raw_size(w, 1, &state->info_png.color);
+  s->chunksize = chunksize ? chunksize : STREAM_IDAT_SIZE;
+  s->windowsize = (zlibsettings->btype != 0 && zlibsettings->use_lz77) ? zlibsettings->windowsize : 0;
+  s->datapos = s->datasize = 0;
+  s->bp = 0;
+  s->adler = 1;
+  ucvector_init(&s->zlib);
+
+  /*the same block size lodepng_deflate picks for the whole filtered image*/
+  filteredsize = (size_t)h * (s->linebytes + 1);
+  if(zlibsettings->btype == 0) s->blocksize = 65535;
+  else
+  {
+    s->blocksize = filteredsize / 8 + 8;
+    if(s->blocksize < 65536) s->blocksize = 65536;
+    if(s->blocksize > 262144) s->blocksize = 262144;
+  }
+
+  /*after moving back there are less than 2 windows of history, so a full block plus a row always fits*/
+  s->dataalloc = 2 * s->windowsize + s->blocksize + s->linebytes + 1;
+  s->convertedrows = s->blocksize / (s->linebytes + 1);
+  if(s->convertedrows == 0) s->convertedrows = 1;
+  s->data = (unsigned char*)lodepng_malloc(s->dataalloc);
+  s->prevline = (unsigned char*)lodepng_malloc(s->linebytes + 1);
+  s->converted = (unsigned char*)lodepng_malloc(s->convertedrows * s->linebytes + 1);
+  error = hash_init(&s->hash, zlibsettings->windowsize,
+                    s->windowsize ? zlibsettings->match_strategy : LMS_RLE);
+  if(!error && (!s->data || !s->prevline || !s->converted)) error = 83; /*alloc fail*/
+
+  /*zlib header, the same as lodepng_zlib_compress writes*/
+  ucvector_push_back(&s->zlib, 120);
+  ucvector_push_back(&s->zlib, 1);
+
+  ucvector_init(&header);
+  if(!error) error = addChunksBeforeIDAT(&header, w, h, &state->info_png, &state->encoder);
+  if(!error) error = sink(user, header.data, header.size);
+  ucvector_cleanup(&header);
+
+  state->error = error;
+  if(error) streamEncoderCleanup(s);
+  else *encoder = s;
+  return error;
+}
+
+unsigned lodepng_encode_write_rows(LodePNGStreamEncoder* encoder, const unsigned char* rows,
+                                   size_t stride, unsigned numrows)
+{
+  LodePNGStreamEncoder* s = encoder;
+  LodePNGState* state = s->state;
+  const LodePNGColorMode* mode = &state->info_png.color;
+  unsigned convert = !lodepng_color_mode_equal(&state->info_raw, mode);
+  size_t rawbytes = lodepng_get_raw_size(s->w, 1, &state->info_raw);
+  size_t rowsize = s->linebytes + 1;
+  /*rows without padding bits can be converted all at once if they are contiguous*/
+  unsigned contiguous = stride == rawbytes && (s->w * lodepng_get_bpp(&state->info_raw)) % 8 == 0
+                        && (s->w * lodepng_get_bpp(mode)) % 8 == 0;
+
+  if(s->error) return s->error;
+  if(numrows > s->h - s->y) s->error = 107;
+  else if(numrows > 1 && stride < rawbytes) s->error = 106;
+
+  while(numrows && !s->error)
+  {
+    const unsigned char* in = rows;
+    size_t i, n = (s->dataalloc - s->datasize) / rowsize;
+    if(n == 0)
+    {
+      streamDiscardHistory(s);
+      n = (s->dataalloc - s->datasize) / rowsize;
+    }
+    if(n > numrows) n = numrows;
+
+    if(convert || stride != s->linebytes)
+    {
+      if(n > s->convertedrows) n = s->convertedrows;
+      if(convert && contiguous)
+      {
+        s->error = lodepng_convert(s->converted, rows, mode, &state->info_raw, s->w, (unsigned)n);
+      }
+      else
+      {
+        for(i = 0; i != n && !s->error; ++i)
+        {
+          if(convert)
+          {
+            s->error = lodepng_convert(&s->converted[i * s->linebytes], &rows[i * stride],
+                                       mode, &state->info_raw, s->w, 1);
+          }
+          else memcpy(&s->converted[i * s->linebytes], &rows[i * stride], s->linebytes);
+        }
+      }
+      in = s->converted;
+    }
+
+    if(!s->error)
+    {
+      s->error = filter(&s->data[s->datasize], in, s->y ? s->prevline : 0, s->y,
+                        s->w, (unsigned)n, mode, &state->encoder);
+    }
+    if(s->error) break;
+    memcpy(s->prevline, &in[(n - 1) * s->linebytes], s->linebytes);
+    s->adler = update_adler32(s->adler, &s->data[s->datasize], (unsigned)(n * rowsize));
+    s->datasize += n * rowsize;
+    s->y += (unsigned)n;
+    rows += n * stride;
+    numrows -= (unsigned)n;
+
+    /*keep back at least one byte, the final block must not be empty*/
+    while(!s->error && s->datasize - s->datapos > s->blocksize)
+    {
+      s->error = streamDeflateBlock(s, s->datapos + s->blocksize, 0);
+    }
+    if(!s->error) s->error = streamWriteIDAT(s, 0);
+  }
+
+  state->error = s->error;
+  return s->error;
+}
+
+unsigned lodepng_encode_finish(LodePNGStreamEncoder* encoder)
+{
+  LodePNGStreamEncoder* s = encoder;
+  LodePNGState* state;
+  unsigned error;
+
+  if(!s) return 0; /*lodepng_encode_begin failed and already freed it*/
+  state = s->state;
+  error = s->error;
+
+  if(!error && s->y != s->h) error = 107;
+  if(!error) error = streamDeflateBlock(s, s->datasize, 1);
+  if(!error)
+  {
+    lodepng_add32bitInt(&s->zlib, s->adler);
+    error = streamWriteIDAT(s, 1);
+  }
+  if(!error)
+  {
+    ucvector trailer;
+    ucvector_init(&trailer);
+    error = addChunksAfterIDAT(&trailer, &state->info_png, &state->encoder);
+    if(!error) error = s->sink(s->user, trailer.data, trailer.size);
+    ucvector_cleanup(&trailer);
+  }
+
+  streamEncoderCleanup(s);
+  state->error = error;
+  return error;
+}
+
 #ifdef LODEPNG_COMPILE_DISK
 unsigned lodepng_encode_file(const char* filename, const unsigned char* image, unsigned w, unsigned h,
                              LodePNGColorType colortype, unsigned bitdepth)
@@ -6621,6 +8413,11 @@ const char* lodepng_error_text(unsigned code)
     case 102: return "not allowed to set greyscale ICC profile with colored pixels by PNG specification";
     case 103: return "Invalid palette index in bKGD chunk. Maybe it came before PLTE chunk?";
     case 104: return "Invalid bKGD color while encoding (e.g. palette index out of range)";
+    case 105: return "image size does not match the size of the given output surface";
+    case 106: return "surface stride is smaller than a row of the raw image";
+    case 107: return "streaming encoder was given more or fewer rows than the image height";
+    case 108: return "streaming encoder can't write Adam7 interlaced images, they need the whole image";
+    case 109: return "streaming decoder found IDAT data after the end of the zlib stream";
   }
   return "unknown error code";
 }
@@ -270,6 +270,13 @@ struct LodePNGDecompressSettings
                              const LodePNGDecompressSettings*);
 
   const void* custom_context; /*optional custom settings for custom functions*/
+
+  /*run the parts of a stream written with full flushes at the same time (default: null), see
+  custom_parallel of LodePNGDecoderSettings for the contract. The result is the same as without it.
+  Only used by the built in inflate.*/
+  void (*custom_parallel)(void (*task)(void* data, unsigned index), void* data, unsigned count,
+                          const void* context);
+  const void* custom_parallel_context; /*optional custom settings for custom_parallel*/
 };
 
 extern const LodePNGDecompressSettings lodepng_default_decompress_settings;
@@ -277,6 +284,19 @@ void lodepng_decompress_settings_init(LodePNGDecompressSettings* settings);
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 #ifdef LODEPNG_COMPILE_ENCODER
+/*LZ77 match finder used by the deflate encoder*/
+typedef enum LodePNGMatchStrategy
+{
+  /*hash chains with lazy matching; the classic LodePNG matcher*/
+  LMS_CHAIN,
+  /*probe a single hash table slot per position and take the first match, no lazy
+  matching. Much faster, somewhat larger output.*/
+  LMS_GREEDY,
+  /*only look for matches at distances 1 to 4 (runs of bytes or of whole pixels), which
+  is what filtered PNG scanlines mostly consist of. Fastest, no hash table needed.*/
+  LMS_RLE
+} LodePNGMatchStrategy;
+
 /*
 Settings for zlib compression. Tweaking these settings tweaks the balance
 between speed and compression ratio.
@@ -291,6 +311,8 @@ struct LodePNGCompressSettings /*deflate = compress*/
   unsigned minmatch; /*mininum lz77 length. 3 is normally best, 6 can be better for some PNGs. Default: 0*/
   unsigned nicematch; /*stop searching if >= this length found. Set to 258 for best compression. Default: 128*/
   unsigned lazymatching; /*use lazy matching: better compression but a bit slower. Default: true*/
+  unsigned maxchainlength; /*max hash chain entries to follow per position. 0 derives it from windowsize. Default: 0*/
+  LodePNGMatchStrategy match_strategy; /*which LZ77 match finder to use. Default: LMS_CHAIN*/
 
   /*use custom zlib encoder instead of built in one (default: null)*/
   unsigned (*custom_zlib)(unsigned char**, size_t*,
@@ -308,6 +330,10 @@ struct LodePNGCompressSettings /*deflate = compress*/
 
 extern const LodePNGCompressSettings lodepng_default_compress_settings;
 void lodepng_compress_settings_init(LodePNGCompressSettings* settings);
+/*Sets the LZ77 settings from a zlib-like compression level: 0 stores uncompressed, 1 uses the
+greedy matcher, 2-3 use short hash chains without lazy matching, 4-9 use lazy matching with
+growing chain lengths. Levels above 9 are treated as 9. Does not touch the custom_ fields.*/
+void lodepng_compress_settings_set_level(LodePNGCompressSettings* settings, unsigned level);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 #ifdef LODEPNG_COMPILE_PNG
@@ -629,6 +655,15 @@ typedef struct LodePNGDecoderSettings
 
   unsigned color_convert; /*whether to convert the PNG to the color type you want. Default: yes*/
 
+  /*use a thread pool for the parts of decoding that are independent (default: null, everything runs
+  on the calling thread). It must call task(data, i) once for every i in [0, count), in any order or at
+  the same time, and return when all of them are done. The seven passes of Adam7 interlaced images
+  with 8 or more bits per pixel are decoded this way; the last pass is half of the image, so at most
+  two threads are busy most of the time.*/
+  void (*custom_parallel)(void (*task)(void* data, unsigned index), void* data, unsigned count,
+                          const void* context);
+  const void* custom_parallel_context; /*optional custom settings for custom_parallel*/
+
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   unsigned read_text_chunks; /*if false but remember_unknown_chunks is true, they're stored in the unknown chunks*/
   /*store all bytes from unknown chunks in the LodePNGInfo (off by default, useful for a png editor)*/
@@ -656,7 +691,12 @@ typedef enum LodePNGFilterStrategy
   */
   LFS_BRUTE_FORCE,
   /*use predefined_filters buffer: you specify the filter type for each scanline*/
-  LFS_PREDEFINED
+  LFS_PREDEFINED,
+  /*Computes the minsum cost of all five filters in a single (SSE2 when available) pass over
+  the row, and when the two cheapest are close, decides between them by the entropy of a
+  sample of the filtered bytes. Compresses a bit better than LFS_MINSUM, and the filtering
+  itself runs several times faster than LFS_MINSUM.*/
+  LFS_ADAPTIVE
 } LodePNGFilterStrategy;
 
 /*Gives characteristics about the integer RGBA colors of the image (count, alpha channel usage, bit depth, ...),
@@ -770,6 +810,34 @@ information is placed in the info_png field of the LodePNGState.
 unsigned lodepng_inspect(unsigned* w, unsigned* h,
                          LodePNGState* state,
                          const unsigned char* in, size_t insize);
+
+/*
+Streaming decoding: instead of one image buffer, the image is handed out one row at a time,
+in the color type of state->info_raw (the same pixels lodepng_decode would produce). The IDAT
+data is inflated incrementally, straight from the chunks in "in", so apart from the input
+the memory used is a 64 KB input buffer, a 160 KB deflate window and three rows, no matter
+how many rows the image has. Each row starts at a byte boundary, also for bit depths < 8.
+Adam7 interlaced images can't be produced row by row: they are decoded whole and then handed out.
+The custom_zlib and custom_inflate decoder settings are not used by the streaming functions.
+The zlib stream must end with the last IDAT chunk, more data after it is error 109.
+*/
+
+/*called for every row in order, with y from 0 to h - 1. rowsize is the size of the row in bytes.
+Return 0 to continue, any other value stops decoding and is returned as the error code.*/
+typedef unsigned (*LodePNGRowCallback)(void* user, unsigned y, const unsigned char* row, size_t rowsize);
+
+/*decodes the PNG in "in" and calls callback for every row. w and h receive the image size.*/
+unsigned lodepng_decode_rows(unsigned* w, unsigned* h,
+                             LodePNGState* state,
+                             const unsigned char* in, size_t insize,
+                             LodePNGRowCallback callback, void* user);
+
+/*decodes the PNG in "in" into a surface allocated by the caller, with rows stride bytes apart.
+Use lodepng_inspect to get the size first. w and h must match the PNG (error 105 otherwise)
+and stride must hold a row in the color type of state->info_raw (error 106 otherwise).*/
+unsigned lodepng_decode_into(unsigned char* out, size_t stride, unsigned w, unsigned h,
+                             LodePNGState* state,
+                             const unsigned char* in, size_t insize);
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 /*
@@ -792,6 +860,42 @@ unsigned lodepng_inspect_chunk(LodePNGState* state, size_t pos,
 unsigned lodepng_encode(unsigned char** out, size_t* outsize,
                         const unsigned char* image, unsigned w, unsigned h,
                         LodePNGState* state);
+
+/*
+Streaming encoding: the image is given a few rows at a time, and the PNG file is handed to a sink
+as it is produced, so neither the image nor the PNG file has to be in memory at once. Rows are
+filtered and deflated as they arrive, the memory used is about two deflate windows plus one
+deflate block (at most 256 KB) plus a few rows, no matter how many rows the image has.
+The file is the same as lodepng_encode gives with these differences: the color type of
+state->info_png is used as given (auto_convert is ignored), Adam7 interlacing is not supported
+(error 108), the IDAT data is split in chunks and the custom_zlib and custom_deflate settings are
+not used. state must stay alive until lodepng_encode_finish.
+*/
+
+/*the streaming encoder, created by lodepng_encode_begin and freed by lodepng_encode_finish*/
+typedef struct LodePNGStreamEncoder LodePNGStreamEncoder;
+
+/*receives the next size bytes of the PNG file, always a whole number of chunks (the first time
+also the signature). Return 0 to continue, any other value stops encoding and is returned as
+the error code.*/
+typedef unsigned (*LodePNGChunkSink)(void* user, const unsigned char* data, size_t size);
+
+/*writes the signature and the chunks before the image data to sink, and creates the encoder.
+chunksize is the amount of compressed data per IDAT chunk, 0 for the default of 64 KB.*/
+unsigned lodepng_encode_begin(LodePNGStreamEncoder** encoder, unsigned w, unsigned h,
+                              LodePNGState* state, size_t chunksize,
+                              LodePNGChunkSink sink, void* user);
+
+/*encodes the next numrows rows, in the color type of state->info_raw. Each row starts at a byte
+boundary, also for bit depths < 8, and the rows are stride bytes apart. Full IDAT chunks are
+written to the sink. More rows than the image has left gives error 107.*/
+unsigned lodepng_encode_write_rows(LodePNGStreamEncoder* encoder, const unsigned char* rows,
+                                   size_t stride, unsigned numrows);
+
+/*writes the last IDAT chunk and the chunks after it, and frees the encoder. Must also be called
+after an error of lodepng_encode_write_rows to free the encoder, then it returns that error. Error 107
+if not all rows were given. If lodepng_encode_begin failed, encoder is NULL and this returns 0.*/
+unsigned lodepng_encode_finish(LodePNGStreamEncoder* encoder);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 /*
@@ -898,7 +1002,9 @@ part of zlib that is required for PNG, it does not support dictionaries.
 */
 
 #ifdef LODEPNG_COMPILE_DECODER
-/*Inflate a buffer. Inflate is the decompression step of deflate. Out buffer must be freed after use.*/
+/*Inflate a buffer. Inflate is the decompression step of deflate. Out buffer must be freed after use.
+With settings->custom_parallel, the parts between full flush points (Z_FULL_FLUSH in zlib, the bytes
+00 00 ff ff of an empty stored block) are inflated at the same time. Streams without them gain nothing.*/
 unsigned lodepng_inflate(unsigned char** out, size_t* outsize,
                          const unsigned char* in, size_t insize,
                          const LodePNGDecompressSettings* settings);
@@ -1044,7 +1150,7 @@ TODO:
 [X] support color profile chunk types (but never let them touch RGB values by default)
 [ ] support all public PNG chunk types
 [ ] make sure encoder generates no chunks with size > (2^31)-1
-[ ] partial decoding (stream processing)
+[X] partial decoding (stream processing)
 [X] let the "isFullyOpaque" function check color keys and transparent palettes too
 [X] better name for the variables "codes", "codesD", "codelengthcodes", "clcl" and "lldl"
 [ ] don't stop decoding on errors like 69, 57, 58 (make warnings)
@@ -1325,6 +1431,11 @@ can encode the colors of all pixels without information loss.
    true for proper compression.
 *) windowsize: the window size used by the LZ77 encoder (1 - 32768). Has value
    2048 by default, but can be set to 32768 for better, but slow, compression.
+*) maxchainlength: how many earlier positions with the same hash are compared
+   at most. 0 (the default) derives it from windowsize like older versions did.
+*) match_strategy: LMS_CHAIN (default), LMS_GREEDY for a fast single-probe
+   matcher, or LMS_RLE to only match runs, which is very fast on filtered data.
+   lodepng_compress_settings_set_level picks all of the above from a 0-9 level.
 *) force_palette: if colortype is 2 or 6, you can make the encoder write a PLTE
    chunk if force_palette is true. This can used as suggested palette to convert
    to by viewers that don't support more than 256 colors (if those still exist)
@@ -1738,6 +1849,8 @@ state.encoder.zlibsettings.windowsize: tweak LZ77 windowsize
 state.encoder.zlibsettings.minmatch: tweak min LZ77 length to match
 state.encoder.zlibsettings.nicematch: tweak LZ77 match where to stop searching
 state.encoder.zlibsettings.lazymatching: try one more LZ77 matching
+state.encoder.zlibsettings.maxchainlength: limit LZ77 hash chain search
+state.encoder.zlibsettings.match_strategy: choose chain, greedy or RLE LZ77 matcher
 state.encoder.zlibsettings.custom_...: use custom deflate function
 state.encoder.auto_convert: choose optimal PNG color type, if 0 uses info_png
 state.encoder.filter_palette_zero: PNG filter strategy for palette
@@ -1,9 +1,18 @@
 /*
 */
 #include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
 #include <mango/mango.hpp>
+#include "../common/stealing_queue.hpp"
 
 using namespace mango;
+using stealing::StealingQueue;
 
 static inline
 void print(const char* text)
@@ -12,14 +21,29 @@ void print(const char* text)
     fflush(stdout);
 }
 
+static inline
+void print_rate(u64 tasks, u64 us)
+{
+    printf("tasks: %.2f M/s\n", double(tasks) / std::max(us, u64(1)));
+}
+
+// ----------------------------------------------------------------------
+// tests
+// ----------------------------------------------------------------------
+
+// the tests with a Queue run with ConcurrentQueue and StealingQueue
+
+template <typename Queue>
 bool test0()
 {
-    ConcurrentQueue q;
+    Queue q;
 
     std::atomic<int> counter { 0 };
 
     constexpr u64 icount = 7'500'000;
 
+    u64 time0 = Time::us();
+
     for (u64 i = 0; i < icount; ++i)
     {
         q.enqueue([&]
@@ -29,6 +53,8 @@ bool test0()
     }
 
     q.wait();
+
+    print_rate(icount, Time::us() - time0);
     return counter.load() == icount;
 }
 
@@ -111,12 +137,13 @@ bool test1()
     return success;
 }
 
+template <typename Queue>
 bool test2()
 {
-    ConcurrentQueue a;
-    ConcurrentQueue b;
+    Queue a;
+    Queue b;
 
-    u64 time0 = Time::ms();
+    u64 time0 = Time::us();
 
     std::atomic<int> counter { 0 };
 
@@ -137,19 +164,20 @@ bool test2()
         });
     }
 
-    u64 time1 = Time::ms();
+    u64 time1 = Time::us();
 
     printf("enqueue counter: %d\n", counter.load());
 
     a.wait();
     b.wait();
 
-    u64 time2 = Time::ms();
+    u64 time2 = Time::us();
 
     bool success = counter == icount * jcount;
 
     printf("counter: %d [%s]\n", counter.load(), success ? "Success" : "FAILED");
-    printf("enqueue: %d ms, execute: %d ms\n", int(time1 - time0), int(time2 - time1));
+    printf("enqueue: %d ms, execute: %d ms\n", int((time1 - time0) / 1000), int((time2 - time1) / 1000));
+    print_rate(icount + icount * jcount, time2 - time0);
 
     return success;
 }
@@ -262,6 +290,7 @@ bool test4()
     return success;
 }
 
+template <typename Queue>
 bool test5()
 {
     std::atomic<int> counter { 0 };
@@ -269,8 +298,10 @@ bool test5()
     constexpr u64 icount = 1'000'000 / 10;
     constexpr u64 jcount = 10;
 
-    ConcurrentQueue a;
-    ConcurrentQueue b;
+    u64 time0 = Time::us();
+
+    Queue a;
+    Queue b;
 
     for (u64 i = 0; i < icount; ++i)
     {
@@ -289,8 +320,11 @@ bool test5()
     a.wait();
     b.wait();
 
+    u64 time1 = Time::us();
+
     bool success = counter == icount * jcount;
     printf("counter: %d [%s]\n", counter.load(), success ? "Success" : "FAILED");
+    print_rate(icount + icount * jcount, time1 - time0);
     return success;
 }
 
@@ -328,6 +362,110 @@ bool test6()
     return success;
 }
 
+// test0 with one submission
+bool test7()
+{
+    StealingQueue q;
+
+    std::atomic<int> counter { 0 };
+
+    constexpr u64 icount = 7'500'000;
+
+    u64 time0 = Time::us();
+
+    q.enqueue_bulk(icount, [&] (u64)
+    {
+        ++counter;
+    });
+
+    q.wait();
+
+    print_rate(icount, Time::us() - time0);
+    return counter.load() == icount;
+}
+
+// rows of an image like the mandelbrot renderer: a task per row against one range
+bool test8()
+{
+    constexpr int width = 1920;
+    constexpr int height = 1080;
+    constexpr int frames = 20;
+
+    std::vector<u32> image[3];
+
+    auto render = [&] (int index, int y)
+    {
+        u32* scan = image[index].data() + y * width;
+        for (int x = 0; x < width; ++x)
+        {
+            u32 h = u32(y * width + x) * 0x9e3779b9;
+            h ^= h >> 15;
+            h *= 0x85ebca6b;
+            scan[x] = h ^ (h >> 13);
+        }
+    };
+
+    auto print_time = [] (const char* name, u64 us)
+    {
+        printf("%-28s %8.2f ms/frame %8.2f M rows/s\n", name, us / 1000.0 / frames,
+            double(height) * frames / std::max(us, u64(1)));
+    };
+
+    for (auto& v : image)
+    {
+        v.resize(width * height);
+    }
+
+    u64 time0 = Time::us();
+
+    for (int i = 0; i < frames; ++i)
+    {
+        ConcurrentQueue q;
+        for (int y = 0; y < height; ++y)
+        {
+            q.enqueue([&render, y] { render(0, y); });
+        }
+        q.wait();
+    }
+
+    u64 time1 = Time::us();
+
+    for (int i = 0; i < frames; ++i)
+    {
+        StealingQueue q;
+        for (int y = 0; y < height; ++y)
+        {
+            q.enqueue([&render, y] { render(1, y); });
+        }
+        q.wait();
+    }
+
+    u64 time2 = Time::us();
+
+    for (int i = 0; i < frames; ++i)
+    {
+        StealingQueue q;
+        q.parallel_for(0, height, 1, [&render] (u64 begin, u64 end)
+        {
+            for (u64 y = begin; y < end; ++y)
+            {
+                render(2, int(y));
+            }
+        });
+        q.wait();
+    }
+
+    u64 time3 = Time::us();
+
+    print_time("ConcurrentQueue, per row", time1 - time0);
+    print_time("StealingQueue, per row", time2 - time1);
+    print_time("StealingQueue, parallel_for", time3 - time2);
+
+    bool success = image[0] == image[1] && image[0] == image[2];
+    printf("images: [%s]\n", success ? "Success" : "FAILED");
+    return success;
+}
+
 int main(int argc, char* argv[])
 {
     int count = 1;
@@ -338,29 +476,39 @@ int main(int argc, char* argv[])
 
     using Function = bool (*)(void);
 
-    Function tests [] =
+    struct Test
+    {
+        const char* name;
+        Function function;
+    };
+
+    Test tests [] =
     {
-        test0,
-        test1,
-        test2,
-        test3,
-        test4,
-        test5,
-        test6,
+        { "test0", test0<ConcurrentQueue> },
+        { "test0 (StealingQueue)", test0<StealingQueue> },
+        { "test1", test1 },
+        { "test2", test2<ConcurrentQueue> },
+        { "test2 (StealingQueue)", test2<StealingQueue> },
+        { "test3", test3 },
+        { "test4", test4 },
+        { "test5", test5<ConcurrentQueue> },
+        { "test5 (StealingQueue)", test5<StealingQueue> },
+        { "test6", test6 },
+        { "test7", test7 },
+        { "test8", test8 },
     };
 
     for (int i = 0; i < count; ++i)
     {
-        int index = 0;
-        for (auto func : tests)
+        for (auto test : tests)
         {
             printf("------------------------------------------------------------\n");
-            printf(" test%d\n", index++);
+            printf(" %s\n", test.name);
             printf("------------------------------------------------------------\n");
             printf("\n");
 
             u64 time0 = Time::ms();
-            bool success = func();
+            bool success = test.function();
             printf("\n <<<< complete: %d ms \n\n", int(Time::ms() - time0));
 
             if (!success)
@@ -3,35 +3,104 @@
     Copyright (C) 2012-2019 Twilight Finland 3D Oy Ltd. All rights reserved.
 */
 #include <mango/mango.hpp>
+#include "../common/benchmark.hpp"
 
 using namespace mango;
 
+using benchmark::Image;
+
+// Both formats go through mango with its default quality, from the same RGBA image. The codecs
+// decode the file they encoded, unless the input is in their format.
+
+static ImageEncodeOptions get_options(int level)
+{
+    ImageEncodeOptions options;
+    if (level != benchmark::DEFAULT_LEVEL)
+        options.quality = level / 100.0f;
+    return options;
+}
+
+Image decode_jpeg(ConstMemory memory)
+{
+    return benchmark::decode_bitmap(memory, ".jpg", 4);
+}
+
+bool encode_jpeg(std::vector<u8>& output, const Image& image, int level)
+{
+    return benchmark::encode_bitmap(output, image, ".jpg", get_options(level));
+}
+
+Image decode_webp(ConstMemory memory)
+{
+    return benchmark::decode_bitmap(memory, ".webp", 4);
+}
+
+bool encode_webp(std::vector<u8>& output, const Image& image, int level)
+{
+    return benchmark::encode_bitmap(output, image, ".webp", get_options(level));
+}
+
+static benchmark::Plugin jpeg_plugin({ "jpeg", ".jpg", decode_jpeg, encode_jpeg });
+static benchmark::Plugin webp_plugin({ "webp", ".webp", decode_webp, encode_webp });
+
 int main(int argc, const char* argv[])
 {
     if (argc < 2)
     {
-        printf("Too few arguments. usage: <image>\n");
+        printf("Too few arguments. usage: <image> %s\n", benchmark::OPTIONS_USAGE);
         exit(1);
     }
 
+    const char* filename = argv[1];
+
+    benchmark::Options options;
+
+    for (int i = 2; i < argc; ++i)
+    {
+        if (!benchmark::parse_option(options, argc, argv, i))
+        {
+            printf("Unknown argument: %s\n", argv[i]);
+            exit(1);
+        }
+    }
+
     printf("%s\n", getSystemInfo().c_str());
 
-    u64 time0 = Time::ms();
+    std::string extension = filesystem::getExtension(filename);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    if (extension == ".jpeg")
+        extension = ".jpg";
 
-    Bitmap bitmap(argv[1]);
-    u64 time1 = Time::ms();
+    filesystem::File file(filename);
+    Buffer buffer(file);
 
-    bitmap.save("output.webp");
-    u64 time2 = Time::ms();
+    Image reference = benchmark::load_reference(buffer, extension, 4);
+    if (!reference)
+    {
+        printf("Can't decode %s\n", filename);
+        exit(1);
+    }
 
-    Bitmap bitmap2("output.webp");
-    u64 time3 = Time::ms();
+    printf("image: %d x %d (%d KB)\n", reference.width, reference.height, int(file.size() / 1024));
+    printf("runs: %d (+%d warmup), times in ms\n", options.runs, options.warmup);
+    benchmark::print_header();
 
-    bitmap2.save("output.jpg");
-    u64 time4 = Time::ms();
+    std::vector<benchmark::Result> results;
+
+    for (const auto& codec : benchmark::codecs())
+    {
+        std::vector<benchmark::Result> codec_results;
+        std::vector<u8> output = benchmark::test(codec_results, codec, filename, buffer, extension, reference,
+            benchmark::DEFAULT_LEVEL, options);
+
+        if (!output.empty())
+        {
+            benchmark::write_file(std::string("output") + codec.extension, output);
+        }
+
+        benchmark::print_results(codec_results);
+        results.insert(results.end(), codec_results.begin(), codec_results.end());
+    }
 
-    printf("jpeg decode: %d ms\n", int(time1 - time0));
-    printf("jpeg encode: %d ms\n", int(time4 - time3));
-    printf("webp decode: %d ms\n", int(time3 - time2));
-    printf("webp encode: %d ms\n", int(time2 - time1));
+    benchmark::write_reports(results, options);
 }